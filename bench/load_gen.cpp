@@ -0,0 +1,759 @@
+/**
+ * Load generator for `server/http_server.cpp`
+ *
+ * Every thread runs its own epoll loop over a share of the connections
+ * and keeps a latency histogram, the histograms are merged at the end and
+ * the result is printed as one JSON object, so runs can be compared
+ * across commits (see `bench/run_bench.sh`).
+ *
+ * Scenarios:
+ *   close          a new connection for every request (`Connection: close`)
+ *   keepalive      one request at a time on persistent connections
+ *   pipeline       `--pipeline N` requests in flight per connection
+ *   large-headers  keep-alive with a `--header-bytes` cookie on every request
+ *   slowloris      keep-alive traffic while `--slow-connections` clients
+ *                  trickle one header line per second and never finish
+ *
+ * By default the load is closed-loop: a connection sends its next request
+ * as soon as an answer comes back. A closed loop undercounts stalls, while
+ * the server stalls nobody sends, so the requests that would have waited
+ * are never measured ("coordinated omission"). The reported latencies are
+ * corrected the way HdrHistogram does it: every sample longer than the
+ * average interval between requests on a connection adds the samples the
+ * missing requests would have had. `latency_uncorrected_us` is the raw data.
+ *
+ * With `--rate R` the load is open-loop instead: R requests per second are
+ * scheduled at fixed times whether or not the server keeps up, and a
+ * request's latency counts from when it should have been sent.
+ *
+ *   g++ -std=c++17 -O2 -pthread bench/load_gen.cpp -o load_gen
+ *   ./load_gen --scenario keepalive --connections 64 --duration 10 [--server-pid PID]
+ */
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+#define MAX_EVENTS 256
+
+struct Options
+{
+    std::string scenario = "keepalive";
+    std::string host = "127.0.0.1";
+    int port = 8080;
+    std::string path = "/";
+    int threads = 2;
+    int connections = 64;
+    int pipeline = 16;
+    double duration = 10;
+    double warmup = 1;
+    double rate = 0;
+    int header_bytes = 8192;
+    int slow_connections = 256;
+    int server_pid = 0;
+};
+
+static uint64_t now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Log-bucketed latency histogram, every power of two split into
+ * `1 << HISTOGRAM_SUB_BITS` linear buckets (about 3% precision)
+ */
+struct Histogram
+{
+    uint64_t counts[HISTOGRAM_BUCKETS] = {};
+    uint64_t total = 0;
+    uint64_t max = 0;
+
+    static int bucket(uint64_t value)
+    {
+        const uint64_t sub_buckets = 1 << HISTOGRAM_SUB_BITS;
+        if (value < sub_buckets)
+            return (int)value;
+        int msb = 63 - __builtin_clzll(value);
+        return (int)((msb - HISTOGRAM_SUB_BITS + 1) * sub_buckets +
+                     ((value >> (msb - HISTOGRAM_SUB_BITS)) & (sub_buckets - 1)));
+    }
+
+    /* Middle of a bucket, what a sample in it is reported as */
+    static uint64_t value_of(int index)
+    {
+        const int sub_buckets = 1 << HISTOGRAM_SUB_BITS;
+        if (index < sub_buckets)
+            return index;
+        int shift = index / sub_buckets - 1;
+        uint64_t low = (uint64_t)(sub_buckets + index % sub_buckets) << shift;
+        return low + ((uint64_t)1 << shift) / 2;
+    }
+
+    void record(uint64_t value, uint64_t count = 1)
+    {
+        counts[bucket(value)] += count;
+        total += count;
+        max = std::max(max, value);
+    }
+
+    void merge(const Histogram &other)
+    {
+        for (int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+            counts[i] += other.counts[i];
+        total += other.total;
+        max = std::max(max, other.max);
+    }
+
+    uint64_t percentile(double p) const
+    {
+        uint64_t wanted = (uint64_t)(p / 100.0 * total);
+        uint64_t seen = 0;
+        for (int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+        {
+            seen += counts[i];
+            if (seen > wanted)
+                return std::min(value_of(i), max);
+        }
+        return max;
+    }
+
+    double mean() const
+    {
+        double sum = 0;
+        for (int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+            sum += (double)counts[i] * value_of(i);
+        return total == 0 ? 0 : sum / total;
+    }
+
+    /**
+     * HdrHistogram's coordinated omission correction: a sample of `v`
+     * while requests were due every `interval` also stands for the
+     * requests that would have been sent meanwhile, which would have
+     * waited `v - interval`, `v - 2 * interval`, ...
+     */
+    Histogram corrected(uint64_t interval) const
+    {
+        Histogram out;
+        for (int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+        {
+            if (counts[i] == 0)
+                continue;
+            uint64_t value = value_of(i);
+            out.record(value, counts[i]);
+            if (interval == 0)
+                continue;
+            for (uint64_t missing = value > interval ? value - interval : 0; missing >= interval;
+                 missing -= interval)
+                out.record(missing, counts[i]);
+        }
+        out.max = std::max(out.max, max);
+        return out;
+    }
+};
+
+/**
+ * A request in flight: when it should have gone out (open loop) and
+ * when it actually did
+ */
+struct InFlight
+{
+    uint64_t intended;
+    uint64_t sent;
+};
+
+struct Client
+{
+    int fd = -1;
+    bool connected = false;
+    bool slow = false;
+    bool idle_listed = false;
+    std::string out;
+    size_t out_offset = 0;
+    std::string in;
+    std::deque<InFlight> in_flight;
+};
+
+struct Worker
+{
+    const Options *options = nullptr;
+    int epoll_fd = -1;
+    std::string request;
+    int depth = 1;
+    sockaddr_in addr{};
+
+    std::vector<Client> clients;
+    std::vector<int> idle;
+    std::deque<uint64_t> backlog;
+    uint64_t next_send = 0;
+    uint64_t interval_ns = 0;
+
+    uint64_t measure_start = 0;
+    uint64_t measure_end = 0;
+    Histogram latency;
+    Histogram service;
+    uint64_t requests = 0;
+    uint64_t errors = 0;
+    uint64_t non_2xx = 0;
+    uint64_t bytes_in = 0;
+    uint64_t slow_closed = 0;
+};
+
+static void close_client(Worker &worker, Client &client)
+{
+    if (client.fd != -1)
+    {
+        epoll_ctl(worker.epoll_fd, EPOLL_CTL_DEL, client.fd, nullptr);
+        close(client.fd);
+    }
+    client.fd = -1;
+    client.connected = false;
+    client.out.clear();
+    client.out_offset = 0;
+    client.in.clear();
+}
+
+static int open_client(Worker &worker, int index)
+{
+    Client &client = worker.clients[index];
+    client.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (client.fd == -1)
+        return -1;
+    int one = 1;
+    setsockopt(client.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(client.fd, (sockaddr *)&worker.addr, sizeof(worker.addr)) == -1 && errno != EINPROGRESS)
+    {
+        close_client(worker, client);
+        return -1;
+    }
+    epoll_event event{};
+    event.data.u32 = index;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    epoll_ctl(worker.epoll_fd, EPOLL_CTL_ADD, client.fd, &event);
+    return 0;
+}
+
+static bool flush_client(Client &client)
+{
+    while (client.connected && client.out_offset < client.out.size())
+    {
+        ssize_t sent = send(client.fd, client.out.data() + client.out_offset, client.out.size() - client.out_offset,
+                            MSG_NOSIGNAL);
+        if (sent > 0)
+        {
+            client.out_offset += sent;
+            continue;
+        }
+        if (sent == -1 && errno == EINTR)
+            continue;
+        if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return true;
+        return false;
+    }
+    if (client.out_offset == client.out.size())
+    {
+        client.out.clear();
+        client.out_offset = 0;
+    }
+    return true;
+}
+
+static void issue_request(Worker &worker, int index, uint64_t intended)
+{
+    Client &client = worker.clients[index];
+    if (client.fd == -1 && open_client(worker, index) == -1)
+    {
+        worker.errors++;
+        return;
+    }
+    uint64_t now = now_ns();
+    client.in_flight.push_back({intended == 0 ? now : intended, now});
+    client.out += worker.request;
+    flush_client(client);
+}
+
+static bool has_room(const Worker &worker, const Client &client)
+{
+    return !client.slow && (int)client.in_flight.size() < worker.depth;
+}
+
+/**
+ * Give every free connection work: in a closed loop right away, in an
+ * open loop only what the schedule says is due (oldest first)
+ */
+static void refill(Worker &worker, int index)
+{
+    Client &client = worker.clients[index];
+    if (worker.interval_ns == 0)
+    {
+        while (has_room(worker, client))
+            issue_request(worker, index, 0);
+        return;
+    }
+    while (has_room(worker, client) && !worker.backlog.empty())
+    {
+        issue_request(worker, index, worker.backlog.front());
+        worker.backlog.pop_front();
+    }
+    if (has_room(worker, client) && !client.idle_listed)
+    {
+        client.idle_listed = true;
+        worker.idle.push_back(index);
+    }
+}
+
+static void dispatch_backlog(Worker &worker)
+{
+    while (!worker.backlog.empty() && !worker.idle.empty())
+    {
+        int index = worker.idle.back();
+        worker.idle.pop_back();
+        worker.clients[index].idle_listed = false;
+        refill(worker, index);
+    }
+}
+
+/**
+ * Parse one response at the front of `client.in`, `0` when it is not
+ * complete yet, else its size. Sets `status` and `close_after`.
+ */
+static size_t parse_response(const std::string &in, int &status, bool &close_after)
+{
+    size_t head_end = in.find("\r\n\r\n");
+    if (head_end == std::string::npos)
+        return 0;
+    if (in.compare(0, 9, "HTTP/1.1 ") != 0 && in.compare(0, 9, "HTTP/1.0 ") != 0)
+    {
+        status = 0;
+        close_after = true;
+        return head_end + 4;
+    }
+    status = atoi(in.c_str() + 9);
+    close_after = in.compare(0, 9, "HTTP/1.0 ") == 0;
+    size_t content_length = 0;
+    size_t line = in.find("\r\n") + 2;
+    while (line < head_end)
+    {
+        size_t eol = in.find("\r\n", line);
+        if (strncasecmp(in.c_str() + line, "Content-Length:", 15) == 0)
+            content_length = strtoul(in.c_str() + line + 15, nullptr, 10);
+        else if (strncasecmp(in.c_str() + line, "Connection:", 11) == 0)
+            close_after = strcasestr(in.substr(line, eol - line).c_str(), "close") != nullptr;
+        line = eol + 2;
+    }
+    size_t total = head_end + 4 + content_length;
+    return in.size() >= total ? total : 0;
+}
+
+static void handle_readable(Worker &worker, int index)
+{
+    Client &client = worker.clients[index];
+    char buf[65536];
+    bool peer_closed = false;
+    while (true)
+    {
+        ssize_t count = read(client.fd, buf, sizeof(buf));
+        if (count > 0)
+        {
+            client.in.append(buf, count);
+            worker.bytes_in += count;
+            continue;
+        }
+        if (count == -1 && errno == EINTR)
+            continue;
+        if (count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        peer_closed = true;
+        break;
+    }
+
+    bool reconnect = false;
+    while (!client.in_flight.empty())
+    {
+        int status = 0;
+        bool close_after = false;
+        size_t size = parse_response(client.in, status, close_after);
+        if (size == 0)
+            break;
+        client.in.erase(0, size);
+
+        uint64_t now = now_ns();
+        InFlight request = client.in_flight.front();
+        client.in_flight.pop_front();
+        if (now >= worker.measure_start && now < worker.measure_end)
+        {
+            worker.latency.record(now - request.intended);
+            worker.service.record(now - request.sent);
+            worker.requests++;
+            if (status < 200 || status > 299)
+                worker.non_2xx++;
+        }
+        if (close_after)
+        {
+            reconnect = true;
+            break;
+        }
+    }
+
+    if (client.slow)
+    {
+        if (peer_closed)
+        {
+            worker.slow_closed++;
+            close_client(worker, client);
+        }
+        return;
+    }
+    if (peer_closed || reconnect)
+    {
+        /* Whatever was still in flight on this connection is lost */
+        worker.errors += client.in_flight.size();
+        client.in_flight.clear();
+        close_client(worker, client);
+    }
+    refill(worker, index);
+}
+
+/**
+ * Slow clients send the request line and then one more header line per second
+ */
+static void drip(Worker &worker)
+{
+    for (size_t i = 0; i < worker.clients.size(); ++i)
+    {
+        Client &client = worker.clients[i];
+        if (!client.slow || client.fd == -1 || !client.connected)
+            continue;
+        client.out += "X-Slow: 1\r\n";
+        flush_client(client);
+    }
+}
+
+static void run_worker(Worker &worker, int connections, int slow_connections, uint64_t start, uint64_t end)
+{
+    const Options &options = *worker.options;
+    worker.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    worker.clients.resize(connections + slow_connections);
+    for (int i = 0; i < slow_connections; ++i)
+    {
+        Client &client = worker.clients[connections + i];
+        client.slow = true;
+        client.out = "GET " + options.path + " HTTP/1.1\r\nHost: " + options.host + "\r\n";
+        open_client(worker, connections + i);
+    }
+
+    worker.next_send = start;
+    for (int i = 0; i < connections; ++i)
+    {
+        if (worker.interval_ns == 0)
+            refill(worker, i);
+        else if (open_client(worker, i) == 0)
+            refill(worker, i);
+    }
+
+    std::vector<epoll_event> events(MAX_EVENTS);
+    uint64_t next_drip = start + 1000000000;
+    while (true)
+    {
+        uint64_t now = now_ns();
+        if (now >= end)
+            break;
+
+        if (worker.interval_ns != 0)
+        {
+            while (worker.next_send <= now)
+            {
+                worker.backlog.push_back(worker.next_send);
+                worker.next_send += worker.interval_ns;
+            }
+            dispatch_backlog(worker);
+        }
+        if (slow_connections > 0 && now >= next_drip)
+        {
+            drip(worker);
+            next_drip += 1000000000;
+        }
+
+        int timeout_ms = 10;
+        if (worker.interval_ns != 0)
+            timeout_ms = (int)std::min<uint64_t>(10, (worker.next_send - now) / 1000000);
+        int n = epoll_wait(worker.epoll_fd, events.data(), (int)events.size(), timeout_ms);
+        for (int i = 0; i < n; ++i)
+        {
+            int index = (int)events[i].data.u32;
+            Client &client = worker.clients[index];
+            if (client.fd == -1)
+                continue;
+            if (!client.connected && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+            {
+                int error = 0;
+                socklen_t len = sizeof(error);
+                getsockopt(client.fd, SOL_SOCKET, SO_ERROR, &error, &len);
+                if (error != 0)
+                {
+                    worker.errors += client.slow ? 0 : std::max<size_t>(client.in_flight.size(), 1);
+                    client.in_flight.clear();
+                    close_client(worker, client);
+                    if (!client.slow)
+                        refill(worker, index);
+                    continue;
+                }
+                client.connected = true;
+            }
+            if (events[i].events & EPOLLOUT)
+                flush_client(client);
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                handle_readable(worker, index);
+        }
+    }
+
+    for (Client &client : worker.clients)
+        close_client(worker, client);
+    close(worker.epoll_fd);
+}
+
+static double cpu_seconds_self()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec +
+           usage.ru_stime.tv_usec / 1e6;
+}
+
+/**
+ * CPU time the server process used so far, from /proc/PID/stat
+ */
+static double cpu_seconds_of(int pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *file = fopen(path, "r");
+    if (file == nullptr)
+        return -1;
+    char buf[1024];
+    size_t len = fread(buf, 1, sizeof(buf) - 1, file);
+    fclose(file);
+    buf[len] = '\0';
+
+    /* Fields after the command name, which may contain spaces */
+    const char *p = strrchr(buf, ')');
+    if (p == nullptr)
+        return -1;
+    unsigned long utime = 0, stime = 0;
+    if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        return -1;
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static std::string build_request(const Options &options)
+{
+    std::string request = "GET " + options.path + " HTTP/1.1\r\nHost: " + options.host + "\r\n";
+    request += "User-Agent: load_gen\r\n";
+    if (options.scenario == "large-headers")
+    {
+        request += "Cookie: ";
+        for (int i = 0; (int)request.size() < options.header_bytes; ++i)
+            request += "session_" + std::to_string(i) + "=0123456789abcdef0123456789abcdef; ";
+        request += "\r\n";
+    }
+    if (options.scenario == "close")
+        request += "Connection: close\r\n";
+    request += "\r\n";
+    return request;
+}
+
+static void print_latency(const char *name, const Histogram &histogram)
+{
+    printf("\"%s\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f,\"mean\":%.1f}", name,
+           histogram.percentile(50) / 1e3, histogram.percentile(90) / 1e3, histogram.percentile(99) / 1e3,
+           histogram.percentile(99.9) / 1e3, histogram.max / 1e3, histogram.mean() / 1e3);
+}
+
+static int parse_args(int argc, char **argv, Options &options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (i + 1 >= argc)
+            return -1;
+        const char *value = argv[++i];
+        if (arg == "--scenario")
+            options.scenario = value;
+        else if (arg == "--host")
+            options.host = value;
+        else if (arg == "--path")
+            options.path = value;
+        else if (arg == "--port")
+            options.port = atoi(value);
+        else if (arg == "--threads")
+            options.threads = std::max(1, atoi(value));
+        else if (arg == "--connections")
+            options.connections = std::max(1, atoi(value));
+        else if (arg == "--pipeline")
+            options.pipeline = std::max(1, atoi(value));
+        else if (arg == "--duration")
+            options.duration = atof(value);
+        else if (arg == "--warmup")
+            options.warmup = atof(value);
+        else if (arg == "--rate")
+            options.rate = atof(value);
+        else if (arg == "--header-bytes")
+            options.header_bytes = atoi(value);
+        else if (arg == "--slow-connections")
+            options.slow_connections = atoi(value);
+        else if (arg == "--server-pid")
+            options.server_pid = atoi(value);
+        else
+            return -1;
+    }
+    const char *scenarios[] = {"close", "keepalive", "pipeline", "large-headers", "slowloris"};
+    for (const char *scenario : scenarios)
+    {
+        if (options.scenario == scenario)
+            return 0;
+    }
+    return -1;
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+    if (parse_args(argc, argv, options) == -1)
+    {
+        fprintf(stderr,
+                "usage: %s [--scenario close|keepalive|pipeline|large-headers|slowloris] [--host IP]"
+                " [--port N] [--path P] [--threads N] [--connections N] [--pipeline N] [--duration S]"
+                " [--warmup S] [--rate R] [--header-bytes N] [--slow-connections N] [--server-pid PID]\n",
+                argv[0]);
+        return 1;
+    }
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(options.port);
+    if (inet_pton(AF_INET, options.host.c_str(), &addr.sin_addr) != 1)
+    {
+        fprintf(stderr, "load_gen: --host must be an IPv4 address\n");
+        return 1;
+    }
+
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    int slow_total = options.scenario == "slowloris" ? options.slow_connections : 0;
+    std::string request = build_request(options);
+    uint64_t start = now_ns();
+    uint64_t measure_start = start + (uint64_t)(options.warmup * 1e9);
+    uint64_t end = measure_start + (uint64_t)(options.duration * 1e9);
+
+    std::vector<Worker> workers(options.threads);
+    for (int t = 0; t < options.threads; ++t)
+    {
+        Worker &worker = workers[t];
+        worker.options = &options;
+        worker.addr = addr;
+        worker.request = request;
+        worker.depth = options.scenario == "pipeline" ? options.pipeline : 1;
+        worker.measure_start = measure_start;
+        worker.measure_end = end;
+        if (options.rate > 0)
+            worker.interval_ns = (uint64_t)(1e9 * options.threads / options.rate);
+    }
+
+    /* CPU is only counted over the measured part of the run */
+    double client_cpu = 0;
+    double server_cpu = -1;
+    std::thread sampler([&] {
+        uint64_t now = now_ns();
+        if (now < measure_start)
+            usleep((measure_start - now) / 1000);
+        double client_before = cpu_seconds_self();
+        double server_before = options.server_pid ? cpu_seconds_of(options.server_pid) : -1;
+        now = now_ns();
+        if (now < end)
+            usleep((end - now) / 1000);
+        client_cpu = cpu_seconds_self() - client_before;
+        if (server_before >= 0)
+            server_cpu = cpu_seconds_of(options.server_pid) - server_before;
+    });
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < options.threads; ++t)
+    {
+        int connections = options.connections / options.threads + (t < options.connections % options.threads);
+        int slow = slow_total / options.threads + (t < slow_total % options.threads);
+        threads.emplace_back(run_worker, std::ref(workers[t]), connections, slow, start, end);
+    }
+    for (std::thread &thread : threads)
+        thread.join();
+    sampler.join();
+
+    Histogram latency;
+    Histogram service;
+    uint64_t requests = 0, errors = 0, non_2xx = 0, bytes_in = 0, slow_closed = 0;
+    for (const Worker &worker : workers)
+    {
+        latency.merge(worker.latency);
+        service.merge(worker.service);
+        requests += worker.requests;
+        errors += worker.errors;
+        non_2xx += worker.non_2xx;
+        bytes_in += worker.bytes_in;
+        slow_closed += worker.slow_closed;
+    }
+
+    /**
+     * Closed loop: the expected interval between two requests on one
+     * connection slot is the measured time divided by the requests it
+     * answered
+     */
+    int slots = options.connections * (options.scenario == "pipeline" ? options.pipeline : 1);
+    if (options.rate <= 0 && requests > 0)
+        latency = latency.corrected((uint64_t)(options.duration * 1e9 * slots / requests));
+
+    printf("{\"scenario\":\"%s\",\"mode\":\"%s\",\"threads\":%d,\"connections\":%d,\"pipeline\":%d,",
+           options.scenario.c_str(), options.rate > 0 ? "open" : "closed", options.threads, options.connections,
+           options.scenario == "pipeline" ? options.pipeline : 1);
+    printf("\"duration_s\":%.3f,\"requests\":%llu,\"errors\":%llu,\"non_2xx\":%llu,\"rps\":%.1f,", options.duration,
+           (unsigned long long)requests, (unsigned long long)errors, (unsigned long long)non_2xx,
+           requests / options.duration);
+    if (options.rate > 0)
+        printf("\"target_rps\":%.1f,", options.rate);
+    print_latency("latency_us", latency);
+    printf(",");
+    print_latency("latency_uncorrected_us", service);
+    printf(",\"bytes_received\":%llu,\"client_cpu_us_per_request\":%.3f,", (unsigned long long)bytes_in,
+           requests ? client_cpu * 1e6 / requests : 0.0);
+    if (server_cpu >= 0)
+        printf("\"server_cpu_us_per_request\":%.3f", requests ? server_cpu * 1e6 / requests : 0.0);
+    else
+        printf("\"server_cpu_us_per_request\":null");
+    if (slow_total > 0)
+        printf(",\"slow_connections\":%d,\"slow_closed_by_server\":%llu", slow_total,
+               (unsigned long long)slow_closed);
+    printf("}\n");
+    return 0;
+}
@@ -0,0 +1,55 @@
+#!/bin/sh
+# Build a profile-guided optimized server: build it instrumented, run every
+# bench scenario against it so it records where the time goes, then build
+# it again in the same directory with those profiles and LTO.
+#
+#   bench/pgo_train.sh [BUILD]
+#
+# BUILD (default build-pgo) ends up with the optimized server in
+# BUILD/http_server and the profiles in BUILD/pgo. The profiles name the
+# objects they were recorded for, so the optimized build has to happen in
+# the directory that recorded them.
+#
+# DURATION, CONNECTIONS, THREADS, PORT and SERVER_ARGS override the defaults.
+set -e
+
+cd "$(dirname "$0")/.."
+BUILD=${1:-build-pgo}
+DURATION=${DURATION:-5}
+CONNECTIONS=${CONNECTIONS:-64}
+THREADS=${THREADS:-2}
+PORT=${PORT:-18080}
+case $BUILD in
+/*) PROFILES=$BUILD/pgo ;;
+*) PROFILES=$(pwd)/$BUILD/pgo ;;
+esac
+
+rm -rf "$PROFILES"
+cmake -S . -B "$BUILD" -DCMAKE_BUILD_TYPE=Release -DHTTP_SERVER_PGO=generate -DHTTP_SERVER_PGO_DIR="$PROFILES" \
+    -DHTTP_SERVER_LTO=OFF
+cmake --build "$BUILD" -j"$(nproc)" --target http_server load_gen
+
+"$BUILD/http_server" --port "$PORT" --max-requests 1000000 $SERVER_ARGS >/dev/null &
+SERVER=$!
+trap 'kill $SERVER 2>/dev/null' EXIT
+sleep 0.5
+
+for SCENARIO in close keepalive pipeline large-headers slowloris; do
+    echo "training: $SCENARIO"
+    "$BUILD/load_gen" --scenario "$SCENARIO" --port "$PORT" --duration "$DURATION" \
+        --connections "$CONNECTIONS" --threads "$THREADS" >/dev/null
+done
+
+# The profiles are written when the server exits, SIGTERM lets it drain and return
+kill -TERM $SERVER
+wait $SERVER
+trap - EXIT
+
+# clang writes raw profiles that have to be merged first, gcc reads its own
+if ls "$PROFILES"/*.profraw >/dev/null 2>&1; then
+    llvm-profdata merge -output="$PROFILES/default.profdata" "$PROFILES"/*.profraw
+fi
+
+cmake -S . -B "$BUILD" -DHTTP_SERVER_PGO=use -DHTTP_SERVER_LTO=ON
+cmake --build "$BUILD" -j"$(nproc)"
+echo "optimized server: $BUILD/http_server"
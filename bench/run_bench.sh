@@ -0,0 +1,38 @@
+#!/bin/sh
+# Build the server and the load generator, then run every scenario against
+# a fresh server and append one JSON line per scenario to RESULTS (default
+# bench/results.jsonl), tagged with the commit, so runs can be compared
+# across commits.
+#
+#   bench/run_bench.sh [RESULTS]
+#
+# DURATION, CONNECTIONS, THREADS, PORT, BUILD and SERVER_ARGS override the
+# defaults. CMAKE_ARGS picks a build profile, `-DHTTP_SERVER_LTO=ON` for
+# instance; bench/pgo_train.sh builds a PGO server, BUILD=build-pgo runs
+# the bench against it.
+set -e
+
+cd "$(dirname "$0")/.."
+RESULTS=${1:-bench/results.jsonl}
+DURATION=${DURATION:-10}
+CONNECTIONS=${CONNECTIONS:-64}
+THREADS=${THREADS:-2}
+PORT=${PORT:-18080}
+BUILD=${BUILD:-/tmp/http_server_bench}
+
+cmake -S . -B "$BUILD" -DCMAKE_BUILD_TYPE=Release $CMAKE_ARGS >/dev/null
+cmake --build "$BUILD" -j"$(nproc)" --target http_server load_gen >/dev/null
+
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+DIRTY=$(git diff --quiet 2>/dev/null && echo false || echo true)
+
+"$BUILD/http_server" --port "$PORT" --max-requests 1000000 $SERVER_ARGS >/dev/null &
+SERVER=$!
+trap 'kill $SERVER 2>/dev/null' EXIT
+sleep 0.5
+
+for SCENARIO in close keepalive pipeline large-headers slowloris; do
+    RESULT=$("$BUILD/load_gen" --scenario "$SCENARIO" --port "$PORT" --duration "$DURATION" \
+        --connections "$CONNECTIONS" --threads "$THREADS" --server-pid "$SERVER")
+    echo "{\"commit\":\"$COMMIT\",\"dirty\":$DIRTY,\"result\":$RESULT}" | tee -a "$RESULTS"
+done
@@ -0,0 +1,167 @@
+/**
+ * Microbenchmark for the header scanning kernels in `server/http_scan.hpp`
+ *
+ * Builds a realistic request head with a few kilobytes of cookies and
+ * walks it the way the parser does (end of head, then every header name
+ * and value) with every kernel set this CPU supports. The same bytes are
+ * then unmasked as if they were the payload of a WebSocket frame.
+ *
+ * Before timing, every kernel is checked against the scalar one on random
+ * inputs, a fast kernel that gives a different answer is worse than useless.
+ *
+ *   g++ -std=c++17 -O2 bench/scan_bench.cpp -o scan_bench
+ *   ./scan_bench [cookie_bytes] [iterations]
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+
+#include "../server/http_scan.hpp"
+
+static std::string build_head(size_t cookie_bytes)
+{
+    std::string head =
+        "GET /api/v1/dashboard/metrics?range=24h&step=60 HTTP/1.1\r\n"
+        "Host: dashboard.example.com\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+        "Accept-Language: en-US,en;q=0.9\r\n"
+        "Accept-Encoding: gzip, deflate, br\r\n"
+        "Referer: https://dashboard.example.com/overview\r\n"
+        "Cookie: ";
+    std::mt19937 rng(42);
+    const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    size_t start = head.size();
+    while (head.size() - start < cookie_bytes)
+    {
+        head += "session_";
+        head += std::to_string(rng() % 1000);
+        head += '=';
+        for (int i = 0; i < 40; ++i)
+            head += alphabet[rng() % (sizeof(alphabet) - 1)];
+        head += "; ";
+    }
+    head +=
+        "\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n";
+    return head;
+}
+
+/**
+ * One pass over the head the way `parse_request_head` scans it,
+ * returns a checksum so the compiler can not drop the work
+ */
+static size_t scan_head(const ScanKernels &scan, const std::string &head)
+{
+    const char *buf = head.data();
+    const char *end = buf + head.size();
+    const char *head_end = scan.find_head_end(buf, end);
+    if (head_end == nullptr)
+        return 0;
+
+    size_t sum = head_end - buf;
+    const char *p = (const char *)memchr(buf, '\n', head_end - buf) + 1;
+    while (p < head_end)
+    {
+        const char *name_end = scan.find_token_end(p, head_end);
+        const char *value_end = scan.find_value_end(name_end + 1, head_end + 2);
+        sum += (name_end - p) + (value_end - name_end);
+        p = value_end + 2;
+    }
+    return sum;
+}
+
+static int verify(const ScanKernels &scan)
+{
+    const ScanKernels &reference = scalar_scan_kernels();
+    std::mt19937 rng(7);
+    /* Mostly harmless bytes with the occasional interesting one */
+    const char interesting[] = "\r\n\t :|~\x7f\x80\x01{}@";
+    std::string input;
+    for (int round = 0; round < 20000; ++round)
+    {
+        input.assign(rng() % 200, 'a');
+        for (char &c : input)
+        {
+            unsigned r = rng() % 100;
+            if (r < 10)
+                c = interesting[rng() % (sizeof(interesting) - 1)];
+            else if (r < 20)
+                c = (char)(rng() % 256);
+        }
+        if (rng() % 4 == 0 && input.size() > 4)
+            input.replace(rng() % (input.size() - 4), 4, "\r\n\r\n");
+
+        const char *b = input.data();
+        const char *e = b + input.size();
+        for (size_t offset = 0; offset < std::min<size_t>(input.size(), 40); offset += 7)
+        {
+            if (scan.find_head_end(b + offset, e) != reference.find_head_end(b + offset, e) ||
+                scan.find_token_end(b + offset, e) != reference.find_token_end(b + offset, e) ||
+                scan.find_value_end(b + offset, e) != reference.find_value_end(b + offset, e))
+            {
+                fprintf(stderr, "%s disagrees with scalar on round %d\n", scan.name, round);
+                return -1;
+            }
+        }
+
+        uint32_t key = (uint32_t)rng();
+        std::string expected = input;
+        reference.unmask(&expected[0], expected.size(), key);
+        scan.unmask(&input[0], input.size(), key);
+        if (input != expected)
+        {
+            fprintf(stderr, "%s unmasks differently from scalar on round %d\n", scan.name, round);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    size_t cookie_bytes = argc > 1 ? strtoul(argv[1], nullptr, 10) : 3072;
+    long iterations = argc > 2 ? strtol(argv[2], nullptr, 10) : 200000;
+
+    std::string head = build_head(cookie_bytes);
+    const ScanKernels *kernels[3];
+    int count = supported_scan_kernels(kernels);
+
+    printf("head: %zu bytes, %ld iterations\n", head.size(), iterations);
+    double scalar_ns = 0;
+    double scalar_unmask_ns = 0;
+    for (int k = 0; k < count; ++k)
+    {
+        const ScanKernels &scan = *kernels[k];
+        if (verify(scan) != 0)
+            return 1;
+
+        size_t checksum = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (long i = 0; i < iterations; ++i)
+            checksum += scan_head(scan, head);
+        auto elapsed = std::chrono::steady_clock::now() - start;
+
+        double ns = std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+        if (k == 0)
+            scalar_ns = ns;
+        printf("%-8s %9.1f ns/head %7.2f GB/s %6.2fx  (checksum %zu)\n", scan.name, ns,
+               head.size() / ns, scalar_ns / ns, checksum / iterations);
+
+        /* Unmasking twice gives the input back, so every round works on the same bytes */
+        std::string payload = head;
+        start = std::chrono::steady_clock::now();
+        for (long i = 0; i < iterations; ++i)
+            scan.unmask(&payload[0], payload.size(), 0x5a3c96e1);
+        elapsed = std::chrono::steady_clock::now() - start;
+        ns = std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+        if (k == 0)
+            scalar_unmask_ns = ns;
+        printf("%-8s %9.1f ns/unmask %5.2f GB/s %6.2fx  (checksum %d)\n", scan.name, ns, payload.size() / ns,
+               scalar_unmask_ns / ns, (unsigned char)payload[payload.size() / 2]);
+    }
+    return 0;
+}
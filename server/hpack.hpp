@@ -0,0 +1,547 @@
+#ifndef HPACK_HPP
+#define HPACK_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#define HPACK_STATIC_ENTRIES 61
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+#define HPACK_ENTRY_OVERHEAD 32
+
+/**
+ * HPACK, the header compression of HTTP/2 (RFC 7541)
+ *
+ * A header block is a sequence of field representations. A field is
+ * either an index into the tables both ends share, or a literal name
+ * (or the index of a name) and value, which may also be added to the
+ * table. Index 1 to 61 is the fixed static table of common fields, after
+ * it comes the dynamic table, newest entry first, which the encoder
+ * fills as it goes and which is capped in bytes, the oldest entries fall
+ * out first. Literal strings are plain or Huffman coded with a fixed code
+ * tuned for header text.
+ *
+ * A connection has one `HpackTable` per direction: decoding the
+ * requests keeps our copy of the client's table, encoding the responses
+ * keeps the table the client mirrors. Both ends must apply every block in
+ * order, so a block that fails to decode ends the connection.
+ */
+struct HpackTable
+{
+    std::deque<std::pair<std::string, std::string>> entries;
+    size_t size = 0;
+    size_t max_size = HPACK_DEFAULT_TABLE_SIZE;
+    size_t limit = HPACK_DEFAULT_TABLE_SIZE;
+    bool update_pending = false;
+};
+
+inline const char *const (&hpack_static_table())[HPACK_STATIC_ENTRIES][2]
+{
+    static const char *const table[HPACK_STATIC_ENTRIES][2] = {
+        {":authority", ""},
+        {":method", "GET"},
+        {":method", "POST"},
+        {":path", "/"},
+        {":path", "/index.html"},
+        {":scheme", "http"},
+        {":scheme", "https"},
+        {":status", "200"},
+        {":status", "204"},
+        {":status", "206"},
+        {":status", "304"},
+        {":status", "400"},
+        {":status", "404"},
+        {":status", "500"},
+        {"accept-charset", ""},
+        {"accept-encoding", "gzip, deflate"},
+        {"accept-language", ""},
+        {"accept-ranges", ""},
+        {"accept", ""},
+        {"access-control-allow-origin", ""},
+        {"age", ""},
+        {"allow", ""},
+        {"authorization", ""},
+        {"cache-control", ""},
+        {"content-disposition", ""},
+        {"content-encoding", ""},
+        {"content-language", ""},
+        {"content-length", ""},
+        {"content-location", ""},
+        {"content-range", ""},
+        {"content-type", ""},
+        {"cookie", ""},
+        {"date", ""},
+        {"etag", ""},
+        {"expect", ""},
+        {"expires", ""},
+        {"from", ""},
+        {"host", ""},
+        {"if-match", ""},
+        {"if-modified-since", ""},
+        {"if-none-match", ""},
+        {"if-range", ""},
+        {"if-unmodified-since", ""},
+        {"last-modified", ""},
+        {"link", ""},
+        {"location", ""},
+        {"max-forwards", ""},
+        {"proxy-authenticate", ""},
+        {"proxy-authorization", ""},
+        {"range", ""},
+        {"referer", ""},
+        {"refresh", ""},
+        {"retry-after", ""},
+        {"server", ""},
+        {"set-cookie", ""},
+        {"strict-transport-security", ""},
+        {"transfer-encoding", ""},
+        {"user-agent", ""},
+        {"vary", ""},
+        {"via", ""},
+        {"www-authenticate", ""},
+    };
+    return table;
+}
+
+/**
+ * The Huffman code from RFC 7541 appendix B, code and length in bits per
+ * byte value. It is canonical: codes of one length are consecutive and
+ * in byte order, which is all the decoder needs to know.
+ */
+inline const uint32_t *hpack_huffman_codes()
+{
+    static const uint32_t codes[256] = {
+        0x00001ff8, 0x007fffd8, 0x0fffffe2, 0x0fffffe3, 0x0fffffe4, 0x0fffffe5,
+        0x0fffffe6, 0x0fffffe7, 0x0fffffe8, 0x00ffffea, 0x3ffffffc, 0x0fffffe9,
+        0x0fffffea, 0x3ffffffd, 0x0fffffeb, 0x0fffffec, 0x0fffffed, 0x0fffffee,
+        0x0fffffef, 0x0ffffff0, 0x0ffffff1, 0x0ffffff2, 0x3ffffffe, 0x0ffffff3,
+        0x0ffffff4, 0x0ffffff5, 0x0ffffff6, 0x0ffffff7, 0x0ffffff8, 0x0ffffff9,
+        0x0ffffffa, 0x0ffffffb, 0x00000014, 0x000003f8, 0x000003f9, 0x00000ffa,
+        0x00001ff9, 0x00000015, 0x000000f8, 0x000007fa, 0x000003fa, 0x000003fb,
+        0x000000f9, 0x000007fb, 0x000000fa, 0x00000016, 0x00000017, 0x00000018,
+        0x00000000, 0x00000001, 0x00000002, 0x00000019, 0x0000001a, 0x0000001b,
+        0x0000001c, 0x0000001d, 0x0000001e, 0x0000001f, 0x0000005c, 0x000000fb,
+        0x00007ffc, 0x00000020, 0x00000ffb, 0x000003fc, 0x00001ffa, 0x00000021,
+        0x0000005d, 0x0000005e, 0x0000005f, 0x00000060, 0x00000061, 0x00000062,
+        0x00000063, 0x00000064, 0x00000065, 0x00000066, 0x00000067, 0x00000068,
+        0x00000069, 0x0000006a, 0x0000006b, 0x0000006c, 0x0000006d, 0x0000006e,
+        0x0000006f, 0x00000070, 0x00000071, 0x00000072, 0x000000fc, 0x00000073,
+        0x000000fd, 0x00001ffb, 0x0007fff0, 0x00001ffc, 0x00003ffc, 0x00000022,
+        0x00007ffd, 0x00000003, 0x00000023, 0x00000004, 0x00000024, 0x00000005,
+        0x00000025, 0x00000026, 0x00000027, 0x00000006, 0x00000074, 0x00000075,
+        0x00000028, 0x00000029, 0x0000002a, 0x00000007, 0x0000002b, 0x00000076,
+        0x0000002c, 0x00000008, 0x00000009, 0x0000002d, 0x00000077, 0x00000078,
+        0x00000079, 0x0000007a, 0x0000007b, 0x00007ffe, 0x000007fc, 0x00003ffd,
+        0x00001ffd, 0x0ffffffc, 0x000fffe6, 0x003fffd2, 0x000fffe7, 0x000fffe8,
+        0x003fffd3, 0x003fffd4, 0x003fffd5, 0x007fffd9, 0x003fffd6, 0x007fffda,
+        0x007fffdb, 0x007fffdc, 0x007fffdd, 0x007fffde, 0x00ffffeb, 0x007fffdf,
+        0x00ffffec, 0x00ffffed, 0x003fffd7, 0x007fffe0, 0x00ffffee, 0x007fffe1,
+        0x007fffe2, 0x007fffe3, 0x007fffe4, 0x001fffdc, 0x003fffd8, 0x007fffe5,
+        0x003fffd9, 0x007fffe6, 0x007fffe7, 0x00ffffef, 0x003fffda, 0x001fffdd,
+        0x000fffe9, 0x003fffdb, 0x003fffdc, 0x007fffe8, 0x007fffe9, 0x001fffde,
+        0x007fffea, 0x003fffdd, 0x003fffde, 0x00fffff0, 0x001fffdf, 0x003fffdf,
+        0x007fffeb, 0x007fffec, 0x001fffe0, 0x001fffe1, 0x003fffe0, 0x001fffe2,
+        0x007fffed, 0x003fffe1, 0x007fffee, 0x007fffef, 0x000fffea, 0x003fffe2,
+        0x003fffe3, 0x003fffe4, 0x007ffff0, 0x003fffe5, 0x003fffe6, 0x007ffff1,
+        0x03ffffe0, 0x03ffffe1, 0x000fffeb, 0x0007fff1, 0x003fffe7, 0x007ffff2,
+        0x003fffe8, 0x01ffffec, 0x03ffffe2, 0x03ffffe3, 0x03ffffe4, 0x07ffffde,
+        0x07ffffdf, 0x03ffffe5, 0x00fffff1, 0x01ffffed, 0x0007fff2, 0x001fffe3,
+        0x03ffffe6, 0x07ffffe0, 0x07ffffe1, 0x03ffffe7, 0x07ffffe2, 0x00fffff2,
+        0x001fffe4, 0x001fffe5, 0x03ffffe8, 0x03ffffe9, 0x0ffffffd, 0x07ffffe3,
+        0x07ffffe4, 0x07ffffe5, 0x000fffec, 0x00fffff3, 0x000fffed, 0x001fffe6,
+        0x003fffe9, 0x001fffe7, 0x001fffe8, 0x007ffff3, 0x003fffea, 0x003fffeb,
+        0x01ffffee, 0x01ffffef, 0x00fffff4, 0x00fffff5, 0x03ffffea, 0x007ffff4,
+        0x03ffffeb, 0x07ffffe6, 0x03ffffec, 0x03ffffed, 0x07ffffe7, 0x07ffffe8,
+        0x07ffffe9, 0x07ffffea, 0x07ffffeb, 0x0ffffffe, 0x07ffffec, 0x07ffffed,
+        0x07ffffee, 0x07ffffef, 0x07fffff0, 0x03ffffee,
+    };
+    return codes;
+}
+
+inline const uint8_t *hpack_huffman_lengths()
+{
+    static const uint8_t lengths[256] = {
+        13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+        28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+        6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+        5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+        13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+        7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+        15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+        6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+        20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+        24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+        22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+        21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+        26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+        19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+        20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+        26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    };
+    return lengths;
+}
+
+/**
+ * Canonical decoding tables: for every code length, the first code of
+ * that length, how many codes have it and where their symbols start in
+ * `symbols` (all byte values ordered by length, then value)
+ */
+struct HpackHuffmanDecoder
+{
+    uint32_t first[31] = {};
+    uint16_t count[31] = {};
+    uint16_t start[31] = {};
+    uint8_t symbols[256] = {};
+
+    HpackHuffmanDecoder()
+    {
+        const uint32_t *codes = hpack_huffman_codes();
+        const uint8_t *lengths = hpack_huffman_lengths();
+        uint16_t next = 0;
+        for (int length = 1; length <= 30; ++length)
+        {
+            start[length] = next;
+            for (int symbol = 0; symbol < 256; ++symbol)
+            {
+                if (lengths[symbol] != length)
+                    continue;
+                if (count[length] == 0)
+                    first[length] = codes[symbol];
+                count[length]++;
+                symbols[next++] = (uint8_t)symbol;
+            }
+        }
+    }
+};
+
+/**
+ * Append the Huffman decoding of `[p, p + len)` to `out`, `false` when
+ * it is not valid: a code that does not exist (the end-of-string code
+ * included) or padding that is longer than 7 bits or not all ones
+ */
+inline bool hpack_huffman_decode(const unsigned char *p, size_t len, std::string &out)
+{
+    static const HpackHuffmanDecoder decoder;
+    uint32_t code = 0;
+    int length = 0;
+    for (size_t i = 0; i < len; ++i)
+    {
+        for (int bit = 7; bit >= 0; --bit)
+        {
+            code = code << 1 | ((p[i] >> bit) & 1);
+            if (++length > 30)
+                return false;
+            uint32_t offset = code - decoder.first[length];
+            if (decoder.count[length] != 0 && code >= decoder.first[length] && offset < decoder.count[length])
+            {
+                out += (char)decoder.symbols[decoder.start[length] + offset];
+                code = 0;
+                length = 0;
+            }
+        }
+    }
+    return length < 8 && code == (1u << length) - 1;
+}
+
+inline size_t hpack_huffman_size(std::string_view text)
+{
+    const uint8_t *lengths = hpack_huffman_lengths();
+    size_t bits = 0;
+    for (unsigned char c : text)
+        bits += lengths[c];
+    return (bits + 7) / 8;
+}
+
+inline void hpack_huffman_encode(std::string_view text, std::string &out)
+{
+    const uint32_t *codes = hpack_huffman_codes();
+    const uint8_t *lengths = hpack_huffman_lengths();
+    uint64_t bits = 0;
+    int pending = 0;
+    for (unsigned char c : text)
+    {
+        bits = bits << lengths[c] | codes[c];
+        pending += lengths[c];
+        while (pending >= 8)
+        {
+            pending -= 8;
+            out += (char)(bits >> pending);
+        }
+    }
+    /* Pad with the most significant bits of the end-of-string code, all ones */
+    if (pending > 0)
+        out += (char)(bits << (8 - pending) | (0xff >> pending));
+}
+
+/**
+ * Integers have an `prefix_bits` wide prefix in the first byte, larger
+ * values continue in 7-bit groups, least significant first. We refuse
+ * anything that does not fit 28 bits, no table or string gets that big.
+ */
+inline bool hpack_read_int(const unsigned char *&p, const unsigned char *end, int prefix_bits, size_t &value)
+{
+    if (p == end)
+        return false;
+    size_t mask = (1u << prefix_bits) - 1;
+    value = *p++ & mask;
+    if (value < mask)
+        return true;
+    for (int shift = 0; shift <= 21; shift += 7)
+    {
+        if (p == end)
+            return false;
+        unsigned char byte = *p++;
+        value += (size_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+inline void hpack_write_int(std::string &out, unsigned char first, int prefix_bits, size_t value)
+{
+    size_t mask = (1u << prefix_bits) - 1;
+    if (value < mask)
+    {
+        out += (char)(first | value);
+        return;
+    }
+    out += (char)(first | mask);
+    value -= mask;
+    while (value >= 0x80)
+    {
+        out += (char)(value | 0x80);
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+/**
+ * A string literal: one bit for Huffman, the length, the bytes. A plain
+ * string is returned in place, a Huffman coded one is decoded into `scratch`.
+ */
+inline bool hpack_read_string(const unsigned char *&p, const unsigned char *end, std::string &scratch,
+                              std::string_view &text)
+{
+    if (p == end)
+        return false;
+    bool huffman = *p & 0x80;
+    size_t len;
+    if (!hpack_read_int(p, end, 7, len) || len > (size_t)(end - p))
+        return false;
+    if (huffman)
+    {
+        scratch.clear();
+        if (!hpack_huffman_decode(p, len, scratch))
+            return false;
+        text = scratch;
+    }
+    else
+    {
+        text = std::string_view((const char *)p, len);
+    }
+    p += len;
+    return true;
+}
+
+/* Huffman coding is used whenever it makes the string shorter */
+inline void hpack_write_string(std::string &out, std::string_view text)
+{
+    size_t coded = hpack_huffman_size(text);
+    if (coded < text.size())
+    {
+        hpack_write_int(out, 0x80, 7, coded);
+        hpack_huffman_encode(text, out);
+    }
+    else
+    {
+        hpack_write_int(out, 0, 7, text.size());
+        out.append(text.data(), text.size());
+    }
+}
+
+inline void hpack_evict(HpackTable &table, size_t room)
+{
+    while (!table.entries.empty() && table.size + room > table.max_size)
+    {
+        const auto &oldest = table.entries.back();
+        table.size -= oldest.first.size() + oldest.second.size() + HPACK_ENTRY_OVERHEAD;
+        table.entries.pop_back();
+    }
+}
+
+/* An entry larger than the whole table empties it and is not added */
+inline void hpack_insert(HpackTable &table, std::string_view name, std::string_view value)
+{
+    size_t entry_size = name.size() + value.size() + HPACK_ENTRY_OVERHEAD;
+    if (entry_size > table.max_size)
+    {
+        hpack_evict(table, table.max_size + 1);
+        return;
+    }
+    hpack_evict(table, entry_size);
+    table.entries.emplace_front(std::string(name), std::string(value));
+    table.size += entry_size;
+}
+
+inline bool hpack_lookup(const HpackTable &table, size_t index, std::string_view &name, std::string_view &value)
+{
+    if (index == 0)
+        return false;
+    if (index <= HPACK_STATIC_ENTRIES)
+    {
+        name = hpack_static_table()[index - 1][0];
+        value = hpack_static_table()[index - 1][1];
+        return true;
+    }
+    index -= HPACK_STATIC_ENTRIES + 1;
+    if (index >= table.entries.size())
+        return false;
+    name = table.entries[index].first;
+    value = table.entries[index].second;
+    return true;
+}
+
+/**
+ * Decode the header block `[p, p + len)` with `table`, calling
+ * `emit(name, value)` for every field in order, the views only live until
+ * `emit` returns. `false` when the block is malformed, the table is then
+ * out of step with the peer's.
+ */
+template <typename Emit>
+bool hpack_decode(HpackTable &table, const unsigned char *p, size_t len, std::string &name_scratch,
+                  std::string &value_scratch, Emit &&emit)
+{
+    const unsigned char *end = p + len;
+    bool fields_seen = false;
+    while (p < end)
+    {
+        unsigned char first = *p;
+        std::string_view name;
+        std::string_view value;
+        size_t index;
+        if (first & 0x80)
+        {
+            if (!hpack_read_int(p, end, 7, index) || !hpack_lookup(table, index, name, value))
+                return false;
+            fields_seen = true;
+            emit(name, value);
+            continue;
+        }
+        if ((first & 0xe0) == 0x20)
+        {
+            /* Size updates may only open a block, and stay within what we allowed */
+            if (fields_seen || !hpack_read_int(p, end, 5, index) || index > table.limit)
+                return false;
+            table.max_size = index;
+            hpack_evict(table, 0);
+            continue;
+        }
+
+        bool indexing = (first & 0xc0) == 0x40;
+        if (!hpack_read_int(p, end, indexing ? 6 : 4, index))
+            return false;
+        if (index == 0)
+        {
+            if (!hpack_read_string(p, end, name_scratch, name))
+                return false;
+        }
+        else
+        {
+            std::string_view unused;
+            if (!hpack_lookup(table, index, name, unused))
+                return false;
+            /* Adding the field below may evict the entry the name comes from */
+            if (indexing && index > HPACK_STATIC_ENTRIES)
+            {
+                name_scratch.assign(name.data(), name.size());
+                name = name_scratch;
+            }
+        }
+        if (!hpack_read_string(p, end, value_scratch, value))
+            return false;
+        fields_seen = true;
+        if (indexing)
+            hpack_insert(table, name, value);
+        emit(name, value);
+    }
+    return true;
+}
+
+/**
+ * Change how large the encoder's table may get, the decoder on the other
+ * side hears about it at the start of the next block
+ */
+inline void hpack_set_max_size(HpackTable &table, size_t max_size)
+{
+    if (max_size == table.max_size)
+        return;
+    table.max_size = max_size;
+    hpack_evict(table, 0);
+    table.update_pending = true;
+}
+
+inline void hpack_begin_block(HpackTable &table, std::string &out)
+{
+    if (!table.update_pending)
+        return;
+    hpack_write_int(out, 0x20, 5, table.max_size);
+    table.update_pending = false;
+}
+
+/**
+ * Append the encoding of one field to `out`
+ *
+ * A field already in a table is sent as its index. Otherwise the
+ * value is sent as a literal, with the index of the name when a table
+ * has it; `index` adds the field to the table, worth it for fields that
+ * repeat across responses, not for ones like `content-length`.
+ */
+inline void hpack_encode(HpackTable &table, std::string &out, std::string_view name, std::string_view value,
+                         bool index)
+{
+    size_t name_index = 0;
+    for (size_t i = 0; i < HPACK_STATIC_ENTRIES; ++i)
+    {
+        const char *const *entry = hpack_static_table()[i];
+        if (name != entry[0])
+            continue;
+        if (value == entry[1])
+        {
+            hpack_write_int(out, 0x80, 7, i + 1);
+            return;
+        }
+        if (name_index == 0)
+            name_index = i + 1;
+    }
+    for (size_t i = 0; i < table.entries.size(); ++i)
+    {
+        const auto &entry = table.entries[i];
+        if (entry.first != name)
+            continue;
+        if (entry.second == value)
+        {
+            hpack_write_int(out, 0x80, 7, i + HPACK_STATIC_ENTRIES + 1);
+            return;
+        }
+        if (name_index == 0)
+            name_index = i + HPACK_STATIC_ENTRIES + 1;
+    }
+
+    index = index && name.size() + value.size() + HPACK_ENTRY_OVERHEAD <= table.max_size;
+    if (index)
+        hpack_write_int(out, 0x40, 6, name_index);
+    else
+        hpack_write_int(out, 0x00, 4, name_index);
+    if (name_index == 0)
+        hpack_write_string(out, name);
+    hpack_write_string(out, value);
+    if (index)
+        hpack_insert(table, name, value);
+}
+
+#endif
@@ -0,0 +1,313 @@
+#include "http_parser.hpp"
+
+#include <strings.h>
+
+#include <cstdint>
+
+#include "http_scan.hpp"
+
+bool header_value_has_token(std::string_view value, std::string_view token)
+{
+    size_t i = 0;
+    while (i < value.size())
+    {
+        while (i < value.size() && (value[i] == ' ' || value[i] == '\t' || value[i] == ','))
+            ++i;
+        size_t begin = i;
+        while (i < value.size() && value[i] != ',')
+            ++i;
+        size_t end = i;
+        while (end > begin && (value[end - 1] == ' ' || value[end - 1] == '\t'))
+            --end;
+        if (end - begin == token.size() && strncasecmp(value.data() + begin, token.data(), token.size()) == 0)
+            return true;
+    }
+    return false;
+}
+
+long parse_content_length(std::string_view value)
+{
+    if (value.empty() || value.size() > 18)
+        return -1;
+    long length = 0;
+    for (char c : value)
+    {
+        if (c < '0' || c > '9')
+            return -1;
+        length = length * 10 + (c - '0');
+    }
+    return length;
+}
+
+int parse_request_head(const char *buf, size_t len, HttpRequest &req)
+{
+    const ScanKernels &scan = scan_kernels();
+    const char *p = buf;
+    const char *end = buf + len;
+    req.head = std::string_view(buf, len);
+
+    const char *start = p;
+    p = scan.find_token_end(p, end);
+    if (p == start || *p != ' ')
+        return 400;
+    req.method = std::string_view(start, p - start);
+    ++p;
+
+    start = p;
+    while ((unsigned char)*p > ' ' && *p != 0x7f)
+        ++p;
+    if (p == start || *p != ' ')
+        return 400;
+    req.target = std::string_view(start, p - start);
+    ++p;
+
+    if (end - p < 10 || memcmp(p, "HTTP/", 5) != 0)
+        return 400;
+    if (p[5] != '1' || p[6] != '.' || p[7] < '0' || p[7] > '9')
+        return 505;
+    if (p[8] != '\r' || p[9] != '\n')
+        return 400;
+    req.version_minor = p[7] - '0';
+    p += 10;
+
+    req.num_headers = 0;
+    while (p[0] != '\r')
+    {
+        start = p;
+        p = scan.find_token_end(p, end);
+        if (p == start || *p != ':')
+            return 400;
+        std::string_view name(start, p - start);
+        ++p;
+
+        while (*p == ' ' || *p == '\t')
+            ++p;
+        start = p;
+        p = scan.find_value_end(p, end);
+        if (p[0] != '\r' || p[1] != '\n')
+            return 400;
+        const char *value_end = p;
+        while (value_end > start && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+            --value_end;
+
+        if (req.num_headers == MAX_HEADERS)
+            return 431;
+        req.headers[req.num_headers++] = {name, std::string_view(start, value_end - start)};
+        p += 2;
+    }
+    if (p + 2 != end)
+        return 400;
+
+    req.content_length = -1;
+    req.chunked = false;
+    req.keep_alive = req.version_minor >= 1;
+    bool has_host = false;
+    for (size_t i = 0; i < req.num_headers; ++i)
+    {
+        const HttpHeader &header = req.headers[i];
+        if (header.name.size() == 10 && strncasecmp(header.name.data(), "Connection", 10) == 0)
+        {
+            if (header_value_has_token(header.value, "close"))
+                req.keep_alive = false;
+            else if (header_value_has_token(header.value, "keep-alive"))
+                req.keep_alive = true;
+        }
+        else if (header.name.size() == 14 && strncasecmp(header.name.data(), "Content-Length", 14) == 0)
+        {
+            long length = parse_content_length(header.value);
+            if (length < 0 || (req.content_length != -1 && req.content_length != length))
+                return 400;
+            req.content_length = length;
+        }
+        else if (header.name.size() == 17 && strncasecmp(header.name.data(), "Transfer-Encoding", 17) == 0)
+        {
+            /* `chunked` is the only coding we decode, anything else we can not frame */
+            if (req.chunked || header.value.size() != 7 || strncasecmp(header.value.data(), "chunked", 7) != 0)
+                return 501;
+            req.chunked = true;
+        }
+        else if (header.name.size() == 4 && strncasecmp(header.name.data(), "Host", 4) == 0)
+        {
+            has_host = true;
+        }
+    }
+
+    /**
+     * A request with both framings is the classic request smuggling
+     * vector, and HTTP/1.1 requires a Host header
+     */
+    if (req.chunked && req.content_length != -1)
+        return 400;
+    if (req.version_minor >= 1 && !has_host)
+        return 400;
+    if (req.content_length > UINT32_MAX)
+        return 413;
+    return 0;
+}
+
+ParseResult parse_error(HttpParser &parser, int status)
+{
+    parser.error_status = status;
+    return PARSE_ERROR;
+}
+
+int parse_chunk_size(const char *line, const char *eol, size_t &size)
+{
+    size = 0;
+    const char *p = line;
+    for (; p < eol; ++p)
+    {
+        int digit;
+        if (*p >= '0' && *p <= '9')
+            digit = *p - '0';
+        else if (*p >= 'a' && *p <= 'f')
+            digit = *p - 'a' + 10;
+        else if (*p >= 'A' && *p <= 'F')
+            digit = *p - 'A' + 10;
+        else
+            break;
+        if (p - line >= 15)
+            return 413;
+        size = size * 16 + digit;
+    }
+    /* Chunk extensions after `;` are allowed and ignored */
+    if (p == line || (p != eol && *p != ';' && *p != ' ' && *p != '\t'))
+        return 400;
+    return 0;
+}
+
+ParseResult parse_chunked_body(HttpParser &parser, char *buf, size_t len, size_t max_body)
+{
+    while (true)
+    {
+        switch (parser.state)
+        {
+        case HttpParser::CHUNK_SIZE:
+        {
+            const char *line = buf + parser.raw_pos;
+            const char *eol = (const char *)memmem(line, len - parser.raw_pos, "\r\n", 2);
+            if (eol == nullptr)
+            {
+                if (len - parser.raw_pos > MAX_CHUNK_LINE)
+                    return parse_error(parser, 400);
+                return PARSE_INCOMPLETE;
+            }
+
+            size_t size = 0;
+            int status = parse_chunk_size(line, eol, size);
+            if (status != 0)
+                return parse_error(parser, status);
+            if (parser.body_len + size > max_body)
+                return parse_error(parser, 413);
+
+            parser.raw_pos = eol + 2 - buf;
+            parser.chunk_left = size;
+            parser.state = size == 0 ? HttpParser::TRAILER : HttpParser::CHUNK_DATA;
+            break;
+        }
+        case HttpParser::CHUNK_DATA:
+        {
+            size_t available = std::min((size_t)parser.chunk_left, len - parser.raw_pos);
+            memmove(buf + parser.head_len + parser.body_len, buf + parser.raw_pos, available);
+            parser.body_len += available;
+            parser.raw_pos += available;
+            parser.chunk_left -= available;
+            if (parser.chunk_left > 0)
+                return PARSE_INCOMPLETE;
+            parser.state = HttpParser::CHUNK_DATA_END;
+            break;
+        }
+        case HttpParser::CHUNK_DATA_END:
+            if (len - parser.raw_pos < 2)
+                return PARSE_INCOMPLETE;
+            if (buf[parser.raw_pos] != '\r' || buf[parser.raw_pos + 1] != '\n')
+                return parse_error(parser, 400);
+            parser.raw_pos += 2;
+            parser.state = HttpParser::CHUNK_SIZE;
+            break;
+        case HttpParser::TRAILER:
+        {
+            /* Trailer fields are skipped, the empty line ends the request */
+            const char *line = buf + parser.raw_pos;
+            const char *eol = (const char *)memmem(line, len - parser.raw_pos, "\r\n", 2);
+            if (eol == nullptr)
+            {
+                if (len - parser.raw_pos > MAX_REQUEST_HEAD)
+                    return parse_error(parser, 431);
+                return PARSE_INCOMPLETE;
+            }
+            parser.raw_pos = eol + 2 - buf;
+            if (eol == line)
+            {
+                parser.consumed = parser.raw_pos;
+                return PARSE_COMPLETE;
+            }
+            break;
+        }
+        default:
+            return parse_error(parser, 400);
+        }
+    }
+}
+
+ParseResult parse_request(HttpParser &parser, char *buf, size_t len, HttpRequest &req, size_t max_body)
+{
+    bool head_parsed = false;
+    if (parser.state == HttpParser::HEAD)
+    {
+        size_t from = parser.scanned > 3 ? parser.scanned - 3 : 0;
+        const char *blank_line = scan_kernels().find_head_end(buf + from, buf + len);
+        if (blank_line == nullptr)
+        {
+            parser.scanned = len;
+            if (len > MAX_REQUEST_HEAD)
+                return parse_error(parser, 431);
+            return PARSE_INCOMPLETE;
+        }
+        parser.head_len = blank_line + 4 - buf;
+        if (parser.head_len > MAX_REQUEST_HEAD)
+            return parse_error(parser, 431);
+
+        int status = parse_request_head(buf, parser.head_len, req);
+        if (status != 0)
+            return parse_error(parser, status);
+        head_parsed = true;
+
+        if (req.chunked)
+        {
+            parser.state = HttpParser::CHUNK_SIZE;
+            parser.raw_pos = parser.head_len;
+        }
+        else
+        {
+            parser.state = HttpParser::BODY;
+            parser.content_length = req.content_length > 0 ? req.content_length : 0;
+        }
+        if (req.chunked || req.content_length > 0)
+            return PARSE_HEAD;
+    }
+
+    if (parser.state == HttpParser::BODY)
+    {
+        if (len - parser.head_len < (size_t)parser.content_length)
+            return PARSE_INCOMPLETE;
+        parser.body_len = parser.content_length;
+        parser.consumed = parser.head_len + parser.content_length;
+    }
+    else
+    {
+        ParseResult result = parse_chunked_body(parser, buf, len, max_body);
+        if (result != PARSE_COMPLETE)
+            return result;
+    }
+
+    /**
+     * The head of a request whose body took several reads was parsed on an
+     * earlier call, its views pointed at a buffer that may have moved since.
+     * It already passed validation, parsing it again is cheap.
+     */
+    if (!head_parsed)
+        parse_request_head(buf, parser.head_len, req);
+    req.body = std::string_view(buf + parser.head_len, parser.body_len);
+    return PARSE_COMPLETE;
+}
@@ -0,0 +1,175 @@
+#ifndef HTTP_PARSER_HPP
+#define HTTP_PARSER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#include <strings.h>
+
+#define MAX_REQUEST_HEAD 16384
+#define MAX_HEADERS 64
+#define MAX_CHUNK_LINE 1024
+
+/**
+ * HTTP/1.1 request parser
+ *
+ * The parser never copies: method, target, header names and values are
+ * `std::string_view`s pointing straight into the connection input buffer,
+ * and headers go into a fixed array so parsing a request does not touch
+ * the heap.
+ *
+ * It is also incremental. With edge-triggered reads a request can arrive
+ * in any number of pieces, `HttpParser` remembers how far it got (how much
+ * of the head it already searched, where it is inside a chunked body) and
+ * continues from there on the next read instead of starting over.
+ */
+struct HttpHeader
+{
+    std::string_view name;
+    std::string_view value;
+};
+
+/**
+ * A fully received request
+ *
+ * Every view points into the connection input buffer and is only valid
+ * until the request has been answered. `head` is the whole head as it
+ * arrived, blank line included. `body` is the request body with any
+ * chunked framing already removed.
+ */
+struct HttpRequest
+{
+    std::string_view head;
+    std::string_view method;
+    std::string_view target;
+    int version_minor = 1;
+
+    HttpHeader headers[MAX_HEADERS];
+    size_t num_headers = 0;
+
+    long content_length = -1;
+    bool chunked = false;
+    bool keep_alive = false;
+    std::string_view body;
+
+    /* Case-insensitive header lookup, `nullptr` when the header is absent */
+    const HttpHeader *find_header(std::string_view name) const
+    {
+        for (size_t i = 0; i < num_headers; ++i)
+        {
+            if (headers[i].name.size() == name.size() &&
+                strncasecmp(headers[i].name.data(), name.data(), name.size()) == 0)
+                return &headers[i];
+        }
+        return nullptr;
+    }
+};
+
+/**
+ * `PARSE_HEAD` is reported once, when the head of a request with a body is
+ * complete: the caller may decide where the body goes before it arrives
+ */
+enum ParseResult
+{
+    PARSE_INCOMPLETE,
+    PARSE_HEAD,
+    PARSE_COMPLETE,
+    PARSE_ERROR,
+};
+
+/**
+ * Per-connection parser state, everything is an offset from the first
+ * byte of the request currently being parsed
+ *
+ * `scanned` is how far we already searched for the blank line ending the
+ * head. Once the head is complete `head_len` is its size and the body is
+ * framed by `content_length` or by the chunked decoder (`raw_pos` is the
+ * next undecoded byte, `body_len` how many body bytes we decoded so far,
+ * `chunk_left` what is left of the current chunk).
+ *
+ * On `PARSE_COMPLETE`, `consumed` is the size of the whole request on the
+ * wire. On `PARSE_ERROR`, `error_status` is the status code to answer with.
+ *
+ * One of these lives in every connection, so the fields are kept small:
+ * a buffered request has to fit a pooled input buffer and a streamed
+ * body is capped below 4 GB by `max_body`.
+ */
+struct HttpParser
+{
+    enum State : uint8_t
+    {
+        HEAD,
+        BODY,
+        CHUNK_SIZE,
+        CHUNK_DATA,
+        CHUNK_DATA_END,
+        TRAILER,
+    };
+
+    State state = HEAD;
+    uint32_t scanned = 0;
+    uint32_t head_len = 0;
+    uint32_t content_length = 0;
+    uint32_t raw_pos = 0;
+    uint32_t body_len = 0;
+    uint32_t chunk_left = 0;
+    uint32_t consumed = 0;
+    uint16_t error_status = 0;
+
+    void reset() { *this = HttpParser{}; }
+};
+
+/**
+ * Case-insensitive search for `token` inside a comma separated header value
+ */
+bool header_value_has_token(std::string_view value, std::string_view token);
+
+/**
+ * Strict decimal parse of a Content-Length value, `-1` if it is not one
+ */
+long parse_content_length(std::string_view value);
+
+/**
+ * Parse a complete head, `buf` starts with the request line and `len`
+ * includes the blank line that ends the head
+ *
+ * Besides filling `req` with views into `buf` this works out how the body
+ * is framed and whether the connection is persistent: HTTP/1.1 connections
+ * are persistent unless the client sends `Connection: close`, HTTP/1.0
+ * connections are closed unless the client sends `Connection: keep-alive`.
+ *
+ * Returns the status code to reject the request with, or `0`.
+ */
+int parse_request_head(const char *buf, size_t len, HttpRequest &req);
+
+ParseResult parse_error(HttpParser &parser, int status);
+
+/**
+ * Parse the size at the start of a chunk size line ending at `eol`,
+ * returns the status to reject the request with or `0`
+ */
+int parse_chunk_size(const char *line, const char *eol, size_t &size);
+
+/**
+ * Read a chunked body in place
+ *
+ * The chunk framing is stripped by moving every chunk's data down to
+ * directly after the head, so once the last chunk arrived the decoded body
+ * is contiguous at `buf + head_len` and can be handed out as one view.
+ */
+ParseResult parse_chunked_body(HttpParser &parser, char *buf, size_t len, size_t max_body);
+
+/**
+ * Feed the bytes of one request, starting at its first byte, to the parser
+ *
+ * Call again with the same start and a larger `len` whenever more bytes
+ * arrive. `buf` is writable because chunked bodies are decoded in place.
+ * On `PARSE_COMPLETE` `req` describes the request and `parser.consumed`
+ * says how many bytes of `buf` it used; reset the parser before the next one.
+ * On `PARSE_HEAD` `req` describes the head, call again for the body,
+ * whose decoded size may not exceed `max_body`.
+ */
+ParseResult parse_request(HttpParser &parser, char *buf, size_t len, HttpRequest &req, size_t max_body);
+
+#endif
@@ -0,0 +1,92 @@
+#include "http_response.hpp"
+
+#include <time.h>
+
+#include <cstdio>
+#include <cstring>
+
+void format_http_date(time_t when, char *out)
+{
+    static const char days[7][4] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+    static const char months[12][4] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                       "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    tm parts;
+    gmtime_r(&when, &parts);
+    char formatted[64];
+    snprintf(formatted, sizeof(formatted), "%s, %02d %s %04d %02d:%02d:%02d GMT", days[parts.tm_wday],
+             parts.tm_mday, months[parts.tm_mon], parts.tm_year + 1900, parts.tm_hour, parts.tm_min,
+             parts.tm_sec);
+    memcpy(out, formatted, HTTP_DATE_SIZE);
+    out[HTTP_DATE_SIZE] = '\0';
+}
+
+void patch_response_date(ResponseCache &cache, int generation)
+{
+    for (StaticResponse &response : cache.responses)
+    {
+        for (int keep_alive = 0; keep_alive < 2; ++keep_alive)
+        {
+            std::string &bytes = response.bytes[keep_alive][generation];
+            memcpy(&bytes[response.date_offset[keep_alive]], cache.date, HTTP_DATE_SIZE);
+        }
+    }
+}
+
+void refresh_response_date(ResponseCache &cache)
+{
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    if (ts.tv_sec == cache.date_second)
+        return;
+
+    cache.date_second = ts.tv_sec;
+    format_http_date(ts.tv_sec, cache.date);
+    patch_response_date(cache, ts.tv_sec & 1);
+}
+
+void render_static_response(ResponseCache &cache, StaticResponseId id, const char *status,
+                            const char *content_type, std::string_view body,
+                            const char *extra_headers)
+{
+    StaticResponse &response = cache.responses[id];
+    for (int keep_alive = 0; keep_alive < 2; ++keep_alive)
+    {
+        std::string head = std::string("HTTP/1.1 ") + status + "\r\n";
+        if (content_type != nullptr)
+            head += std::string("Content-Type: ") + content_type + "\r\n";
+        head += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+        head += extra_headers;
+        head += keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+        head += "Date: ";
+        response.date_offset[keep_alive] = head.size();
+        head.append(HTTP_DATE_SIZE, ' ');
+        head += "\r\n\r\n";
+        response.header_size[keep_alive] = head.size();
+
+        std::string bytes = head;
+        bytes.append(body.data(), body.size());
+        response.bytes[keep_alive][0] = bytes;
+        response.bytes[keep_alive][1] = bytes;
+    }
+}
+
+void build_response_cache(ResponseCache &cache)
+{
+    render_static_response(cache, RESPONSE_HELLO, "200 OK", "text/plain", "Hello, world!");
+    render_static_response(cache, RESPONSE_HEALTH, "200 OK", "text/plain", "ok\n");
+    render_static_response(cache, RESPONSE_NOT_FOUND, "404 Not Found", "text/plain", "Not Found\n");
+    render_static_response(cache, RESPONSE_BAD_REQUEST, "400 Bad Request", nullptr, "");
+    render_static_response(cache, RESPONSE_PAYLOAD_TOO_LARGE, "413 Content Too Large", nullptr, "");
+    render_static_response(cache, RESPONSE_HEADERS_TOO_LARGE, "431 Request Header Fields Too Large", nullptr, "");
+    render_static_response(cache, RESPONSE_INTERNAL_ERROR, "500 Internal Server Error", nullptr, "");
+    render_static_response(cache, RESPONSE_NOT_IMPLEMENTED, "501 Not Implemented", nullptr, "");
+    render_static_response(cache, RESPONSE_VERSION_NOT_SUPPORTED, "505 HTTP Version Not Supported", nullptr, "");
+    render_static_response(cache, RESPONSE_TOO_MANY_REQUESTS, "429 Too Many Requests", nullptr, "",
+                           "Retry-After: 1\r\n");
+    render_static_response(cache, RESPONSE_SERVICE_UNAVAILABLE, "503 Service Unavailable", nullptr, "",
+                           "Retry-After: 1\r\n");
+
+    /* Both date generations start out filled in */
+    refresh_response_date(cache);
+    patch_response_date(cache, (cache.date_second & 1) ^ 1);
+}
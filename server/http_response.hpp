@@ -0,0 +1,89 @@
+#ifndef HTTP_RESPONSE_HPP
+#define HTTP_RESPONSE_HPP
+
+#include <cstddef>
+#include <ctime>
+#include <string>
+#include <string_view>
+
+#define HTTP_DATE_SIZE 29
+
+/**
+ * Fixed responses, serialized once when a reactor starts
+ *
+ * Status line, headers and body of a fixed response (hello world, health
+ * check, errors) never change, so instead of building them per request
+ * every reactor renders them once and afterwards only queues a pointer
+ * into the rendered bytes, nothing is copied or allocated per request.
+ *
+ * The only moving part is the `Date` header. The reactor formats the date
+ * once per second and patches it into every cached response. There are
+ * two copies of each response, one for even and one for odd seconds, so
+ * the bytes behind a response that is still waiting in a slow client's
+ * output queue are not rewritten for at least another second.
+ *
+ * Each response exists in a keep-alive and a `Connection: close` flavour,
+ * `header_size` is where the body starts so HEAD requests can share them.
+ */
+enum StaticResponseId
+{
+    RESPONSE_HELLO,
+    RESPONSE_HEALTH,
+    RESPONSE_NOT_FOUND,
+    RESPONSE_BAD_REQUEST,
+    RESPONSE_PAYLOAD_TOO_LARGE,
+    RESPONSE_HEADERS_TOO_LARGE,
+    RESPONSE_INTERNAL_ERROR,
+    RESPONSE_NOT_IMPLEMENTED,
+    RESPONSE_VERSION_NOT_SUPPORTED,
+    RESPONSE_TOO_MANY_REQUESTS,
+    RESPONSE_SERVICE_UNAVAILABLE,
+    RESPONSE_COUNT,
+};
+
+struct StaticResponse
+{
+    std::string bytes[2][2];
+    size_t date_offset[2] = {};
+    size_t header_size[2] = {};
+};
+
+struct ResponseCache
+{
+    StaticResponse responses[RESPONSE_COUNT];
+    long date_second = -1;
+    char date[HTTP_DATE_SIZE + 1] = {};
+
+    std::string_view get(StaticResponseId id, bool keep_alive, bool head_only = false) const
+    {
+        const StaticResponse &response = responses[id];
+        const std::string &bytes = response.bytes[keep_alive][date_second & 1];
+        return std::string_view(bytes.data(), head_only ? response.header_size[keep_alive] : bytes.size());
+    }
+};
+
+/**
+ * Format the current wall clock second as an IMF-fixdate
+ * (`Sun, 06 Nov 1994 08:49:37 GMT`), always `HTTP_DATE_SIZE` characters
+ */
+void format_http_date(time_t when, char *out);
+
+/**
+ * Copy `cache.date` into the `generation` copy of every cached response
+ */
+void patch_response_date(ResponseCache &cache, int generation);
+
+/**
+ * Refresh the cached date, cheap enough to call on every loop iteration:
+ * the clock read is served from the vDSO and the patching only happens
+ * when the second actually changed
+ */
+void refresh_response_date(ResponseCache &cache);
+
+void render_static_response(ResponseCache &cache, StaticResponseId id, const char *status,
+                            const char *content_type, std::string_view body,
+                            const char *extra_headers = "");
+
+void build_response_cache(ResponseCache &cache);
+
+#endif
@@ -0,0 +1,379 @@
+#ifndef HTTP_SCAN_HPP
+#define HTTP_SCAN_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_SCAN_X86 1
+#endif
+
+/**
+ * Byte scanning kernels for the request parser
+ *
+ * Almost all the time spent parsing a request goes into three searches:
+ *  - the blank line (`\r\n\r\n`) that ends the head
+ *  - the end of a token (method, header name), the first byte that is not a `tchar`
+ *  - the end of a header value, the first control character other than HTAB
+ *
+ * Browsers send kilobytes of cookies, so these searches run over long
+ * stretches of bytes. Every search has a plain scalar version and, on
+ * x86, SSE4.2 (`PCMPESTRI`) and AVX2 versions that look at 16 or 32 bytes
+ * per step. `scan_kernels()` picks the best set the CPU supports once,
+ * at first use, so the same binary runs on any x86-64 host.
+ *
+ * Every search takes `[p, end)` and returns a pointer into that range:
+ * the match, or `end` (`nullptr` for `find_head_end`) when there is none.
+ *
+ * The set also carries `unmask`, which is no search but touches every
+ * byte a WebSocket client sends: it XORs the `size` bytes at `p` with the
+ * frame's 4-byte masking key, `key` holds the key bytes in memory order
+ * and `p` is the first byte of the payload.
+ */
+struct ScanKernels
+{
+    const char *name;
+    const char *(*find_head_end)(const char *p, const char *end);
+    const char *(*find_token_end)(const char *p, const char *end);
+    const char *(*find_value_end)(const char *p, const char *end);
+    void (*unmask)(char *p, size_t size, uint32_t key);
+};
+
+/**
+ * `tchar` from RFC 9110, the characters a method or a header name may use
+ */
+inline const bool *token_chars()
+{
+    static const struct Table
+    {
+        bool chars[256] = {};
+        Table()
+        {
+            for (int c = '0'; c <= '9'; ++c)
+                chars[c] = true;
+            for (int c = 'a'; c <= 'z'; ++c)
+                chars[c] = chars[c - 'a' + 'A'] = true;
+            for (const char *p = "!#$%&'*+-.^_`|~"; *p; ++p)
+                chars[(unsigned char)*p] = true;
+        }
+    } table;
+    return table.chars;
+}
+
+inline bool is_value_end(unsigned char c)
+{
+    return (c < ' ' && c != '\t') || c == 0x7f;
+}
+
+inline const char *scalar_find_head_end(const char *p, const char *end)
+{
+    for (; end - p >= 4; ++p)
+    {
+        if (p[0] == '\r' && p[1] == '\n' && p[2] == '\r' && p[3] == '\n')
+            return p;
+    }
+    return nullptr;
+}
+
+inline const char *scalar_find_token_end(const char *p, const char *end)
+{
+    const bool *tchar = token_chars();
+    while (p < end && tchar[(unsigned char)*p])
+        ++p;
+    return p;
+}
+
+inline const char *scalar_find_value_end(const char *p, const char *end)
+{
+    while (p < end && !is_value_end((unsigned char)*p))
+        ++p;
+    return p;
+}
+
+/* Eight bytes per step, the key repeats every four so it is simply doubled */
+inline void scalar_unmask(char *p, size_t size, uint32_t key)
+{
+    uint64_t wide = (uint64_t)key << 32 | key;
+    size_t i = 0;
+    for (; size - i >= 8; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, p + i, 8);
+        word ^= wide;
+        memcpy(p + i, &word, 8);
+    }
+    const unsigned char *bytes = (const unsigned char *)&key;
+    for (; i < size; ++i)
+        p[i] ^= bytes[i & 3];
+}
+
+#ifdef HTTP_SCAN_X86
+
+/**
+ * SSE4.2 kernels, picohttpparser style
+ *
+ * `PCMPESTRI` in "equal ordered" mode is a 16 byte substring search, and
+ * in "ranges" mode it finds the first byte that falls into up to eight
+ * byte ranges. The token ranges cannot express `|` and `~` exactly, so a
+ * stop on one of those is double checked with the scalar table.
+ */
+__attribute__((target("sse4.2"))) inline const char *sse42_find_head_end(const char *p, const char *end)
+{
+    const __m128i needle = _mm_setr_epi8('\r', '\n', '\r', '\n', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    while (end - p >= 16)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        int index = _mm_cmpestri(needle, 4, chunk, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ORDERED);
+        if (index <= 12)
+            return p + index;
+        /* Nothing, or only the start of a match at the very end of the block */
+        p += index;
+    }
+    return scalar_find_head_end(p, end);
+}
+
+__attribute__((target("sse4.2"))) inline const char *sse42_find_token_end(const char *p, const char *end)
+{
+    static const char ranges[17] = "\x00 "  /* control characters and space */
+                                   "\"\""   /* 0x22 */
+                                   "()"     /* 0x28, 0x29 */
+                                   ",,"     /* 0x2c */
+                                   "//"     /* 0x2f */
+                                   ":@"     /* 0x3a - 0x40 */
+                                   "[]"     /* 0x5b - 0x5d */
+                                   "{\xff"; /* 0x7b - 0xff, catches `|` and `~` too */
+    const __m128i delimiters = _mm_loadu_si128((const __m128i *)ranges);
+    const bool *tchar = token_chars();
+    while (end - p >= 16)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        int index = _mm_cmpestri(delimiters, 16, chunk, 16,
+                                 _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (index == 16)
+        {
+            p += 16;
+            continue;
+        }
+        p += index;
+        if (!tchar[(unsigned char)*p])
+            return p;
+        ++p;
+    }
+    return scalar_find_token_end(p, end);
+}
+
+__attribute__((target("sse4.2"))) inline const char *sse42_find_value_end(const char *p, const char *end)
+{
+    static const char ranges[16] = "\x00\x08"  /* control characters before HTAB */
+                                   "\x0a\x1f"  /* control characters after HTAB */
+                                   "\x7f\x7f"; /* DEL */
+    const __m128i delimiters = _mm_loadu_si128((const __m128i *)ranges);
+    while (end - p >= 16)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        int index = _mm_cmpestri(delimiters, 6, chunk, 16,
+                                 _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (index != 16)
+            return p + index;
+        p += 16;
+    }
+    return scalar_find_value_end(p, end);
+}
+
+/* Only needs SSE2, the set is named after its searches */
+__attribute__((target("sse4.2"))) inline void sse42_unmask(char *p, size_t size, uint32_t key)
+{
+    const __m128i mask = _mm_set1_epi32((int)key);
+    size_t i = 0;
+    for (; size - i >= 16; i += 16)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(p + i));
+        _mm_storeu_si128((__m128i *)(p + i), _mm_xor_si128(chunk, mask));
+    }
+    /* Every step is a multiple of four bytes, so the key is still in phase */
+    scalar_unmask(p + i, size - i, key);
+}
+
+/**
+ * AVX2 kernels, 32 bytes per step
+ *
+ * The blank line is found by comparing four overlapping loads, one per
+ * byte of `\r\n\r\n`, and and-ing the results. Token bytes are classified
+ * exactly with two nibble lookups (`VPSHUFB`): the low nibble selects a
+ * bitmap of the high nibbles that form a `tchar` with it.
+ */
+__attribute__((target("avx2"))) inline const char *avx2_find_head_end(const char *p, const char *end)
+{
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    while (end - p >= 35)
+    {
+        __m256i b0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), cr);
+        __m256i b1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 1)), lf);
+        __m256i b2 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 2)), cr);
+        __m256i b3 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 3)), lf);
+        __m256i match = _mm256_and_si256(_mm256_and_si256(b0, b1), _mm256_and_si256(b2, b3));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(match);
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    return scalar_find_head_end(p, end);
+}
+
+/**
+ * Bit `h` of `token_nibble_bitmap()[l]` is set when byte `h << 4 | l` is a `tchar`
+ */
+inline const unsigned char *token_nibble_bitmap()
+{
+    static const struct Bitmap
+    {
+        unsigned char bits[32] = {};
+        Bitmap()
+        {
+            const bool *tchar = token_chars();
+            for (int c = 0; c < 128; ++c)
+            {
+                if (tchar[c])
+                    bits[c & 0x0f] |= (unsigned char)(1u << (c >> 4));
+            }
+            /* `VPSHUFB` looks up each 128 bit lane separately, so the table is repeated */
+            memcpy(bits + 16, bits, 16);
+        }
+    } bitmap;
+    return bitmap.bits;
+}
+
+__attribute__((target("avx2"))) inline const char *avx2_find_token_end(const char *p, const char *end)
+{
+    const __m256i low_lookup = _mm256_loadu_si256((const __m256i *)token_nibble_bitmap());
+    /* 1 << high nibble for ASCII, bytes >= 0x80 never belong to a token */
+    const __m256i high_lookup = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, (char)128, 0, 0, 0, 0, 0, 0, 0, 0,
+                                                 1, 2, 4, 8, 16, 32, 64, (char)128, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    while (end - p >= 32)
+    {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)p);
+        __m256i low = _mm256_and_si256(chunk, nibble);
+        __m256i high = _mm256_and_si256(_mm256_srli_epi16(chunk, 4), nibble);
+        __m256i bits = _mm256_and_si256(_mm256_shuffle_epi8(low_lookup, low),
+                                        _mm256_shuffle_epi8(high_lookup, high));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(bits, zero));
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    return scalar_find_token_end(p, end);
+}
+
+__attribute__((target("avx2"))) inline const char *avx2_find_value_end(const char *p, const char *end)
+{
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    while (end - p >= 32)
+    {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)p);
+        /* unsigned `chunk >= ' '` is `max(chunk, ' ') == chunk` */
+        __m256i printable = _mm256_cmpeq_epi8(_mm256_max_epu8(chunk, space), chunk);
+        __m256i allowed = _mm256_or_si256(printable, _mm256_cmpeq_epi8(chunk, tab));
+        __m256i stop = _mm256_or_si256(_mm256_andnot_si256(allowed, _mm256_set1_epi8(-1)),
+                                       _mm256_cmpeq_epi8(chunk, del));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(stop);
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    return scalar_find_value_end(p, end);
+}
+
+__attribute__((target("avx2"))) inline void avx2_unmask(char *p, size_t size, uint32_t key)
+{
+    const __m256i mask = _mm256_set1_epi32((int)key);
+    size_t i = 0;
+    for (; size - i >= 64; i += 64)
+    {
+        __m256i first = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i second = _mm256_loadu_si256((const __m256i *)(p + i + 32));
+        _mm256_storeu_si256((__m256i *)(p + i), _mm256_xor_si256(first, mask));
+        _mm256_storeu_si256((__m256i *)(p + i + 32), _mm256_xor_si256(second, mask));
+    }
+    for (; size - i >= 32; i += 32)
+    {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(p + i));
+        _mm256_storeu_si256((__m256i *)(p + i), _mm256_xor_si256(chunk, mask));
+    }
+    scalar_unmask(p + i, size - i, key);
+}
+
+#endif
+
+inline const ScanKernels &scalar_scan_kernels()
+{
+    static const ScanKernels kernels = {"scalar", scalar_find_head_end, scalar_find_token_end,
+                                        scalar_find_value_end, scalar_unmask};
+    return kernels;
+}
+
+#ifdef HTTP_SCAN_X86
+inline const ScanKernels &sse42_scan_kernels()
+{
+    static const ScanKernels kernels = {"sse4.2", sse42_find_head_end, sse42_find_token_end,
+                                        sse42_find_value_end, sse42_unmask};
+    return kernels;
+}
+
+inline const ScanKernels &avx2_scan_kernels()
+{
+    static const ScanKernels kernels = {"avx2", avx2_find_head_end, avx2_find_token_end, avx2_find_value_end,
+                                        avx2_unmask};
+    return kernels;
+}
+#endif
+
+/**
+ * Every kernel set this CPU can run, scalar first, best last
+ *
+ * Fills `out` and returns how many sets were stored, `out` needs room for 3.
+ */
+inline int supported_scan_kernels(const ScanKernels **out)
+{
+    int count = 0;
+    out[count++] = &scalar_scan_kernels();
+#ifdef HTTP_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        out[count++] = &sse42_scan_kernels();
+    if (__builtin_cpu_supports("avx2"))
+        out[count++] = &avx2_scan_kernels();
+#endif
+    return count;
+}
+
+/**
+ * The kernel set the parser uses, selected once on first use
+ *
+ * Setting `HTTP_SCAN=scalar` (or `sse4.2`) in the environment forces a
+ * weaker set, useful to compare or to rule the SIMD paths out of a bug.
+ */
+inline const ScanKernels &scan_kernels()
+{
+    static const ScanKernels &selected = []() -> const ScanKernels & {
+        const ScanKernels *kernels[3];
+        int count = supported_scan_kernels(kernels);
+        const char *wanted = getenv("HTTP_SCAN");
+        for (int i = 0; wanted != nullptr && i < count; ++i)
+        {
+            if (strcmp(kernels[i]->name, wanted) == 0)
+                return *kernels[i];
+        }
+        return *kernels[count - 1];
+    }();
+    return selected;
+}
+
+#endif
@@ -1,32 +1,136 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <strings.h>
+#include <poll.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <linux/filter.h>
+#include <linux/io_uring.h>
+#include <linux/mempolicy.h>
+#include <linux/openat2.h>
+
+#include <brotli/encode.h>
+#include <openssl/core_names.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "hpack.hpp"
+#include "http_parser.hpp"
+#include "http_response.hpp"
+#include "http_scan.hpp"
+#include "http_server.hpp"
+#include "timer_wheel.hpp"
+#include "websocket.hpp"
+
 #define MAX_EVENTS 10
-#define PORT 8080
+#define MAX_PENDING_OUTPUT (256 * 1024)
+#define FILE_CACHE_VALID 1
+#define BUFFER_MIN_SIZE 4096
+#define BUFFER_CLASSES 10
+#define BUFFER_SLAB_CLASSES 3
+#define BUFFER_SLAB_SIZE (1024 * 1024)
+#define BUFFER_KEEP_LARGE 8
+#define OUTPUT_CHUNK_KEEP 4096
+#define MIN_READ_SIZE 1024
+#define BODY_READ_SIZE (64 * 1024)
+#define STREAM_CHUNK_SIZE 16384
+#define STREAM_MAX_PENDING (64 * 1024)
+#define LATENCY_SUB_BITS 2
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+#define COMPRESS_MIN_SIZE 256
+#define COMPRESS_MAX_FILE (8 * 1024 * 1024)
+#define COMPRESS_INLINE_MAX (32 * 1024)
+#define COMPRESSOR_KEEP 16
+#define COMPRESSION_ARENA_KEEP 64
+#define BROTLI_WINDOW_BITS 20
+#define TLS_RECORD_SIZE 16384
+#define TICKET_KEY_NAME_SIZE 16
+#define COROUTINE_FRAME_MIN 256
+#define COROUTINE_FRAME_CLASSES 6
+#define COROUTINE_ARENA_SIZE (4 * 1024 * 1024)
+#define UPSTREAM_CHECK_MS 2000
+#define UPSTREAM_READ_SIZE 16384
+#define RESPONSE_CACHE_PASS_MS 5000
+#define RATE_LIMIT_BITS 14
+#define RATE_LIMIT_PROBES 8
+#define ACCESS_LOG_RING 4096
+#define ACCESS_LOG_SAMPLE 16
+#define ACCESS_LOG_BATCH 65536
+#define ACCESS_LOG_FLUSH_MS 50
+#define HANDOFF_TIMEOUT_MS 10000
+#define HANDOFF_MAX_FDS 253
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_FRAME_HEADER 9
+#define H2_MAX_FRAME 16384
+#define H2_DEFAULT_WINDOW 65535
+#define H2_WINDOW (1024 * 1024)
+#define H2_MAX_STREAMS 100
+#define H2_COPY_LIMIT 4096
+#define WEBSOCKET_MAX_FRAME (1024 * 1024)
+#define WEBSOCKET_DEFLATE_MIN 128
+#define URING_QUEUE_DEPTH 4096
+#define URING_RECV_BUFFERS 1024
+#define URING_RECV_BUFFER_SIZE 4096
+#define URING_SEND_IOV 64
 
 /**
  * `fcntl` File Control Flags
  * By default our socket has blocking behaivour
  * which means if no data comes in from an client, we cannot handle others
- * 
+ *
  * To make non-blocking socket we use file control flags
  * file control flags explicitly mentions that if no data is coming
  * then switch to next client
- * 
+ *
  * `fcntl` requires a file descriptor, Operation Flag, mode
- * 
- * We are providing the `listen()` to `fcntl` because 
+ *
+ * We are providing the `listen()` to `fcntl` because
  * it is the entry point of our server
- * 
+ *
  * it cannot be non blocking.
  */
 int make_socket_non_blocking(int fd)
@@ -37,7 +141,17 @@ int make_socket_non_blocking(int fd)
     return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
-int main()
+/**
+ * Create a non-blocking listening socket bound to `port`
+ *
+ * `SO_REUSEPORT` lets every reactor bind its own socket to the same port.
+ * The kernel then keeps one accept queue per socket and hashes each new
+ * connection to one of them, so reactors never fight over a shared
+ * listening socket or a lock.
+ *
+ * Returns the listening fd, or `-1` on error.
+ */
+int create_listen_socket(int port)
 {
     /**
      * Create a listening socket for client
@@ -47,13 +161,22 @@ int main()
     if (listen_fd < 0)
     {
         perror("socket");
-        return 1;
+        return -1;
+    }
+
+    int one = 1;
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+    {
+        perror("setsockopt");
+        close(listen_fd);
+        return -1;
     }
 
     sockaddr_in addr{};
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(PORT);
+    addr.sin_port = htons(port);
 
     /**
      * Bind the socket to our specific port
@@ -61,7 +184,8 @@ int main()
     if (bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) < 0)
     {
         perror("bind");
-        return 1;
+        close(listen_fd);
+        return -1;
     }
 
     /**
@@ -71,140 +195,10038 @@ int main()
     if (listen(listen_fd, SOMAXCONN) < 0)
     {
         perror("listen");
-        return 1;
+        close(listen_fd);
+        return -1;
     }
 
     /**
      * `make_socket_blocking` has the implementation of `fctl()`
      * Make our listening socket non-blocking
     */
-    make_socket_non_blocking(listen_fd);
+    if (make_socket_non_blocking(listen_fd) == -1)
+    {
+        perror("fcntl");
+        close(listen_fd);
+        return -1;
+    }
 
-    /**
-     * Create a epoll instance using `epoll_create1`
-     * it is a special object that can monitor multiple sockets for event
-     * 
-     * It returns a file descriptor, flat `0` describes normal epoll_instance
-     */
-    int epoll_fd = epoll_create1(0);
-    if (epoll_fd == -1)
+    return listen_fd;
+}
+
+/**
+ * NUMA placement
+ *
+ * On a machine with several NUMA nodes, memory behind another socket
+ * costs a trip over the interconnect on every cache miss. With `--numa`
+ * every reactor is pinned to a CPU and, before it allocates anything,
+ * asks the kernel to take its memory from that CPU's node
+ * (`set_mempolicy(MPOL_PREFERRED)`). A reactor builds all its state on
+ * its own thread, so its buffer pool, output chunks, connection table,
+ * caches and io_uring rings all end up node-local. Preferred, not bound:
+ * a node that runs out of memory falls back to the others instead of
+ * failing allocations.
+ *
+ * Reactors go round-robin over the nodes, so fewer reactors than CPUs
+ * still use the memory bandwidth of every node. Like `--pin-cpus` we only
+ * pick from the CPUs this process may run on, so the server still behaves
+ * under `taskset` or a cgroup cpuset.
+ *
+ * Steering (`--steer`) keeps a connection on the CPU its packets arrive
+ * at. The NIC hashes every connection to a receive queue whose interrupt
+ * one CPU serves, and the kernel hands the connection to the reactor
+ * pinned to that CPU:
+ *  - `incoming-cpu` sets `SO_INCOMING_CPU` on every listener, the kernel
+ *    (6.2 and later) prefers the listener of the receiving CPU within the
+ *    `SO_REUSEPORT` group
+ *  - `cbpf` attaches a classic BPF program to the group that maps the
+ *    receiving CPU to its reactor's listener, connections received on a
+ *    CPU without a reactor are spread by the usual hash. With more
+ *    reactors than CPUs several share one, the packet's flow hash picks
+ *    among them.
+ *
+ * Both only pay off when the interrupts of the NIC queues go to the
+ * reactors' CPUs, e.g. one queue per reactor and `irqbalance` off.
+ */
+
+/**
+ * Read a small sysfs file, `false` when it does not exist
+ */
+bool read_sysfs(const char *path, std::string &text)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    char buf[4096];
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n < 0)
+        return false;
+    text.assign(buf, n);
+    return true;
+}
+
+/**
+ * Parse a sysfs list like `0-3,8-11`, memoryless nodes have an empty one
+ */
+void parse_cpu_list(const std::string &text, std::vector<int> &items)
+{
+    const char *p = text.c_str();
+    while (*p >= '0' && *p <= '9')
     {
-        perror("epoll_create1");
+        char *end = nullptr;
+        long first = std::strtol(p, &end, 10);
+        long last = first;
+        if (*end == '-')
+            last = std::strtol(end + 1, &end, 10);
+        for (long item = first; item <= last && item < CPU_SETSIZE; ++item)
+            items.push_back((int)item);
+        p = *end == ',' ? end + 1 : end;
+    }
+}
+
+/**
+ * Fill `node_of` with the NUMA node of every CPU id, returns the number
+ * of nodes. Without NUMA information (or with `--numa` off) everything
+ * is node `0`.
+ */
+int read_cpu_nodes(bool numa, std::vector<int> &node_of)
+{
+    node_of.assign(CPU_SETSIZE, 0);
+    std::string text;
+    if (!numa || !read_sysfs("/sys/devices/system/node/online", text))
         return 1;
+    std::vector<int> nodes;
+    parse_cpu_list(text, nodes);
+    int count = 1;
+    for (int node : nodes)
+    {
+        std::string path = "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+        std::vector<int> cpus;
+        if (read_sysfs(path.c_str(), text))
+            parse_cpu_list(text, cpus);
+        for (int cpu : cpus)
+            node_of[cpu] = node;
+        count = std::max(count, node + 1);
     }
+    return count;
+}
 
-    /**
-     * Adding Listener on `listen` socket
-     * specifically listen on reading
-     * so basically whenever someone trys to connect to the server event is generated
-     * EPOLLIN is generated
-     */
-    epoll_event event{};
-    event.data.fd = listen_fd;
-    event.events = EPOLLIN;
-    
-    /**
-     * `epoll_ctl` is defines a definition for add sockets to the epoll instance
-     * `epoll_ctl(epoll_instance_created, Operation name add or remove, for which fd, event defined earlier)`
-    */
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) == -1)
+/**
+ * Choose the CPU and node of every reactor into `config.reactor_cpus`
+ * and `config.reactor_nodes`: the allowed CPUs in order, or round-robin
+ * over the nodes with `--numa`
+ */
+bool plan_reactor_cpus(ServerConfig &config)
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
     {
-        perror("epoll_ctl");
-        return 1;
+        perror("sched_getaffinity");
+        return false;
     }
 
-    /**
-     * This events will store all the epoll events
-     * With the capacity of `MAX_EVENTS`
-     * lets suppose 15 connection simultaneously, it will first handle
-     * 10 clients, remaining 5 clients will go to `epoll_wait()`
-     */
-    std::vector<epoll_event> events(MAX_EVENTS);
+    std::vector<int> node_of;
+    std::vector<std::vector<int>> by_node(read_cpu_nodes(config.numa, node_of));
+    size_t count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    {
+        if (CPU_ISSET(cpu, &allowed))
+        {
+            by_node[node_of[cpu]].push_back(cpu);
+            ++count;
+        }
+    }
+    std::vector<int> order;
+    for (size_t round = 0; order.size() < count; ++round)
+    {
+        for (const std::vector<int> &cpus : by_node)
+        {
+            if (round < cpus.size())
+                order.push_back(cpus[round]);
+        }
+    }
+    if (order.empty())
+        return false;
 
-    std::cout << "HTTP server running on port " << PORT << std::endl;
+    config.reactor_cpus.clear();
+    config.reactor_nodes.clear();
+    for (int i = 0; i < config.workers; ++i)
+    {
+        int cpu = order[i % order.size()];
+        config.reactor_cpus.push_back(cpu);
+        config.reactor_nodes.push_back(node_of[cpu]);
+    }
+    return true;
+}
 
-    while (true)
+/**
+ * Pin the calling thread to `cpu`
+ */
+int pin_thread_to_cpu(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ? 0 : -1;
+}
+
+/**
+ * Have the calling thread's memory come from `node` where it can
+ */
+int prefer_numa_node(int node)
+{
+    unsigned long mask[1024 / (8 * sizeof(unsigned long))] = {};
+    if (node < 0 || node >= 1024)
+        return -1;
+    mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    return (int)syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, sizeof(mask) * 8 + 1);
+}
+
+/**
+ * Steer the connections of the `SO_REUSEPORT` group of `listen_fds` to
+ * the listener of the reactor on the receiving CPU, see above.
+ * `listen_fds[i]` is the `i`-th socket of the group and reactor `i`'s.
+ */
+bool steer_connections(const ServerConfig &config, const std::vector<int> &listen_fds)
+{
+    if (config.steer == "incoming-cpu")
     {
-        /**
-         * epoll_wait stores the socker which are ready for an event
-         * these sockets are stored in event[]
-         * 
-         * Methodology:
-         *  When client connects to the listening first it talks to the kernal
-         *  Kernal places this connection request in pending backlog
-         *  This pending backlog is cleared by `accept()`
-         * 
-         *  EPOllIN tells the epoll that `alert me when a client tries to connect`
-         *  as soon as client connection comes in our listening socket becomes active
-         * 
-         * 
-         */
-        int n = epoll_wait(epoll_fd, events.data(), MAX_EVENTS, -1);
-        for (int i = 0; i < n; ++i)
+        for (size_t i = 0; i < listen_fds.size(); ++i)
         {
-            if (events[i].data.fd == listen_fd)
+            int cpu = config.reactor_cpus[i];
+            if (setsockopt(listen_fds[i], SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) == -1)
             {
-                /* Client address details*/
-                sockaddr_in client_addr;
-                socklen_t client_len = sizeof(client_addr);
+                perror("SO_INCOMING_CPU");
+                return false;
+            }
+        }
+        return true;
+    }
 
-                /**
-                 * Whenever a new client connects, a new file descriptor is created
-                 */
-                int client_fd = accept(listen_fd, (sockaddr *)&client_addr, &client_len);
-                if (client_fd == -1)
-                {
-                    perror("accept");
-                    continue;
-                }
+    /**
+     * `A = cpu`, then one block per CPU: a compare that skips it, and the
+     * index of the CPU's reactor, or the flow hash modulo its reactors
+     * and one compare per reactor. A packet without a hash (some drivers
+     * set none) takes a random number, only the SYN is steered. An index
+     * past the group makes the kernel fall back to the hash.
+     */
+    std::vector<int> cpus;
+    std::vector<std::vector<uint32_t>> reactors_of;
+    for (size_t i = 0; i < listen_fds.size(); ++i)
+    {
+        size_t at = std::find(cpus.begin(), cpus.end(), config.reactor_cpus[i]) - cpus.begin();
+        if (at == cpus.size())
+        {
+            cpus.push_back(config.reactor_cpus[i]);
+            reactors_of.emplace_back();
+        }
+        reactors_of[at].push_back((uint32_t)i);
+    }
 
-                /**
-                 * By default all sockets are blocking
-                 * we are making the new client socket non-blocking as well
-                 */
-                make_socket_non_blocking(client_fd);
-
-                /**
-                 * Again creating a specific watcher for this socket
-                 * With specified operations such as EPOLLN -> client send data, EPOLLET -> new data arrives
-                */
-                epoll_event client_event{};
-                client_event.data.fd = client_fd;
-                client_event.events = EPOLLIN | EPOLLET; 
-                epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &client_event);
+    std::vector<sock_filter> code;
+    code.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU)));
+    for (size_t c = 0; c < cpus.size(); ++c)
+    {
+        const std::vector<uint32_t> &reactors = reactors_of[c];
+        std::vector<sock_filter> block;
+        if (reactors.size() == 1)
+        {
+            block.push_back(BPF_STMT(BPF_RET | BPF_K, reactors[0]));
+        }
+        else
+        {
+            block.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_AD_OFF + SKF_AD_RXHASH)));
+            block.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 1));
+            block.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_AD_OFF + SKF_AD_RANDOM)));
+            block.push_back(BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t)reactors.size()));
+            for (size_t j = 0; j + 1 < reactors.size(); ++j)
+            {
+                block.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)j, 0, 1));
+                block.push_back(BPF_STMT(BPF_RET | BPF_K, reactors[j]));
             }
-            else
+            block.push_back(BPF_STMT(BPF_RET | BPF_K, reactors.back()));
+        }
+        /* Jump offsets are 8 bits */
+        if (block.size() > 255)
+        {
+            std::cerr << "steering: too many reactors on CPU " << cpus[c] << " for one BPF program" << std::endl;
+            return false;
+        }
+        code.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)cpus[c], 0, (uint8_t)block.size()));
+        code.insert(code.end(), block.begin(), block.end());
+    }
+    code.push_back(BPF_STMT(BPF_RET | BPF_K, 0xffffffffu));
+    if (code.size() > BPF_MAXINSNS)
+    {
+        std::cerr << "steering: too many reactors for one BPF program" << std::endl;
+        return false;
+    }
+    sock_fprog program = {(unsigned short)code.size(), code.data()};
+    if (setsockopt(listen_fds[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) == -1)
+    {
+        perror("SO_ATTACH_REUSEPORT_CBPF");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Seconds from a monotonic clock
+ *
+ * `CLOCK_MONOTONIC_COARSE` is served from the vDSO without a real syscall,
+ * and the file cache only needs one second granularity anyway.
+ */
+long monotonic_seconds()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+/**
+ * Milliseconds from a monotonic clock, for the timer wheel, its resolution
+ * (a few milliseconds) is much finer than a tick
+ */
+long monotonic_milliseconds()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Response compression
+ *
+ * A response is compressed when its content type has a rule (see
+ * `ServerConfig::compression`) and the client accepts gzip or brotli.
+ * Compressing is the expensive part, so a reactor never sets up a
+ * compressor twice: `CompressorPool` keeps idle `Compressor`s, whose zlib
+ * stream is only reset between responses. Brotli has no reset, its
+ * instances are created per response, but their memory comes from the
+ * pool's `CompressionArena`, which hands the same blocks out again
+ * instead of going back to `malloc`.
+ */
+/**
+ * Memory blocks brotli freed, kept to be handed out again for the next
+ * request of the same size. Brotli asks for the same few sizes for every
+ * response compressed with the same settings.
+ */
+struct CompressionArena
+{
+    std::vector<std::pair<size_t, void *>> blocks;
+
+    ~CompressionArena()
+    {
+        for (auto &block : blocks)
+            free(block.second);
+    }
+};
+
+/* Every block starts with its size, so a freed block knows which requests it can serve */
+void *arena_alloc(void *opaque, size_t size)
+{
+    CompressionArena &arena = *(CompressionArena *)opaque;
+    for (size_t i = 0; i < arena.blocks.size(); ++i)
+    {
+        if (arena.blocks[i].first == size)
+        {
+            void *block = arena.blocks[i].second;
+            arena.blocks[i] = arena.blocks.back();
+            arena.blocks.pop_back();
+            return (char *)block + 16;
+        }
+    }
+    void *block = malloc(size + 16);
+    if (block == nullptr)
+        return nullptr;
+    *(size_t *)block = size;
+    return (char *)block + 16;
+}
+
+void arena_free(void *opaque, void *address)
+{
+    if (address == nullptr)
+        return;
+    CompressionArena &arena = *(CompressionArena *)opaque;
+    void *block = (char *)address - 16;
+    if (arena.blocks.size() >= COMPRESSION_ARENA_KEEP)
+    {
+        free(block);
+        return;
+    }
+    arena.blocks.emplace_back(*(size_t *)block, block);
+}
+
+/**
+ * One compression context, used for one response at a time: `begin`,
+ * any number of `compress` calls with the last one passing `finish`, `end`
+ */
+struct Compressor
+{
+    CompressionArena *arena = nullptr;
+    Encoding encoding = ENCODING_IDENTITY;
+    z_stream zlib = {};
+    bool zlib_ready = false;
+    BrotliEncoderState *brotli = nullptr;
+
+    ~Compressor()
+    {
+        end();
+        if (zlib_ready)
+            deflateEnd(&zlib);
+    }
+
+    bool begin(Encoding with, int level, size_t size_hint)
+    {
+        encoding = with;
+        if (encoding == ENCODING_GZIP)
+        {
+            /* `15 + 16` is the largest window, with a gzip header instead of a zlib one */
+            if (zlib_ready)
+                return deflateReset(&zlib) == Z_OK && deflateParams(&zlib, level, Z_DEFAULT_STRATEGY) == Z_OK;
+            zlib_ready = deflateInit2(&zlib, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+            return zlib_ready;
+        }
+
+        brotli = BrotliEncoderCreateInstance(arena_alloc, arena_free, arena);
+        if (brotli == nullptr)
+            return false;
+        BrotliEncoderSetParameter(brotli, BROTLI_PARAM_QUALITY, level);
+        BrotliEncoderSetParameter(brotli, BROTLI_PARAM_LGWIN, BROTLI_WINDOW_BITS);
+        BrotliEncoderSetParameter(brotli, BROTLI_PARAM_MODE, BROTLI_MODE_TEXT);
+        if (size_hint > 0)
+            BrotliEncoderSetParameter(brotli, BROTLI_PARAM_SIZE_HINT, (uint32_t)std::min<size_t>(size_hint, 1 << 30));
+        return true;
+    }
+
+    /* Append the compressed form of `size` bytes at `data` to `out` */
+    bool compress(const char *data, size_t size, bool finish, std::string &out)
+    {
+        if (encoding == ENCODING_GZIP)
+        {
+            zlib.next_in = (Bytef *)data;
+            zlib.avail_in = (uInt)size;
+            while (true)
             {
-                /* This stores the client fd which are ready*/
-                int client_fd = events[i].data.fd;
-                char buf[4096];
-                ssize_t count = read(client_fd, buf, sizeof(buf));
-                if (count <= 0)
-                {
-                    close(client_fd);
+                size_t used = out.size();
+                size_t room = std::max<size_t>(size / 2, 4096);
+                out.resize(used + room);
+                zlib.next_out = (Bytef *)&out[used];
+                zlib.avail_out = (uInt)room;
+                int result = deflate(&zlib, finish ? Z_FINISH : Z_NO_FLUSH);
+                out.resize(used + room - zlib.avail_out);
+                if (result == Z_STREAM_ERROR)
+                    return false;
+                if (finish ? result == Z_STREAM_END : (zlib.avail_in == 0 && zlib.avail_out != 0))
+                    return true;
+            }
+        }
 
-                    /**
-                     * This tells the epoll to stop monitoring this socket, no longer need to watch
-                     */
-                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client_fd, nullptr);
-                }
-                else
+        const uint8_t *next_in = (const uint8_t *)data;
+        size_t available_in = size;
+        BrotliEncoderOperation operation = finish ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS;
+        while (true)
+        {
+            size_t available_out = 0;
+            if (!BrotliEncoderCompressStream(brotli, operation, &available_in, &next_in, &available_out, nullptr,
+                                             nullptr))
+                return false;
+            size_t produced = 0;
+            const uint8_t *output = BrotliEncoderTakeOutput(brotli, &produced);
+            out.append((const char *)output, produced);
+            if (available_in == 0 && !BrotliEncoderHasMoreOutput(brotli) &&
+                (!finish || BrotliEncoderIsFinished(brotli)))
+                return true;
+        }
+    }
+
+    void end()
+    {
+        if (brotli != nullptr)
+            BrotliEncoderDestroyInstance(brotli);
+        brotli = nullptr;
+    }
+};
+
+struct CompressorPool
+{
+    CompressionArena arena;
+    std::vector<std::unique_ptr<Compressor>> idle;
+};
+
+std::unique_ptr<Compressor> acquire_compressor(CompressorPool &pool)
+{
+    if (pool.idle.empty())
+    {
+        std::unique_ptr<Compressor> compressor(new Compressor);
+        compressor->arena = &pool.arena;
+        return compressor;
+    }
+    std::unique_ptr<Compressor> compressor = std::move(pool.idle.back());
+    pool.idle.pop_back();
+    return compressor;
+}
+
+void release_compressor(CompressorPool &pool, std::unique_ptr<Compressor> compressor)
+{
+    compressor->end();
+    if (pool.idle.size() < COMPRESSOR_KEEP)
+        pool.idle.push_back(std::move(compressor));
+}
+
+/**
+ * The rule for `content_type`, the longest matching prefix wins,
+ * `nullptr` when it is not compressed at all
+ */
+const CompressionRule *compression_rule(const ServerConfig &config, std::string_view content_type)
+{
+    const CompressionRule *best = nullptr;
+    for (const CompressionRule &rule : config.compression)
+    {
+        if (content_type.substr(0, rule.type.size()) == rule.type &&
+            (best == nullptr || rule.type.size() > best->type.size()))
+            best = &rule;
+    }
+    if (best != nullptr && best->levels[ENCODING_GZIP] == 0 && best->levels[ENCODING_BROTLI] == 0)
+        return nullptr;
+    return best;
+}
+
+/**
+ * Pick the coding for a response from `Accept-Encoding`
+ *
+ * The highest `q` wins, brotli before gzip on a tie since it compresses
+ * better. A coding the rule turns off or the client gives `q=0` is never
+ * picked, `*` stands for every coding not listed by name.
+ */
+Encoding negotiate_encoding(const HttpRequest &req, const CompressionRule &rule)
+{
+    const HttpHeader *accept = req.find_header("Accept-Encoding");
+    if (accept == nullptr)
+        return ENCODING_IDENTITY;
+
+    int quality[ENCODINGS] = {-1, -1, -1};
+    int wildcard = -1;
+    std::string_view value = accept->value;
+    size_t i = 0;
+    while (i < value.size())
+    {
+        size_t end = value.find(',', i);
+        if (end == std::string_view::npos)
+            end = value.size();
+        std::string_view item = value.substr(i, end - i);
+        i = end + 1;
+
+        size_t semicolon = item.find(';');
+        std::string_view coding = item.substr(0, semicolon);
+        while (!coding.empty() && (coding.front() == ' ' || coding.front() == '\t'))
+            coding.remove_prefix(1);
+        while (!coding.empty() && (coding.back() == ' ' || coding.back() == '\t'))
+            coding.remove_suffix(1);
+
+        /* `q` in thousandths, `q=0.8` is 800 */
+        int q = 1000;
+        size_t q_at = semicolon == std::string_view::npos ? std::string_view::npos : item.find("q=", semicolon);
+        if (q_at != std::string_view::npos)
+        {
+            std::string_view digits = item.substr(q_at + 2);
+            q = digits.empty() || digits[0] != '1' ? 0 : 1000;
+            if (digits.size() > 2 && digits[0] == '0' && digits[1] == '.')
+            {
+                int scale = 100;
+                for (size_t d = 2; d < digits.size() && d < 5 && isdigit((unsigned char)digits[d]); ++d)
                 {
-                    std::string response =
-                        "HTTP/1.1 200 OK\r\n"
-                        "Content-Type: text/plain\r\n"
-                        "Content-Length: 13\r\n"
-                        "Connection: close\r\n"
-                        "\r\n"
-                        "Hello, world!";
-                    write(client_fd, response.c_str(), response.size());
-                    close(client_fd);
-                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client_fd, nullptr);
+                    q += (digits[d] - '0') * scale;
+                    scale /= 10;
                 }
             }
         }
+
+        if (coding == "*")
+            wildcard = q;
+        for (int e = ENCODING_GZIP; e < ENCODINGS; ++e)
+        {
+            if (coding.size() == strlen(encoding_names[e]) &&
+                strncasecmp(coding.data(), encoding_names[e], coding.size()) == 0)
+                quality[e] = q;
+        }
     }
 
-    close(listen_fd);
+    Encoding best = ENCODING_IDENTITY;
+    int best_quality = 0;
+    for (int e = ENCODINGS - 1; e > ENCODING_IDENTITY; --e)
+    {
+        int q = quality[e] == -1 ? wildcard : quality[e];
+        if (rule.levels[e] > 0 && q > best_quality)
+        {
+            best = (Encoding)e;
+            best_quality = q;
+        }
+    }
+    return best;
+}
+
+/**
+ * Static files from the document root
+ *
+ * Every reactor keeps an LRU cache of the files it served recently: the
+ * open fd plus everything we need for the response headers (size, mtime,
+ * ETag, Last-Modified, Content-Type). A hot file is served without
+ * `open` or `stat`, the body goes out with `sendfile` straight from the
+ * page cache and never passes through user space.
+ *
+ * A cached entry is trusted for `FILE_CACHE_VALID` seconds, after that
+ * the next request `stat`s the path again and reopens the file when it
+ * was replaced or modified.
+ *
+ * Entries are shared with the output queues through `std::shared_ptr`, a
+ * file that is evicted while a response is still being sent stays open
+ * until that response is done.
+ *
+ * A compressible file also keeps its compressed copies in `variants`,
+ * indexed by `Encoding`, each made the first time a client asks for that
+ * coding. `tried` without a `body` means compressing did not pay off, or
+ * that a worker is still at it, see `compressed_variant()`. The copies
+ * count against `byte_budget`, the bytes all copies of the cache may
+ * take together: the least recently used files lose theirs first and
+ * make them again when asked. `cached` is cleared once the entry left
+ * the cache, its copies then no longer count.
+ */
+struct FileVariant
+{
+    std::shared_ptr<const std::string> body;
+    std::string etag;
+    bool tried = false;
+};
+
+struct CachedFile
+{
+    int fd = -1;
+    off_t size = 0;
+    ino_t inode = 0;
+    dev_t device = 0;
+    timespec mtime = {};
+    long checked_at = 0;
+    const char *content_type = nullptr;
+    std::string etag;
+    std::string last_modified;
+    FileVariant variants[ENCODINGS];
+    size_t variant_bytes = 0;
+    bool cached = false;
+
+    ~CachedFile()
+    {
+        if (fd != -1)
+            close(fd);
+    }
+};
+
+struct FileCache
+{
+    using Entry = std::pair<std::string, std::shared_ptr<CachedFile>>;
+
+    size_t capacity = 0;
+    size_t byte_budget = 0;
+    size_t variant_bytes = 0;
+    std::list<Entry> lru;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+};
+
+void forget_file(FileCache &cache, std::list<FileCache::Entry>::iterator entry)
+{
+    CachedFile &file = *entry->second;
+    cache.variant_bytes -= file.variant_bytes;
+    file.variant_bytes = 0;
+    file.cached = false;
+    cache.index.erase(entry->first);
+    cache.lru.erase(entry);
+}
+
+/**
+ * Keep `compressed` as the `encoding` copy of `file`, making room for it
+ * by dropping the copies of the least recently used files. `nullptr`
+ * when it alone is larger than the budget.
+ */
+const FileVariant *store_variant(FileCache &cache, CachedFile &file, Encoding encoding, std::string &&compressed)
+{
+    if (compressed.size() > cache.byte_budget)
+        return nullptr;
+    FileVariant &variant = file.variants[encoding];
+    variant.body = std::make_shared<const std::string>(std::move(compressed));
+    variant.etag = file.etag.substr(0, file.etag.size() - 1) + "-" + encoding_names[encoding] + "\"";
+    if (!file.cached)
+        return &variant;
+
+    file.variant_bytes += variant.body->size();
+    cache.variant_bytes += variant.body->size();
+    for (auto entry = cache.lru.rbegin(); entry != cache.lru.rend() && cache.variant_bytes > cache.byte_budget;
+         ++entry)
+    {
+        CachedFile &old = *entry->second;
+        for (FileVariant &dropped : old.variants)
+        {
+            if (dropped.body == nullptr || &dropped == &variant)
+                continue;
+            old.variant_bytes -= dropped.body->size();
+            cache.variant_bytes -= dropped.body->size();
+            dropped = FileVariant();
+        }
+    }
+    return &variant;
+}
+
+const char *content_type_for(std::string_view path)
+{
+    static const struct
+    {
+        const char *extension;
+        const char *type;
+    } types[] = {
+        {".html", "text/html; charset=utf-8"},
+        {".htm", "text/html; charset=utf-8"},
+        {".css", "text/css; charset=utf-8"},
+        {".js", "text/javascript; charset=utf-8"},
+        {".mjs", "text/javascript; charset=utf-8"},
+        {".json", "application/json"},
+        {".txt", "text/plain; charset=utf-8"},
+        {".xml", "application/xml"},
+        {".svg", "image/svg+xml"},
+        {".png", "image/png"},
+        {".jpg", "image/jpeg"},
+        {".jpeg", "image/jpeg"},
+        {".gif", "image/gif"},
+        {".webp", "image/webp"},
+        {".avif", "image/avif"},
+        {".ico", "image/x-icon"},
+        {".woff", "font/woff"},
+        {".woff2", "font/woff2"},
+        {".wasm", "application/wasm"},
+        {".pdf", "application/pdf"},
+        {".mp4", "video/mp4"},
+        {".webm", "video/webm"},
+    };
+
+    size_t dot = path.rfind('.');
+    if (dot != std::string_view::npos && path.find('/', dot) == std::string_view::npos)
+    {
+        std::string_view extension = path.substr(dot);
+        for (const auto &entry : types)
+        {
+            if (extension.size() == strlen(entry.extension) &&
+                strncasecmp(extension.data(), entry.extension, extension.size()) == 0)
+                return entry.type;
+        }
+    }
+    return "application/octet-stream";
+}
+
+/**
+ * Open `path`, relative to the document root, without ever leaving it
+ *
+ * `resolve_target_path()` keeps `..` out of the path, but a symlink under
+ * the root may still point anywhere. `openat2(RESOLVE_BENEATH)` resolves
+ * symlinks that stay inside the root and fails on the others (`EXDEV`,
+ * `ELOOP` for magic links). Kernels before 5.6 lack it, there every
+ * component is opened on its own with `O_NOFOLLOW`, so no symlink is
+ * followed at all.
+ */
+int open_beneath(int docroot_fd, const std::string &path)
+{
+    static std::atomic<bool> no_openat2{false};
+    if (!no_openat2.load(std::memory_order_relaxed))
+    {
+        open_how how = {};
+        how.flags = O_RDONLY | O_CLOEXEC | O_NONBLOCK;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        int fd = (int)syscall(SYS_openat2, docroot_fd, path.c_str(), &how, sizeof(how));
+        if (fd != -1 || (errno != ENOSYS && errno != EPERM))
+            return fd;
+        /* Seccomp filters that do not know the call answer `EPERM` */
+        no_openat2.store(true, std::memory_order_relaxed);
+    }
+
+    int dir_fd = docroot_fd;
+    size_t start = 0;
+    while (true)
+    {
+        size_t slash = path.find('/', start);
+        std::string segment = path.substr(start, slash == std::string::npos ? std::string::npos : slash - start);
+        int flags = O_CLOEXEC | O_NOFOLLOW;
+        flags |= slash == std::string::npos ? O_RDONLY | O_NONBLOCK : O_PATH | O_DIRECTORY;
+        int fd = openat(dir_fd, segment.c_str(), flags);
+        if (dir_fd != docroot_fd)
+            close(dir_fd);
+        if (fd == -1 || slash == std::string::npos)
+            return fd;
+        dir_fd = fd;
+        start = slash + 1;
+    }
+}
+
+/**
+ * Open `path` (relative to the document root) and fill in its metadata,
+ * `nullptr` when there is no regular file there, or only through a
+ * symlink leading out of the root
+ */
+std::shared_ptr<CachedFile> open_cached_file(int docroot_fd, const std::string &path, long now)
+{
+    int fd = open_beneath(docroot_fd, path);
+    if (fd == -1)
+        return nullptr;
+
+    auto file = std::make_shared<CachedFile>();
+    file->fd = fd;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+        return nullptr;
+
+    file->size = st.st_size;
+    file->inode = st.st_ino;
+    file->device = st.st_dev;
+    file->mtime = st.st_mtim;
+    file->checked_at = now;
+    file->content_type = content_type_for(path);
+
+    /* Same shape nginx uses: hex mtime and size */
+    char etag[64];
+    snprintf(etag, sizeof(etag), "\"%llx-%llx\"", (unsigned long long)st.st_mtim.tv_sec,
+             (unsigned long long)st.st_size);
+    file->etag = etag;
+
+    char date[HTTP_DATE_SIZE + 1];
+    format_http_date(st.st_mtim.tv_sec, date);
+    file->last_modified = date;
+    return file;
+}
+
+/**
+ * Look `path` up in the reactor's file cache, opening and caching it on a miss
+ */
+std::shared_ptr<CachedFile> lookup_file(FileCache &cache, int docroot_fd, const std::string &path, long now)
+{
+    auto it = cache.index.find(path);
+    if (it != cache.index.end())
+    {
+        std::shared_ptr<CachedFile> &file = it->second->second;
+        bool fresh = now - file->checked_at < FILE_CACHE_VALID;
+        if (!fresh)
+        {
+            struct stat st;
+            fresh = fstatat(docroot_fd, path.c_str(), &st, 0) == 0 && st.st_ino == file->inode &&
+                    st.st_dev == file->device && st.st_size == file->size &&
+                    st.st_mtim.tv_sec == file->mtime.tv_sec && st.st_mtim.tv_nsec == file->mtime.tv_nsec;
+            if (fresh)
+                file->checked_at = now;
+        }
+        if (fresh)
+        {
+            cache.lru.splice(cache.lru.begin(), cache.lru, it->second);
+            return file;
+        }
+        forget_file(cache, it->second);
+    }
+
+    std::shared_ptr<CachedFile> file = open_cached_file(docroot_fd, path, now);
+    if (file == nullptr || cache.capacity == 0)
+        return file;
+
+    if (cache.index.size() >= cache.capacity)
+        forget_file(cache, std::prev(cache.lru.end()));
+    file->cached = true;
+    cache.lru.emplace_front(path, file);
+    cache.index.emplace(path, cache.lru.begin());
+    return file;
+}
+
+/**
+ * Turn a request target into a path relative to the document root
+ *
+ * The query string is dropped and percent escapes are decoded. Targets
+ * that try to leave the document root (`..`), contain a NUL byte or are
+ * not origin-form are rejected. A trailing slash means `index.html`.
+ *
+ * Returns `false` for a target that can not name a file.
+ */
+bool resolve_target_path(std::string_view target, std::string &path)
+{
+    size_t query = target.find_first_of("?#");
+    if (query != std::string_view::npos)
+        target = target.substr(0, query);
+    if (target.empty() || target[0] != '/')
+        return false;
+
+    path.clear();
+    for (size_t i = 0; i < target.size(); ++i)
+    {
+        char c = target[i];
+        if (c == '%')
+        {
+            if (i + 2 >= target.size() || !isxdigit((unsigned char)target[i + 1]) ||
+                !isxdigit((unsigned char)target[i + 2]))
+                return false;
+            char hex[3] = {target[i + 1], target[i + 2], '\0'};
+            c = (char)strtol(hex, nullptr, 16);
+            i += 2;
+            if (c == '\0')
+                return false;
+        }
+        path += c;
+    }
+
+    /* Walk the segments: drop empty and `.` ones, refuse `..` */
+    std::string clean;
+    size_t start = 1;
+    while (start <= path.size())
+    {
+        size_t slash = path.find('/', start);
+        if (slash == std::string::npos)
+            slash = path.size();
+        std::string_view segment(path.data() + start, slash - start);
+        if (segment == "..")
+            return false;
+        if (!segment.empty() && segment != ".")
+        {
+            if (!clean.empty())
+                clean += '/';
+            clean.append(segment.data(), segment.size());
+        }
+        start = slash + 1;
+    }
+
+    if (path.back() == '/')
+        clean += clean.empty() ? "index.html" : "/index.html";
+    path.swap(clean);
+    return true;
+}
+
+/**
+ * Parse an IMF-fixdate as sent in `If-Modified-Since`, `-1` if it is not one
+ */
+time_t parse_http_date(std::string_view value)
+{
+    char date[64];
+    if (value.size() >= sizeof(date))
+        return -1;
+    memcpy(date, value.data(), value.size());
+    date[value.size()] = '\0';
+
+    tm parts = {};
+    const char *end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &parts);
+    if (end == nullptr || *end != '\0')
+        return -1;
+    return timegm(&parts);
+}
+
+/**
+ * `If-None-Match` uses weak comparison: `W/` prefixes do not matter
+ */
+bool etag_matches(std::string_view header, const std::string &etag)
+{
+    std::string_view strong = etag;
+    size_t i = 0;
+    while (i < header.size())
+    {
+        while (i < header.size() && (header[i] == ' ' || header[i] == '\t' || header[i] == ','))
+            ++i;
+        size_t begin = i;
+        while (i < header.size() && header[i] != ',')
+            ++i;
+        std::string_view candidate = header.substr(begin, i - begin);
+        while (!candidate.empty() && (candidate.back() == ' ' || candidate.back() == '\t'))
+            candidate.remove_suffix(1);
+        if (candidate == "*")
+            return true;
+        if (candidate.size() > 2 && candidate.substr(0, 2) == "W/")
+            candidate.remove_prefix(2);
+        if (candidate == strong)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Parse a single `bytes=` range against a file of `size` bytes
+ *
+ * Returns `1` and fills `[first, last]` for a satisfiable range, `0` when
+ * the header should be ignored (malformed, or several ranges, which we
+ * answer with the whole file) and `-1` when it is not satisfiable.
+ */
+int parse_byte_range(std::string_view value, off_t size, off_t &first, off_t &last)
+{
+    if (value.size() < 7 || strncasecmp(value.data(), "bytes=", 6) != 0)
+        return 0;
+    value.remove_prefix(6);
+    if (value.find(',') != std::string_view::npos)
+        return 0;
+
+    size_t dash = value.find('-');
+    if (dash == std::string_view::npos)
+        return 0;
+    std::string_view from = value.substr(0, dash);
+    std::string_view to = value.substr(dash + 1);
+
+    long long a = from.empty() ? -1 : parse_content_length(from);
+    long long b = to.empty() ? -1 : parse_content_length(to);
+    if ((!from.empty() && a < 0) || (!to.empty() && b < 0) || (from.empty() && to.empty()))
+        return 0;
+
+    if (from.empty())
+    {
+        /* `bytes=-N` is the last N bytes */
+        if (b == 0 || size == 0)
+            return -1;
+        first = b >= size ? 0 : size - b;
+        last = size - 1;
+        return 1;
+    }
+    if (a >= size)
+        return -1;
+    if (b != -1 && b < a)
+        return 0;
+    first = a;
+    last = (b == -1 || b >= size) ? size - 1 : b;
+    return 1;
+}
+
+/**
+ * One piece of a response that is waiting to be written
+ *
+ * Fixed responses just point at memory that outlives every connection,
+ * anything built per request is kept alive in `owned` until it is sent,
+ * bytes shared with a cache (a compressed file) are held by `shared`.
+ * A file chunk is `size` bytes of `file` starting at `file_offset` and
+ * goes out with `sendfile` instead of `writev`. `next` links the chunks
+ * queued on a connection. The last chunk of every response carries the
+ * time its request was read in `request_start`, for the latency histogram.
+ */
+struct EventLoop;
+struct UringSend;
+
+struct OutputChunk
+{
+    const char *data = nullptr;
+    size_t size = 0;
+    std::string owned;
+    std::shared_ptr<const std::string> shared;
+    std::shared_ptr<CachedFile> file;
+    off_t file_offset = 0;
+    OutputChunk *next = nullptr;
+    uint64_t request_start = 0;
+
+    const char *bytes() const { return owned.empty() ? data : owned.data(); }
+};
+
+/**
+ * Metrics
+ *
+ * Every reactor counts what it does in its own `ReactorMetrics`, aligned
+ * to a cache line so two reactors never write to the same line. Only the
+ * owning reactor writes its counters, so an update is a plain load and
+ * store: the atomics are there so the admin thread can read them at any
+ * time, not to synchronise writers, and no locked instruction is needed.
+ * The admin thread sums all reactors when `/metrics` is scraped.
+ *
+ * Request latencies go into a log-bucketed histogram like HdrHistogram's:
+ * every power of two is split into `1 << LATENCY_SUB_BITS` linear buckets,
+ * so any recorded value is known to within 25% over the whole range from
+ * nanoseconds to hours in a fixed 2 KB.
+ */
+struct alignas(64) ReactorMetrics
+{
+    std::atomic<uint64_t> connections_accepted{0};
+    std::atomic<uint64_t> connections_closed{0};
+    std::atomic<uint64_t> connections_refused{0};
+    std::atomic<uint64_t> requests_limited{0};
+    std::atomic<uint64_t> access_log_dropped{0};
+    std::atomic<uint64_t> connections_timed_out{0};
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> parse_errors{0};
+    std::atomic<uint64_t> bytes_in{0};
+    std::atomic<uint64_t> bytes_out{0};
+    std::atomic<uint64_t> read_eagain{0};
+    std::atomic<uint64_t> write_eagain{0};
+    std::atomic<uint64_t> tls_handshakes{0};
+    std::atomic<uint64_t> tls_resumed{0};
+    std::atomic<uint64_t> tls_failures{0};
+    std::atomic<uint64_t> ktls_connections{0};
+    std::atomic<uint64_t> tasks_offloaded{0};
+    std::atomic<uint64_t> upstream_requests{0};
+    std::atomic<uint64_t> upstream_failures{0};
+    std::atomic<uint64_t> cache_hits{0};
+    std::atomic<uint64_t> cache_misses{0};
+    std::atomic<uint64_t> cache_coalesced{0};
+    std::atomic<uint64_t> websocket_upgrades{0};
+    std::atomic<uint64_t> websocket_messages{0};
+    std::atomic<uint64_t> websocket_broadcasts{0};
+    std::atomic<uint64_t> latency_sum_ns{0};
+    std::atomic<uint64_t> latency[LATENCY_BUCKETS] = {};
+};
+
+void add_metric(std::atomic<uint64_t> &counter, uint64_t value = 1)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+/**
+ * Nanoseconds from the precise monotonic clock, for latencies
+ */
+uint64_t monotonic_nanoseconds()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Histogram bucket of `value`: the position of its highest bit picks the
+ * power of two, the next `LATENCY_SUB_BITS` bits the bucket within it
+ */
+int latency_bucket(uint64_t value)
+{
+    const uint64_t sub_buckets = 1 << LATENCY_SUB_BITS;
+    if (value < sub_buckets)
+        return (int)value;
+    int msb = 63 - __builtin_clzll(value);
+    return (msb - LATENCY_SUB_BITS + 1) * sub_buckets + ((value >> (msb - LATENCY_SUB_BITS)) & (sub_buckets - 1));
+}
+
+/**
+ * Smallest value that no longer falls into `bucket`
+ */
+uint64_t latency_bucket_end(int bucket)
+{
+    const int sub_buckets = 1 << LATENCY_SUB_BITS;
+    if (bucket < sub_buckets)
+        return bucket + 1;
+    int msb = bucket / sub_buckets + LATENCY_SUB_BITS - 1;
+    uint64_t sub = bucket % sub_buckets;
+    return (sub_buckets + sub + 1) << (msb - LATENCY_SUB_BITS);
+}
+
+void record_latency(ReactorMetrics &metrics, uint64_t ns)
+{
+    add_metric(metrics.latency[latency_bucket(ns)]);
+    add_metric(metrics.latency_sum_ns, ns);
+}
+
+/**
+ * Connection buffers
+ *
+ * With keep-alive most connections sit idle between requests, so a
+ * connection does not own any buffer. It borrows one from its reactor's
+ * `BufferPool` while it has unread input or queued output and gives it
+ * back as soon as that is gone, an idle connection is just its `Connection`.
+ *
+ * Input buffers come in power-of-two size classes, from `BUFFER_MIN_SIZE`
+ * (enough for almost every request) up to one that holds the largest
+ * request we accept. The small classes are carved out of
+ * `BUFFER_SLAB_SIZE` slabs and never returned to malloc, the big ones come
+ * from malloc and only a few of them are kept around.
+ *
+ * Output chunks are pooled the same way, a free list of `OutputChunk`
+ * nodes that `conn.out` links together.
+ */
+struct InputBuffer
+{
+    char *data = nullptr;
+    uint32_t length = 0;
+    uint8_t size_class = 0;
+
+    size_t capacity() const { return data == nullptr ? 0 : (size_t)BUFFER_MIN_SIZE << size_class; }
+};
+
+struct OutputQueue
+{
+    OutputChunk *head = nullptr;
+    OutputChunk *tail = nullptr;
+
+    bool empty() const { return head == nullptr; }
+    OutputChunk &front() const { return *head; }
+};
+
+struct BufferPool
+{
+    std::vector<char *> free_buffers[BUFFER_CLASSES];
+    std::vector<char *> slabs;
+    size_t slab_used = BUFFER_SLAB_SIZE;
+    std::vector<OutputChunk *> free_chunks;
+
+    ~BufferPool()
+    {
+        for (int size_class = BUFFER_SLAB_CLASSES; size_class < BUFFER_CLASSES; ++size_class)
+        {
+            for (char *buf : free_buffers[size_class])
+                free(buf);
+        }
+        for (char *slab : slabs)
+            free(slab);
+        for (OutputChunk *chunk : free_chunks)
+            delete chunk;
+    }
+};
+
+/**
+ * Smallest size class holding `size` bytes, `-1` when none does
+ */
+int buffer_class_for(size_t size)
+{
+    int size_class = 0;
+    while (((size_t)BUFFER_MIN_SIZE << size_class) < size)
+    {
+        if (++size_class == BUFFER_CLASSES)
+            return -1;
+    }
+    return size_class;
+}
+
+char *acquire_buffer(BufferPool &pool, int size_class)
+{
+    std::vector<char *> &free_list = pool.free_buffers[size_class];
+    if (!free_list.empty())
+    {
+        char *buf = free_list.back();
+        free_list.pop_back();
+        return buf;
+    }
+
+    size_t size = (size_t)BUFFER_MIN_SIZE << size_class;
+    if (size_class >= BUFFER_SLAB_CLASSES)
+        return (char *)malloc(size);
+
+    if (pool.slab_used + size > BUFFER_SLAB_SIZE)
+    {
+        char *slab = (char *)malloc(BUFFER_SLAB_SIZE);
+        if (slab == nullptr)
+            return nullptr;
+        pool.slabs.push_back(slab);
+        pool.slab_used = 0;
+    }
+    char *buf = pool.slabs.back() + pool.slab_used;
+    pool.slab_used += size;
+    return buf;
+}
+
+void release_buffer(BufferPool &pool, char *buf, int size_class)
+{
+    std::vector<char *> &free_list = pool.free_buffers[size_class];
+    if (size_class >= BUFFER_SLAB_CLASSES && free_list.size() >= BUFFER_KEEP_LARGE)
+        free(buf);
+    else
+        free_list.push_back(buf);
+}
+
+/**
+ * Make room for at least `want` more bytes at the end of `in`, moving it
+ * to a bigger buffer when needed
+ *
+ * Returns where the new bytes go, or `nullptr` when the input would not
+ * fit the largest size class (or malloc failed).
+ */
+char *reserve_input(BufferPool &pool, InputBuffer &in, size_t want)
+{
+    size_t need = in.length + want;
+    if (need <= in.capacity())
+        return in.data + in.length;
+
+    int size_class = buffer_class_for(need);
+    if (size_class == -1)
+        return nullptr;
+    char *buf = acquire_buffer(pool, size_class);
+    if (buf == nullptr)
+        return nullptr;
+    if (in.data != nullptr)
+    {
+        memcpy(buf, in.data, in.length);
+        release_buffer(pool, in.data, in.size_class);
+    }
+    in.data = buf;
+    in.size_class = (uint8_t)size_class;
+    return buf + in.length;
+}
+
+void release_input(BufferPool &pool, InputBuffer &in)
+{
+    if (in.data != nullptr)
+        release_buffer(pool, in.data, in.size_class);
+    in = InputBuffer{};
+}
+
+/**
+ * Drop the first `consumed` bytes of `in`, the buffer goes back to the
+ * pool once nothing is left
+ */
+void consume_input(BufferPool &pool, InputBuffer &in, size_t consumed)
+{
+    in.length -= consumed;
+    if (in.length == 0)
+        release_input(pool, in);
+    else if (consumed > 0)
+        memmove(in.data, in.data + consumed, in.length);
+}
+
+OutputChunk *acquire_chunk(BufferPool &pool)
+{
+    if (pool.free_chunks.empty())
+        return new OutputChunk;
+    OutputChunk *chunk = pool.free_chunks.back();
+    pool.free_chunks.pop_back();
+    return chunk;
+}
+
+void release_chunk(BufferPool &pool, OutputChunk *chunk)
+{
+    if (pool.free_chunks.size() >= OUTPUT_CHUNK_KEEP)
+    {
+        delete chunk;
+        return;
+    }
+    /* Drops the owned bytes and the file reference right away */
+    *chunk = OutputChunk{};
+    pool.free_chunks.push_back(chunk);
+}
+
+void push_output(OutputQueue &out, OutputChunk *chunk)
+{
+    if (out.tail == nullptr)
+        out.head = chunk;
+    else
+        out.tail->next = chunk;
+    out.tail = chunk;
+}
+
+void pop_output(BufferPool &pool, OutputQueue &out)
+{
+    OutputChunk *chunk = out.head;
+    out.head = chunk->next;
+    if (out.head == nullptr)
+        out.tail = nullptr;
+    release_chunk(pool, chunk);
+}
+
+/**
+ * A response body produced while it is sent
+ *
+ * A handler that can not (or should not) hold its whole body in memory
+ * hands `start_stream()` one of these. The server asks it for more only
+ * while less than `STREAM_MAX_PENDING` bytes of the connection's output
+ * are waiting for the socket, so a slow client holds back the producer
+ * instead of making us buffer the whole body.
+ *
+ * `produce` appends at most `limit` bytes to `out` and returns `false`
+ * once the body is complete. Appending nothing means nothing is ready
+ * yet, the stream is asked again once the output drained or when its
+ * producer wakes it. The remaining fields belong to the server,
+ * `compressor` is set when the body is sent compressed.
+ */
+struct ResponseStream
+{
+    virtual ~ResponseStream() {}
+    virtual bool produce(std::string &out, size_t limit) = 0;
+
+    std::unique_ptr<Compressor> compressor;
+    bool chunked = true;
+    bool keep_alive = false;
+    uint64_t request_start = 0;
+};
+
+struct Reactor;
+struct Connection;
+struct CacheFill;
+struct Http2Session;
+struct WebSocketSession;
+struct BlockingTask;
+struct AsyncPromise;
+struct Async;
+
+/**
+ * Where a streamed request body goes, handed out by a `BodyHandler`
+ *
+ * `write` gets the decoded body piece by piece as it arrives and returns
+ * `false` when it can not take it (the client gets a `500`). A body that
+ * wants to end up in a file can name it in `splice_target`, the epoll
+ * backend then moves the rest of a `Content-Length` body straight from the
+ * socket into it and reports it through `spliced` instead of `write`.
+ *
+ * Once the last byte arrived `finish` queues the response, exactly like a
+ * `RouteHandler` would. The head is gone by then, whatever the answer
+ * needs from it has to be kept when the body is created. The remaining
+ * fields belong to the server.
+ */
+struct RequestBody
+{
+    virtual ~RequestBody() {}
+    virtual bool write(const char *data, size_t size) = 0;
+    virtual int splice_target() { return -1; }
+    virtual void spliced(size_t) {}
+    virtual void finish(Reactor &reactor, Connection &conn, bool keep_alive) = 0;
+
+    bool keep_alive = false;
+    uint64_t request_start = 0;
+};
+
+/**
+ * Hand the body bytes in `buf` to `body` without keeping them
+ *
+ * The streaming counterpart of the body half of `parse_request()`, with
+ * the same states, but `buf` starts at the first byte not handed out yet
+ * and `used` says how many bytes this call took. What is left over (an
+ * incomplete chunk size line or trailer) has to be passed again together
+ * with the bytes that follow it. `body_len` counts the decoded bytes
+ * against `max_body`, `content_length` what is left of a framed body.
+ */
+ParseResult stream_request_body(HttpParser &parser, const char *buf, size_t len, size_t max_body,
+                                RequestBody &body, size_t &used)
+{
+    used = 0;
+    while (true)
+    {
+        switch (parser.state)
+        {
+        case HttpParser::BODY:
+        {
+            size_t size = std::min((size_t)parser.content_length, len - used);
+            if (size > 0 && !body.write(buf + used, size))
+                return parse_error(parser, 500);
+            used += size;
+            parser.content_length -= size;
+            parser.body_len += size;
+            return parser.content_length == 0 ? PARSE_COMPLETE : PARSE_INCOMPLETE;
+        }
+        case HttpParser::CHUNK_SIZE:
+        {
+            const char *line = buf + used;
+            const char *eol = (const char *)memmem(line, len - used, "\r\n", 2);
+            if (eol == nullptr)
+            {
+                if (len - used > MAX_CHUNK_LINE)
+                    return parse_error(parser, 400);
+                return PARSE_INCOMPLETE;
+            }
+
+            size_t size = 0;
+            int status = parse_chunk_size(line, eol, size);
+            if (status != 0)
+                return parse_error(parser, status);
+            if (parser.body_len + size > max_body)
+                return parse_error(parser, 413);
+
+            used = eol + 2 - buf;
+            parser.chunk_left = size;
+            parser.state = size == 0 ? HttpParser::TRAILER : HttpParser::CHUNK_DATA;
+            break;
+        }
+        case HttpParser::CHUNK_DATA:
+        {
+            size_t size = std::min((size_t)parser.chunk_left, len - used);
+            if (size > 0 && !body.write(buf + used, size))
+                return parse_error(parser, 500);
+            used += size;
+            parser.chunk_left -= size;
+            parser.body_len += size;
+            if (parser.chunk_left > 0)
+                return PARSE_INCOMPLETE;
+            parser.state = HttpParser::CHUNK_DATA_END;
+            break;
+        }
+        case HttpParser::CHUNK_DATA_END:
+            if (len - used < 2)
+                return PARSE_INCOMPLETE;
+            if (buf[used] != '\r' || buf[used + 1] != '\n')
+                return parse_error(parser, 400);
+            used += 2;
+            parser.state = HttpParser::CHUNK_SIZE;
+            break;
+        case HttpParser::TRAILER:
+        {
+            const char *line = buf + used;
+            const char *eol = (const char *)memmem(line, len - used, "\r\n", 2);
+            if (eol == nullptr)
+            {
+                if (len - used > MAX_REQUEST_HEAD)
+                    return parse_error(parser, 431);
+                return PARSE_INCOMPLETE;
+            }
+            used = eol + 2 - buf;
+            if (eol == line)
+                return PARSE_COMPLETE;
+            break;
+        }
+        default:
+            return parse_error(parser, 400);
+        }
+    }
+}
+
+/**
+ * A request body kept in memory while it is small and in a temporary file
+ * once it is not
+ *
+ * Up to `body_memory` bytes stay in `memory`. The first byte beyond that
+ * moves everything into an unlinked file under `spool_dir`, a body that
+ * announced a larger `Content-Length` goes there right away so all of it
+ * can be spliced. `size` is how much arrived. Writing to the file blocks
+ * the reactor only as long as the page cache takes the data.
+ */
+struct SpoolBody : RequestBody
+{
+    std::string memory;
+    int fd = -1;
+    uint64_t size = 0;
+    size_t memory_limit = 0;
+    const char *spool_dir = nullptr;
+    bool spill_now = false;
+
+    SpoolBody(const ServerConfig &config, long content_length)
+        : memory_limit(config.body_memory), spool_dir(config.spool_dir.c_str()),
+          spill_now(content_length > (long)config.body_memory)
+    {
+    }
+
+    ~SpoolBody() override
+    {
+        if (fd != -1)
+            close(fd);
+    }
+
+    bool spill()
+    {
+        fd = open(spool_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (fd == -1)
+        {
+            /* Not every file system knows `O_TMPFILE` */
+            std::string path = std::string(spool_dir) + "/http_server.XXXXXX";
+            fd = mkostemp(&path[0], O_CLOEXEC);
+            if (fd == -1)
+            {
+                perror(spool_dir);
+                return false;
+            }
+            unlink(path.c_str());
+        }
+        std::string held;
+        held.swap(memory);
+        return write_file(held.data(), held.size());
+    }
+
+    bool write_file(const char *data, size_t length)
+    {
+        while (length > 0)
+        {
+            ssize_t written = ::write(fd, data, length);
+            if (written == -1 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                return false;
+            data += written;
+            length -= written;
+        }
+        return true;
+    }
+
+    bool write(const char *data, size_t length) override
+    {
+        size += length;
+        if (fd == -1 && !spill_now && memory.size() + length <= memory_limit)
+        {
+            memory.append(data, length);
+            return true;
+        }
+        if (fd == -1 && !spill())
+            return false;
+        return write_file(data, length);
+    }
+
+    int splice_target() override
+    {
+        if (fd == -1 && spill_now && !spill())
+            spill_now = false;
+        return fd;
+    }
+
+    void spliced(size_t length) override { size += length; }
+};
+
+/**
+ * Access logging
+ *
+ * With `--access-log FILE` every request is logged to FILE as one JSON
+ * object per line: when it was answered, the client's address, the
+ * method, target and protocol, the status, the bytes queued for the
+ * answer and how long producing them took.
+ *
+ * A reactor never writes the log itself. While it answers a request it
+ * fills in the fixed-size `AccessRecord` of the request's connection, and
+ * once the answer is queued it copies the record into its own
+ * `AccessLogRing`. The ring has one producer and one consumer: only the
+ * reactor moves `head`, only the log thread moves `tail`, so handing a
+ * record over is a copy and a release store. The reactor reads `tail`
+ * (a cache line the log thread writes) only once `tail_seen` says the
+ * ring may be half full. The log thread (`run_access_log()`) goes round
+ * the rings, formats the records and writes them in batches of up to
+ * `ACCESS_LOG_BATCH` bytes, and sleeps `ACCESS_LOG_FLUSH_MS` whenever a
+ * round found nothing.
+ *
+ * A record that finds its ring full is dropped: a log that falls behind
+ * costs log lines, never latency. With `--access-log-overflow sample` a
+ * ring more than half full takes only every `ACCESS_LOG_SAMPLE`th record
+ * (`offered` counts them), so a burst leaves a sample of itself instead
+ * of a gap. What is left out is counted in `access_log_dropped`.
+ *
+ * Targets longer than `target` are cut, `truncated` says so. A request
+ * whose client went away before it was answered is logged with the
+ * status its answer had so far, `0` when there was none.
+ */
+struct AccessRecord
+{
+    uint64_t started = 0;
+    uint64_t time_ms = 0;
+    uint64_t bytes = 0;
+    uint32_t peer = 0;
+    uint32_t duration_us = 0;
+    uint16_t status = 0;
+    uint8_t version = 0;
+    uint8_t target_len = 0;
+    bool truncated = false;
+    char method[7] = {};
+    char target[84] = {};
+};
+
+static_assert(sizeof(AccessRecord) == 128, "access records are two cache lines");
+
+struct AccessLogRing
+{
+    alignas(64) std::atomic<uint64_t> head{0};
+    uint64_t tail_seen = 0;
+    uint64_t offered = 0;
+    alignas(64) std::atomic<uint64_t> tail{0};
+    alignas(64) AccessRecord records[ACCESS_LOG_RING];
+};
+
+/**
+ * State we keep for every open client socket
+ *
+ * With keep-alive a client fd survives many requests, so we remember how
+ * many requests it already got. `timer` is its current deadline and
+ * `timer_kind` which of the timeouts that deadline is.
+ *
+ * `in` holds bytes read from the socket that do not form a complete
+ * request yet, the rest of it arrives with the next read. `parser`
+ * remembers how far into that request we already got. Both `in` and
+ * `out` borrow their memory from the reactor's `BufferPool`.
+ *
+ * `out` holds responses the socket could not take yet, `out_offset` is
+ * how much of the first chunk already went out. While `out` is not empty
+ * the epoll backend also watches the socket for EPOLLOUT (`want_write`).
+ *
+ * `closing` is set once we decided to close the connection, it is closed
+ * as soon as `out` is flushed.
+ *
+ * `peer` is the client's IPv4 address in network order, known when
+ * requests are rate limited or logged. `access` is the access log record
+ * of the request being answered, see "Access logging".
+ *
+ * `stream` is the response body still being produced, requests pipelined
+ * behind it wait in `in` until it ends. `body` is where the body of the
+ * request being read goes when its route streams it.
+ *
+ * `tls` is the TLS session of the connection when the server speaks TLS.
+ * `ktls_send` is set once the kernel took over encrypting what we send,
+ * from then on the plain `sendmsg` and `sendfile` paths work as before.
+ *
+ * `h2` is the HTTP/2 session once the client opened the connection with
+ * the HTTP/2 preface. `http2_parent` marks the connection of one HTTP/2
+ * stream instead, it has no socket and no deadline of its own and its
+ * output leaves through the parent. `ws` is the WebSocket session once a
+ * request upgraded the connection, see "WebSockets".
+ *
+ * `task` is the blocking task the connection's request waits for, see
+ * `BlockingTask`, `coroutine` the coroutine handler answering it, see
+ * `AsyncPromise`. `cache_fill` is the response cache fill its answer is
+ * copied into, `cache_wait` the fill its next request waits for.
+ *
+ * The remaining fields belong to the io_uring backend, which has
+ * operations in flight for a connection: `generation` tells completions
+ * for this connection apart from ones for an earlier connection that had
+ * the same fd, and `uring_send` holds the `msghdr` of the send in flight.
+ */
+struct Connection
+{
+    int fd = -1;
+    uint32_t peer = 0;
+    int requests_served = 0;
+    TimerNode timer;
+    uint8_t timer_kind = 0;
+
+    InputBuffer in;
+    HttpParser parser;
+
+    OutputQueue out;
+    size_t out_offset = 0;
+    size_t out_bytes = 0;
+    ResponseStream *stream = nullptr;
+    RequestBody *body = nullptr;
+    SSL *tls = nullptr;
+    Http2Session *h2 = nullptr;
+    Connection *http2_parent = nullptr;
+    WebSocketSession *ws = nullptr;
+    BlockingTask *task = nullptr;
+    AsyncPromise *coroutine = nullptr;
+    CacheFill *cache_fill = nullptr;
+    CacheFill *cache_wait = nullptr;
+    AccessRecord access;
+    bool want_write = false;
+    bool ktls_send = false;
+
+    bool closing = false;
+
+    uint32_t generation = 0;
+    bool recv_armed = false;
+    bool recv_paused = false;
+    bool send_in_flight = false;
+    bool close_requested = false;
+    bool close_submitted = false;
+    UringSend *uring_send = nullptr;
+};
+
+/**
+ * HTTP/2 sessions
+ *
+ * An HTTP/2 connection carries many requests at once, each on a stream
+ * of its own. Every stream gets a `Connection` of its own (`conn`) and
+ * its request is fed into it as HTTP/1.1, so routing, request bodies,
+ * files and streamed or compressed responses work exactly as on an
+ * HTTP/1.1 connection. What the stream queues in its `out` is an
+ * HTTP/1.1 response, which the session turns back into HEADERS and DATA
+ * frames on the real connection.
+ *
+ * `send_window` is how much the client still lets us send on the
+ * stream, `recv_window` how much we still let it send. `body_left` is
+ * what is left of a body announced with `content-length`, a body without
+ * one is passed on in chunked encoding (`chunked_body`). `remote_closed`
+ * is set once the client ended the stream. `head` collects the response
+ * head until it is complete. `flags_at` is where the flags of the
+ * stream's last frame sit in the session's `frames`, so the end of the
+ * stream can be flagged there instead of costing a frame of its own.
+ */
+struct Http2Stream
+{
+    uint32_t id = 0;
+    int64_t send_window = 0;
+    int64_t recv_window = H2_WINDOW;
+    long body_left = -1;
+    bool chunked_body = false;
+    bool remote_closed = false;
+    bool head_sent = false;
+    size_t flags_at = std::string::npos;
+    std::string head;
+    Connection conn;
+};
+
+/**
+ * `decoder` mirrors the table the client compresses request headers
+ * with, `encoder` the one it decompresses ours with. `last_stream` is the
+ * highest stream the client opened. A header block too large for one
+ * frame goes on in CONTINUATION frames, meanwhile `continuation` is its
+ * stream and `header_block` collects it.
+ *
+ * `send_window` is what the client lets us send on the whole
+ * connection, `recv_window` what we let it send. `peer_window` and
+ * `peer_max_frame` are the client's settings. `goaway` is set once either
+ * side is shutting the connection down, no new streams are answered.
+ *
+ * `frames` collects everything we send until it is queued as one chunk,
+ * so all the frames written for one batch of input leave in one write.
+ * The remaining strings are scratch space for decoding a request.
+ */
+struct Http2Session
+{
+    HpackTable decoder;
+    HpackTable encoder;
+    std::unordered_map<uint32_t, std::unique_ptr<Http2Stream>> streams;
+    uint32_t last_stream = 0;
+    uint32_t continuation = 0;
+    uint8_t continuation_flags = 0;
+    bool settings = false;
+    bool goaway = false;
+    int64_t send_window = H2_DEFAULT_WINDOW;
+    int64_t recv_window = H2_WINDOW;
+    uint32_t peer_window = H2_DEFAULT_WINDOW;
+    uint32_t peer_max_frame = H2_MAX_FRAME;
+    std::string header_block;
+    std::string frames;
+    std::string request;
+    std::string method;
+    std::string path;
+    std::string authority;
+    std::string fields;
+    std::string name_scratch;
+    std::string value_scratch;
+};
+
+/**
+ * WebSockets
+ *
+ * A `GET` for a route added with `add_websocket_route()` that asks for
+ * `Upgrade: websocket` is answered with `101 Switching Protocols`, and
+ * from then on the connection carries WebSocket frames on the same
+ * reactor and event loop as before: `process_input` hands what arrives
+ * to `process_websocket` instead of the request parser, and what we send
+ * is queued in `conn.out` like any response, so TLS (`wss://`), both
+ * backends and backpressure work unchanged. HTTP/2 streams are not
+ * upgraded.
+ *
+ * Client frames are unmasked in place in `conn.in` by the SIMD kernels of
+ * `http_scan.hpp`, a message that arrives in one frame goes to its
+ * handler straight from there. Only a fragmented message is collected in
+ * `message`. A frame must fit `WEBSOCKET_MAX_FRAME` and a message
+ * `websocket_max_message`, the connection is closed with 1009 otherwise.
+ *
+ * `permessage-deflate` is always taken without context takeover in
+ * either direction, every message is compressed on its own. That gives
+ * up some ratio on small messages, but no connection keeps a zlib window
+ * of its own: the one `WebSocketZlib` of a reactor, reset between
+ * messages, serves all of them, and a broadcast is compressed once for
+ * every subscriber. Messages below `WEBSOCKET_DEFLATE_MIN` bytes and ones
+ * that do not shrink go out as they are.
+ *
+ * `websocket_publish()` builds the frame of a broadcast once, plain and
+ * compressed, and posts it to the `BroadcastInbox` of every reactor,
+ * waking the others through their eventfd. A reactor takes its inbox
+ * after every poll (`deliver_broadcasts()`) and queues the frame on
+ * every subscriber of the channel with `queue_shared`: a subscriber costs
+ * an `OutputChunk` and a reference, never a copy. A reactor with
+ * subscribers takes one copy of its own first, so its sends read memory on its own NUMA node
+ * and the cores do not pass one reference count around. A subscriber with
+ * more than `MAX_PENDING_OUTPUT` bytes waiting can not keep up and is
+ * dropped.
+ *
+ * The deadline of a WebSocket is `websocket_ping`: once it passes we
+ * ping, once it passes again without a word from the client we close.
+ * A draining server says 1001 (going away) and closes once the client
+ * answered or the drain deadline passed.
+ */
+
+/**
+ * `handler` answers the messages of the connection, `deflate` is set
+ * when the client took `permessage-deflate`. `fragments` is the opcode
+ * of the fragmented message being collected in `message`, `0` while there
+ * is none, `compressed` whether it is compressed. `ping_sent` is set while
+ * our ping waits for the client, `close_sent` once we sent a close frame.
+ * `channels` are the ones the connection subscribed to.
+ */
+struct WebSocketSession
+{
+    const WebSocketHandler *handler = nullptr;
+    bool deflate = false;
+    uint8_t fragments = 0;
+    bool compressed = false;
+    bool ping_sent = false;
+    bool close_sent = false;
+    std::string message;
+    std::vector<std::string> channels;
+};
+
+/**
+ * The raw deflate streams a reactor compresses and decompresses every
+ * WebSocket message with. `deflated` and `inflated` hold the results,
+ * apart so a handler can send while it reads the message it got.
+ */
+struct WebSocketZlib
+{
+    z_stream deflater = {};
+    z_stream inflater = {};
+    bool deflater_ready = false;
+    bool inflater_ready = false;
+    std::string deflated;
+    std::string inflated;
+
+    ~WebSocketZlib()
+    {
+        if (deflater_ready)
+            deflateEnd(&deflater);
+        if (inflater_ready)
+            inflateEnd(&inflater);
+    }
+};
+
+/**
+ * One published message: `plain` is its frame, `deflated` the frame of
+ * its compressed form, `nullptr` when it is not worth compressing
+ */
+struct Broadcast
+{
+    std::string channel;
+    std::shared_ptr<const std::string> plain;
+    std::shared_ptr<const std::string> deflated;
+};
+
+/**
+ * The broadcasts posted to one reactor, `pending` spares it the lock
+ * while there are none. Whoever posts to an empty inbox of another
+ * reactor writes to its `event_fd`.
+ */
+struct BroadcastInbox
+{
+    std::mutex lock;
+    std::vector<std::shared_ptr<const Broadcast>> queued;
+    std::atomic<bool> pending{false};
+    int event_fd = -1;
+};
+
+struct WebSocketHub
+{
+    std::vector<std::unique_ptr<BroadcastInbox>> inboxes;
+};
+
+/**
+ * Blocking work
+ *
+ * A reactor must never wait: a handler that reads a slow disk or asks a
+ * database would stall every other client of the reactor while it
+ * blocks. Such a handler hands a `BlockingTask` to `offload_task()`
+ * instead. `run` is called on a thread of the shared `WorkerPool`, and
+ * once it returned the task goes back to the reactor that owns the
+ * connection, where `finish` queues the answer exactly like a
+ * `RouteHandler` would. `run` must not touch the reactor or the
+ * connection, anything it needs from the request has to be copied into
+ * the task first, and anything `finish` needs it leaves in the task.
+ * Until the task is back the connection reads no further requests.
+ *
+ * A task no connection waits for is handed out with `detach_task()`, it
+ * has `settle` called on the reactor instead of `finish`. So has a task
+ * whose connection went away meanwhile, its answer is dropped.
+ *
+ * The remaining fields belong to the server. `conn` is cleared when the
+ * connection goes away meanwhile. `done` is
+ * the owning reactor's `TaskCompletions`. `resumes` is the coroutine
+ * handler that waits for the task, it owns the task and is resumed
+ * instead of calling `finish`.
+ */
+struct TaskCompletions;
+
+struct BlockingTask
+{
+    virtual ~BlockingTask() {}
+    virtual void run() = 0;
+    virtual void finish(Reactor &reactor, Connection &conn, bool keep_alive) = 0;
+    virtual void settle(Reactor &) {}
+
+    Connection *conn = nullptr;
+    TaskCompletions *done = nullptr;
+    BlockingTask *next = nullptr;
+    AsyncPromise *resumes = nullptr;
+    bool keep_alive = false;
+    uint64_t request_start = 0;
+};
+
+/**
+ * Tasks that are back from the pool, a lock-free stack every worker
+ * pushes onto and only the reactor takes from, always all at once
+ *
+ * The worker that pushes onto an empty stack wakes the reactor through
+ * `event_fd`, which its event loop watches like a socket. The reactor
+ * reads the eventfd before it takes the stack, so a task pushed in
+ * between is either taken or has signaled again.
+ *
+ * `pending` counts the tasks the reactor handed out and did not finish
+ * yet, only the reactor touches it.
+ */
+struct TaskCompletions
+{
+    std::atomic<BlockingTask *> head{nullptr};
+    int event_fd = -1;
+    size_t pending = 0;
+};
+
+/**
+ * The thread pool `offload_task()` hands tasks to, shared by all reactors
+ *
+ * Every worker has a queue of its own, reactors spread their tasks over
+ * them round robin. A worker takes its own tasks oldest first, and once
+ * its queue ran dry steals the newest task of another worker, so a few
+ * slow tasks never hold up the ones queued behind them while a worker
+ * idles. A queue is only locked to push or pop one pointer, a reactor
+ * never waits for a task to run.
+ *
+ * `queued` counts the tasks in all queues, `sleeping` the workers
+ * waiting for one, a task only costs a wakeup when somebody sleeps.
+ */
+struct alignas(64) WorkerQueue
+{
+    std::mutex lock;
+    std::deque<BlockingTask *> tasks;
+};
+
+struct WorkerPool
+{
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> queued{0};
+    std::atomic<int> sleeping{0};
+    std::mutex sleep_lock;
+    std::condition_variable wake;
+    bool stopping = false;
+};
+
+void submit_task(WorkerPool &pool, BlockingTask *task)
+{
+    WorkerQueue &queue = *pool.queues[pool.next.fetch_add(1, std::memory_order_relaxed) % pool.queues.size()];
+    {
+        std::lock_guard<std::mutex> guard(queue.lock);
+        queue.tasks.push_back(task);
+    }
+    pool.queued.fetch_add(1);
+    if (pool.sleeping.load() > 0)
+    {
+        /* Taking the lock orders the wakeup after the sleeper's last look at `queued` */
+        {
+            std::lock_guard<std::mutex> guard(pool.sleep_lock);
+        }
+        pool.wake.notify_one();
+    }
+}
+
+/**
+ * Our own oldest task, or else the newest task of the first other
+ * worker that has one, `nullptr` when every queue is empty
+ */
+BlockingTask *take_task(WorkerPool &pool, size_t self)
+{
+    size_t count = pool.queues.size();
+    for (size_t i = 0; i < count; ++i)
+    {
+        WorkerQueue &queue = *pool.queues[(self + i) % count];
+        std::lock_guard<std::mutex> guard(queue.lock);
+        if (queue.tasks.empty())
+            continue;
+        BlockingTask *task;
+        if (i == 0)
+        {
+            task = queue.tasks.front();
+            queue.tasks.pop_front();
+        }
+        else
+        {
+            task = queue.tasks.back();
+            queue.tasks.pop_back();
+        }
+        pool.queued.fetch_sub(1);
+        return task;
+    }
+    return nullptr;
+}
+
+/* Hand a task that ran back to its reactor */
+void complete_task(BlockingTask *task)
+{
+    TaskCompletions &done = *task->done;
+    BlockingTask *head = done.head.load(std::memory_order_relaxed);
+    do
+        task->next = head;
+    while (!done.head.compare_exchange_weak(head, task, std::memory_order_release, std::memory_order_relaxed));
+    if (head == nullptr)
+    {
+        uint64_t one = 1;
+        if (write(done.event_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+            perror("eventfd write");
+    }
+}
+
+void run_worker(WorkerPool &pool, size_t self)
+{
+    while (true)
+    {
+        BlockingTask *task = take_task(pool, self);
+        if (task != nullptr)
+        {
+            task->run();
+            complete_task(task);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(pool.sleep_lock);
+        pool.sleeping.fetch_add(1);
+        pool.wake.wait(guard, [&] { return pool.stopping || pool.queued.load() > 0; });
+        pool.sleeping.fetch_sub(1);
+        if (pool.stopping)
+            return;
+    }
+}
+
+void start_worker_pool(WorkerPool &pool, int threads)
+{
+    for (int i = 0; i < threads; ++i)
+        pool.queues.emplace_back(new WorkerQueue);
+    for (int i = 0; i < threads; ++i)
+        pool.threads.emplace_back(run_worker, std::ref(pool), (size_t)i);
+}
+
+void stop_worker_pool(WorkerPool &pool)
+{
+    {
+        std::lock_guard<std::mutex> guard(pool.sleep_lock);
+        pool.stopping = true;
+    }
+    pool.wake.notify_all();
+    for (std::thread &thread : pool.threads)
+        thread.join();
+}
+
+/**
+ * Coroutine frames
+ *
+ * A coroutine handler (see `AsyncPromise`) keeps its state in a frame
+ * that lives from its request until the answer is queued. Frames come
+ * from the reactor's `FramePool`: size classes from 256 bytes up to
+ * 8 KB, carved from one arena that is reserved on first use and
+ * recycled through free lists threaded through the free frames. Waiting
+ * and resuming never allocate, and all the frames of a reactor together
+ * never take more than `COROUTINE_ARENA_SIZE`. A frame that does not fit
+ * a class, or one that finds the arena used up, fails the handler call
+ * and the client gets a `503`.
+ *
+ * Every frame sits behind a header that names its pool and class, the
+ * promise's `operator delete` only gets the frame back.
+ */
+struct FramePool;
+
+struct alignas(16) FrameHeader
+{
+    FramePool *pool;
+    uint32_t size_class;
+};
+
+struct FramePool
+{
+    char *arena = (char *)MAP_FAILED;
+    size_t used = 0;
+    FrameHeader *free_frames[COROUTINE_FRAME_CLASSES] = {};
+
+    ~FramePool()
+    {
+        if (arena != MAP_FAILED)
+            munmap(arena, COROUTINE_ARENA_SIZE);
+    }
+};
+
+void *allocate_frame(FramePool &pool, size_t size)
+{
+    int size_class = 0;
+    while (size_class < COROUTINE_FRAME_CLASSES &&
+           ((size_t)COROUTINE_FRAME_MIN << size_class) < size + sizeof(FrameHeader))
+        ++size_class;
+    if (size_class == COROUTINE_FRAME_CLASSES)
+        return nullptr;
+
+    FrameHeader *header = pool.free_frames[size_class];
+    if (header != nullptr)
+    {
+        pool.free_frames[size_class] = *(FrameHeader **)(header + 1);
+    }
+    else
+    {
+        size_t block = (size_t)COROUTINE_FRAME_MIN << size_class;
+        if (pool.arena == MAP_FAILED)
+            pool.arena = (char *)mmap(nullptr, COROUTINE_ARENA_SIZE, PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (pool.arena == MAP_FAILED || pool.used + block > COROUTINE_ARENA_SIZE)
+            return nullptr;
+        header = (FrameHeader *)(pool.arena + pool.used);
+        pool.used += block;
+    }
+    header->pool = &pool;
+    header->size_class = (uint32_t)size_class;
+    return header + 1;
+}
+
+void release_frame(void *frame)
+{
+    FrameHeader *header = (FrameHeader *)frame - 1;
+    FramePool &pool = *header->pool;
+    *(FrameHeader **)frame = pool.free_frames[header->size_class];
+    pool.free_frames[header->size_class] = header;
+}
+
+/**
+ * Upstream connections, see "Upstream proxy"
+ *
+ * An `UpstreamLink` is one connection to a backend. `waiter` is the
+ * coroutine waiting for it to become ready, `in` what was read from it
+ * and not used yet. It is `idle` while it waits in its backend's pool
+ * and a `check` when it only carries a health check. `registered` and
+ * `polling` belong to the event loop (the socket is known to epoll, the
+ * events io_uring polls for).
+ *
+ * Every reactor has its own `UpstreamPool`: one `Backend` per
+ * `--upstream` with its idle connections, how many requests are in
+ * flight there (`outstanding`) and its health, and every open link by fd.
+ */
+struct UpstreamLink
+{
+    int fd = -1;
+    uint32_t backend = 0;
+    uint32_t generation = 0;
+    AsyncPromise *waiter = nullptr;
+    bool connecting = false;
+    bool idle = false;
+    bool check = false;
+    bool registered = false;
+    uint32_t polling = 0;
+    std::string in;
+};
+
+struct Backend
+{
+    bool healthy = true;
+    uint32_t outstanding = 0;
+    std::vector<UpstreamLink *> idle;
+    UpstreamLink *check = nullptr;
+};
+
+struct UpstreamPool
+{
+    std::vector<Backend> backends;
+    std::unordered_map<int, UpstreamLink *> links;
+    uint32_t next_generation = 0;
+    uint32_t next_backend = 0;
+    long next_check = 0;
+
+    ~UpstreamPool()
+    {
+        for (auto &entry : links)
+        {
+            close(entry.first);
+            delete entry.second;
+        }
+    }
+};
+
+/**
+ * Request routing
+ *
+ * Routes are registered once at startup into a radix trie and shared,
+ * read-only, by every reactor. A node covers a run of literal bytes, a
+ * `:name` parameter (one path segment) or a `*name` wildcard (the rest of
+ * the path). Every node is 28 bytes and refers to its bytes by offset into
+ * `Router::text`, so a lookup touches a couple of cache lines per path
+ * segment and never copies or allocates.
+ *
+ * Literal children are tried first, then the parameter, then the
+ * wildcard, so `/files/index` beats `/files/:name` beats a wildcard
+ * below `/files/`, no matter the order the routes were added in.
+ */
+struct RequestBody;
+
+/**
+ * A route that takes its body as it arrives is called as soon as the head
+ * is complete and returns where the body should go, see `RequestBody`.
+ * Returning `nullptr` means it already queued an answer, the body is not
+ * read and the connection closes after the answer.
+ */
+typedef RequestBody *(*BodyHandler)(Reactor &reactor, Connection &conn, const HttpRequest &req,
+                                    const RouteParams &params);
+
+/**
+ * A route answered by a coroutine, called once the head is complete and
+ * reading its body itself with `async_read()`, see `AsyncPromise`
+ */
+typedef Async (*AsyncHandler)(Reactor &reactor, Connection &conn, const HttpRequest &req,
+                              const RouteParams &params, bool keep_alive);
+
+enum RouteMethod : uint8_t
+{
+    ROUTE_GET,
+    ROUTE_HEAD,
+    ROUTE_POST,
+    ROUTE_PUT,
+    ROUTE_DELETE,
+    ROUTE_PATCH,
+    ROUTE_OPTIONS,
+    ROUTE_ANY,
+    ROUTE_METHODS,
+};
+
+static const char *const route_method_names[ROUTE_ANY] = {"GET", "HEAD", "POST", "PUT",
+                                                          "DELETE", "PATCH", "OPTIONS"};
+
+enum RouteNodeKind : uint8_t
+{
+    ROUTE_LITERAL,
+    ROUTE_PARAM,
+    ROUTE_WILDCARD,
+};
+
+/**
+ * `text` and `length` are the literal bytes, or the parameter's name.
+ * Node `0` is the root, so `0` also means "no such node" in the links.
+ */
+struct RouteNode
+{
+    uint32_t text = 0;
+    uint16_t length = 0;
+    RouteNodeKind kind = ROUTE_LITERAL;
+    uint32_t first_child = 0;
+    uint32_t next_sibling = 0;
+    uint32_t param_child = 0;
+    uint32_t wildcard_child = 0;
+    uint32_t endpoint = 0;
+};
+
+/**
+ * What a complete route leads to: one handler per method, a plain one,
+ * one that streams the body or a coroutine. `ROUTE_ANY` answers every method
+ * without a handler of its own. A WebSocket route (`upgrades`) takes the
+ * `GET` slot with `websocket`. `allow` is the `Allow` header for a `405`.
+ */
+struct RouteEndpoint
+{
+    RouteHandler handlers[ROUTE_METHODS] = {};
+    BodyHandler body_handlers[ROUTE_METHODS] = {};
+    AsyncHandler async_handlers[ROUTE_METHODS] = {};
+    WebSocketHandler websocket;
+    bool upgrades = false;
+    std::string allow;
+};
+
+struct Router
+{
+    std::vector<RouteNode> nodes = std::vector<RouteNode>(1);
+    std::vector<RouteEndpoint> endpoints;
+    std::string text;
+};
+
+/**
+ * Map a request method to its handler slot, `ROUTE_ANY` for the ones
+ * without a slot of their own
+ */
+RouteMethod route_method(std::string_view method)
+{
+    for (int i = 0; i < ROUTE_ANY; ++i)
+    {
+        if (method == route_method_names[i])
+            return (RouteMethod)i;
+    }
+    return ROUTE_ANY;
+}
+
+std::string_view route_text(const Router &router, const RouteNode &node)
+{
+    return std::string_view(router.text.data() + node.text, node.length);
+}
+
+uint32_t add_route_node(Router &router, RouteNodeKind kind, size_t text, size_t length)
+{
+    RouteNode node;
+    node.kind = kind;
+    node.text = (uint32_t)text;
+    node.length = (uint16_t)length;
+    router.nodes.push_back(node);
+    return (uint32_t)(router.nodes.size() - 1);
+}
+
+/**
+ * The `:name` or `*name` child of `parent`, created on first use. Two
+ * routes may not give the same position different names.
+ */
+uint32_t add_named_route_node(Router &router, uint32_t parent, RouteNodeKind kind, size_t text, size_t length)
+{
+    uint32_t child = kind == ROUTE_PARAM ? router.nodes[parent].param_child : router.nodes[parent].wildcard_child;
+    if (child != 0)
+    {
+        const RouteNode &node = router.nodes[child];
+        return route_text(router, node) == std::string_view(router.text.data() + text, length) ? child : 0;
+    }
+
+    child = add_route_node(router, kind, text, length);
+    if (kind == ROUTE_PARAM)
+        router.nodes[parent].param_child = child;
+    else
+        router.nodes[parent].wildcard_child = child;
+    return child;
+}
+
+/**
+ * Register `handler`, `body_handler`, `async_handler` or `websocket` for
+ * `method` (`nullptr` for any method) on `pattern`, `add_route()`,
+ * `add_body_route()`, `add_async_route()` and `add_websocket_route()` below
+ *
+ * A pattern is an absolute path where a segment may be `:name` and the
+ * last one may be `*name`. Literal runs shared with earlier routes are
+ * split so every node stays a maximal common prefix.
+ *
+ * Returns `false` and says why on `stderr` for a malformed pattern or one
+ * that conflicts with an earlier route.
+ */
+bool register_route(Router &router, const char *method, std::string_view pattern, RouteHandler handler,
+                    BodyHandler body_handler, AsyncHandler async_handler,
+                    const WebSocketHandler *websocket = nullptr)
+{
+    if (pattern.empty() || pattern[0] != '/' || pattern.size() > UINT16_MAX)
+    {
+        std::cerr << "route " << pattern << ": must be an absolute path" << std::endl;
+        return false;
+    }
+
+    size_t base = router.text.size();
+    router.text.append(pattern.data(), pattern.size());
+    const std::string &text = router.text;
+    size_t end = text.size();
+    size_t i = base;
+    uint32_t node = 0;
+    uint32_t params = 0;
+    while (i < end)
+    {
+        char c = text[i];
+        if (c == ':' || c == '*')
+        {
+            size_t name_end = c == '*' ? end : text.find('/', i);
+            if (name_end == std::string::npos)
+                name_end = end;
+            if (text[i - 1] != '/' || name_end == i + 1 || ++params > MAX_ROUTE_PARAMS)
+            {
+                std::cerr << "route " << pattern << ": bad parameter" << std::endl;
+                return false;
+            }
+            node = add_named_route_node(router, node, c == ':' ? ROUTE_PARAM : ROUTE_WILDCARD, i + 1,
+                                        name_end - i - 1);
+            if (node == 0)
+            {
+                std::cerr << "route " << pattern << ": parameter name conflicts with an earlier route"
+                          << std::endl;
+                return false;
+            }
+            i = name_end;
+            continue;
+        }
+
+        size_t literal_end = text.find_first_of(":*", i);
+        if (literal_end == std::string::npos)
+            literal_end = end;
+
+        uint32_t child = router.nodes[node].first_child;
+        while (child != 0 && text[router.nodes[child].text] != c)
+            child = router.nodes[child].next_sibling;
+        if (child == 0)
+        {
+            child = add_route_node(router, ROUTE_LITERAL, i, literal_end - i);
+            router.nodes[child].next_sibling = router.nodes[node].first_child;
+            router.nodes[node].first_child = child;
+            node = child;
+            i = literal_end;
+            continue;
+        }
+
+        size_t common = 0;
+        size_t length = router.nodes[child].length;
+        while (common < length && i + common < literal_end &&
+               text[router.nodes[child].text + common] == text[i + common])
+            ++common;
+        if (common < length)
+        {
+            /* Split: the tail keeps everything `child` led to */
+            uint32_t tail = add_route_node(router, ROUTE_LITERAL, 0, 0);
+            RouteNode &split = router.nodes[child];
+            RouteNode &rest = router.nodes[tail];
+            rest = split;
+            rest.text += (uint32_t)common;
+            rest.length -= (uint16_t)common;
+            rest.next_sibling = 0;
+            split.length = (uint16_t)common;
+            split.first_child = tail;
+            split.param_child = 0;
+            split.wildcard_child = 0;
+            split.endpoint = 0;
+        }
+        node = child;
+        i += common;
+    }
+
+    if (router.nodes[node].endpoint == 0)
+    {
+        router.endpoints.emplace_back();
+        router.nodes[node].endpoint = (uint32_t)router.endpoints.size();
+    }
+    RouteEndpoint &endpoint = router.endpoints[router.nodes[node].endpoint - 1];
+    RouteMethod slot = method == nullptr ? ROUTE_ANY : route_method(method);
+    if (slot == ROUTE_ANY && method != nullptr)
+    {
+        std::cerr << "route " << pattern << ": unknown method " << method << std::endl;
+        return false;
+    }
+    if (endpoint.handlers[slot] != nullptr || endpoint.body_handlers[slot] != nullptr ||
+        endpoint.async_handlers[slot] != nullptr || (slot == ROUTE_GET && endpoint.upgrades))
+    {
+        std::cerr << "route " << (method ? method : "*") << " " << pattern << ": registered twice" << std::endl;
+        return false;
+    }
+    endpoint.handlers[slot] = handler;
+    endpoint.body_handlers[slot] = body_handler;
+    endpoint.async_handlers[slot] = async_handler;
+    if (websocket != nullptr)
+    {
+        endpoint.websocket = *websocket;
+        endpoint.upgrades = true;
+    }
+
+    endpoint.allow.clear();
+    for (int m = 0; m < ROUTE_ANY; ++m)
+    {
+        bool allowed = endpoint.handlers[m] != nullptr || endpoint.body_handlers[m] != nullptr ||
+                       endpoint.async_handlers[m] != nullptr || (m == ROUTE_GET && endpoint.upgrades) ||
+                       (m == ROUTE_HEAD && (endpoint.handlers[ROUTE_GET] || endpoint.async_handlers[ROUTE_GET]));
+        if (allowed)
+        {
+            if (!endpoint.allow.empty())
+                endpoint.allow += ", ";
+            endpoint.allow += route_method_names[m];
+        }
+    }
+    return true;
+}
+
+bool add_route(Router &router, const char *method, std::string_view pattern, RouteHandler handler)
+{
+    return register_route(router, method, pattern, handler, nullptr, nullptr);
+}
+
+bool add_body_route(Router &router, const char *method, std::string_view pattern, BodyHandler handler)
+{
+    return register_route(router, method, pattern, nullptr, handler, nullptr);
+}
+
+bool add_async_route(Router &router, const char *method, std::string_view pattern, AsyncHandler handler)
+{
+    return register_route(router, method, pattern, nullptr, nullptr, handler);
+}
+
+bool add_websocket_route(Router &router, std::string_view pattern, const WebSocketHandler &handler)
+{
+    return register_route(router, "GET", pattern, nullptr, nullptr, nullptr, &handler);
+}
+
+/**
+ * Match `path` below `node`, whose own bytes are already consumed
+ *
+ * Returns the endpoint number, `0` when nothing matches. A failed branch
+ * gives back the parameters it captured before the next one is tried.
+ */
+uint32_t match_route_node(const Router &router, uint32_t index, std::string_view path, RouteParams &params)
+{
+    const RouteNode &node = router.nodes[index];
+    if (path.empty() && node.endpoint != 0)
+        return node.endpoint;
+
+    if (!path.empty())
+    {
+        uint32_t child = node.first_child;
+        while (child != 0 && router.text[router.nodes[child].text] != path[0])
+            child = router.nodes[child].next_sibling;
+        if (child != 0)
+        {
+            std::string_view literal = route_text(router, router.nodes[child]);
+            if (path.size() >= literal.size() && memcmp(path.data(), literal.data(), literal.size()) == 0)
+            {
+                uint32_t endpoint = match_route_node(router, child, path.substr(literal.size()), params);
+                if (endpoint != 0)
+                    return endpoint;
+            }
+        }
+    }
+
+    uint32_t captured = params.count;
+    if (node.param_child != 0 && !path.empty() && path[0] != '/')
+    {
+        size_t segment = std::min(path.find('/'), path.size());
+        const RouteNode &param = router.nodes[node.param_child];
+        params.items[params.count++] = RouteParam{route_text(router, param), path.substr(0, segment)};
+        uint32_t endpoint = match_route_node(router, node.param_child, path.substr(segment), params);
+        if (endpoint != 0)
+            return endpoint;
+        params.count = captured;
+    }
+
+    if (node.wildcard_child != 0)
+    {
+        const RouteNode &wildcard = router.nodes[node.wildcard_child];
+        params.items[params.count++] = RouteParam{route_text(router, wildcard), path};
+        return wildcard.endpoint;
+    }
+    return 0;
+}
+
+/**
+ * Find the route for a request target, the query string is not part of
+ * the match. Returns `nullptr` when no route matches.
+ */
+const RouteEndpoint *match_route(const Router &router, std::string_view target, RouteParams &params)
+{
+    size_t query = target.find_first_of("?#");
+    if (query != std::string_view::npos)
+        target = target.substr(0, query);
+    params.count = 0;
+    uint32_t endpoint = match_route_node(router, 0, target, params);
+    return endpoint == 0 ? nullptr : &router.endpoints[endpoint - 1];
+}
+
+/**
+ * The handler slot of `endpoint` that answers `method`, `-1` for a `405`
+ *
+ * `HEAD` falls back to the `GET` handler, every handler leaves the body
+ * out for `HEAD` itself.
+ */
+int route_slot(const RouteEndpoint &endpoint, RouteMethod method)
+{
+    if (endpoint.handlers[method] != nullptr || endpoint.body_handlers[method] != nullptr ||
+        endpoint.async_handlers[method] != nullptr || (method == ROUTE_GET && endpoint.upgrades))
+        return method;
+    if (method == ROUTE_HEAD &&
+        (endpoint.handlers[ROUTE_GET] != nullptr || endpoint.async_handlers[ROUTE_GET] != nullptr))
+        return ROUTE_GET;
+    if (endpoint.handlers[ROUTE_ANY] != nullptr || endpoint.body_handlers[ROUTE_ANY] != nullptr ||
+        endpoint.async_handlers[ROUTE_ANY] != nullptr)
+        return ROUTE_ANY;
+    return -1;
+}
+
+/**
+ * Response caching
+ *
+ * With `--response-cache BYTES` every reactor keeps up to BYTES of the
+ * answers its handlers said may be reused. An answer to a `GET` is kept
+ * when it
+ *
+ *  - has status 200, 203, 300, 301, 404 or 410 and a `Content-Length`
+ *  - carries `Cache-Control` with `s-maxage` or `max-age` (the former
+ *    wins) and none of `no-store`, `no-cache` or `private`
+ *  - sets no cookie and does not `Vary: *`
+ *
+ * The key is the request target. An answer that names request headers in
+ * `Vary` is one variant of it, picked by the request's values of them
+ * (`vary`). Requests with `Authorization`, ranges, conditional requests
+ * and ones that say `no-store` pass the cache by, `no-cache` (or `Pragma:
+ * no-cache`) has the handler answer afresh and replaces what was kept.
+ *
+ * A hit queues a head rendered for this request (its own `Connection`,
+ * the current `Date` and an `Age`) followed by the kept body itself,
+ * which the output queue shares with the cache like a compressed file.
+ * Once `size` goes over the budget entries are evicted in CLOCK order:
+ * the hand gives an entry that was used since it last came by another
+ * round (`referenced`), and evicts it otherwise. New entries go in right
+ * behind the hand, so they are the last it comes to. Expired entries go
+ * as soon as they are found.
+ *
+ * A miss starts a `CacheFill`, every byte the handler queues for it is
+ * copied into `captured` as well. Requests for the same target that come
+ * in meanwhile wait in `waiters` and leave their request unread in `in`,
+ * it is read again once the fill is done and then usually hits, so a
+ * slow handler runs once however many clients ask at the same time. A
+ * fill whose answer can not be kept leaves a `pass` entry for
+ * `RESPONSE_CACHE_PASS_MS`: until it expires requests for the target go
+ * to the handler at once, so routes that are never cached never queue
+ * up behind each other.
+ *
+ * Like the file cache everything is per reactor, no lock is involved.
+ * `key` is scratch space for lookups.
+ */
+struct CachedAnswer
+{
+    std::string target;
+    std::vector<std::pair<std::string, std::string>> vary;
+    std::string status_line;
+    std::string fields;
+    std::shared_ptr<const std::string> body;
+    long stored = 0;
+    long expires = 0;
+    size_t size = 0;
+    std::list<CachedAnswer *>::iterator position;
+    bool pass = false;
+    bool referenced = false;
+};
+
+struct CacheFill
+{
+    std::string target;
+    std::string request_head;
+    std::string captured;
+    bool storable = true;
+    std::vector<Connection *> waiters;
+};
+
+struct HttpCache
+{
+    size_t budget = 0;
+    size_t size = 0;
+    std::unordered_map<std::string, std::vector<CachedAnswer *>> answers;
+    std::list<CachedAnswer *> clock;
+    std::list<CachedAnswer *>::iterator hand = clock.end();
+    std::unordered_map<std::string, CacheFill *> fills;
+    std::vector<CacheFill *> done;
+    std::string key;
+
+    ~HttpCache()
+    {
+        for (CachedAnswer *answer : clock)
+            delete answer;
+        for (auto &entry : fills)
+            delete entry.second;
+        for (CacheFill *fill : done)
+            delete fill;
+    }
+};
+
+/**
+ * Admission control
+ *
+ * Two limits keep one client, or too many of them, from using the server
+ * up, both are checked before a new client costs us a `Connection`:
+ *
+ *  - with `--max-connections` a reactor that accepts a client while that
+ *    many are open answers `503` and closes it. The count is shared by
+ *    all reactors (one atomic add per connection opened and closed); two
+ *    reactors accepting at the same moment may each let one more in.
+ *  - with `--rate-limit` every client address has a token bucket that
+ *    fills at `rate_limit` tokens per second up to `rate_burst`. A new
+ *    connection and every request take a token, one that finds none gets
+ *    `429` and the connection is closed (over HTTP/2 only its stream
+ *    ends).
+ *
+ * Refusals are written straight to the socket, a TLS client is closed
+ * without one instead of paying for the handshake first.
+ *
+ * Like everything else the buckets are per reactor: a client whose
+ * connections land on several reactors gets a budget on each. They live
+ * in a fixed open addressing table of `1 << RATE_LIMIT_BITS` 12-byte
+ * `ClientBucket`s with no locks and no allocation once it is set up. An
+ * address is looked for in `RATE_LIMIT_PROBES` slots from its hash. A
+ * bucket that would be full again by now holds nothing worth keeping, so
+ * a new address takes that slot (or an empty one), and when every slot
+ * is busy the one that was used longest ago. Buckets are refilled only
+ * when they are looked at, from `stamp`, the millisecond they were last.
+ */
+struct ClientBucket
+{
+    uint32_t address = 0;
+    uint32_t stamp = 0;
+    float tokens = 0;
+};
+
+struct ClientLimiter
+{
+    std::vector<ClientBucket> buckets;
+    float rate = 0;
+    float burst = 0;
+};
+
+/* Refill `bucket` up to the millisecond `stamp` */
+void refill_bucket(const ClientLimiter &limiter, ClientBucket &bucket, uint32_t stamp)
+{
+    bucket.tokens = std::min(limiter.burst, bucket.tokens + (float)(uint32_t)(stamp - bucket.stamp) * limiter.rate);
+    bucket.stamp = stamp;
+}
+
+/**
+ * Take one token from the bucket of the client `address` at `now`
+ * (milliseconds), `false` when it has none left
+ */
+bool take_token(ClientLimiter &limiter, uint32_t address, long now)
+{
+    uint32_t stamp = (uint32_t)now;
+    size_t mask = limiter.buckets.size() - 1;
+    size_t home = (size_t)(((uint64_t)address * 0x9E3779B97F4A7C15ull) >> (64 - RATE_LIMIT_BITS));
+    ClientBucket *bucket = nullptr;
+    ClientBucket *free = nullptr;
+    ClientBucket *stalest = nullptr;
+    for (size_t i = 0; i < RATE_LIMIT_PROBES && bucket == nullptr; ++i)
+    {
+        ClientBucket &candidate = limiter.buckets[(home + i) & mask];
+        if (candidate.address == address)
+        {
+            bucket = &candidate;
+        }
+        else if (free == nullptr)
+        {
+            if (candidate.address == 0 ||
+                candidate.tokens + (float)(uint32_t)(stamp - candidate.stamp) * limiter.rate >= limiter.burst)
+                free = &candidate;
+            else if (stalest == nullptr || stamp - candidate.stamp > stamp - stalest->stamp)
+                stalest = &candidate;
+        }
+    }
+    if (bucket == nullptr)
+    {
+        bucket = free != nullptr ? free : stalest;
+        bucket->address = address;
+        bucket->tokens = limiter.burst;
+        bucket->stamp = stamp;
+    }
+    refill_bucket(limiter, *bucket, stamp);
+    if (bucket->tokens < 1)
+        return false;
+    bucket->tokens -= 1;
+    return true;
+}
+
+/**
+ * One reactor: a single event loop serving the clients accepted on `listen_fd`
+ *
+ * Every reactor owns its listening socket, its event loop (`loop`) and all
+ * the clients it accepted, nothing is shared between reactors.
+ *
+ * `request` is scratch space for the request being answered, a reactor
+ * answers one request at a time so one header array is enough.
+ * `responses` holds this reactor's copy of the fixed responses and
+ * `files` its cache of open static files, `path` is scratch space for
+ * resolving request targets. `buffers` lends memory to its connections
+ * and `timers` holds their deadlines. `metrics` is what this reactor
+ * counts, owned by `run_server()` so the admin thread can read it.
+ * `router` is shared by all reactors, `params` holds the route
+ * parameters of the request being answered. `compressors` are this
+ * reactor's compression contexts, `stream_input` is scratch space for a
+ * streamed body on its way into one. `tls_record` is where small
+ * responses are packed into one TLS record. `workers` runs the blocking
+ * tasks of all reactors, the ones of this reactor come back through
+ * `completed`. `frames` holds the frames of this reactor's coroutine
+ * handlers, `ready` the ones that can go on. `upstreams` are its
+ * connections to the backends it proxies to, `cache` the answers it
+ * keeps for reuse. `limiter` holds the request budgets of its clients,
+ * `open_connections` counts the clients of all reactors, both only in
+ * use with their option (see "Admission control"). `access_log` is the
+ * ring its access log records go through, if there is a log.
+ * `websocket_zlib` compresses its WebSocket messages, `channels` holds
+ * its WebSocket subscribers by channel and `hub` the inboxes broadcasts
+ * reach every reactor through, `fanout` is scratch space for delivering
+ * one, see "WebSockets". `draining` is set once the
+ * reactor stopped accepting to shut down, it then closes connections
+ * instead of keeping them alive until `drain_deadline`.
+ */
+struct Reactor
+{
+    int id = 0;
+    int listen_fd = -1;
+    EventLoop *loop = nullptr;
+    const ServerConfig *config = nullptr;
+    const Router *router = nullptr;
+    CompressorPool compressors;
+    std::unordered_map<int, Connection> connections;
+    std::vector<iovec> iov;
+    HttpRequest request;
+    RouteParams params;
+    ResponseCache responses;
+    FileCache files;
+    std::string path;
+    BufferPool buffers;
+    TimerWheel timers;
+    ReactorMetrics *metrics = nullptr;
+    std::string stream_input;
+    std::string tls_record;
+    WorkerPool *workers = nullptr;
+    TaskCompletions completed;
+    FramePool frames;
+    std::vector<AsyncPromise *> ready;
+    UpstreamPool upstreams;
+    HttpCache cache;
+    ClientLimiter limiter;
+    std::atomic<int> *open_connections = nullptr;
+    AccessLogRing *access_log = nullptr;
+    WebSocketZlib websocket_zlib;
+    std::unordered_map<std::string, std::unordered_set<Connection *>> channels;
+    WebSocketHub *hub = nullptr;
+    std::vector<Connection *> fanout;
+    bool draining = false;
+    long drain_deadline = 0;
+};
+
+/**
+ * Which timeout a connection's deadline currently is
+ */
+enum ConnectionTimer : uint8_t
+{
+    TIMER_NONE,
+    TIMER_IDLE,
+    TIMER_HEADER,
+    TIMER_BODY,
+    TIMER_SEND,
+    TIMER_WAKE,
+};
+
+/**
+ * Coroutine handlers
+ *
+ * An `AsyncHandler` is a C++20 coroutine that answers a request. It can
+ * wait without blocking the reactor and without callbacks:
+ *
+ *  - `co_await async_read(piece)` hands out the next piece of the request
+ *    body and is `false` once the body ended
+ *  - `co_await async_write(bytes)` adds to a body begun with
+ *    `start_async_stream()`, it only waits while the client is behind
+ *  - `co_await async_sleep(ms)` waits on the connection's timer, in the
+ *    timer wheel's 100 ms ticks
+ *  - `co_await async_offload(task)` runs a `BlockingTask` that lives in
+ *    the coroutine on the worker pool
+ *
+ * Plain answers are queued with the usual helpers, at any point. The
+ * request and the route parameters are views into buffers that are
+ * reused once the coroutine first waits, whatever it needs from them
+ * later has to be copied before that.
+ *
+ * Coroutines run on their reactor's thread and nowhere else. Whatever
+ * they wait for only marks them ready (`wake_coroutine()`), the reactor
+ * resumes the ready ones after each round of events, so a coroutine
+ * never runs inside the code that woke it. While it runs its connection
+ * reads no further requests, and it only reads on in the body when the
+ * coroutine asks for more.
+ *
+ * `waiting` is what the coroutine waits for. `body` is what arrived of
+ * the body and was not read yet, `reader` where it comes from, `stream`
+ * the body being written. `conn` is `nullptr` when the connection went
+ * away while a task of the coroutine's own was out in the pool, the
+ * frame holds that task and is only destroyed once it is back.
+ */
+enum AsyncWait : uint8_t
+{
+    ASYNC_RUNNING,
+    ASYNC_BODY,
+    ASYNC_WRITE,
+    ASYNC_TIMER,
+    ASYNC_TASK,
+    ASYNC_UPSTREAM,
+};
+
+struct AsyncStream;
+struct CoroutineBody;
+
+struct Async
+{
+    using promise_type = AsyncPromise;
+    std::coroutine_handle<AsyncPromise> handle;
+};
+
+struct AsyncPromise
+{
+    Reactor *reactor = nullptr;
+    Connection *conn = nullptr;
+    AsyncWait waiting = ASYNC_RUNNING;
+    bool ready = false;
+    bool keep_alive = false;
+    bool body_done = true;
+    uint64_t request_start = 0;
+    std::string body;
+    CoroutineBody *reader = nullptr;
+    AsyncStream *stream = nullptr;
+
+    /* The frame comes from the pool of the reactor the handler is called on */
+    static void *operator new(size_t size, Reactor &reactor, Connection &, const HttpRequest &, const RouteParams &,
+                              bool) noexcept
+    {
+        return allocate_frame(reactor.frames, size);
+    }
+
+    static void operator delete(void *frame, size_t)
+    {
+        release_frame(frame);
+    }
+
+    static Async get_return_object_on_allocation_failure()
+    {
+        return Async();
+    }
+
+    Async get_return_object()
+    {
+        return Async{std::coroutine_handle<AsyncPromise>::from_promise(*this)};
+    }
+
+    std::suspend_always initial_suspend() noexcept
+    {
+        return {};
+    }
+
+    std::suspend_always final_suspend() noexcept
+    {
+        return {};
+    }
+
+    void return_void() {}
+
+    void unhandled_exception()
+    {
+        std::terminate();
+    }
+};
+
+void wake_coroutine(AsyncPromise &coroutine)
+{
+    if (coroutine.ready)
+        return;
+    coroutine.ready = true;
+    coroutine.reactor->ready.push_back(&coroutine);
+}
+
+/**
+ * The body of a coroutine's request, kept until the coroutine reads it
+ */
+struct CoroutineBody : RequestBody
+{
+    AsyncPromise *coroutine = nullptr;
+
+    bool write(const char *data, size_t size) override
+    {
+        if (coroutine == nullptr)
+            return true;
+        coroutine->body.append(data, size);
+        if (coroutine->waiting == ASYNC_BODY)
+            wake_coroutine(*coroutine);
+        return true;
+    }
+
+    void finish(Reactor &, Connection &, bool) override
+    {
+        if (coroutine == nullptr)
+            return;
+        coroutine->body_done = true;
+        coroutine->reader = nullptr;
+        if (coroutine->waiting == ASYNC_BODY)
+            wake_coroutine(*coroutine);
+    }
+};
+
+/**
+ * A coroutine's response body, what `async_write()` added until the
+ * reactor sends it. Produces nothing while the coroutine has nothing
+ * new, and ends once the coroutine returned and everything went out.
+ */
+struct AsyncStream : ResponseStream
+{
+    AsyncPromise *coroutine = nullptr;
+    std::string pending;
+
+    bool produce(std::string &out, size_t limit) override
+    {
+        size_t size = std::min(limit, pending.size());
+        out.append(pending, 0, size);
+        pending.erase(0, size);
+        if (coroutine == nullptr)
+            return !pending.empty();
+        if (coroutine->waiting == ASYNC_WRITE && pending.size() < STREAM_MAX_PENDING / 2)
+            wake_coroutine(*coroutine);
+        return true;
+    }
+};
+
+/**
+ * Free a coroutine's frame, whatever it waited for forgets it
+ */
+void destroy_coroutine(Reactor &reactor, AsyncPromise &coroutine)
+{
+    if (coroutine.ready)
+        std::replace(reactor.ready.begin(), reactor.ready.end(), &coroutine, (AsyncPromise *)nullptr);
+    if (coroutine.reader != nullptr)
+        coroutine.reader->coroutine = nullptr;
+    if (coroutine.stream != nullptr)
+        coroutine.stream->coroutine = nullptr;
+    std::coroutine_handle<AsyncPromise>::from_promise(coroutine).destroy();
+}
+
+struct AsyncRead
+{
+    std::string &piece;
+    AsyncPromise *coroutine = nullptr;
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    bool await_suspend(std::coroutine_handle<AsyncPromise> handle)
+    {
+        coroutine = &handle.promise();
+        if (!coroutine->body.empty() || coroutine->body_done)
+            return false;
+        coroutine->waiting = ASYNC_BODY;
+        return true;
+    }
+
+    bool await_resume()
+    {
+        piece.clear();
+        piece.swap(coroutine->body);
+        return !piece.empty() || !coroutine->body_done;
+    }
+};
+
+struct AsyncWrite
+{
+    std::string_view bytes;
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    bool await_suspend(std::coroutine_handle<AsyncPromise> handle)
+    {
+        AsyncPromise &coroutine = handle.promise();
+        if (coroutine.stream == nullptr)
+            return false;
+        coroutine.stream->pending.append(bytes.data(), bytes.size());
+        if (coroutine.stream->pending.size() < STREAM_MAX_PENDING)
+            return false;
+        coroutine.waiting = ASYNC_WRITE;
+        return true;
+    }
+
+    void await_resume() {}
+};
+
+struct AsyncSleep
+{
+    long ms;
+
+    bool await_ready() const noexcept
+    {
+        return ms <= 0;
+    }
+
+    void await_suspend(std::coroutine_handle<AsyncPromise> handle)
+    {
+        AsyncPromise &coroutine = handle.promise();
+        Connection &conn = *coroutine.conn;
+        coroutine.waiting = ASYNC_TIMER;
+        conn.timer_kind = TIMER_WAKE;
+        set_timer(coroutine.reactor->timers, conn.timer, ms, monotonic_milliseconds());
+    }
+
+    void await_resume() {}
+};
+
+struct AsyncOffload
+{
+    BlockingTask &task;
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<AsyncPromise> handle)
+    {
+        AsyncPromise &coroutine = handle.promise();
+        Reactor &reactor = *coroutine.reactor;
+        coroutine.waiting = ASYNC_TASK;
+        task.conn = coroutine.conn;
+        task.done = &reactor.completed;
+        task.resumes = &coroutine;
+        coroutine.conn->task = &task;
+        add_metric(reactor.metrics->tasks_offloaded);
+        reactor.completed.pending++;
+        submit_task(*reactor.workers, &task);
+    }
+
+    void await_resume() {}
+};
+
+AsyncRead async_read(std::string &piece)
+{
+    return AsyncRead{piece};
+}
+
+/* The bytes are copied, they need not outlive the call */
+AsyncWrite async_write(std::string_view bytes)
+{
+    return AsyncWrite{bytes};
+}
+
+AsyncSleep async_sleep(long ms)
+{
+    return AsyncSleep{ms};
+}
+
+AsyncOffload async_offload(BlockingTask &task)
+{
+    return AsyncOffload{task};
+}
+
+/**
+ * Whether `conn` stops reading for its coroutine handler: the requests
+ * after the coroutine's wait until it returned, and its body waits once
+ * the coroutine has plenty left to read
+ */
+bool held_by_coroutine(const Connection &conn)
+{
+    return conn.coroutine != nullptr && (conn.body == nullptr || conn.in.length >= BODY_READ_SIZE);
+}
+
+/**
+ * Whether `conn` stops reading until the server got further with it: its
+ * blocking task works, its coroutine handler holds it, or its request
+ * waits for a response cache fill
+ */
+bool held_by_server(const Connection &conn)
+{
+    return conn.task != nullptr || held_by_coroutine(conn) || conn.cache_wait != nullptr;
+}
+
+/**
+ * Move the deadline of `conn` to match what it is doing, called whenever
+ * it made progress
+ *
+ *  - a client that has not finished its request head (including one that
+ *    has not sent anything yet on a new connection) gets `header_timeout`
+ *    for the whole head, counted from the first byte: trickling in a
+ *    header every few seconds (slowloris) does not buy more time
+ *  - while a body arrives, or HTTP/2 streams are open, every read or
+ *    write restarts `body_timeout`
+ *  - while a response is written, every write restarts `idle_timeout`
+ *  - while a `BlockingTask` works on its request, a backend answers it
+ *    or it waits for a response cache fill there is no deadline
+ *  - a coroutine handler sleeping in `async_sleep()` has the timer to
+ *    itself until it wakes
+ *  - between requests the connection may stay idle for `idle_timeout`
+ */
+void update_connection_timer(Reactor &reactor, Connection &conn)
+{
+    if (conn.http2_parent != nullptr || conn.timer_kind == TIMER_WAKE)
+        return;
+    if (conn.task != nullptr || conn.cache_wait != nullptr ||
+        (conn.coroutine != nullptr && conn.coroutine->waiting == ASYNC_UPSTREAM))
+    {
+        /* The wait for a task, a backend or a cache fill is ours, not the client's */
+        cancel_timer(reactor.timers, conn.timer);
+        conn.timer_kind = TIMER_NONE;
+        return;
+    }
+
+    const ServerConfig &config = *reactor.config;
+    ConnectionTimer kind;
+    int seconds;
+    if (conn.ws != nullptr)
+    {
+        /* A WebSocket may be silent for good, the ping sent on expiry tells */
+        kind = TIMER_IDLE;
+        seconds = config.websocket_ping;
+    }
+    else if (conn.h2 != nullptr && !conn.h2->streams.empty())
+    {
+        /* Open HTTP/2 streams keep the connection busy like a body in progress */
+        kind = TIMER_BODY;
+        seconds = config.body_timeout;
+    }
+    else if (conn.parser.state != HttpParser::HEAD)
+    {
+        kind = TIMER_BODY;
+        seconds = config.body_timeout;
+    }
+    else if (conn.in.length > 0 || (conn.requests_served == 0 && conn.out.empty()))
+    {
+        /* The head deadline keeps running until the head is complete */
+        if (conn.timer_kind == TIMER_HEADER)
+            return;
+        kind = TIMER_HEADER;
+        seconds = config.header_timeout;
+    }
+    else if (!conn.out.empty())
+    {
+        kind = TIMER_SEND;
+        seconds = config.idle_timeout;
+    }
+    else
+    {
+        kind = TIMER_IDLE;
+        seconds = config.idle_timeout;
+    }
+    conn.timer_kind = kind;
+    set_timer(reactor.timers, conn.timer, seconds * 1000L, monotonic_milliseconds());
+}
+
+/**
+ * Start tracking a freshly accepted client socket, `peer` is the
+ * client's address
+ */
+Connection &open_connection(Reactor &reactor, int client_fd, uint32_t peer)
+{
+    /**
+     * Answers go out as soon as they are queued, and TLS and HTTP/2 write
+     * one record or frame batch at a time: Nagle would hold the second
+     * small write back until the client's delayed ACK, about 40 ms
+     */
+    int one = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    Connection &conn = reactor.connections[client_fd];
+    conn.fd = client_fd;
+    conn.peer = peer;
+    if (reactor.config->max_connections > 0)
+        reactor.open_connections->fetch_add(1, std::memory_order_relaxed);
+    update_connection_timer(reactor, conn);
+    add_metric(reactor.metrics->connections_accepted);
+    return conn;
+}
+
+/**
+ * The value of the field `name` in the complete message `head`, empty
+ * when it has none (the first one counts when there are several)
+ */
+std::string_view head_field(std::string_view head, std::string_view name)
+{
+    size_t eol = head.find("\r\n");
+    for (size_t pos = eol + 2; eol != std::string_view::npos && pos + 2 < head.size(); pos = eol + 2)
+    {
+        eol = head.find("\r\n", pos);
+        if (eol == std::string_view::npos)
+            break;
+        std::string_view line = head.substr(pos, eol - pos);
+        if (line.size() <= name.size() || line[name.size()] != ':' ||
+            strncasecmp(line.data(), name.data(), name.size()) != 0)
+            continue;
+        std::string_view value = line.substr(name.size() + 1);
+        while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+            value.remove_prefix(1);
+        while (!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+            value.remove_suffix(1);
+        return value;
+    }
+    return {};
+}
+
+/**
+ * Whether the `Cache-Control` value `value` has the directive `name`,
+ * `argument` is what follows its `=` (without quotes), if anything
+ */
+bool cache_directive(std::string_view value, std::string_view name, std::string_view &argument)
+{
+    size_t i = 0;
+    while (i < value.size())
+    {
+        while (i < value.size() && (value[i] == ' ' || value[i] == '\t' || value[i] == ','))
+            ++i;
+        size_t begin = i;
+        while (i < value.size() && value[i] != ',')
+            ++i;
+        std::string_view directive = value.substr(begin, i - begin);
+        while (!directive.empty() && (directive.back() == ' ' || directive.back() == '\t'))
+            directive.remove_suffix(1);
+        if (directive.size() < name.size() || strncasecmp(directive.data(), name.data(), name.size()) != 0)
+            continue;
+        if (directive.size() == name.size())
+        {
+            argument = {};
+            return true;
+        }
+        if (directive[name.size()] != '=')
+            continue;
+        argument = directive.substr(name.size() + 1);
+        if (argument.size() >= 2 && argument.front() == '"' && argument.back() == '"')
+            argument = argument.substr(1, argument.size() - 2);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * The seconds a `max-age` or `s-maxage` directive gives, `-1` when it is
+ * absent or no number. More than a year counts as a year.
+ */
+long cache_directive_seconds(std::string_view value, std::string_view name)
+{
+    std::string_view argument;
+    if (!cache_directive(value, name, argument) || argument.empty())
+        return -1;
+    long seconds = 0;
+    for (char c : argument)
+    {
+        if (c < '0' || c > '9')
+            return -1;
+        seconds = std::min(seconds * 10 + (c - '0'), 365L * 24 * 3600);
+    }
+    return seconds;
+}
+
+/* Take `answer` off the clock and free it, its target's variants no longer list it */
+void drop_answer(HttpCache &cache, CachedAnswer *answer)
+{
+    if (cache.hand == answer->position)
+        ++cache.hand;
+    cache.clock.erase(answer->position);
+    cache.size -= answer->size;
+    delete answer;
+}
+
+void evict_answer(HttpCache &cache, CachedAnswer *answer)
+{
+    auto it = cache.answers.find(answer->target);
+    std::vector<CachedAnswer *> &variants = it->second;
+    variants.erase(std::find(variants.begin(), variants.end(), answer));
+    if (variants.empty())
+        cache.answers.erase(it);
+    drop_answer(cache, answer);
+}
+
+/**
+ * Evict entries in CLOCK order until `size` more bytes fit the budget,
+ * see "Response caching"
+ */
+void make_room(HttpCache &cache, size_t size, long now)
+{
+    while (!cache.clock.empty() && cache.size + size > cache.budget)
+    {
+        if (cache.hand == cache.clock.end())
+            cache.hand = cache.clock.begin();
+        CachedAnswer *answer = *cache.hand;
+        if (answer->referenced && answer->expires > now)
+        {
+            answer->referenced = false;
+            ++cache.hand;
+        }
+        else
+        {
+            evict_answer(cache, answer);
+        }
+    }
+}
+
+/**
+ * Work out whether the answer `fill` captured may be kept, and if so
+ * fill in `answer` and its time to live
+ */
+bool parse_cacheable(CacheFill &fill, CachedAnswer &answer, long &seconds)
+{
+    std::string_view captured = fill.captured;
+    size_t end = captured.find("\r\n\r\n");
+    if (!fill.storable || end == std::string_view::npos || captured.compare(0, 9, "HTTP/1.1 ") != 0 || end < 12)
+        return false;
+    int status = atoi(captured.data() + 9);
+    if (status != 200 && status != 203 && status != 300 && status != 301 && status != 404 && status != 410)
+        return false;
+
+    std::string_view head = captured.substr(0, end + 2);
+    size_t eol = head.find("\r\n");
+    answer.status_line.assign(head.data(), eol + 2);
+    long length = -1;
+    long max_age = -1;
+    long shared_max_age = -1;
+    std::string_view vary;
+    for (size_t pos = eol + 2; pos < head.size(); pos = eol + 2)
+    {
+        eol = head.find("\r\n", pos);
+        std::string_view line = head.substr(pos, eol - pos);
+        size_t colon = line.find(':');
+        if (colon == std::string_view::npos)
+            return false;
+        std::string_view name = line.substr(0, colon);
+        std::string_view value = line.substr(colon + 1);
+        while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+            value.remove_prefix(1);
+        while (!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+            value.remove_suffix(1);
+        std::string_view argument;
+        auto is = [&](const char *field) {
+            return name.size() == strlen(field) && strncasecmp(name.data(), field, name.size()) == 0;
+        };
+        if (is("Transfer-Encoding") || is("Set-Cookie"))
+            return false;
+        if (is("Connection") || is("Keep-Alive") || is("Date") || is("Age"))
+            continue;
+        if (is("Content-Length"))
+        {
+            length = parse_content_length(value);
+        }
+        else if (is("Vary"))
+        {
+            if (header_value_has_token(value, "*"))
+                return false;
+            vary = value;
+        }
+        else if (is("Cache-Control"))
+        {
+            if (cache_directive(value, "no-store", argument) || cache_directive(value, "no-cache", argument) ||
+                cache_directive(value, "private", argument))
+                return false;
+            max_age = cache_directive_seconds(value, "max-age");
+            shared_max_age = cache_directive_seconds(value, "s-maxage");
+        }
+        answer.fields.append(line.data(), line.size());
+        answer.fields += "\r\n";
+    }
+    seconds = shared_max_age != -1 ? shared_max_age : max_age;
+    if (seconds <= 0 || length < 0 || (size_t)length != captured.size() - end - 4)
+        return false;
+
+    /* The request's own values of the fields the answer varies by pick it */
+    size_t i = 0;
+    while (i < vary.size())
+    {
+        while (i < vary.size() && (vary[i] == ' ' || vary[i] == '\t' || vary[i] == ','))
+            ++i;
+        size_t begin = i;
+        while (i < vary.size() && vary[i] != ',' && vary[i] != ' ' && vary[i] != '\t')
+            ++i;
+        if (i > begin)
+        {
+            std::string_view name = vary.substr(begin, i - begin);
+            answer.vary.emplace_back(std::string(name), std::string(head_field(fill.request_head, name)));
+        }
+    }
+    fill.captured.erase(0, end + 4);
+    answer.body = std::make_shared<const std::string>(std::move(fill.captured));
+    return true;
+}
+
+/**
+ * Keep the answer `fill` captured, or a `pass` entry for its target when
+ * it may not be kept. It replaces the entry for the same variant, a pass
+ * entry replaces them all.
+ */
+void store_answer(HttpCache &cache, CacheFill &fill)
+{
+    long now = monotonic_milliseconds();
+    CachedAnswer *answer = new CachedAnswer;
+    long seconds = 0;
+    if (!parse_cacheable(fill, *answer, seconds))
+    {
+        *answer = CachedAnswer();
+        answer->pass = true;
+    }
+    answer->target = fill.target;
+    answer->stored = now;
+    answer->expires = now + (answer->pass ? RESPONSE_CACHE_PASS_MS : seconds * 1000);
+    answer->size = sizeof(CachedAnswer) + answer->target.size() + answer->status_line.size() + answer->fields.size() +
+                   (answer->body != nullptr ? answer->body->size() : 0);
+    for (const auto &field : answer->vary)
+        answer->size += field.first.size() + field.second.size();
+
+    auto it = cache.answers.find(answer->target);
+    if (it != cache.answers.end())
+    {
+        std::vector<CachedAnswer *> &variants = it->second;
+        for (size_t i = 0; i < variants.size();)
+        {
+            CachedAnswer *old = variants[i];
+            if (!answer->pass && !old->pass && old->vary != answer->vary)
+            {
+                ++i;
+                continue;
+            }
+            variants[i] = variants.back();
+            variants.pop_back();
+            drop_answer(cache, old);
+        }
+        if (variants.empty())
+            cache.answers.erase(it);
+    }
+    make_room(cache, answer->size, now);
+    cache.answers[answer->target].push_back(answer);
+    answer->position = cache.clock.insert(cache.hand, answer);
+    cache.size += answer->size;
+}
+
+/**
+ * The response `conn` filled the cache with is complete, or abandoned
+ * because the connection went away. The requests that waited for it go
+ * on from `wake_cache_waiters()`.
+ */
+void end_fill(Reactor &reactor, Connection &conn, bool complete)
+{
+    CacheFill *fill = conn.cache_fill;
+    conn.cache_fill = nullptr;
+    reactor.cache.fills.erase(fill->target);
+    if (complete)
+        store_answer(reactor.cache, *fill);
+    if (fill->waiters.empty())
+        delete fill;
+    else
+        reactor.cache.done.push_back(fill);
+}
+
+/**
+ * Start the access log record of the request `req` just read on `conn`,
+ * one whose head started it already keeps it
+ */
+void begin_access(Reactor &reactor, Connection &conn, const HttpRequest &req)
+{
+    AccessRecord &record = conn.access;
+    if (reactor.access_log == nullptr || record.started != 0)
+        return;
+    record = AccessRecord();
+    record.started = monotonic_nanoseconds();
+    record.peer = conn.http2_parent != nullptr ? conn.http2_parent->peer : conn.peer;
+    record.version = conn.http2_parent != nullptr ? 20 : (uint8_t)(10 + req.version_minor);
+    memcpy(record.method, req.method.data(), std::min(req.method.size(), sizeof(record.method)));
+    size_t length = std::min(req.target.size(), sizeof(record.target));
+    memcpy(record.target, req.target.data(), length);
+    record.target_len = (uint8_t)length;
+    record.truncated = length < req.target.size();
+}
+
+/* Count bytes queued for the answer `conn.access` records, the status is the first final one */
+void note_access(Connection &conn, const char *data, size_t size)
+{
+    AccessRecord &record = conn.access;
+    record.bytes += size;
+    if (record.status < 200 && size >= 12 && memcmp(data, "HTTP/1.", 7) == 0)
+        record.status = (uint16_t)((data[9] - '0') * 100 + (data[10] - '0') * 10 + (data[11] - '0'));
+}
+
+/**
+ * The answer `conn.access` records is queued, or never will be: hand the
+ * record to the log thread, or count it as dropped when its ring has no
+ * room for it
+ */
+void end_access(Reactor &reactor, Connection &conn)
+{
+    AccessRecord &record = conn.access;
+    if (record.started == 0)
+        return;
+    record.duration_us = (uint32_t)std::min<uint64_t>((monotonic_nanoseconds() - record.started) / 1000, UINT32_MAX);
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    record.time_ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+    AccessLogRing &ring = *reactor.access_log;
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    if (head - ring.tail_seen >= ACCESS_LOG_RING / 2)
+        ring.tail_seen = ring.tail.load(std::memory_order_acquire);
+    uint64_t queued = head - ring.tail_seen;
+    bool keep = queued < ACCESS_LOG_RING;
+    if (keep && reactor.config->access_log_sample && queued >= ACCESS_LOG_RING / 2)
+        keep = ring.offered++ % ACCESS_LOG_SAMPLE == 0;
+    if (keep)
+    {
+        ring.records[head % ACCESS_LOG_RING] = record;
+        ring.head.store(head + 1, std::memory_order_release);
+    }
+    else
+    {
+        add_metric(reactor.metrics->access_log_dropped);
+    }
+    record.started = 0;
+}
+
+/**
+ * Give back everything a connection holds: its buffers, its queued
+ * output, the bodies in progress and the streams of its HTTP/2 session.
+ * A task still out in the pool finds no connection when it comes back,
+ * a coroutine handler waiting for it is destroyed once it did. A cache
+ * fill it was answering is abandoned.
+ */
+void release_connection(Reactor &reactor, Connection &conn)
+{
+    cancel_timer(reactor.timers, conn.timer);
+    if (conn.coroutine != nullptr)
+    {
+        AsyncPromise &coroutine = *conn.coroutine;
+        conn.coroutine = nullptr;
+        if (conn.task != nullptr && conn.task->resumes == &coroutine)
+        {
+            /* The task lives in the frame, the body and the stream go below */
+            coroutine.conn = nullptr;
+            coroutine.reader = nullptr;
+            coroutine.stream = nullptr;
+        }
+        else
+        {
+            destroy_coroutine(reactor, coroutine);
+        }
+    }
+    if (conn.task != nullptr)
+    {
+        conn.task->conn = nullptr;
+        conn.task = nullptr;
+    }
+    if (conn.cache_fill != nullptr)
+        end_fill(reactor, conn, false);
+    end_access(reactor, conn);
+    if (conn.cache_wait != nullptr)
+    {
+        std::vector<Connection *> &waiters = conn.cache_wait->waiters;
+        waiters.erase(std::find(waiters.begin(), waiters.end(), &conn));
+        conn.cache_wait = nullptr;
+    }
+    release_input(reactor.buffers, conn.in);
+    while (!conn.out.empty())
+        pop_output(reactor.buffers, conn.out);
+    delete conn.stream;
+    conn.stream = nullptr;
+    delete conn.body;
+    conn.body = nullptr;
+    if (conn.h2 != nullptr)
+    {
+        for (auto &entry : conn.h2->streams)
+            release_connection(reactor, entry.second->conn);
+        delete conn.h2;
+        conn.h2 = nullptr;
+    }
+    if (conn.ws != nullptr)
+    {
+        for (const std::string &name : conn.ws->channels)
+        {
+            auto channel = reactor.channels.find(name);
+            channel->second.erase(&conn);
+            if (channel->second.empty())
+                reactor.channels.erase(channel);
+        }
+        delete conn.ws;
+        conn.ws = nullptr;
+    }
+}
+
+/**
+ * Forget a connection whose socket is closed, its buffers go back to the pool
+ */
+void erase_connection(Reactor &reactor, int client_fd)
+{
+    auto it = reactor.connections.find(client_fd);
+    if (it == reactor.connections.end())
+        return;
+    Connection &conn = it->second;
+    release_connection(reactor, conn);
+    SSL_free(conn.tls);
+    reactor.connections.erase(it);
+    if (reactor.config->max_connections > 0)
+        reactor.open_connections->fetch_sub(1, std::memory_order_relaxed);
+    add_metric(reactor.metrics->connections_closed);
+}
+
+/**
+ * Decide whether the client just accepted on `client_fd` from `peer`
+ * may stay, see "Admission control". One that may not gets its `503` or
+ * `429` right away and is closed before it ever became a `Connection`.
+ */
+bool admit_client(Reactor &reactor, int client_fd, uint32_t peer)
+{
+    const ServerConfig &config = *reactor.config;
+    StaticResponseId refusal;
+    if (config.max_connections > 0 &&
+        reactor.open_connections->load(std::memory_order_relaxed) >= config.max_connections)
+    {
+        refusal = RESPONSE_SERVICE_UNAVAILABLE;
+        add_metric(reactor.metrics->connections_refused);
+    }
+    else if (config.rate_limit > 0 && !take_token(reactor.limiter, peer, monotonic_milliseconds()))
+    {
+        refusal = RESPONSE_TOO_MANY_REQUESTS;
+        add_metric(reactor.metrics->requests_limited);
+    }
+    else
+    {
+        return true;
+    }
+
+    if (config.tls_context == nullptr)
+    {
+        /* Closing on unread input would reset the connection before the client read the answer */
+        char discard[2048];
+        while (recv(client_fd, discard, sizeof(discard), MSG_DONTWAIT) == (ssize_t)sizeof(discard))
+            ;
+        std::string_view response = reactor.responses.get(refusal, false);
+        send(client_fd, response.data(), response.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    ::close(client_fd);
+    return false;
+}
+
+/**
+ * Answers for requests we reject, they all end the connection because
+ * after a framing error we no longer know where the next request starts
+ */
+StaticResponseId error_response_id(int status)
+{
+    switch (status)
+    {
+    case 413:
+        return RESPONSE_PAYLOAD_TOO_LARGE;
+    case 431:
+        return RESPONSE_HEADERS_TOO_LARGE;
+    case 500:
+        return RESPONSE_INTERNAL_ERROR;
+    case 501:
+        return RESPONSE_NOT_IMPLEMENTED;
+    case 505:
+        return RESPONSE_VERSION_NOT_SUPPORTED;
+    default:
+        return RESPONSE_BAD_REQUEST;
+    }
+}
+
+/**
+ * Copy bytes queued for a response the cache is filled with, an answer
+ * outgrowing an eighth of the budget is not kept
+ */
+void capture_output(Reactor &reactor, Connection &conn, const char *data, size_t size)
+{
+    CacheFill &fill = *conn.cache_fill;
+    if (!fill.storable)
+        return;
+    if (fill.captured.size() + size > reactor.cache.budget / 8)
+    {
+        fill.storable = false;
+        std::string().swap(fill.captured);
+        return;
+    }
+    fill.captured.append(data, size);
+}
+
+void queue_static(Reactor &reactor, Connection &conn, std::string_view response)
+{
+    if (conn.cache_fill != nullptr)
+        capture_output(reactor, conn, response.data(), response.size());
+    if (conn.access.started != 0)
+        note_access(conn, response.data(), response.size());
+    OutputChunk *chunk = acquire_chunk(reactor.buffers);
+    chunk->data = response.data();
+    chunk->size = response.size();
+    push_output(conn.out, chunk);
+    conn.out_bytes += response.size();
+}
+
+void queue_owned(Reactor &reactor, Connection &conn, std::string &&bytes)
+{
+    if (conn.cache_fill != nullptr)
+        capture_output(reactor, conn, bytes.data(), bytes.size());
+    if (conn.access.started != 0)
+        note_access(conn, bytes.data(), bytes.size());
+    OutputChunk *chunk = acquire_chunk(reactor.buffers);
+    chunk->size = bytes.size();
+    chunk->owned = std::move(bytes);
+    conn.out_bytes += chunk->size;
+    push_output(conn.out, chunk);
+}
+
+void queue_shared(Reactor &reactor, Connection &conn, const std::shared_ptr<const std::string> &bytes)
+{
+    if (conn.cache_fill != nullptr)
+        capture_output(reactor, conn, bytes->data(), bytes->size());
+    if (conn.access.started != 0)
+        note_access(conn, bytes->data(), bytes->size());
+    OutputChunk *chunk = acquire_chunk(reactor.buffers);
+    chunk->data = bytes->data();
+    chunk->size = bytes->size();
+    chunk->shared = bytes;
+    conn.out_bytes += chunk->size;
+    push_output(conn.out, chunk);
+}
+
+void queue_file(Reactor &reactor, Connection &conn, const std::shared_ptr<CachedFile> &file, off_t offset,
+                size_t size)
+{
+    /* Files have a cache of their own */
+    if (conn.cache_fill != nullptr)
+        conn.cache_fill->storable = false;
+    conn.access.bytes += size;
+    OutputChunk *chunk = acquire_chunk(reactor.buffers);
+    chunk->size = size;
+    chunk->file = file;
+    chunk->file_offset = offset;
+    conn.out_bytes += size;
+    push_output(conn.out, chunk);
+}
+
+/**
+ * Answer with the error response for `status` and close the connection,
+ * whatever input is left can not be trusted anymore
+ */
+void reject_request(Reactor &reactor, Connection &conn, int status)
+{
+    queue_static(reactor, conn, reactor.responses.get(error_response_id(status), false));
+    end_access(reactor, conn);
+    add_metric(reactor.metrics->parse_errors);
+    conn.closing = true;
+    release_input(reactor.buffers, conn.in);
+    conn.parser.reset();
+    delete conn.body;
+    conn.body = nullptr;
+    update_connection_timer(reactor, conn);
+}
+
+/**
+ * Answer `429` to a request whose client is over its rate limit and
+ * close the connection, see "Admission control"
+ */
+void limit_request(Reactor &reactor, Connection &conn)
+{
+    queue_static(reactor, conn, reactor.responses.get(RESPONSE_TOO_MANY_REQUESTS, false));
+    end_access(reactor, conn);
+    add_metric(reactor.metrics->requests_limited);
+    conn.closing = true;
+    release_input(reactor.buffers, conn.in);
+    conn.parser.reset();
+    delete conn.body;
+    conn.body = nullptr;
+    update_connection_timer(reactor, conn);
+}
+
+/* Whether the client behind `conn` may send another request, a stream's client is its parent's */
+bool within_rate_limit(Reactor &reactor, const Connection &conn)
+{
+    if (reactor.config->rate_limit == 0)
+        return true;
+    const Connection &client = conn.http2_parent != nullptr ? *conn.http2_parent : conn;
+    return take_token(reactor.limiter, client.peer, monotonic_milliseconds());
+}
+
+/**
+ * Begin a streamed response: queue the head and attach `stream` to `conn`,
+ * `process_requests()` then pulls the body out of it
+ *
+ * HTTP/1.1 clients get the body in chunked encoding. An HTTP/1.0 client
+ * does not know chunks, it gets the plain body and the connection closes
+ * after it, and so does an HTTP/2 stream, whose DATA frames end with the
+ * stream instead. A `HEAD` gets the head alone. A compressible body is
+ * compressed on the fly with one of the reactor's compressors.
+ */
+void start_stream(Reactor &reactor, Connection &conn, const HttpRequest &req, bool keep_alive,
+                  const char *status, const char *content_type, std::unique_ptr<ResponseStream> stream)
+{
+    bool head_only = req.method == "HEAD";
+    bool chunked = req.version_minor >= 1 && conn.http2_parent == nullptr;
+    if (!chunked && !head_only)
+        keep_alive = false;
+
+    const CompressionRule *rule = compression_rule(*reactor.config, content_type);
+    Encoding encoding = rule != nullptr ? negotiate_encoding(req, *rule) : ENCODING_IDENTITY;
+    if (encoding != ENCODING_IDENTITY && !head_only)
+    {
+        stream->compressor = acquire_compressor(reactor.compressors);
+        if (!stream->compressor->begin(encoding, rule->levels[encoding], 0))
+        {
+            release_compressor(reactor.compressors, std::move(stream->compressor));
+            encoding = ENCODING_IDENTITY;
+        }
+    }
+
+    std::string head = std::string("HTTP/1.1 ") + status + "\r\nContent-Type: " + content_type + "\r\n";
+    if (chunked)
+        head += "Transfer-Encoding: chunked\r\n";
+    if (encoding != ENCODING_IDENTITY)
+        head += std::string("Content-Encoding: ") + encoding_names[encoding] + "\r\n";
+    if (rule != nullptr)
+        head += "Vary: Accept-Encoding\r\n";
+    head += keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+    head += "Date: ";
+    head.append(reactor.responses.date, HTTP_DATE_SIZE);
+    head += "\r\n\r\n";
+    queue_owned(reactor, conn, std::move(head));
+    if (head_only)
+        return;
+
+    stream->chunked = chunked;
+    stream->keep_alive = keep_alive;
+    conn.stream = stream.release();
+}
+
+/**
+ * Let `conn.stream` produce until `STREAM_MAX_PENDING` bytes are queued
+ *
+ * Every chunk is produced straight into the string that is queued, behind
+ * room for a fixed width size line that is filled in afterwards (leading
+ * zeros are allowed in a chunk size), a compressed body is produced into
+ * `stream_input` first and compressed into it. Returns `true` once the
+ * stream ended, the last chunk then carries the request's start time for
+ * the latency histogram.
+ */
+bool pump_stream(Reactor &reactor, Connection &conn)
+{
+    static const char last_chunk[] = "0\r\n\r\n";
+    ResponseStream &stream = *conn.stream;
+    size_t prefix = stream.chunked ? 10 : 0;
+    bool more = true;
+    while (more && conn.out_bytes < STREAM_MAX_PENDING)
+    {
+        std::string bytes;
+        bytes.reserve(prefix + STREAM_CHUNK_SIZE + sizeof(last_chunk) + 2);
+        if (stream.chunked)
+            bytes = "00000000\r\n";
+        if (stream.compressor == nullptr)
+        {
+            more = stream.produce(bytes, STREAM_CHUNK_SIZE);
+        }
+        else
+        {
+            std::string &input = reactor.stream_input;
+            input.clear();
+            more = stream.produce(input, STREAM_CHUNK_SIZE);
+            if (!stream.compressor->compress(input.data(), input.size(), !more, bytes))
+            {
+                /* Ending the body here would pass off a truncated one as complete */
+                delete conn.stream;
+                conn.stream = nullptr;
+                conn.closing = true;
+                return true;
+            }
+        }
+
+        size_t produced = stream.compressor == nullptr ? bytes.size() - prefix : reactor.stream_input.size();
+        size_t size = bytes.size() - prefix;
+        if (size == 0)
+        {
+            bytes.clear();
+        }
+        else if (stream.chunked)
+        {
+            char hex[9];
+            snprintf(hex, sizeof(hex), "%08x", (unsigned)size);
+            memcpy(&bytes[0], hex, 8);
+            bytes += "\r\n";
+        }
+        if (!more && stream.chunked)
+            bytes += last_chunk;
+        if (!bytes.empty())
+            queue_owned(reactor, conn, std::move(bytes));
+        if (produced == 0 && more)
+            break;
+    }
+    if (more)
+        return false;
+
+    if (stream.compressor != nullptr)
+        release_compressor(reactor.compressors, std::move(stream.compressor));
+    if (conn.out.tail != nullptr)
+        conn.out.tail->request_start = stream.request_start;
+    if (!stream.keep_alive)
+        conn.closing = true;
+    delete conn.stream;
+    conn.stream = nullptr;
+    if (conn.cache_fill != nullptr)
+        end_fill(reactor, conn, true);
+    end_access(reactor, conn);
+    return true;
+}
+
+/**
+ * Read all of `file` into `raw`, `false` when it came up short
+ */
+bool read_whole_file(const CachedFile &file, std::string &raw)
+{
+    raw.assign(file.size, '\0');
+    for (size_t done = 0; done < raw.size();)
+    {
+        ssize_t count = pread(file.fd, &raw[done], raw.size() - done, done);
+        if (count == -1 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return false;
+        done += count;
+    }
+    return true;
+}
+
+/**
+ * Hand `task` to the worker pool with no connection waiting for it, the
+ * reactor calls its `settle` once it is back
+ */
+void detach_task(Reactor &reactor, std::unique_ptr<BlockingTask> task)
+{
+    task->done = &reactor.completed;
+    add_metric(reactor.metrics->tasks_offloaded);
+    reactor.completed.pending++;
+    submit_task(*reactor.workers, task.release());
+}
+
+/**
+ * Compresses a file too large to be compressed on the reactor, with a
+ * compressor of its own as the reactor's pool is not to be shared. The
+ * copy is kept if the file is still cached when the task is back.
+ */
+struct VariantTask : BlockingTask
+{
+    std::shared_ptr<CachedFile> file;
+    Encoding encoding = ENCODING_IDENTITY;
+    int level = 0;
+    std::string compressed;
+    bool ok = false;
+
+    void run() override
+    {
+        std::string raw;
+        if (!read_whole_file(*file, raw))
+            return;
+        CompressionArena arena;
+        Compressor compressor;
+        compressor.arena = &arena;
+        ok = compressor.begin(encoding, level, raw.size()) &&
+             compressor.compress(raw.data(), raw.size(), true, compressed) && compressed.size() < raw.size();
+        compressor.end();
+    }
+
+    /* Never called, no connection waits for the task */
+    void finish(Reactor &, Connection &, bool) override {}
+
+    void settle(Reactor &reactor) override
+    {
+        if (ok && file->cached)
+            store_variant(reactor.files, *file, encoding, std::move(compressed));
+    }
+};
+
+/**
+ * The `encoding` copy of `file`, `nullptr` when there is none (yet). Its
+ * ETag is the file's with the coding appended, so caches never mix up the
+ * two representations.
+ *
+ * The copy is made the first time a client asks for it and kept with the
+ * cached file from then on, unless it would not be smaller. Compressing
+ * megabytes at a high level takes seconds, so only files up to
+ * `COMPRESS_INLINE_MAX` are compressed right away. A larger one goes to a
+ * `VariantTask`, and the file is sent as it is until the copy is there.
+ */
+const FileVariant *compressed_variant(Reactor &reactor, const std::shared_ptr<CachedFile> &file, Encoding encoding,
+                                      int level)
+{
+    FileVariant &variant = file->variants[encoding];
+    if (variant.tried)
+        return variant.body != nullptr ? &variant : nullptr;
+    variant.tried = true;
+    if (reactor.files.byte_budget == 0)
+        return nullptr;
+
+    if (file->size > COMPRESS_INLINE_MAX)
+    {
+        /* Nothing would keep the copy of a file that is not cached */
+        if (!file->cached)
+            return nullptr;
+        auto task = std::make_unique<VariantTask>();
+        task->file = file;
+        task->encoding = encoding;
+        task->level = level;
+        detach_task(reactor, std::move(task));
+        return nullptr;
+    }
+
+    std::string raw;
+    if (!read_whole_file(*file, raw))
+        return nullptr;
+    std::string compressed;
+    std::unique_ptr<Compressor> compressor = acquire_compressor(reactor.compressors);
+    bool ok = compressor->begin(encoding, level, raw.size()) &&
+              compressor->compress(raw.data(), raw.size(), true, compressed);
+    release_compressor(reactor.compressors, std::move(compressor));
+    if (!ok || compressed.size() >= raw.size())
+        return nullptr;
+    return store_variant(reactor.files, *file, encoding, std::move(compressed));
+}
+
+/**
+ * Answer a GET or HEAD for a file under the document root
+ *
+ * Handles the conditional requests a CDN sends to its origin
+ * (`If-None-Match` first, `If-Modified-Since` only without it) and single
+ * byte ranges, including `If-Range`. The head is built per request, the
+ * body is queued as a file chunk and later leaves through `sendfile`.
+ */
+void serve_static_file(Reactor &reactor, Connection &conn, const HttpRequest &req, const RouteParams &,
+                       bool keep_alive)
+{
+    bool head_only = req.method == "HEAD";
+    std::string &path = reactor.path;
+    std::shared_ptr<CachedFile> file;
+    if (resolve_target_path(req.target, path))
+    {
+        long now = monotonic_seconds();
+        file = lookup_file(reactor.files, reactor.config->docroot_fd, path, now);
+        if (file == nullptr && path.size() < PATH_MAX - 11)
+        {
+            struct stat st;
+            if (fstatat(reactor.config->docroot_fd, path.c_str(), &st, 0) == 0 && S_ISDIR(st.st_mode))
+            {
+                path += "/index.html";
+                file = lookup_file(reactor.files, reactor.config->docroot_fd, path, now);
+            }
+        }
+    }
+    if (file == nullptr)
+    {
+        queue_static(reactor, conn, reactor.responses.get(RESPONSE_NOT_FOUND, keep_alive, head_only));
+        return;
+    }
+
+    /* Ranges always refer to the file itself, a range request is never compressed */
+    const HttpHeader *range_header = req.find_header("Range");
+    const CompressionRule *rule = compression_rule(*reactor.config, file->content_type);
+    bool varies = rule != nullptr && file->size >= COMPRESS_MIN_SIZE && file->size <= COMPRESS_MAX_FILE;
+    Encoding encoding = ENCODING_IDENTITY;
+    const FileVariant *variant = nullptr;
+    if (varies && range_header == nullptr)
+    {
+        encoding = negotiate_encoding(req, *rule);
+        if (encoding != ENCODING_IDENTITY)
+            variant = compressed_variant(reactor, file, encoding, rule->levels[encoding]);
+    }
+    const std::string &etag = variant != nullptr ? variant->etag : file->etag;
+
+    const HttpHeader *if_none_match = req.find_header("If-None-Match");
+    const HttpHeader *if_modified_since = req.find_header("If-Modified-Since");
+    bool not_modified = false;
+    if (if_none_match != nullptr)
+        not_modified = etag_matches(if_none_match->value, etag);
+    else if (if_modified_since != nullptr)
+    {
+        time_t since = parse_http_date(if_modified_since->value);
+        not_modified = since != -1 && file->mtime.tv_sec <= since;
+    }
+
+    off_t first = 0;
+    off_t last = file->size - 1;
+    int range = 0;
+    if (!not_modified && range_header != nullptr)
+    {
+        /* `If-Range` turns the range request into a full one when the file changed */
+        const HttpHeader *if_range = req.find_header("If-Range");
+        if (if_range == nullptr || if_range->value == file->etag || if_range->value == file->last_modified)
+            range = parse_byte_range(range_header->value, file->size, first, last);
+    }
+
+    std::string head;
+    head.reserve(320);
+    if (not_modified)
+        head += "HTTP/1.1 304 Not Modified\r\n";
+    else if (range == 1)
+        head += "HTTP/1.1 206 Partial Content\r\n";
+    else if (range == -1)
+        head += "HTTP/1.1 416 Range Not Satisfiable\r\n";
+    else
+        head += "HTTP/1.1 200 OK\r\n";
+
+    size_t body_size = 0;
+    if (range == -1)
+    {
+        head += "Content-Range: bytes */" + std::to_string(file->size) + "\r\n";
+        head += "Content-Length: 0\r\n";
+    }
+    else if (!not_modified)
+    {
+        body_size = variant != nullptr ? variant->body->size() : (size_t)(last - first + 1);
+        head += "Content-Type: ";
+        head += file->content_type;
+        head += "\r\nContent-Length: " + std::to_string(body_size) + "\r\n";
+        if (variant != nullptr)
+            head += std::string("Content-Encoding: ") + encoding_names[encoding] + "\r\n";
+        if (range == 1)
+            head += "Content-Range: bytes " + std::to_string(first) + "-" + std::to_string(last) + "/" +
+                    std::to_string(file->size) + "\r\n";
+        head += "Accept-Ranges: bytes\r\n";
+    }
+    if (varies)
+        head += "Vary: Accept-Encoding\r\n";
+    head += "ETag: " + etag + "\r\n";
+    head += "Last-Modified: " + file->last_modified + "\r\n";
+    head += keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+    head += "Date: ";
+    head.append(reactor.responses.date, HTTP_DATE_SIZE);
+    head += "\r\n\r\n";
+
+    queue_owned(reactor, conn, std::move(head));
+    if (head_only || body_size == 0)
+        return;
+    if (variant != nullptr)
+        queue_shared(reactor, conn, variant->body);
+    else
+        queue_file(reactor, conn, file, first, body_size);
+}
+
+void queue_text(Reactor &reactor, Connection &conn, const char *status, std::string_view body, bool keep_alive,
+                bool head_only, const char *extra_headers)
+{
+    std::string response = std::string("HTTP/1.1 ") + status + "\r\nContent-Type: text/plain\r\nContent-Length: " +
+                           std::to_string(body.size()) + "\r\n" + extra_headers;
+    response += keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+    response += "Date: ";
+    response.append(reactor.responses.date, HTTP_DATE_SIZE);
+    response += "\r\n\r\n";
+    if (!head_only)
+        response.append(body.data(), body.size());
+    queue_owned(reactor, conn, std::move(response));
+}
+
+void serve_health(Reactor &reactor, Connection &conn, const HttpRequest &req, const RouteParams &,
+                  bool keep_alive)
+{
+    queue_static(reactor, conn, reactor.responses.get(RESPONSE_HEALTH, keep_alive, req.method == "HEAD"));
+}
+
+void serve_hello(Reactor &reactor, Connection &conn, const HttpRequest &req, const RouteParams &,
+                 bool keep_alive)
+{
+    queue_static(reactor, conn, reactor.responses.get(RESPONSE_HELLO, keep_alive, req.method == "HEAD"));
+}
+
+/**
+ * `/hello/:name`, greets whoever the last segment names
+ */
+void serve_hello_name(Reactor &reactor, Connection &conn, const HttpRequest &req, const RouteParams &params,
+                      bool keep_alive)
+{
+    std::string body = "Hello, ";
+    std::string_view name = params.get("name");
+    body.append(name.data(), name.size());
+    body += "!";
+    queue_text(reactor, conn, "200 OK", body, keep_alive, req.method == "HEAD");
+}
+
+/**
+ * Answer the request on `conn` from a worker thread, see `BlockingTask`.
+ * `keep_alive` is what the handler was called with.
+ */
+void offload_task(Reactor &reactor, Connection &conn, std::unique_ptr<BlockingTask> task, bool keep_alive)
+{
+    task->conn = &conn;
+    task->done = &reactor.completed;
+    task->keep_alive = keep_alive;
+    conn.task = task.get();
+    add_metric(reactor.metrics->tasks_offloaded);
+    reactor.completed.pending++;
+    submit_task(*reactor.workers, task.release());
+}
+
+/**
+ * `/sleep/:ms` answers after sleeping `ms` milliseconds (at most ten
+ * seconds) on a worker thread, a stand-in for a handler that blocks on a
+ * database or a slow disk
+ */
+struct SleepTask : BlockingTask
+{
+    long ms = 0;
+    bool head_only = false;
+    const char *extra_headers = "";
+
+    void run() override
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+    }
+
+    void finish(Reactor &reactor, Connection &conn, bool keep_alive) override
+    {
+        queue_text(reactor, conn, "200 OK", "slept " + std::to_string(ms) + " ms\n", keep_alive, head_only,
+                   extra_headers);
+    }
+};
+
+void sleep_on_worker(Reactor &reactor, Connection &conn, const HttpRequest &req, const RouteParams &params,
+                     bool keep_alive, const char *extra_headers)
+{
+    std::string_view digits = params.get("ms");
+    long ms = 0;
+    for (char c : digits)
+    {
+        if (c < '0' || c > '9')
+        {
+            queue_static(reactor, conn, reactor.responses.get(RESPONSE_NOT_FOUND, keep_alive, req.method == "HEAD"));
+            return;
+        }
+        ms = std::min(ms * 10 + (c - '0'), 10000L);
+    }
+
+    std::unique_ptr<SleepTask> task(new SleepTask);
+    task->ms = ms;
+    task->head_only = req.method == "HEAD";
+    task->extra_headers = extra_headers;
+    offload_task(reactor, conn, std::move(task), keep_alive);
+}
+
+void serve_sleep(Reactor &reactor, Connection &conn, const HttpRequest &req, const RouteParams &params,
+                 bool keep_alive)
+{
+    sleep_on_worker(reactor, conn, req, params, keep_alive, "");
+}
+
+/**
+ * `/report/:ms` is `/sleep/:ms` with an answer that may be reused for
+ * five seconds, a stand-in for an expensive page the response cache
+ * keeps (see "Response caching")
+ */
+void serve_report(Reactor &reactor, Connection &conn, const HttpRequest &req, const RouteParams &params,
+                  bool keep_alive)
+{
+    sleep_on_worker(reactor, conn, req, params, keep_alive, "Cache-Control: max-age=5\r\n");
+}
+
+/**
+ * Call the coroutine handler for the request on `conn` and run it to its
+ * first wait, see `AsyncPromise`. `keep_alive` is what the handler is
+ * called with, `reader` the body it reads, if any. Returns `false` when
+ * there was no frame for it, the client then got a `503` and the
+ * connection closes.
+ */
+bool start_coroutine(Reactor &reactor, Connection &conn, const HttpRequest &req, bool keep_alive,
+                     AsyncHandler handler, CoroutineBody *reader)
+{
+    Async async = handler(reactor, conn, req, reactor.params, keep_alive);
+    if (!async.handle)
+    {
+        queue_text(reactor, conn, "503 Service Unavailable", "Service Unavailable\n", false, req.method == "HEAD");
+        conn.closing = true;
+        return false;
+    }
+
+    AsyncPromise &coroutine = async.handle.promise();
+    coroutine.reactor = &reactor;
+    coroutine.conn = &conn;
+    coroutine.keep_alive = keep_alive;
+    coroutine.request_start = monotonic_nanoseconds();
+    if (reader != nullptr)
+    {
+        coroutine.body_done = false;
+        coroutine.reader = reader;
+        reader->coroutine = &coroutine;
+    }
+    conn.coroutine = &coroutine;
+    async.handle.resume();
+    if (async.handle.done())
+    {
+        conn.coroutine = nullptr;
+        destroy_coroutine(reactor, coroutine);
+    }
+    else if (conn.stream != nullptr)
+    {
+        pump_stream(reactor, conn);
+    }
+    return true;
+}
+
+/**
+ * Begin the streamed body the calling coroutine adds to with
+ * `async_write()`, before its first wait. The client gets the head alone
+ * for `HEAD`, and `async_write()` then drops the bytes.
+ */
+void start_async_stream(Reactor &reactor, Connection &conn, const HttpRequest &req, bool keep_alive,
+                        const char *status, const char *content_type)
+{
+    AsyncStream *stream = new AsyncStream;
+    start_stream(reactor, conn, req, keep_alive, status, content_type, std::unique_ptr<ResponseStream>(stream));
+    if (conn.stream == nullptr)
+        return;
+    stream->coroutine = conn.coroutine;
+    conn.coroutine->stream = stream;
+}
+
+/**
+ * Begin a body the calling coroutine writes as it goes on the wire,
+ * after it queued the head itself
+ */
+void start_async_relay(Connection &conn, bool keep_alive)
+{
+    AsyncStream *stream = new AsyncStream;
+    stream->chunked = false;
+    stream->keep_alive = keep_alive;
+    stream->coroutine = conn.coroutine;
+    conn.coroutine->stream = stream;
+    conn.stream = stream;
+}
+
+/**
+ * `/countdown/:n` counts down from `n` (at most 100), one line every 100
+ * milliseconds, a coroutine that sleeps between its writes
+ */
+Async serve_countdown(Reactor &reactor, Connection &conn, const HttpRequest &req, const RouteParams &params,
+                      bool keep_alive)
+{
+    long n = 0;
+    for (char c : params.get("n"))
+    {
+        if (c < '0' || c > '9')
+        {
+            queue_static(reactor, conn, reactor.responses.get(RESPONSE_NOT_FOUND, keep_alive, req.method == "HEAD"));
+            co_return;
+        }
+        n = std::min(n * 10 + (c - '0'), 100L);
+    }
+
+    start_async_stream(reactor, conn, req, keep_alive, "200 OK", "text/plain");
+    for (; n > 0; --n)
+    {
+        co_await async_write(std::to_string(n) + "\n");
+        co_await async_sleep(100);
+    }
+    co_await async_write("liftoff\n");
+}
+
+/**
+ * Hashes one piece of a body on a worker thread
+ */
+struct DigestTask : BlockingTask
+{
+    EVP_MD_CTX *digest = nullptr;
+    std::string input;
+
+    void run() override
+    {
+        EVP_DigestUpdate(digest, input.data(), input.size());
+    }
+
+    void finish(Reactor &, Connection &, bool) override {}
+};
+
+/**
+ * `POST /digest` answers with the SHA-256 of the body, a coroutine that
+ * reads the body piece by piece and hashes every piece on the worker pool
+ */
+Async serve_digest(Reactor &reactor, Connection &conn, const HttpRequest &, const RouteParams &,
+                   bool keep_alive)
+{
+    DigestTask task;
+    std::unique_ptr<EVP_MD_CTX, void (*)(EVP_MD_CTX *)> digest(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+    if (digest == nullptr || !EVP_DigestInit_ex(digest.get(), EVP_sha256(), nullptr))
+    {
+        queue_text(reactor, conn, "500 Internal Server Error", "Internal Server Error\n", keep_alive);
+        co_return;
+    }
+    task.digest = digest.get();
+
+    while (co_await async_read(task.input))
+        co_await async_offload(task);
+
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int size = 0;
+    EVP_DigestFinal_ex(digest.get(), hash, &size);
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    for (unsigned int i = 0; i < size; ++i)
+    {
+        hex += digits[hash[i] >> 4];
+        hex += digits[hash[i] & 15];
+    }
+    queue_text(reactor, conn, "200 OK", hex + "\n", keep_alive);
+}
+
+/**
+ * Generated text of a given size, numbered lines of 64 bytes each
+ */
+struct GeneratedStream : ResponseStream
+{
+    uint64_t remaining = 0;
+    uint64_t line = 0;
+
+    bool produce(std::string &out, size_t limit) override
+    {
+        char text[65];
+        while (remaining > 0 && limit > 0)
+        {
+            snprintf(text, sizeof(text), "line %-58llu\n", (unsigned long long)line++);
+            size_t size = (size_t)std::min<uint64_t>({remaining, limit, 64});
+            out.append(text, size);
+            remaining -= size;
+            limit -= size;
+        }
+        return remaining > 0;
+    }
+};
+
+/**
+ * `/stream/:bytes`, a body of `bytes` bytes sent as it is generated, so
+ * its size is only limited by the client's patience
+ */
+void serve_generated_stream(Reactor &reactor, Connection &conn, const HttpRequest &req, const RouteParams &params,
+                            bool keep_alive)
+{
+    std::string_view digits = params.get("bytes");
+    uint64_t bytes = 0;
+    for (char c : digits)
+    {
+        if (c < '0' || c > '9' || bytes > UINT64_MAX / 10 - 1)
+        {
+            queue_static(reactor, conn, reactor.responses.get(RESPONSE_NOT_FOUND, keep_alive, req.method == "HEAD"));
+            return;
+        }
+        bytes = bytes * 10 + (c - '0');
+    }
+
+    std::unique_ptr<GeneratedStream> stream(new GeneratedStream);
+    stream->remaining = bytes;
+    start_stream(reactor, conn, req, keep_alive, "200 OK", "text/plain", std::move(stream));
+}
+
+/**
+ * `/upload` takes a body of any size up to `max_body` and says where it
+ * ended up, an example of a `BodyHandler`
+ */
+struct UploadBody : SpoolBody
+{
+    using SpoolBody::SpoolBody;
+
+    void finish(Reactor &reactor, Connection &conn, bool keep_alive) override
+    {
+        std::string text = "stored " + std::to_string(size) + " bytes " +
+                           (fd == -1 ? "in memory\n" : "in a temporary file\n");
+        queue_text(reactor, conn, "200 OK", text, keep_alive);
+    }
+};
+
+RequestBody *accept_upload(Reactor &reactor, Connection &, const HttpRequest &req, const RouteParams &)
+{
+    return new UploadBody(*reactor.config, req.content_length);
+}
+
+/**
+ * The `Sec-WebSocket-Accept` value for the client's `key`: the base64 of
+ * the SHA-1 of the key followed by `WEBSOCKET_GUID`
+ */
+std::string websocket_accept_key(std::string_view key)
+{
+    std::string input(key);
+    input += WEBSOCKET_GUID;
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int size = 0;
+    if (!EVP_Digest(input.data(), input.size(), hash, &size, EVP_sha1(), nullptr))
+        return "";
+    unsigned char encoded[4 * ((EVP_MAX_MD_SIZE + 2) / 3) + 1];
+    int length = EVP_EncodeBlock(encoded, hash, (int)size);
+    return std::string((const char *)encoded, length);
+}
+
+/**
+ * Compress the message of `size` bytes at `data` on its own into
+ * `zlib.deflated`, `false` when zlib failed or it did not get smaller
+ *
+ * The message is flushed to a byte boundary, which ends it with the
+ * empty stored block `00 00 ff ff`. RFC 7692 has those four bytes left
+ * out on the wire.
+ */
+bool websocket_deflate(WebSocketZlib &zlib, int level, const char *data, size_t size)
+{
+    if (!zlib.deflater_ready)
+    {
+        /* A negative window is raw deflate, without zlib's header and trailer */
+        zlib.deflater_ready = deflateInit2(&zlib.deflater, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+        if (!zlib.deflater_ready)
+            return false;
+    }
+    else if (deflateReset(&zlib.deflater) != Z_OK)
+    {
+        return false;
+    }
+
+    std::string &out = zlib.deflated;
+    out.clear();
+    zlib.deflater.next_in = (Bytef *)data;
+    zlib.deflater.avail_in = (uInt)size;
+    do
+    {
+        size_t used = out.size();
+        size_t room = std::max<size_t>(size / 2, 1024);
+        out.resize(used + room);
+        zlib.deflater.next_out = (Bytef *)&out[used];
+        zlib.deflater.avail_out = (uInt)room;
+        int result = deflate(&zlib.deflater, Z_SYNC_FLUSH);
+        out.resize(used + room - zlib.deflater.avail_out);
+        if (result == Z_STREAM_ERROR)
+            return false;
+    } while (zlib.deflater.avail_out == 0);
+
+    if (out.size() < 4 || memcmp(out.data() + out.size() - 4, "\0\0\xff\xff", 4) != 0)
+        return false;
+    out.resize(out.size() - 4);
+    return out.size() < size;
+}
+
+/**
+ * Decompress a message compressed on its own, `size` bytes at `data`,
+ * into `zlib.inflated`. Returns `0`, or the close code for data that is
+ * not deflate (1007) or grows beyond `limit` bytes (1009).
+ */
+uint16_t websocket_inflate(WebSocketZlib &zlib, const char *data, size_t size, size_t limit)
+{
+    if (!zlib.inflater_ready)
+    {
+        zlib.inflater_ready = inflateInit2(&zlib.inflater, -15) == Z_OK;
+        if (!zlib.inflater_ready)
+            return WS_INTERNAL_ERROR;
+    }
+    else if (inflateReset(&zlib.inflater) != Z_OK)
+    {
+        return WS_INTERNAL_ERROR;
+    }
+
+    /* The four bytes the sender left out, see `websocket_deflate()` */
+    static const unsigned char tail[4] = {0x00, 0x00, 0xff, 0xff};
+    std::string &out = zlib.inflated;
+    out.clear();
+    for (int part = 0; part < 2; ++part)
+    {
+        zlib.inflater.next_in = part == 0 ? (Bytef *)data : (Bytef *)tail;
+        zlib.inflater.avail_in = part == 0 ? (uInt)size : (uInt)sizeof(tail);
+        do
+        {
+            size_t used = out.size();
+            size_t room = std::min(std::max<size_t>(size * 2, 4096), limit + 1 - used);
+            out.resize(used + room);
+            zlib.inflater.next_out = (Bytef *)&out[used];
+            zlib.inflater.avail_out = (uInt)room;
+            int result = inflate(&zlib.inflater, Z_SYNC_FLUSH);
+            out.resize(used + room - zlib.inflater.avail_out);
+            if (out.size() > limit)
+                return WS_MESSAGE_TOO_BIG;
+            /* A final block ends the message early, what follows it does not count */
+            if (result == Z_STREAM_END)
+                return 0;
+            if (result != Z_OK && result != Z_BUF_ERROR)
+                return WS_INVALID_PAYLOAD;
+        } while (zlib.inflater.avail_in > 0 || zlib.inflater.avail_out == 0);
+    }
+    return 0;
+}
+
+/**
+ * Append the compressed frame of `message` to `frame`, `false` (and
+ * nothing appended) when it is not worth compressing
+ */
+bool deflate_websocket_frame(Reactor &reactor, uint8_t opcode, std::string_view message, std::string &frame)
+{
+    WebSocketZlib &zlib = reactor.websocket_zlib;
+    int level = reactor.config->websocket_deflate;
+    if (level == 0 || message.size() < WEBSOCKET_DEFLATE_MIN ||
+        !websocket_deflate(zlib, level, message.data(), message.size()))
+        return false;
+    websocket_append_header(frame, WS_FIN | WS_RSV1 | opcode, zlib.deflated.size());
+    frame += zlib.deflated;
+    return true;
+}
+
+void queue_websocket_control(Reactor &reactor, Connection &conn, uint8_t opcode, std::string_view payload)
+{
+    std::string frame;
+    websocket_append_header(frame, WS_FIN | opcode, payload.size());
+    frame.append(payload.data(), payload.size());
+    queue_owned(reactor, conn, std::move(frame));
+}
+
+/**
+ * Send a close frame with `code`, unless we did already. With `fail` the
+ * connection is closed as soon as it is out, otherwise once the client
+ * answered with its own.
+ */
+void close_websocket(Reactor &reactor, Connection &conn, uint16_t code, bool fail)
+{
+    WebSocketSession &ws = *conn.ws;
+    if (!ws.close_sent)
+    {
+        char payload[2] = {(char)(code >> 8), (char)code};
+        queue_websocket_control(reactor, conn, WS_CLOSE, std::string_view(payload, 2));
+        ws.close_sent = true;
+    }
+    if (fail)
+        conn.closing = true;
+}
+
+void websocket_send(Reactor &reactor, Connection &conn, std::string_view message, bool binary)
+{
+    if (conn.ws == nullptr || conn.ws->close_sent)
+        return;
+    uint8_t opcode = binary ? WS_BINARY : WS_TEXT;
+    std::string frame;
+    if (!conn.ws->deflate || !deflate_websocket_frame(reactor, opcode, message, frame))
+    {
+        frame.reserve(message.size() + WEBSOCKET_MAX_HEADER);
+        websocket_append_header(frame, WS_FIN | opcode, message.size());
+        frame.append(message.data(), message.size());
+    }
+    queue_owned(reactor, conn, std::move(frame));
+}
+
+void websocket_subscribe(Reactor &reactor, Connection &conn, std::string_view channel)
+{
+    if (conn.ws == nullptr)
+        return;
+    std::vector<std::string> &channels = conn.ws->channels;
+    if (std::find(channels.begin(), channels.end(), channel) != channels.end())
+        return;
+    channels.emplace_back(channel);
+    reactor.channels[channels.back()].insert(&conn);
+}
+
+void websocket_publish(Reactor &reactor, std::string_view channel, std::string_view message, bool binary)
+{
+    uint8_t opcode = binary ? WS_BINARY : WS_TEXT;
+    std::shared_ptr<Broadcast> broadcast = std::make_shared<Broadcast>();
+    broadcast->channel.assign(channel.data(), channel.size());
+    std::string frame;
+    frame.reserve(message.size() + WEBSOCKET_MAX_HEADER);
+    websocket_append_header(frame, WS_FIN | opcode, message.size());
+    frame.append(message.data(), message.size());
+    broadcast->plain = std::make_shared<const std::string>(std::move(frame));
+    std::string deflated;
+    if (deflate_websocket_frame(reactor, opcode, message, deflated))
+        broadcast->deflated = std::make_shared<const std::string>(std::move(deflated));
+
+    /* Our own inbox is taken before we sleep again, the others need waking */
+    std::vector<std::unique_ptr<BroadcastInbox>> &inboxes = reactor.hub->inboxes;
+    for (size_t i = 0; i < inboxes.size(); ++i)
+    {
+        BroadcastInbox &inbox = *inboxes[i];
+        bool wake;
+        {
+            std::lock_guard<std::mutex> guard(inbox.lock);
+            wake = inbox.queued.empty();
+            inbox.queued.push_back(broadcast);
+            inbox.pending.store(true, std::memory_order_release);
+        }
+        uint64_t one = 1;
+        if (wake && (int)i != reactor.id && write(inbox.event_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+            perror("eventfd write");
+    }
+}
+
+/**
+ * Answer a `GET` for a WebSocket route: `101` when it asks for version 13
+ * of the protocol the way RFC 6455 section 4.1 says, `426` naming the
+ * version we speak when it is no upgrade, `400` when it is a broken one.
+ * From the `101` on `conn.ws` is set and `process_requests` stops.
+ */
+void upgrade_websocket(Reactor &reactor, Connection &conn, const HttpRequest &req, const RouteEndpoint &endpoint,
+                       bool keep_alive)
+{
+    const HttpHeader *upgrade = req.find_header("Upgrade");
+    const HttpHeader *connection = req.find_header("Connection");
+    const HttpHeader *version = req.find_header("Sec-WebSocket-Version");
+    const HttpHeader *key = req.find_header("Sec-WebSocket-Key");
+    bool asks = conn.http2_parent == nullptr && req.version_minor >= 1 && upgrade != nullptr &&
+                header_value_has_token(upgrade->value, "websocket") && connection != nullptr &&
+                header_value_has_token(connection->value, "upgrade");
+    if (!asks || version == nullptr || version->value != "13")
+    {
+        queue_text(reactor, conn, "426 Upgrade Required", "Upgrade Required\n", keep_alive, false,
+                   "Upgrade: websocket\r\nSec-WebSocket-Version: 13\r\n");
+        return;
+    }
+    /* The key is 16 random bytes in base64 */
+    if (key == nullptr || key->value.size() != 24 || key->value.substr(22) != "==" ||
+        !std::all_of(key->value.begin(), key->value.end() - 2,
+                     [](char c) { return isalnum((unsigned char)c) || c == '+' || c == '/'; }))
+    {
+        queue_text(reactor, conn, "400 Bad Request", "Bad Request\n", keep_alive);
+        return;
+    }
+    if (reactor.draining)
+    {
+        queue_text(reactor, conn, "503 Service Unavailable", "Service Unavailable\n", false);
+        return;
+    }
+
+    const HttpHeader *extensions = req.find_header("Sec-WebSocket-Extensions");
+    bool deflate = reactor.config->websocket_deflate > 0 && extensions != nullptr &&
+                   websocket_accepts_deflate(extensions->value);
+    std::string head = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                       "Sec-WebSocket-Accept: ";
+    head += websocket_accept_key(key->value);
+    if (deflate)
+        head += "\r\nSec-WebSocket-Extensions: permessage-deflate; server_no_context_takeover; "
+                "client_no_context_takeover";
+    head += "\r\n\r\n";
+    queue_owned(reactor, conn, std::move(head));
+
+    conn.ws = new WebSocketSession;
+    conn.ws->handler = &endpoint.websocket;
+    conn.ws->deflate = deflate;
+    add_metric(reactor.metrics->websocket_upgrades);
+    if (endpoint.websocket.open != nullptr)
+        endpoint.websocket.open(reactor, conn, req, reactor.params);
+}
+
+/**
+ * What is wrong with the frame that starts in `conn.in`, `0` when
+ * nothing is. `limit` is the largest frame we hold in memory.
+ */
+uint16_t check_websocket_frame(const Reactor &reactor, const WebSocketSession &ws, const WebSocketFrame &frame,
+                               size_t limit)
+{
+    if (!frame.masked || (frame.flags & (WS_RSV2 | WS_RSV3)) != 0)
+        return WS_PROTOCOL_ERROR;
+    if (frame.control())
+    {
+        bool known = frame.opcode == WS_CLOSE || frame.opcode == WS_PING || frame.opcode == WS_PONG;
+        if (!known || !frame.fin() || (frame.flags & WS_RSV1) || frame.length > WEBSOCKET_MAX_CONTROL)
+            return WS_PROTOCOL_ERROR;
+        return 0;
+    }
+    if (frame.opcode == WS_CONTINUATION ? ws.fragments == 0 || (frame.flags & WS_RSV1)
+                                        : frame.opcode > WS_BINARY || ws.fragments != 0)
+        return WS_PROTOCOL_ERROR;
+    if ((frame.flags & WS_RSV1) && !ws.deflate)
+        return WS_PROTOCOL_ERROR;
+    if (frame.length > limit || ws.message.size() + frame.length > (size_t)reactor.config->websocket_max_message)
+        return WS_MESSAGE_TOO_BIG;
+    return 0;
+}
+
+/**
+ * Hand a complete message to the handler, decompressed first when it
+ * was compressed. Returns `0`, or the code to close with.
+ */
+uint16_t receive_websocket_message(Reactor &reactor, Connection &conn, uint8_t opcode, bool compressed,
+                                   std::string_view message)
+{
+    if (compressed)
+    {
+        WebSocketZlib &zlib = reactor.websocket_zlib;
+        uint16_t error = websocket_inflate(zlib, message.data(), message.size(),
+                                           (size_t)reactor.config->websocket_max_message);
+        if (error != 0)
+            return error;
+        message = zlib.inflated;
+    }
+    bool binary = opcode == WS_BINARY;
+    if (!binary && !utf8_valid(message.data(), message.size()))
+        return WS_INVALID_PAYLOAD;
+    add_metric(reactor.metrics->websocket_messages);
+    if (conn.ws->handler->message != nullptr)
+        conn.ws->handler->message(reactor, conn, message, binary);
+    return 0;
+}
+
+/**
+ * Answer a close frame with its `payload`: a close of our own naming the
+ * same code, or the error it makes. The connection closes once it is out.
+ */
+void receive_websocket_close(Reactor &reactor, Connection &conn, std::string_view payload)
+{
+    uint16_t code = WS_NO_STATUS;
+    if (payload.size() == 1)
+        code = WS_PROTOCOL_ERROR;
+    else if (payload.size() >= 2)
+    {
+        code = (uint16_t)((unsigned char)payload[0] << 8 | (unsigned char)payload[1]);
+        if (!websocket_close_code_valid(code))
+            code = WS_PROTOCOL_ERROR;
+        else if (!utf8_valid(payload.data() + 2, payload.size() - 2))
+            code = WS_INVALID_PAYLOAD;
+    }
+    if (code == WS_NO_STATUS && !conn.ws->close_sent)
+    {
+        queue_websocket_control(reactor, conn, WS_CLOSE, "");
+        conn.ws->close_sent = true;
+    }
+    close_websocket(reactor, conn, code, true);
+}
+
+/**
+ * Handle every complete frame in `conn.in`
+ *
+ * Frames are unmasked where they are, a message in a single frame goes
+ * to its handler from there. A client that breaks the protocol gets a
+ * close frame naming what it did wrong and the connection closes as soon
+ * as that is out, anything it sent after is dropped unread.
+ */
+void process_websocket(Reactor &reactor, Connection &conn)
+{
+    WebSocketSession &ws = *conn.ws;
+    size_t limit = std::min<size_t>(WEBSOCKET_MAX_FRAME, (size_t)reactor.config->websocket_max_message);
+    size_t consumed = 0;
+    while (!conn.closing && consumed < conn.in.length)
+    {
+        char *start = conn.in.data + consumed;
+        size_t available = conn.in.length - consumed;
+        WebSocketFrame frame;
+        int header = websocket_read_header((const unsigned char *)start, available, frame);
+        if (header == 0)
+            break;
+        uint16_t error = header == -1 ? (uint16_t)WS_PROTOCOL_ERROR : check_websocket_frame(reactor, ws, frame, limit);
+        if (error != 0)
+        {
+            close_websocket(reactor, conn, error, true);
+            break;
+        }
+        if (available - frame.header_size < frame.length)
+            break;
+
+        char *payload = start + frame.header_size;
+        scan_kernels().unmask(payload, frame.length, frame.key);
+        consumed += frame.header_size + frame.length;
+        std::string_view data(payload, frame.length);
+        ws.ping_sent = false;
+
+        if (frame.opcode == WS_PING)
+        {
+            if (!ws.close_sent)
+                queue_websocket_control(reactor, conn, WS_PONG, data);
+            continue;
+        }
+        if (frame.opcode == WS_PONG)
+            continue;
+        if (frame.opcode == WS_CLOSE)
+        {
+            receive_websocket_close(reactor, conn, data);
+            break;
+        }
+
+        /* Once we said goodbye only the client's close still matters */
+        if (frame.opcode != WS_CONTINUATION)
+        {
+            ws.fragments = frame.opcode;
+            ws.compressed = (frame.flags & WS_RSV1) != 0;
+        }
+        if (frame.fin() && ws.message.empty())
+        {
+            error = ws.close_sent ? 0 : receive_websocket_message(reactor, conn, ws.fragments, ws.compressed, data);
+            ws.fragments = 0;
+        }
+        else if (!frame.fin())
+        {
+            ws.message.append(data.data(), data.size());
+            continue;
+        }
+        else
+        {
+            ws.message.append(data.data(), data.size());
+            error = ws.close_sent ? 0 : receive_websocket_message(reactor, conn, ws.fragments, ws.compressed,
+                                                                  ws.message);
+            ws.fragments = 0;
+            if (ws.message.capacity() > BODY_READ_SIZE)
+                std::string().swap(ws.message);
+            else
+                ws.message.clear();
+        }
+        if (error != 0)
+            close_websocket(reactor, conn, error, true);
+    }
+
+    if (conn.closing)
+        release_input(reactor.buffers, conn.in);
+    else
+        consume_input(reactor.buffers, conn.in, consumed);
+    update_connection_timer(reactor, conn);
+}
+
+/**
+ * `/echo` sends every WebSocket message back as it came
+ */
+void echo_message(Reactor &reactor, Connection &conn, std::string_view message, bool binary)
+{
+    websocket_send(reactor, conn, message, binary);
+}
+
+/**
+ * `/live/:channel` subscribes a WebSocket to `channel`, a `POST` to the
+ * same path publishes its body there, as a text message when it is UTF-8
+ */
+void open_live(Reactor &reactor, Connection &conn, const HttpRequest &, const RouteParams &params)
+{
+    websocket_subscribe(reactor, conn, params.get("channel"));
+}
+
+void publish_live(Reactor &reactor, Connection &conn, const HttpRequest &req, const RouteParams &params,
+                  bool keep_alive)
+{
+    websocket_publish(reactor, params.get("channel"), req.body, !utf8_valid(req.body.data(), req.body.size()));
+    queue_text(reactor, conn, "202 Accepted", "published\n", keep_alive);
+}
+
+/**
+ * Hand one parsed request to the handler its route names
+ *
+ * A route that streams its body but got a request without one sees an
+ * empty body right away.
+ */
+void dispatch_request(Reactor &reactor, Connection &conn, const HttpRequest &req, bool keep_alive)
+{
+    const RouteEndpoint *endpoint = match_route(*reactor.router, req.target, reactor.params);
+    bool head_only = req.method == "HEAD";
+    if (endpoint == nullptr)
+    {
+        queue_static(reactor, conn, reactor.responses.get(RESPONSE_NOT_FOUND, keep_alive, head_only));
+        return;
+    }
+
+    int slot = route_slot(*endpoint, route_method(req.method));
+    if (slot == -1)
+    {
+        std::string allow = "Allow: " + endpoint->allow + "\r\n";
+        queue_text(reactor, conn, "405 Method Not Allowed", "Method Not Allowed\n", keep_alive, head_only,
+                   allow.c_str());
+    }
+    else if (endpoint->handlers[slot] != nullptr)
+    {
+        endpoint->handlers[slot](reactor, conn, req, reactor.params, keep_alive);
+    }
+    else if (endpoint->async_handlers[slot] != nullptr)
+    {
+        start_coroutine(reactor, conn, req, keep_alive, endpoint->async_handlers[slot], nullptr);
+    }
+    else if (slot == ROUTE_GET && endpoint->upgrades)
+    {
+        upgrade_websocket(reactor, conn, req, *endpoint, keep_alive);
+    }
+    else if (RequestBody *body = endpoint->body_handlers[slot](reactor, conn, req, reactor.params))
+    {
+        body->finish(reactor, conn, keep_alive);
+        delete body;
+    }
+}
+
+/**
+ * Work out where the body of the request whose head just arrived goes
+ *
+ * A route that streams bodies gets a `RequestBody` now and the body is fed
+ * to it as it arrives, so does a coroutine, which starts now and reads
+ * the body as it arrives. One that does not waits until the whole body is
+ * buffered. Either way a body that is announced too large is refused
+ * before it is sent, a client waiting for `100 Continue` gets it once we
+ * know we will read the body.
+ *
+ * Returns `false` when the request was answered already.
+ */
+bool begin_request_body(Reactor &reactor, Connection &conn, const HttpRequest &req)
+{
+    const ServerConfig &config = *reactor.config;
+    const RouteEndpoint *endpoint = match_route(*reactor.router, req.target, reactor.params);
+    int slot = endpoint == nullptr ? -1 : route_slot(*endpoint, route_method(req.method));
+    BodyHandler handler = slot == -1 ? nullptr : endpoint->body_handlers[slot];
+    AsyncHandler async_handler = slot == -1 ? nullptr : endpoint->async_handlers[slot];
+    bool streamed = handler != nullptr || async_handler != nullptr;
+    if (req.content_length > (streamed ? config.max_body : config.body_memory))
+    {
+        reject_request(reactor, conn, 413);
+        return false;
+    }
+
+    const HttpHeader *expect = req.find_header("Expect");
+    if (expect != nullptr && req.version_minor >= 1 && expect->value.size() == 12 &&
+        strncasecmp(expect->value.data(), "100-continue", 12) == 0)
+        queue_static(reactor, conn, "HTTP/1.1 100 Continue\r\n\r\n");
+    if (!streamed)
+        return true;
+
+    conn.requests_served++;
+    conn.timer_kind = TIMER_NONE;
+    add_metric(reactor.metrics->requests);
+    bool keep_alive = req.keep_alive && conn.requests_served < config.max_requests && !reactor.draining;
+    RequestBody *body;
+    if (async_handler != nullptr)
+    {
+        CoroutineBody *reader = new CoroutineBody;
+        body = reader;
+        conn.body = body;
+        if (!start_coroutine(reactor, conn, req, keep_alive, async_handler, reader))
+        {
+            conn.body = nullptr;
+            delete body;
+            body = nullptr;
+        }
+    }
+    else
+    {
+        body = handler(reactor, conn, req, reactor.params);
+    }
+    if (body == nullptr)
+    {
+        /* Answered without reading the body, so we can not read on after it */
+        conn.closing = true;
+        release_input(reactor.buffers, conn.in);
+        conn.parser.reset();
+        update_connection_timer(reactor, conn);
+        return false;
+    }
+    body->keep_alive = keep_alive;
+    body->request_start = monotonic_nanoseconds();
+    conn.body = body;
+    return true;
+}
+
+/**
+ * A streamed response decides on its own when the connection closes, an
+ * offloaded one once its task is back, a coroutine's once it returned,
+ * everything else is done once the answer is queued
+ */
+void end_response(Reactor &reactor, Connection &conn, bool keep_alive, uint64_t started)
+{
+    if (conn.coroutine != nullptr)
+        return;
+    if (conn.task != nullptr)
+    {
+        conn.task->request_start = started;
+        return;
+    }
+    if (conn.stream != nullptr)
+    {
+        conn.stream->request_start = started;
+        pump_stream(reactor, conn);
+        return;
+    }
+    if (!keep_alive && conn.ws == nullptr)
+        conn.closing = true;
+    if (conn.out.tail != nullptr)
+        conn.out.tail->request_start = started;
+    if (conn.cache_fill != nullptr)
+        end_fill(reactor, conn, true);
+    end_access(reactor, conn);
+}
+
+/**
+ * The last byte of a streamed request body arrived, let its `finish`
+ * answer and get ready for the next request
+ */
+void finish_request_body(Reactor &reactor, Connection &conn)
+{
+    RequestBody *body = conn.body;
+    conn.body = nullptr;
+    conn.parser.reset();
+    body->finish(reactor, conn, body->keep_alive);
+    end_response(reactor, conn, body->keep_alive, body->request_start);
+    delete body;
+}
+
+/**
+ * What the response cache has for a request, see `lookup_cache()`
+ */
+enum CacheLookup : uint8_t
+{
+    CACHE_SKIP,
+    CACHE_HIT,
+    CACHE_MISS,
+    CACHE_WAIT,
+};
+
+/* Whether `req` has the values of the fields `answer` varies by */
+bool vary_matches(const CachedAnswer &answer, const HttpRequest &req)
+{
+    for (const auto &field : answer.vary)
+    {
+        const HttpHeader *header = req.find_header(field.first);
+        if ((header == nullptr ? std::string_view() : header->value) != field.second)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Look the complete request `req` up in the response cache
+ *
+ *  - `CACHE_SKIP`: it goes to its handler and the answer is not kept
+ *  - `CACHE_HIT`: `hit` answers it
+ *  - `CACHE_MISS`: it goes to its handler, `conn.cache_fill` keeps the answer
+ *  - `CACHE_WAIT`: the same target is answered right now, `conn.cache_wait`
+ *    waits for that
+ *
+ * A `HEAD` request only ever hits, its answer has no body to keep.
+ */
+CacheLookup lookup_cache(Reactor &reactor, Connection &conn, const HttpRequest &req, CachedAnswer *&hit)
+{
+    HttpCache &cache = reactor.cache;
+    bool head_only = req.method == "HEAD";
+    if (cache.budget == 0 || (!head_only && req.method != "GET") || req.content_length > 0 || req.chunked)
+        return CACHE_SKIP;
+    /* Answers only this client may see, only part of one, or a switch to another protocol */
+    static const char *const personal[] = {"Authorization", "Range",           "If-Range",
+                                           "If-None-Match", "If-Match",        "If-Modified-Since",
+                                           "If-Unmodified-Since", "Upgrade"};
+    for (const char *field : personal)
+    {
+        if (req.find_header(field) != nullptr)
+            return CACHE_SKIP;
+    }
+    std::string_view argument;
+    const HttpHeader *control = req.find_header("Cache-Control");
+    if (control != nullptr && cache_directive(control->value, "no-store", argument))
+        return CACHE_SKIP;
+    const HttpHeader *pragma = req.find_header("Pragma");
+    bool refresh = (control != nullptr && cache_directive(control->value, "no-cache", argument)) ||
+                   (pragma != nullptr && header_value_has_token(pragma->value, "no-cache"));
+
+    cache.key.assign(req.target.data(), req.target.size());
+    auto it = refresh ? cache.answers.end() : cache.answers.find(cache.key);
+    if (it != cache.answers.end())
+    {
+        CachedAnswer *match = nullptr;
+        for (CachedAnswer *answer : it->second)
+        {
+            if (answer->pass || vary_matches(*answer, req))
+            {
+                match = answer;
+                break;
+            }
+        }
+        if (match != nullptr && match->expires <= monotonic_milliseconds())
+        {
+            evict_answer(cache, match);
+        }
+        else if (match != nullptr)
+        {
+            if (match->pass)
+                return CACHE_SKIP;
+            match->referenced = true;
+            hit = match;
+            return CACHE_HIT;
+        }
+    }
+    if (head_only)
+        return CACHE_SKIP;
+
+    auto filling = cache.fills.find(cache.key);
+    if (filling != cache.fills.end())
+    {
+        if (refresh)
+            return CACHE_SKIP;
+        filling->second->waiters.push_back(&conn);
+        conn.cache_wait = filling->second;
+        return CACHE_WAIT;
+    }
+    CacheFill *fill = new CacheFill;
+    fill->target = cache.key;
+    fill->request_head.assign(req.head.data(), req.head.size());
+    cache.fills.emplace(fill->target, fill);
+    conn.cache_fill = fill;
+    return CACHE_MISS;
+}
+
+/**
+ * Answer from the response cache: the kept head with this connection's
+ * own `Connection`, the current `Date` and the `Age` of the answer, then
+ * the kept body itself
+ */
+void queue_cached_answer(Reactor &reactor, Connection &conn, const CachedAnswer &answer, bool keep_alive,
+                         bool head_only)
+{
+    std::string head;
+    head.reserve(answer.status_line.size() + answer.fields.size() + 96);
+    head += answer.status_line;
+    head += answer.fields;
+    head += "Age: ";
+    head += std::to_string((monotonic_milliseconds() - answer.stored) / 1000);
+    head += keep_alive ? "\r\nConnection: keep-alive\r\nDate: " : "\r\nConnection: close\r\nDate: ";
+    head.append(reactor.responses.date, HTTP_DATE_SIZE);
+    head += "\r\n\r\n";
+    queue_owned(reactor, conn, std::move(head));
+    if (!head_only && !answer.body->empty())
+        queue_shared(reactor, conn, answer.body);
+}
+
+/**
+ * Answer every complete request sitting in `conn.in`
+ *
+ * A client may pipeline several requests in one segment. The responses
+ * come from the reactor's `ResponseCache`, so every answer is just a
+ * pointer appended to `conn.out` and the whole batch later leaves in a
+ * single `writev`.
+ *
+ * The connection stays open when the client asks for it and it has
+ * not used up its `max_requests` yet, the last response on a connection
+ * always carries `Connection: close` so the client knows not to reuse it
+ *
+ * A body that is streamed to its route leaves `conn.in` as soon as it
+ * arrived, so a connection only ever holds one read's worth of it. A
+ * coroutine handler's body waits in `conn.in` while the coroutine still
+ * has `BODY_READ_SIZE` bytes to read, and what follows its request waits
+ * until it returned.
+ *
+ * A request that waits for a response cache fill stays in `conn.in` and
+ * is parsed again once the fill is done.
+ */
+void process_requests(Reactor &reactor, Connection &conn)
+{
+    HttpRequest &req = reactor.request;
+    const ServerConfig &config = *reactor.config;
+    size_t consumed = 0;
+    uint64_t started = 0;
+    while (!conn.closing && conn.stream == nullptr && conn.task == nullptr && conn.cache_wait == nullptr &&
+           conn.ws == nullptr && (conn.coroutine == nullptr || conn.body != nullptr) && consumed < conn.in.length)
+    {
+        if (conn.body != nullptr)
+        {
+            /* A coroutine reads its body at its own pace */
+            if (conn.coroutine != nullptr && conn.coroutine->body.size() >= BODY_READ_SIZE)
+                break;
+            size_t used = 0;
+            ParseResult result = stream_request_body(conn.parser, conn.in.data + consumed, conn.in.length - consumed,
+                                                     config.max_body, *conn.body, used);
+            consumed += used;
+            if (result == PARSE_ERROR)
+            {
+                reject_request(reactor, conn, conn.parser.error_status);
+                return;
+            }
+            if (result == PARSE_INCOMPLETE)
+                break;
+            finish_request_body(reactor, conn);
+            continue;
+        }
+
+        ParseResult result = parse_request(conn.parser, conn.in.data + consumed,
+                                           conn.in.length - consumed, req, config.body_memory);
+        if (result == PARSE_INCOMPLETE)
+            break;
+
+        if (result == PARSE_ERROR)
+        {
+            reject_request(reactor, conn, conn.parser.error_status);
+            return;
+        }
+
+        if (result == PARSE_HEAD)
+        {
+            begin_access(reactor, conn, req);
+            if (!within_rate_limit(reactor, conn))
+            {
+                limit_request(reactor, conn);
+                return;
+            }
+            if (!begin_request_body(reactor, conn, req))
+                return;
+            /* A streamed body starts right after the head, which is done with */
+            if (conn.body != nullptr)
+                consumed += conn.parser.head_len;
+            continue;
+        }
+
+        CachedAnswer *hit = nullptr;
+        CacheLookup lookup = lookup_cache(reactor, conn, req, hit);
+        if (lookup == CACHE_WAIT)
+        {
+            conn.parser.reset();
+            add_metric(reactor.metrics->cache_coalesced);
+            break;
+        }
+        begin_access(reactor, conn, req);
+        /* A request with a body paid when its head arrived */
+        if (!req.chunked && req.content_length <= 0 && !within_rate_limit(reactor, conn))
+        {
+            if (conn.cache_fill != nullptr)
+                end_fill(reactor, conn, false);
+            limit_request(reactor, conn);
+            return;
+        }
+        consumed += conn.parser.consumed;
+        conn.parser.reset();
+        conn.requests_served++;
+        /* A request that follows gets a head deadline of its own */
+        conn.timer_kind = TIMER_NONE;
+        bool keep_alive = req.keep_alive && conn.requests_served < config.max_requests && !reactor.draining;
+        if (lookup == CACHE_HIT)
+        {
+            queue_cached_answer(reactor, conn, *hit, keep_alive, req.method == "HEAD");
+            add_metric(reactor.metrics->cache_hits);
+        }
+        else
+        {
+            if (lookup == CACHE_MISS)
+                add_metric(reactor.metrics->cache_misses);
+            dispatch_request(reactor, conn, req, keep_alive);
+        }
+        if (started == 0)
+            started = monotonic_nanoseconds();
+        add_metric(reactor.metrics->requests);
+        end_response(reactor, conn, keep_alive, started);
+    }
+
+    consume_input(reactor.buffers, conn.in, consumed);
+    update_connection_timer(reactor, conn);
+}
+
+/**
+ * Drop `written` bytes from the front of `conn.out`, a response whose last
+ * byte just went out is recorded in the latency histogram
+ */
+void drop_output(Reactor &reactor, Connection &conn, size_t written)
+{
+    conn.out_bytes -= written;
+    uint64_t now = 0;
+    while (written > 0)
+    {
+        OutputChunk &front = conn.out.front();
+        size_t remaining = front.size - conn.out_offset;
+        if (written < remaining)
+        {
+            conn.out_offset += written;
+            break;
+        }
+        written -= remaining;
+        conn.out_offset = 0;
+        if (front.request_start != 0)
+        {
+            if (now == 0)
+                now = monotonic_nanoseconds();
+            record_latency(*reactor.metrics, now - front.request_start);
+        }
+        pop_output(reactor.buffers, conn.out);
+    }
+}
+
+/**
+ * HTTP/2
+ *
+ * A client speaks HTTP/2 when it opens the connection with the preface,
+ * over TLS after ALPN picked `h2`, over plain TCP with prior knowledge
+ * (h2c). The connection then carries frames: a 9-byte header (length,
+ * type, flags, stream) and a payload. `process_frames` handles every
+ * complete frame in `conn.in`; requests go to their stream's connection
+ * as described at `Http2Stream`, and `write_http2` frames what the
+ * streams answered.
+ *
+ * Flow control is per stream and for the whole connection: we grant the
+ * client `H2_WINDOW` for both, and top it up once half of it was used.
+ * Our own sending stops when either window the client granted runs out
+ * and goes on when its WINDOW_UPDATE arrives. File and large shared
+ * payloads are not copied into the frames, the frame header is queued
+ * and the payload follows as a chunk that refers to the same bytes, so
+ * `sendfile` keeps working.
+ *
+ * A protocol violation ends the connection with GOAWAY, a malformed
+ * request only its stream with RST_STREAM.
+ */
+enum Http2FrameType : uint8_t
+{
+    H2_DATA,
+    H2_HEADERS,
+    H2_PRIORITY,
+    H2_RST_STREAM,
+    H2_SETTINGS,
+    H2_PUSH_PROMISE,
+    H2_PING,
+    H2_GOAWAY,
+    H2_WINDOW_UPDATE,
+    H2_CONTINUATION,
+};
+
+enum Http2Flag : uint8_t
+{
+    H2_END_STREAM = 0x1,
+    H2_ACK = 0x1,
+    H2_END_HEADERS = 0x4,
+    H2_PADDED = 0x8,
+    H2_PRIORITY_FLAG = 0x20,
+};
+
+enum Http2Error : uint32_t
+{
+    H2_NO_ERROR,
+    H2_PROTOCOL_ERROR,
+    H2_INTERNAL_ERROR,
+    H2_FLOW_CONTROL_ERROR,
+    H2_SETTINGS_TIMEOUT,
+    H2_STREAM_CLOSED,
+    H2_FRAME_SIZE_ERROR,
+    H2_REFUSED_STREAM,
+    H2_CANCEL,
+    H2_COMPRESSION_ERROR,
+};
+
+enum Http2Setting : uint16_t
+{
+    H2_HEADER_TABLE_SIZE = 1,
+    H2_ENABLE_PUSH,
+    H2_MAX_CONCURRENT_STREAMS,
+    H2_INITIAL_WINDOW_SIZE,
+    H2_MAX_FRAME_SIZE,
+    H2_MAX_HEADER_LIST_SIZE,
+};
+
+uint32_t read_u32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+void append_u32(std::string &out, uint32_t value)
+{
+    char bytes[4] = {(char)(value >> 24), (char)(value >> 16), (char)(value >> 8), (char)value};
+    out.append(bytes, 4);
+}
+
+void append_frame_header(std::string &out, size_t length, Http2FrameType type, uint8_t flags, uint32_t stream)
+{
+    char header[5] = {(char)(length >> 16), (char)(length >> 8), (char)length, (char)type, (char)flags};
+    out.append(header, 5);
+    append_u32(out, stream);
+}
+
+void append_setting(std::string &out, Http2Setting setting, uint32_t value)
+{
+    out += (char)(setting >> 8);
+    out += (char)setting;
+    append_u32(out, value);
+}
+
+void append_window_update(std::string &out, uint32_t stream, uint32_t increment)
+{
+    append_frame_header(out, 4, H2_WINDOW_UPDATE, 0, stream);
+    append_u32(out, increment);
+}
+
+void append_rst_stream(std::string &out, uint32_t stream, Http2Error error)
+{
+    append_frame_header(out, 4, H2_RST_STREAM, 0, stream);
+    append_u32(out, error);
+}
+
+/**
+ * Queue the frames collected so far as one chunk, the streams' frame
+ * flags can not be changed afterwards
+ */
+void flush_frames(Reactor &reactor, Connection &conn)
+{
+    Http2Session &session = *conn.h2;
+    if (session.frames.empty())
+        return;
+    queue_owned(reactor, conn, std::move(session.frames));
+    session.frames.clear();
+    for (auto &entry : session.streams)
+        entry.second->flags_at = std::string::npos;
+}
+
+/**
+ * Answer the preface with our settings and open the connection window
+ * to `H2_WINDOW`
+ */
+void start_http2(Connection &conn)
+{
+    conn.h2 = new Http2Session;
+    std::string &frames = conn.h2->frames;
+    append_frame_header(frames, 18, H2_SETTINGS, 0, 0);
+    append_setting(frames, H2_MAX_CONCURRENT_STREAMS, H2_MAX_STREAMS);
+    append_setting(frames, H2_INITIAL_WINDOW_SIZE, H2_WINDOW);
+    append_setting(frames, H2_MAX_HEADER_LIST_SIZE, MAX_REQUEST_HEAD);
+    append_window_update(frames, 0, H2_WINDOW - H2_DEFAULT_WINDOW);
+}
+
+/**
+ * End the connection after a protocol error: GOAWAY names the error and
+ * the last stream we looked at, every stream is dropped. Returns `false`
+ * so frame handlers can `return http2_error(...)`.
+ */
+bool http2_error(Reactor &reactor, Connection &conn, Http2Error error)
+{
+    Http2Session &session = *conn.h2;
+    append_frame_header(session.frames, 8, H2_GOAWAY, 0, 0);
+    append_u32(session.frames, session.last_stream);
+    append_u32(session.frames, error);
+    for (auto &entry : session.streams)
+        release_connection(reactor, entry.second->conn);
+    session.streams.clear();
+    session.goaway = true;
+    conn.closing = true;
+    add_metric(reactor.metrics->parse_errors);
+    return false;
+}
+
+/* End one stream with RST_STREAM, whatever it queued is dropped */
+void reset_stream(Reactor &reactor, Http2Session &session, uint32_t id, Http2Error error)
+{
+    append_rst_stream(session.frames, id, error);
+    auto it = session.streams.find(id);
+    if (it == session.streams.end())
+        return;
+    release_connection(reactor, it->second->conn);
+    session.streams.erase(it);
+}
+
+/**
+ * Hand request bytes to a stream's connection as if they had just been
+ * read from its socket. A connection that already answered (say with a
+ * `413`) takes no more.
+ */
+void feed_stream(Reactor &reactor, Http2Stream &stream, const char *data, size_t size)
+{
+    Connection &conn = stream.conn;
+    if (conn.closing || size == 0)
+        return;
+    char *space = reserve_input(reactor.buffers, conn.in, size);
+    if (space == nullptr)
+    {
+        reject_request(reactor, conn, 413);
+        return;
+    }
+    memcpy(space, data, size);
+    conn.in.length += size;
+    process_requests(reactor, conn);
+}
+
+bool strip_padding(uint8_t flags, const unsigned char *&payload, size_t &length)
+{
+    if (!(flags & H2_PADDED))
+        return true;
+    if (length == 0 || payload[0] >= length)
+        return false;
+    length -= 1 + payload[0];
+    payload++;
+    return true;
+}
+
+/**
+ * Decode a complete header block and start the request it opens
+ *
+ * The request is rebuilt as an HTTP/1.1 head: the pseudo-headers become
+ * the request line and `host` (empty without `:authority`, as HTTP/1.1
+ * asks for a request without authority), the other fields are copied over. Fields
+ * that only mean something on an HTTP/1.1 connection are malformed in
+ * HTTP/2 and so are values with line breaks, which would otherwise
+ * smuggle extra lines into the head. The request always asks to close,
+ * which makes the stream's connection finish once it answered.
+ * `expect` is dropped, in HTTP/2 a client does not wait for `100 Continue`.
+ *
+ * A header block on a stream that is already open carries trailers,
+ * they end the body and are otherwise ignored.
+ */
+bool handle_header_block(Reactor &reactor, Connection &conn, uint32_t id, uint8_t flags,
+                         const unsigned char *block, size_t size)
+{
+    Http2Session &session = *conn.h2;
+    bool end_stream = flags & H2_END_STREAM;
+
+    auto it = session.streams.find(id);
+    if (it != session.streams.end() || id <= session.last_stream)
+    {
+        if (!hpack_decode(session.decoder, block, size, session.name_scratch, session.value_scratch,
+                          [](std::string_view, std::string_view) {}))
+            return http2_error(reactor, conn, H2_COMPRESSION_ERROR);
+        if (it == session.streams.end())
+            return true;
+        Http2Stream &stream = *it->second;
+        if (stream.remote_closed || !end_stream || stream.body_left > 0)
+        {
+            reset_stream(reactor, session, id, H2_PROTOCOL_ERROR);
+            return true;
+        }
+        stream.remote_closed = true;
+        if (stream.chunked_body)
+            feed_stream(reactor, stream, "0\r\n\r\n", 5);
+        return true;
+    }
+    if (id % 2 == 0)
+        return http2_error(reactor, conn, H2_PROTOCOL_ERROR);
+
+    session.method.clear();
+    session.path.clear();
+    session.authority.clear();
+    session.fields.clear();
+    long content_length = -1;
+    bool host_field = false;
+    bool regular_seen = false;
+    bool malformed = false;
+    bool too_large = false;
+    auto emit = [&](std::string_view name, std::string_view value) {
+        if (malformed || too_large)
+            return;
+        if (name.empty() || value.find_first_of(std::string_view("\r\n\0", 3)) != std::string_view::npos)
+        {
+            malformed = true;
+            return;
+        }
+        if (name[0] == ':')
+        {
+            if (regular_seen)
+                malformed = true;
+            else if (name == ":method")
+                session.method.assign(value.data(), value.size());
+            else if (name == ":path")
+                session.path.assign(value.data(), value.size());
+            else if (name == ":authority")
+                session.authority.assign(value.data(), value.size());
+            else if (name != ":scheme")
+                malformed = true;
+            return;
+        }
+        regular_seen = true;
+        for (char c : name)
+        {
+            if (c >= 'A' && c <= 'Z')
+                malformed = true;
+        }
+        if (name == "connection" || name == "keep-alive" || name == "proxy-connection" ||
+            name == "transfer-encoding" || name == "upgrade" || (name == "te" && value != "trailers"))
+            malformed = true;
+        if (malformed || name == "te" || name == "expect" || (name == "host" && !session.authority.empty()))
+            return;
+        host_field |= name == "host";
+        if (name == "content-length")
+        {
+            content_length = parse_content_length(value);
+            if (content_length < 0)
+                malformed = true;
+        }
+        session.fields.append(name.data(), name.size());
+        session.fields += ": ";
+        session.fields.append(value.data(), value.size());
+        session.fields += "\r\n";
+        too_large = session.fields.size() > MAX_REQUEST_HEAD;
+    };
+    if (!hpack_decode(session.decoder, block, size, session.name_scratch, session.value_scratch, emit))
+        return http2_error(reactor, conn, H2_COMPRESSION_ERROR);
+
+    session.last_stream = id;
+    if (session.goaway)
+        return true;
+    if (malformed || session.method.empty() || session.path.empty() || (end_stream && content_length > 0))
+    {
+        reset_stream(reactor, session, id, H2_PROTOCOL_ERROR);
+        return true;
+    }
+    if (session.streams.size() >= H2_MAX_STREAMS)
+    {
+        reset_stream(reactor, session, id, H2_REFUSED_STREAM);
+        return true;
+    }
+
+    std::unique_ptr<Http2Stream> &slot = session.streams[id];
+    slot.reset(new Http2Stream);
+    Http2Stream &stream = *slot;
+    stream.id = id;
+    stream.send_window = session.peer_window;
+    stream.remote_closed = end_stream;
+    stream.body_left = end_stream ? -1 : content_length;
+    stream.chunked_body = !end_stream && content_length < 0;
+    stream.conn.http2_parent = &conn;
+    conn.requests_served++;
+    if (too_large)
+    {
+        reject_request(reactor, stream.conn, 431);
+        return true;
+    }
+
+    std::string &request = session.request;
+    request = session.method;
+    request += ' ';
+    request += session.path;
+    request += " HTTP/1.1\r\n";
+    if (!session.authority.empty() || !host_field)
+        request += "host: " + session.authority + "\r\n";
+    request += session.fields;
+    if (stream.chunked_body)
+        request += "transfer-encoding: chunked\r\n";
+    request += "connection: close\r\n\r\n";
+    feed_stream(reactor, stream, request.data(), request.size());
+    return true;
+}
+
+/**
+ * The body of a request, passed on as it arrives
+ *
+ * Flow control counts the whole frame, padding included. Frames for a
+ * stream we already finished can still be in flight and are dropped.
+ */
+bool handle_data(Reactor &reactor, Connection &conn, uint8_t flags, uint32_t id, const unsigned char *payload,
+                 size_t length)
+{
+    Http2Session &session = *conn.h2;
+    if (id == 0)
+        return http2_error(reactor, conn, H2_PROTOCOL_ERROR);
+    session.recv_window -= length;
+    if (session.recv_window < 0)
+        return http2_error(reactor, conn, H2_FLOW_CONTROL_ERROR);
+    if (session.recv_window < H2_WINDOW / 2)
+    {
+        append_window_update(session.frames, 0, (uint32_t)(H2_WINDOW - session.recv_window));
+        session.recv_window = H2_WINDOW;
+    }
+
+    size_t frame_length = length;
+    if (!strip_padding(flags, payload, length))
+        return http2_error(reactor, conn, H2_PROTOCOL_ERROR);
+    auto it = session.streams.find(id);
+    if (it == session.streams.end())
+        return id <= session.last_stream || http2_error(reactor, conn, H2_PROTOCOL_ERROR);
+    Http2Stream &stream = *it->second;
+    if (stream.remote_closed)
+    {
+        reset_stream(reactor, session, id, H2_STREAM_CLOSED);
+        return true;
+    }
+
+    bool end_stream = flags & H2_END_STREAM;
+    stream.recv_window -= frame_length;
+    if (stream.recv_window < 0)
+    {
+        reset_stream(reactor, session, id, H2_FLOW_CONTROL_ERROR);
+        return true;
+    }
+    if (!end_stream && stream.recv_window < H2_WINDOW / 2)
+    {
+        append_window_update(session.frames, id, (uint32_t)(H2_WINDOW - stream.recv_window));
+        stream.recv_window = H2_WINDOW;
+    }
+    stream.remote_closed = end_stream;
+
+    if (stream.body_left >= 0)
+    {
+        /* The body must be exactly as long as `content-length` said */
+        if ((long)length > stream.body_left || (end_stream && (long)length != stream.body_left))
+        {
+            reset_stream(reactor, session, id, H2_PROTOCOL_ERROR);
+            return true;
+        }
+        stream.body_left -= length;
+        feed_stream(reactor, stream, (const char *)payload, length);
+        return true;
+    }
+
+    std::string &chunk = session.request;
+    chunk.clear();
+    if (length > 0)
+    {
+        char line[24];
+        snprintf(line, sizeof(line), "%zx\r\n", length);
+        chunk += line;
+        chunk.append((const char *)payload, length);
+        chunk += "\r\n";
+    }
+    if (end_stream)
+        chunk += "0\r\n\r\n";
+    feed_stream(reactor, stream, chunk.data(), chunk.size());
+    return true;
+}
+
+bool handle_settings(Reactor &reactor, Connection &conn, uint8_t flags, uint32_t id, const unsigned char *payload,
+                     size_t length)
+{
+    Http2Session &session = *conn.h2;
+    if (id != 0)
+        return http2_error(reactor, conn, H2_PROTOCOL_ERROR);
+    if (flags & H2_ACK)
+        return length == 0 || http2_error(reactor, conn, H2_FRAME_SIZE_ERROR);
+    if (length % 6 != 0)
+        return http2_error(reactor, conn, H2_FRAME_SIZE_ERROR);
+
+    for (size_t i = 0; i < length; i += 6)
+    {
+        uint16_t setting = (uint16_t)(payload[i] << 8 | payload[i + 1]);
+        uint32_t value = read_u32(payload + i + 2);
+        switch (setting)
+        {
+        case H2_HEADER_TABLE_SIZE:
+            hpack_set_max_size(session.encoder, std::min(value, (uint32_t)HPACK_DEFAULT_TABLE_SIZE));
+            break;
+        case H2_ENABLE_PUSH:
+            if (value > 1)
+                return http2_error(reactor, conn, H2_PROTOCOL_ERROR);
+            break;
+        case H2_INITIAL_WINDOW_SIZE:
+        {
+            /* The change applies to the windows of the open streams too */
+            if (value > INT32_MAX)
+                return http2_error(reactor, conn, H2_FLOW_CONTROL_ERROR);
+            int64_t delta = (int64_t)value - session.peer_window;
+            for (auto &entry : session.streams)
+            {
+                entry.second->send_window += delta;
+                if (entry.second->send_window > INT32_MAX)
+                    return http2_error(reactor, conn, H2_FLOW_CONTROL_ERROR);
+            }
+            session.peer_window = value;
+            break;
+        }
+        case H2_MAX_FRAME_SIZE:
+            if (value < H2_MAX_FRAME || value > 0xffffff)
+                return http2_error(reactor, conn, H2_PROTOCOL_ERROR);
+            session.peer_max_frame = value;
+            break;
+        default:
+            break;
+        }
+    }
+    append_frame_header(session.frames, 0, H2_SETTINGS, H2_ACK, 0);
+    session.settings = true;
+    return true;
+}
+
+/**
+ * Handle one frame, `false` once the connection failed
+ *
+ * The first frame must be the client's SETTINGS, and a header block
+ * that continues must be followed by its CONTINUATION frames and nothing else.
+ */
+bool handle_frame(Reactor &reactor, Connection &conn, uint8_t type, uint8_t flags, uint32_t id,
+                  const unsigned char *payload, size_t length)
+{
+    Http2Session &session = *conn.h2;
+    if (session.continuation != 0 && (type != H2_CONTINUATION || id != session.continuation))
+        return http2_error(reactor, conn, H2_PROTOCOL_ERROR);
+    if (!session.settings && (type != H2_SETTINGS || (flags & H2_ACK)))
+        return http2_error(reactor, conn, H2_PROTOCOL_ERROR);
+
+    switch (type)
+    {
+    case H2_DATA:
+        return handle_data(reactor, conn, flags, id, payload, length);
+    case H2_HEADERS:
+        if (id == 0 || !strip_padding(flags, payload, length))
+            return http2_error(reactor, conn, H2_PROTOCOL_ERROR);
+        if (flags & H2_PRIORITY_FLAG)
+        {
+            if (length < 5)
+                return http2_error(reactor, conn, H2_FRAME_SIZE_ERROR);
+            payload += 5;
+            length -= 5;
+        }
+        if (!(flags & H2_END_HEADERS))
+        {
+            session.continuation = id;
+            session.continuation_flags = flags;
+            session.header_block.assign((const char *)payload, length);
+            return true;
+        }
+        return handle_header_block(reactor, conn, id, flags, payload, length);
+    case H2_CONTINUATION:
+        if (session.continuation == 0)
+            return http2_error(reactor, conn, H2_PROTOCOL_ERROR);
+        session.header_block.append((const char *)payload, length);
+        if (session.header_block.size() > 4 * MAX_REQUEST_HEAD)
+            return http2_error(reactor, conn, H2_PROTOCOL_ERROR);
+        if (!(flags & H2_END_HEADERS))
+            return true;
+        session.continuation = 0;
+        return handle_header_block(reactor, conn, id, session.continuation_flags,
+                                   (const unsigned char *)session.header_block.data(),
+                                   session.header_block.size());
+    case H2_PRIORITY:
+        if (id == 0)
+            return http2_error(reactor, conn, H2_PROTOCOL_ERROR);
+        if (length != 5)
+            reset_stream(reactor, session, id, H2_FRAME_SIZE_ERROR);
+        return true;
+    case H2_RST_STREAM:
+        if (id == 0 || id > session.last_stream)
+            return http2_error(reactor, conn, H2_PROTOCOL_ERROR);
+        if (length != 4)
+            return http2_error(reactor, conn, H2_FRAME_SIZE_ERROR);
+        if (session.streams.count(id))
+        {
+            release_connection(reactor, session.streams[id]->conn);
+            session.streams.erase(id);
+        }
+        return true;
+    case H2_SETTINGS:
+        return handle_settings(reactor, conn, flags, id, payload, length);
+    case H2_PING:
+        if (id != 0)
+            return http2_error(reactor, conn, H2_PROTOCOL_ERROR);
+        if (length != 8)
+            return http2_error(reactor, conn, H2_FRAME_SIZE_ERROR);
+        if (!(flags & H2_ACK))
+        {
+            append_frame_header(session.frames, 8, H2_PING, H2_ACK, 0);
+            session.frames.append((const char *)payload, 8);
+        }
+        return true;
+    case H2_GOAWAY:
+        if (id != 0)
+            return http2_error(reactor, conn, H2_PROTOCOL_ERROR);
+        session.goaway = true;
+        return true;
+    case H2_WINDOW_UPDATE:
+    {
+        if (length != 4)
+            return http2_error(reactor, conn, H2_FRAME_SIZE_ERROR);
+        uint32_t increment = read_u32(payload) & 0x7fffffff;
+        if (id == 0)
+        {
+            session.send_window += increment;
+            if (increment == 0 || session.send_window > INT32_MAX)
+                return http2_error(reactor, conn, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+            return true;
+        }
+        auto it = session.streams.find(id);
+        if (it == session.streams.end())
+            return id <= session.last_stream || http2_error(reactor, conn, H2_PROTOCOL_ERROR);
+        it->second->send_window += increment;
+        if (increment == 0 || it->second->send_window > INT32_MAX)
+            reset_stream(reactor, session, id, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+        return true;
+    }
+    case H2_PUSH_PROMISE:
+        return http2_error(reactor, conn, H2_PROTOCOL_ERROR);
+    default:
+        /* Unknown frame types are ignored */
+        return true;
+    }
+}
+
+/**
+ * Send a complete HTTP/1.1 response head as a HEADERS frame
+ *
+ * The status line becomes `:status`, names are lowercased and fields
+ * that are about the HTTP/1.1 connection are left out. Fields that
+ * repeat across responses go into the dynamic table, ones that change
+ * with every response would only push those out.
+ */
+void send_response_head(Http2Session &session, Http2Stream &stream)
+{
+    std::string_view head = stream.head;
+    std::string &block = session.request;
+    block.clear();
+    hpack_begin_block(session.encoder, block);
+    hpack_encode(session.encoder, block, ":status", head.substr(9, 3), true);
+
+    size_t pos = head.find("\r\n") + 2;
+    while (pos + 2 < head.size())
+    {
+        size_t eol = head.find("\r\n", pos);
+        std::string_view line = head.substr(pos, eol - pos);
+        pos = eol + 2;
+        size_t colon = line.find(':');
+        if (colon == std::string_view::npos)
+            continue;
+        std::string &name = session.name_scratch;
+        name.assign(line.data(), colon);
+        for (char &c : name)
+            c = (char)tolower((unsigned char)c);
+        std::string_view value = line.substr(colon + 1);
+        while (!value.empty() && value[0] == ' ')
+            value.remove_prefix(1);
+        if (name == "connection" || name == "keep-alive" || name == "transfer-encoding" ||
+            name == "proxy-connection" || name == "upgrade")
+            continue;
+        hpack_encode(session.encoder, block, name, value,
+                     name != "content-length" && name != "content-range" && name != "etag" &&
+                         name != "last-modified");
+    }
+
+    /* Whatever does not fit the client's frame size goes on in CONTINUATION frames */
+    size_t first = std::min(block.size(), (size_t)session.peer_max_frame);
+    stream.flags_at = session.frames.size() + 4;
+    append_frame_header(session.frames, first, H2_HEADERS, first == block.size() ? H2_END_HEADERS : 0, stream.id);
+    session.frames.append(block, 0, first);
+    for (size_t sent = first; sent < block.size();)
+    {
+        size_t size = std::min(block.size() - sent, (size_t)session.peer_max_frame);
+        append_frame_header(session.frames, size, H2_CONTINUATION, sent + size == block.size() ? H2_END_HEADERS : 0,
+                            stream.id);
+        session.frames.append(block, sent, size);
+        sent += size;
+    }
+}
+
+/**
+ * Frame what `stream`'s connection queued, as far as the flow control
+ * windows and `MAX_PENDING_OUTPUT` allow
+ *
+ * Returns `true` once the response is complete and the stream ended.
+ * The stream's connection finished when it is `closing` with nothing
+ * left to send, exactly when an HTTP/1.1 connection would be closed.
+ */
+bool frame_stream(Reactor &reactor, Connection &conn, Http2Stream &stream)
+{
+    Http2Session &session = *conn.h2;
+    Connection &child = stream.conn;
+    while (!child.out.empty())
+    {
+        if (conn.out_bytes + session.frames.size() >= MAX_PENDING_OUTPUT)
+            return false;
+        OutputChunk &front = child.out.front();
+        size_t avail = front.size - child.out_offset;
+
+        if (!stream.head_sent)
+        {
+            /* Every head is queued from memory, never spans a file */
+            if (front.file != nullptr || stream.head.size() > MAX_REQUEST_HEAD)
+                break;
+            size_t old = stream.head.size();
+            stream.head.append(front.bytes() + child.out_offset, avail);
+            size_t end = stream.head.find("\r\n\r\n", old >= 3 ? old - 3 : 0);
+            drop_output(reactor, child, end == std::string::npos ? avail : end + 4 - old);
+            if (end == std::string::npos)
+                continue;
+            stream.head.resize(end + 4);
+            send_response_head(session, stream);
+            stream.head_sent = true;
+            stream.head.clear();
+            continue;
+        }
+
+        int64_t window = std::min(stream.send_window, session.send_window);
+        if (window <= 0)
+            return false;
+        size_t size = std::min({avail, (size_t)window, (size_t)session.peer_max_frame});
+        stream.flags_at = session.frames.size() + 4;
+        append_frame_header(session.frames, size, H2_DATA, 0, stream.id);
+        if (front.file != nullptr || (front.shared != nullptr && size >= H2_COPY_LIMIT))
+        {
+            flush_frames(reactor, conn);
+            OutputChunk *chunk = acquire_chunk(reactor.buffers);
+            chunk->size = size;
+            chunk->file = front.file;
+            chunk->file_offset = front.file_offset + child.out_offset;
+            chunk->shared = front.shared;
+            if (front.file == nullptr)
+                chunk->data = front.bytes() + child.out_offset;
+            conn.out_bytes += size;
+            push_output(conn.out, chunk);
+        }
+        else
+        {
+            session.frames.append(front.bytes() + child.out_offset, size);
+        }
+        stream.send_window -= size;
+        session.send_window -= size;
+        drop_output(reactor, child, size);
+        if (child.stream != nullptr && child.out_bytes < STREAM_MAX_PENDING / 2)
+            pump_stream(reactor, child);
+    }
+
+    if (!child.out.empty() || !child.closing || child.stream != nullptr)
+    {
+        if (child.out.empty() || stream.head_sent)
+            return false;
+        /* A response we can not make sense of, the stream fails instead */
+        reset_stream(reactor, session, stream.id, H2_INTERNAL_ERROR);
+        return true;
+    }
+    if (!stream.head_sent)
+    {
+        reset_stream(reactor, session, stream.id, H2_INTERNAL_ERROR);
+        return true;
+    }
+    if (stream.flags_at != std::string::npos)
+        session.frames[stream.flags_at] |= H2_END_STREAM;
+    else
+        append_frame_header(session.frames, 0, H2_DATA, H2_END_STREAM, stream.id);
+    return true;
+}
+
+/**
+ * Frame what the streams of `conn` answered and queue it, streams whose
+ * response is complete are closed
+ *
+ * A client still sending the body of a request we already answered
+ * (say with a `413`) is told to stop with RST_STREAM(NO_ERROR).
+ */
+void write_http2(Reactor &reactor, Connection &conn)
+{
+    Http2Session &session = *conn.h2;
+    for (auto it = session.streams.begin(); it != session.streams.end();)
+    {
+        Http2Stream &stream = *it->second;
+        uint32_t id = stream.id;
+        if (!frame_stream(reactor, conn, stream))
+        {
+            ++it;
+            continue;
+        }
+        it = session.streams.find(id);
+        if (it == session.streams.end())
+        {
+            /* `frame_stream` reset it, start over, the iterator is gone */
+            it = session.streams.begin();
+            continue;
+        }
+        if (!stream.remote_closed)
+            append_rst_stream(session.frames, id, H2_NO_ERROR);
+        release_connection(reactor, stream.conn);
+        it = session.streams.erase(it);
+    }
+    flush_frames(reactor, conn);
+    if (session.goaway && session.streams.empty())
+        conn.closing = true;
+}
+
+/**
+ * Handle every complete frame in `conn.in`, then send what they produced
+ */
+void process_frames(Reactor &reactor, Connection &conn)
+{
+    size_t consumed = 0;
+    while (!conn.closing && conn.in.length - consumed >= H2_FRAME_HEADER)
+    {
+        const unsigned char *p = (const unsigned char *)conn.in.data + consumed;
+        size_t length = (size_t)p[0] << 16 | (size_t)p[1] << 8 | p[2];
+        if (length > H2_MAX_FRAME)
+        {
+            http2_error(reactor, conn, H2_FRAME_SIZE_ERROR);
+            break;
+        }
+        if (conn.in.length - consumed < H2_FRAME_HEADER + length)
+            break;
+        consumed += H2_FRAME_HEADER + length;
+        if (!handle_frame(reactor, conn, p[3], p[4], read_u32(p + 5) & 0x7fffffff, p + H2_FRAME_HEADER, length))
+            break;
+    }
+    consume_input(reactor.buffers, conn.in, consumed);
+    write_http2(reactor, conn);
+    update_connection_timer(reactor, conn);
+}
+
+/**
+ * Answer what arrived in `conn.in`: HTTP/2 frames once the connection
+ * opened with the HTTP/2 preface, WebSocket frames once a request was
+ * upgraded, HTTP/1.1 requests otherwise
+ */
+void process_input(Reactor &reactor, Connection &conn)
+{
+    if (conn.h2 == nullptr && conn.requests_served == 0 && conn.parser.state == HttpParser::HEAD &&
+        conn.in.length > 0 && conn.in.data[0] == 'P')
+    {
+        size_t size = std::min((size_t)conn.in.length, sizeof(H2_PREFACE) - 1);
+        if (memcmp(conn.in.data, H2_PREFACE, size) == 0)
+        {
+            if (size < sizeof(H2_PREFACE) - 1)
+            {
+                update_connection_timer(reactor, conn);
+                return;
+            }
+            consume_input(reactor.buffers, conn.in, size);
+            start_http2(conn);
+        }
+    }
+    if (conn.ws != nullptr)
+    {
+        process_websocket(reactor, conn);
+        return;
+    }
+    if (conn.h2 != nullptr)
+        process_frames(reactor, conn);
+    else
+        process_requests(reactor, conn);
+    /* Frames the client sent right behind its upgrade */
+    if (conn.ws != nullptr && conn.in.length > 0)
+        process_websocket(reactor, conn);
+}
+
+/**
+ * Account for `written` bytes the socket took from the front of `conn.out`
+ */
+void consume_output(Reactor &reactor, Connection &conn, size_t written)
+{
+    add_metric(reactor.metrics->bytes_out, written);
+    drop_output(reactor, conn, written);
+
+    /* Room for more of a streamed body, a finished one unblocks the requests behind it */
+    if (conn.stream != nullptr && conn.out_bytes < STREAM_MAX_PENDING / 2 && pump_stream(reactor, conn))
+        process_requests(reactor, conn);
+    /* Room for more frames, streams that were held back go on */
+    if (conn.h2 != nullptr && conn.out_bytes < MAX_PENDING_OUTPUT / 2)
+        write_http2(reactor, conn);
+    update_connection_timer(reactor, conn);
+}
+
+/**
+ * Point `iov` at the memory chunks at the front of `conn.out`, at most
+ * `max_iov` of them
+ *
+ * Gathering stops at the first file chunk, those are sent separately.
+ * Returns `true` when a file chunk follows, the caller passes `MSG_MORE`
+ * then so the headers and the first part of the file share a packet.
+ */
+bool gather_output(const Connection &conn, std::vector<iovec> &iov, size_t max_iov)
+{
+    iov.clear();
+    size_t offset = conn.out_offset;
+    for (const OutputChunk *chunk = conn.out.head; chunk != nullptr; chunk = chunk->next)
+    {
+        if (chunk->file != nullptr)
+            return true;
+        if (iov.size() == max_iov)
+            break;
+        iov.push_back({(void *)(chunk->bytes() + offset), chunk->size - offset});
+        offset = 0;
+    }
+    return false;
+}
+
+/**
+ * TLS
+ *
+ * Every client connection gets an OpenSSL session on top of its
+ * non-blocking socket. The handshake runs from the same edge-triggered
+ * events as everything else: `SSL_do_handshake` reads and writes what it
+ * can and tells us whether it waits for the socket to become readable or
+ * writable.
+ *
+ * The context asks for kernel TLS. When the kernel and the negotiated
+ * cipher support it, OpenSSL hands the traffic keys to the socket right
+ * after the handshake and the kernel encrypts everything we send: the
+ * plain `sendmsg` and `sendfile` paths then work unchanged and file
+ * bodies never enter user space. Without kernel TLS the bytes are
+ * encrypted by `SSL_write`, file chunks are first read with `pread`.
+ * Reads always go through `SSL_read`, it only decrypts what the kernel
+ * did not already.
+ *
+ * Sessions resume from OpenSSL's shared session cache or, for clients
+ * that support them, from session tickets. Tickets are sealed with keys
+ * of our own that rotate every `ticket_rotation` seconds; the previous
+ * key still opens a ticket (which is then replaced), so a ticket stays
+ * good for between one and two rotation periods.
+ */
+struct TicketKey
+{
+    unsigned char name[TICKET_KEY_NAME_SIZE];
+    unsigned char aes_key[32];
+    unsigned char hmac_key[32];
+    long created = 0;
+};
+
+/**
+ * The ticket keys of a TLS context, used by every reactor's handshakes
+ * and so behind a lock, held only long enough to copy a key out
+ */
+struct TicketKeys
+{
+    std::mutex lock;
+    TicketKey current;
+    TicketKey previous;
+    int rotation = 0;
+};
+
+bool generate_ticket_key(TicketKey &key, long now)
+{
+    if (RAND_bytes(key.name, sizeof(key.name)) != 1 || RAND_bytes(key.aes_key, sizeof(key.aes_key)) != 1 ||
+        RAND_bytes(key.hmac_key, sizeof(key.hmac_key)) != 1)
+        return false;
+    key.created = now;
+    return true;
+}
+
+/**
+ * Replace the current key once it is `rotation` seconds old, it stays
+ * around as the previous key for one more period. Called with the lock held.
+ */
+bool rotate_ticket_keys(TicketKeys &keys, long now)
+{
+    if (keys.current.created != 0 && now - keys.current.created < keys.rotation)
+        return true;
+    keys.previous = keys.current;
+    if (now - keys.previous.created >= keys.rotation * 2L)
+        keys.previous.created = 0;
+    return generate_ticket_key(keys.current, now);
+}
+
+/**
+ * OpenSSL's hook for sealing (`encrypt`) and opening session tickets
+ *
+ * A new ticket gets the current key's name and a random IV. An incoming
+ * ticket is opened with the key its name refers to: `1` accepts it, `2`
+ * accepts it and asks OpenSSL to issue a fresh one because the key is
+ * about to go, `0` means we no longer have the key and a full handshake
+ * follows.
+ */
+int ticket_key_callback(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *cipher,
+                        EVP_MAC_CTX *mac, int encrypt)
+{
+    TicketKeys &keys = *(TicketKeys *)SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    TicketKey key;
+    int result = 1;
+    {
+        std::lock_guard<std::mutex> guard(keys.lock);
+        if (!rotate_ticket_keys(keys, monotonic_seconds()))
+            return -1;
+        if (encrypt || memcmp(name, keys.current.name, TICKET_KEY_NAME_SIZE) == 0)
+        {
+            key = keys.current;
+        }
+        else if (keys.previous.created != 0 && memcmp(name, keys.previous.name, TICKET_KEY_NAME_SIZE) == 0)
+        {
+            key = keys.previous;
+            result = 2;
+        }
+        else
+        {
+            return 0;
+        }
+    }
+
+    if (encrypt)
+    {
+        memcpy(name, key.name, TICKET_KEY_NAME_SIZE);
+        if (RAND_bytes(iv, EVP_CIPHER_get_iv_length(EVP_aes_256_cbc())) != 1)
+            return -1;
+    }
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac_key, sizeof(key.hmac_key)),
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char *)"SHA256", 0),
+        OSSL_PARAM_construct_end(),
+    };
+    if (EVP_MAC_CTX_set_params(mac, params) != 1 ||
+        EVP_CipherInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key.aes_key, iv, encrypt) != 1)
+        return -1;
+    return result;
+}
+
+/**
+ * ALPN: a client that offers `h2` gets HTTP/2, everything else HTTP/1.1.
+ * Either way the connection starts the same, an HTTP/2 client sends the
+ * preface first.
+ */
+int alpn_select_callback(SSL *, const unsigned char **out, unsigned char *outlen, const unsigned char *in,
+                         unsigned int inlen, void *)
+{
+    static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+    unsigned char *selected = nullptr;
+    if (SSL_select_next_proto(&selected, outlen, protocols, sizeof(protocols) - 1, in, inlen) !=
+        OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+/**
+ * Build the TLS context all reactors share from `tls_cert` (a PEM chain,
+ * leaf first) and `tls_key`, `nullptr` after printing why it failed
+ *
+ * `keys` must outlive the context.
+ */
+SSL_CTX *create_tls_context(const ServerConfig &config, TicketKeys &keys)
+{
+    SSL_CTX *context = SSL_CTX_new(TLS_server_method());
+    if (context == nullptr)
+    {
+        ERR_print_errors_fp(stderr);
+        return nullptr;
+    }
+
+    keys.rotation = config.ticket_rotation;
+    SSL_CTX_set_app_data(context, &keys);
+    SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+
+    /**
+     * Renegotiation would need the keys back from the kernel, and a client
+     * that closes without `close_notify` is an ordinary end of stream.
+     * Partial writes let `SSL_write` return after every record, like a
+     * short `send`; idle connections give their record buffers back.
+     */
+    SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    SSL_CTX_set_mode(context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                                  SSL_MODE_RELEASE_BUFFERS);
+
+    /* A ticket outlives its key by at most one rotation */
+    SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_timeout(context, config.ticket_rotation * 2L);
+    const unsigned char session_context[] = "http_server";
+    SSL_CTX_set_session_id_context(context, session_context, sizeof(session_context) - 1);
+    SSL_CTX_set_alpn_select_cb(context, alpn_select_callback, nullptr);
+
+    if (SSL_CTX_use_certificate_chain_file(context, config.tls_cert.c_str()) != 1 ||
+        SSL_CTX_use_PrivateKey_file(context, config.tls_key.c_str(), SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(context) != 1 ||
+        SSL_CTX_set_tlsext_ticket_key_evp_cb(context, ticket_key_callback) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(context);
+        return nullptr;
+    }
+    return context;
+}
+
+/**
+ * Give a freshly accepted connection its TLS session, the handshake
+ * starts with the first bytes the client sends
+ */
+bool start_tls(SSL_CTX *context, Connection &conn)
+{
+    conn.tls = SSL_new(context);
+    if (conn.tls == nullptr || SSL_set_fd(conn.tls, conn.fd) != 1)
+    {
+        ERR_clear_error();
+        return false;
+    }
+    SSL_set_accept_state(conn.tls);
+    return true;
+}
+
+/**
+ * Move the handshake of `conn` forward
+ *
+ * Returns `1` once it completed, `0` while it waits for the socket
+ * (`want_write` tells whether it waits to write) and `-1` when it failed.
+ */
+int tls_handshake(Reactor &reactor, Connection &conn, bool &want_write)
+{
+    ERR_clear_error();
+    int ret = SSL_do_handshake(conn.tls);
+    if (ret == 1)
+    {
+        conn.ktls_send = BIO_get_ktls_send(SSL_get_wbio(conn.tls)) == 1;
+        add_metric(reactor.metrics->tls_handshakes);
+        if (SSL_session_reused(conn.tls))
+            add_metric(reactor.metrics->tls_resumed);
+        if (conn.ktls_send)
+            add_metric(reactor.metrics->ktls_connections);
+        return 1;
+    }
+
+    int error = SSL_get_error(conn.tls, ret);
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+    {
+        want_write = error == SSL_ERROR_WANT_WRITE;
+        return 0;
+    }
+    SSL_set_quiet_shutdown(conn.tls, 1);
+    ERR_clear_error();
+    add_metric(reactor.metrics->tls_failures);
+    return -1;
+}
+
+/**
+ * Turn a failed `SSL_read` or `SSL_write` into what `read` and `send`
+ * report: `0` once the peer closed, `-1` with `EAGAIN` while OpenSSL waits
+ * for the socket, `-1` with another `errno` when the session broke
+ */
+ssize_t tls_failure(Connection &conn, int ret)
+{
+    int error = SSL_get_error(conn.tls, ret);
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (error == SSL_ERROR_ZERO_RETURN)
+        return 0;
+
+    /* After a fatal error nothing may be sent anymore, not even `close_notify` */
+    SSL_set_quiet_shutdown(conn.tls, 1);
+    ERR_clear_error();
+    if (error != SSL_ERROR_SYSCALL || errno == 0 || errno == EAGAIN)
+        errno = EIO;
+    return -1;
+}
+
+/**
+ * Read decrypted bytes from a TLS connection, behaves like `read`
+ */
+ssize_t tls_read(Connection &conn, char *buf, size_t len)
+{
+    ERR_clear_error();
+    int count = SSL_read(conn.tls, buf, (int)std::min(len, (size_t)INT_MAX));
+    return count > 0 ? count : tls_failure(conn, count);
+}
+
+/**
+ * Encrypt and send the front of `conn.out` with `SSL_write`, for a
+ * connection the kernel does not encrypt for
+ *
+ * Chunks smaller than a record are packed into `reactor.tls_record`, so
+ * pipelined responses share one record instead of paying for one each.
+ * File chunks are read into it with `pread`. Behaves like `send`, except
+ * that `0` means a file shrank under us.
+ *
+ * A write OpenSSL could not finish has to be retried with at least as
+ * many bytes. That holds because the record is rebuilt the same way
+ * from the same front of the queue, which only ever grows at the back.
+ */
+ssize_t tls_send_output(Reactor &reactor, Connection &conn)
+{
+    const OutputChunk &front = conn.out.front();
+    std::string &record = reactor.tls_record;
+    if (record.size() < TLS_RECORD_SIZE)
+        record.resize(TLS_RECORD_SIZE);
+
+    const char *data = record.data();
+    size_t size = 0;
+    if (front.file != nullptr)
+    {
+        size = std::min(front.size - conn.out_offset, (size_t)TLS_RECORD_SIZE);
+        ssize_t count = pread(front.file->fd, &record[0], size, front.file_offset + conn.out_offset);
+        if (count <= 0)
+            return count;
+        size = count;
+    }
+    else if (front.size - conn.out_offset >= TLS_RECORD_SIZE || front.next == nullptr ||
+             front.next->file != nullptr)
+    {
+        data = front.bytes() + conn.out_offset;
+        size = std::min(front.size - conn.out_offset, (size_t)INT_MAX);
+    }
+    else
+    {
+        size_t offset = conn.out_offset;
+        for (const OutputChunk *chunk = &front; chunk != nullptr && chunk->file == nullptr && size < TLS_RECORD_SIZE;
+             chunk = chunk->next)
+        {
+            size_t take = std::min(chunk->size - offset, (size_t)TLS_RECORD_SIZE - size);
+            memcpy(&record[size], chunk->bytes() + offset, take);
+            size += take;
+            offset = 0;
+        }
+    }
+
+    ERR_clear_error();
+    int written = SSL_write(conn.tls, data, (int)size);
+    if (written > 0)
+        return written;
+    if (tls_failure(conn, written) == 0)
+        errno = EPIPE;
+    return -1;
+}
+
+/**
+ * Event loop backends
+ *
+ * Everything above this point (parsing, caches, building responses) only
+ * works on a `Connection`: bytes arrive in `conn.in`, `process_requests`
+ * queues answers in `conn.out` and may set `conn.closing`. Getting bytes
+ * in and out of the socket is the job of an `EventLoop`:
+ *
+ *  - `start` begins accepting clients on the reactor's listening socket
+ *  - `poll` waits up to `timeout_ms` for events and handles them
+ *  - `flush` is called when output was queued outside of the backend's
+ *    own event handling, the backend sends it and closes the connection
+ *    when `closing` is set and nothing is left to send
+ *  - `close` drops a connection, the backend erases it from
+ *    `reactor.connections` once no I/O refers to it anymore
+ *  - `resume` is called when a connection that stopped reading while
+ *    its `BlockingTask` ran got the answer queued, the backend sends it
+ *    and goes on reading
+ *  - `watch` reports an upstream connection to `upstream_ready()` once
+ *    it is ready for `events`, a single time, until `unwatch` before it
+ *    is closed
+ *  - `stop_accepting` takes no new clients from here on and closes the
+ *    listening socket, clients still waiting in its backlog are left to
+ *    whoever else holds it
+ *
+ * Both watch `reactor.completed.event_fd` and call `finish_tasks()`
+ * once it fired. The coroutine handlers that became ready meanwhile run
+ * after every `poll`, in `run_coroutines()`.
+ *
+ * There are two backends, readiness based epoll (the default) and
+ * completion based io_uring, picked with `--backend`.
+ */
+struct EventLoop
+{
+    virtual ~EventLoop() = default;
+    virtual int start(Reactor &reactor) = 0;
+    virtual void poll(Reactor &reactor, int timeout_ms) = 0;
+    virtual void flush(Reactor &reactor, Connection &conn) = 0;
+    virtual void close(Reactor &reactor, Connection &conn) = 0;
+    virtual void resume(Reactor &reactor, Connection &conn) = 0;
+    virtual void watch(Reactor &reactor, UpstreamLink &link, uint32_t events) = 0;
+    virtual void unwatch(Reactor &reactor, UpstreamLink &link) = 0;
+    virtual void stop_accepting(Reactor &reactor) = 0;
+};
+
+/**
+ * Answer the requests whose tasks came back from the pool, in the order
+ * they finished
+ *
+ * A connection goes on with the requests it read meanwhile. The
+ * connection of an HTTP/2 stream has its answer framed and sent on the
+ * parent connection instead.
+ */
+void finish_tasks(Reactor &reactor)
+{
+    BlockingTask *stack = reactor.completed.head.exchange(nullptr, std::memory_order_acquire);
+    BlockingTask *task = nullptr;
+    while (stack != nullptr)
+    {
+        BlockingTask *next = stack->next;
+        stack->next = task;
+        task = stack;
+        stack = next;
+    }
+
+    while (task != nullptr)
+    {
+        reactor.completed.pending--;
+        if (AsyncPromise *coroutine = task->resumes)
+        {
+            /* A coroutine's own task, it goes on once the reactor gets to it */
+            Connection *conn = task->conn;
+            task = task->next;
+            if (conn == nullptr)
+            {
+                destroy_coroutine(reactor, *coroutine);
+                continue;
+            }
+            conn->task = nullptr;
+            wake_coroutine(*coroutine);
+            continue;
+        }
+        std::unique_ptr<BlockingTask> done(task);
+        task = task->next;
+        if (done->conn == nullptr)
+        {
+            done->settle(reactor);
+            continue;
+        }
+        Connection &conn = *done->conn;
+        conn.task = nullptr;
+        done->finish(reactor, conn, done->keep_alive);
+        end_response(reactor, conn, done->keep_alive, done->request_start);
+        process_requests(reactor, conn);
+        if (conn.http2_parent != nullptr)
+        {
+            Connection &parent = *conn.http2_parent;
+            write_http2(reactor, parent);
+            reactor.loop->flush(reactor, parent);
+        }
+        else
+        {
+            reactor.loop->resume(reactor, conn);
+        }
+    }
+}
+
+/**
+ * Go on with a coroutine handler that is ready
+ *
+ * Once it returned its answer is complete and the connection goes on
+ * with the requests it read meanwhile, unless the body is still arriving
+ * (it stopped reading it), the answer then ends with the body. The
+ * connection of an HTTP/2 stream has its output framed and sent on the
+ * parent connection.
+ */
+void resume_coroutine(Reactor &reactor, AsyncPromise &coroutine)
+{
+    Connection &conn = *coroutine.conn;
+    std::coroutine_handle<AsyncPromise> handle = std::coroutine_handle<AsyncPromise>::from_promise(coroutine);
+    coroutine.ready = false;
+    coroutine.waiting = ASYNC_RUNNING;
+    handle.resume();
+    if (handle.done())
+    {
+        bool keep_alive = coroutine.keep_alive;
+        uint64_t started = coroutine.request_start;
+        conn.coroutine = nullptr;
+        destroy_coroutine(reactor, coroutine);
+        if (conn.body == nullptr)
+            end_response(reactor, conn, keep_alive, started);
+    }
+    else if (conn.stream != nullptr)
+    {
+        pump_stream(reactor, conn);
+    }
+    process_requests(reactor, conn);
+    if (conn.http2_parent != nullptr)
+    {
+        Connection &parent = *conn.http2_parent;
+        write_http2(reactor, parent);
+        reactor.loop->flush(reactor, parent);
+    }
+    else
+    {
+        reactor.loop->resume(reactor, conn);
+    }
+}
+
+/**
+ * Resume the coroutines woken since the last round, and the ones they
+ * woke in turn
+ */
+void run_coroutines(Reactor &reactor)
+{
+    for (size_t i = 0; i < reactor.ready.size(); ++i)
+    {
+        if (reactor.ready[i] != nullptr)
+            resume_coroutine(reactor, *reactor.ready[i]);
+    }
+    reactor.ready.clear();
+}
+
+/**
+ * Let the requests that waited for response cache fills go on, most of
+ * them hit now. Returns whether there were any, they may have woken
+ * coroutines in turn.
+ */
+bool wake_cache_waiters(Reactor &reactor)
+{
+    if (reactor.cache.done.empty())
+        return false;
+    std::vector<CacheFill *> done;
+    done.swap(reactor.cache.done);
+    for (CacheFill *fill : done)
+    {
+        /* Answering one may release others, see `release_connection()` */
+        while (!fill->waiters.empty())
+        {
+            Connection &conn = *fill->waiters.front();
+            fill->waiters.erase(fill->waiters.begin());
+            conn.cache_wait = nullptr;
+            process_requests(reactor, conn);
+            if (conn.http2_parent != nullptr)
+            {
+                Connection &parent = *conn.http2_parent;
+                write_http2(reactor, parent);
+                reactor.loop->flush(reactor, parent);
+            }
+            else
+            {
+                reactor.loop->resume(reactor, conn);
+            }
+        }
+        delete fill;
+    }
+    return true;
+}
+
+/**
+ * Upstream proxy
+ *
+ * With `--upstream` the server stands in front of one or more backends:
+ * every request outside `/healthz` is answered by `proxy_request()`, a
+ * coroutine handler that forwards it to a backend and relays the answer.
+ *
+ *  - every reactor keeps its own idle keep-alive connections to every
+ *    backend (`Backend::idle`, at most `upstream_idle`), a request goes
+ *    out on one of them when there is one, so forwarding never takes a
+ *    lock and rarely waits for a connect
+ *  - a request goes to the healthy backend with the fewest requests this
+ *    reactor has in flight there, ties take turns
+ *  - every `UPSTREAM_CHECK_MS` a reactor asks every backend for
+ *    `upstream_health`, a `2xx` marks it healthy and anything else (or no
+ *    answer by the next round) marks it down. A refused connect marks it
+ *    down at once.
+ *
+ * Upstream sockets are watched through the reactor's `EventLoop` like its
+ * clients: a coroutine that has to wait for one awaits `async_upstream()`,
+ * `upstream_ready()` wakes it. While a backend answers the client's
+ * deadlines wait, as for a task, a request whose client went away takes
+ * its upstream connection down with it.
+ */
+UpstreamLink *find_link(UpstreamPool &pool, int fd)
+{
+    if (pool.links.empty())
+        return nullptr;
+    auto it = pool.links.find(fd);
+    return it == pool.links.end() ? nullptr : it->second;
+}
+
+void close_link(Reactor &reactor, UpstreamLink *link)
+{
+    reactor.loop->unwatch(reactor, *link);
+    close(link->fd);
+    reactor.upstreams.links.erase(link->fd);
+    delete link;
+}
+
+/**
+ * Start connecting to `backend`, the connect completes once the socket
+ * turns writable. `nullptr` when there is not even a socket.
+ */
+UpstreamLink *open_link(Reactor &reactor, uint32_t backend)
+{
+    const UpstreamAddress &upstream = reactor.config->upstreams[backend];
+    int fd = socket(upstream.address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return nullptr;
+    /* Heads and bodies leave in separate writes, none of them should wait for an ACK */
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (const sockaddr *)&upstream.address, upstream.address_size) == -1 && errno != EINPROGRESS)
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    UpstreamPool &pool = reactor.upstreams;
+    UpstreamLink *link = new UpstreamLink;
+    link->fd = fd;
+    link->backend = backend;
+    link->generation = ++pool.next_generation;
+    link->connecting = true;
+    pool.links[fd] = link;
+    return link;
+}
+
+/**
+ * Whether the connect on `link` went through, once it turned writable
+ */
+bool finish_connect(UpstreamLink &link)
+{
+    int error = 0;
+    socklen_t size = sizeof(error);
+    if (getsockopt(link.fd, SOL_SOCKET, SO_ERROR, &error, &size) == -1 || error != 0)
+        return false;
+    link.connecting = false;
+    return true;
+}
+
+/**
+ * The healthy backend with the fewest requests in flight, `-1` when all
+ * of them are down
+ */
+int pick_backend(UpstreamPool &pool)
+{
+    int best = -1;
+    size_t count = pool.backends.size();
+    for (size_t i = 0; i < count; ++i)
+    {
+        size_t index = (pool.next_backend + i) % count;
+        const Backend &backend = pool.backends[index];
+        if (backend.healthy && (best == -1 || backend.outstanding < pool.backends[best].outstanding))
+            best = (int)index;
+    }
+    pool.next_backend++;
+    return best;
+}
+
+/**
+ * The upstream connection one proxied request holds. It goes back to
+ * the idle ones when the request is done with it and it can carry
+ * another, otherwise (or when the coroutine is destroyed) it is closed.
+ * `reused` says it was idle before this request.
+ */
+struct UpstreamLease
+{
+    Reactor *reactor = nullptr;
+    UpstreamLink *link = nullptr;
+    bool reused = false;
+
+    ~UpstreamLease()
+    {
+        release(false);
+    }
+
+    void release(bool reusable)
+    {
+        if (link == nullptr)
+            return;
+        Backend &backend = reactor->upstreams.backends[link->backend];
+        backend.outstanding--;
+        link->waiter = nullptr;
+        if (reusable && link->in.empty() && backend.idle.size() < (size_t)reactor->config->upstream_idle)
+        {
+            link->idle = true;
+            backend.idle.push_back(link);
+            reactor->loop->watch(*reactor, *link, POLLIN);
+        }
+        else
+        {
+            close_link(*reactor, link);
+        }
+        link = nullptr;
+    }
+};
+
+/**
+ * Lease a connection to the backend `pick_backend()` names, an idle one
+ * when there is one. `false` when every backend is down or no socket
+ * could be had.
+ */
+bool acquire_link(Reactor &reactor, UpstreamLease &lease)
+{
+    UpstreamPool &pool = reactor.upstreams;
+    int index = pick_backend(pool);
+    if (index == -1)
+        return false;
+    Backend &backend = pool.backends[index];
+    lease.reactor = &reactor;
+    lease.reused = !backend.idle.empty();
+    if (lease.reused)
+    {
+        lease.link = backend.idle.back();
+        backend.idle.pop_back();
+        lease.link->idle = false;
+    }
+    else
+    {
+        lease.link = open_link(reactor, index);
+        if (lease.link == nullptr)
+            return false;
+    }
+    backend.outstanding++;
+    return true;
+}
+
+/**
+ * Read what `link` has into `link.in`: the byte count, `-1` with `errno`
+ * set when nothing was there or the read failed, `0` at the end
+ */
+ssize_t read_link(UpstreamLink &link)
+{
+    size_t old = link.in.size();
+    link.in.resize(old + UPSTREAM_READ_SIZE);
+    ssize_t count = recv(link.fd, &link.in[old], UPSTREAM_READ_SIZE, 0);
+    link.in.resize(old + (count > 0 ? count : 0));
+    return count;
+}
+
+/**
+ * One round of `backend`'s health check, see `advance_check()`
+ */
+void end_check(Reactor &reactor, UpstreamLink &link, bool healthy)
+{
+    Backend &backend = reactor.upstreams.backends[link.backend];
+    backend.check = nullptr;
+    backend.healthy = healthy;
+    close_link(reactor, &link);
+}
+
+/**
+ * Drive a health check on: once connected it sends the request, then it
+ * waits for the status line. The check connection is not pooled and
+ * asks the backend to close it.
+ */
+void advance_check(Reactor &reactor, UpstreamLink &link)
+{
+    const ServerConfig &config = *reactor.config;
+    if (link.connecting)
+    {
+        std::string request = "GET " + config.upstream_health + " HTTP/1.1\r\nHost: " +
+                              config.upstreams[link.backend].name + "\r\nConnection: close\r\n\r\n";
+        /* A fresh socket takes a request this small in one go */
+        if (!finish_connect(link) ||
+            send(link.fd, request.data(), request.size(), MSG_NOSIGNAL) != (ssize_t)request.size())
+        {
+            end_check(reactor, link, false);
+            return;
+        }
+        reactor.loop->watch(reactor, link, POLLIN);
+        return;
+    }
+
+    ssize_t count = read_link(link);
+    if (count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        reactor.loop->watch(reactor, link, POLLIN);
+        return;
+    }
+    if (count > 0 && link.in.size() < 12)
+    {
+        reactor.loop->watch(reactor, link, POLLIN);
+        return;
+    }
+    end_check(reactor, link, link.in.size() >= 12 && link.in.compare(0, 7, "HTTP/1.") == 0 && link.in[9] == '2');
+}
+
+/**
+ * Start a round of health checks when it is due, a check still running
+ * from the last round failed. Returns the milliseconds until the next
+ * round, `-1` without backends.
+ */
+int check_upstreams(Reactor &reactor)
+{
+    UpstreamPool &pool = reactor.upstreams;
+    if (pool.backends.empty())
+        return -1;
+    long now = monotonic_milliseconds();
+    if (now >= pool.next_check)
+    {
+        for (uint32_t i = 0; i < pool.backends.size(); ++i)
+        {
+            Backend &backend = pool.backends[i];
+            if (backend.check != nullptr)
+                end_check(reactor, *backend.check, false);
+            backend.check = open_link(reactor, i);
+            if (backend.check == nullptr)
+                continue;
+            backend.check->check = true;
+            reactor.loop->watch(reactor, *backend.check, POLLOUT);
+        }
+        pool.next_check = now + UPSTREAM_CHECK_MS;
+    }
+    return (int)(pool.next_check - now);
+}
+
+/**
+ * An upstream socket the reactor watched for is ready: its coroutine
+ * goes on, a health check takes its next step. An idle connection has
+ * nothing to say until it is used again, when it turns readable the
+ * backend closed it (or broke the protocol) and it is dropped.
+ */
+void upstream_ready(Reactor &reactor, UpstreamLink &link)
+{
+    if (link.waiter != nullptr)
+    {
+        AsyncPromise *waiter = link.waiter;
+        link.waiter = nullptr;
+        wake_coroutine(*waiter);
+    }
+    else if (link.check)
+    {
+        advance_check(reactor, link);
+    }
+    else if (link.idle)
+    {
+        char byte;
+        ssize_t count = recv(link.fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        {
+            reactor.loop->watch(reactor, link, POLLIN);
+            return;
+        }
+        std::vector<UpstreamLink *> &idle = reactor.upstreams.backends[link.backend].idle;
+        idle.erase(std::find(idle.begin(), idle.end(), &link));
+        close_link(reactor, &link);
+    }
+}
+
+struct AsyncUpstream
+{
+    UpstreamLink &link;
+    uint32_t events;
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<AsyncPromise> handle)
+    {
+        AsyncPromise &coroutine = handle.promise();
+        Reactor &reactor = *coroutine.reactor;
+        coroutine.waiting = ASYNC_UPSTREAM;
+        link.waiter = &coroutine;
+        reactor.loop->watch(reactor, link, events);
+        update_connection_timer(reactor, *coroutine.conn);
+    }
+
+    void await_resume() {}
+};
+
+/* Wait until `link` is ready for `events` (`POLLIN`, `POLLOUT`) */
+AsyncUpstream async_upstream(UpstreamLink &link, uint32_t events)
+{
+    return AsyncUpstream{link, events};
+}
+
+/**
+ * Fields that only concern one hop, they are never forwarded: the
+ * connection options (and `Expect`, which we answered ourselves), and
+ * `Transfer-Encoding` too when the body is passed on without its framing
+ */
+bool hop_by_hop_field(std::string_view name, bool unframed)
+{
+    static const char *const fields[] = {"connection", "keep-alive", "proxy-connection", "upgrade", "te", "expect"};
+    for (const char *field : fields)
+    {
+        if (name.size() == strlen(field) && strncasecmp(name.data(), field, name.size()) == 0)
+            return true;
+    }
+    return unframed && name.size() == 17 && strncasecmp(name.data(), "transfer-encoding", 17) == 0;
+}
+
+/**
+ * Copy a complete `head` to `out` as it is, without its blank line and
+ * without the lines of hop-by-hop fields, see `hop_by_hop_field()`
+ */
+void append_forwarded_head(std::string &out, std::string_view head, bool unframed)
+{
+    size_t eol = head.find("\r\n");
+    out.append(head.data(), eol + 2);
+    for (size_t pos = eol + 2; pos + 2 < head.size(); pos = eol + 2)
+    {
+        eol = head.find("\r\n", pos);
+        std::string_view line = head.substr(pos, eol + 2 - pos);
+        if (!hop_by_hop_field(line.substr(0, line.find(':')), unframed))
+            out.append(line.data(), line.size());
+    }
+}
+
+/**
+ * What a backend's response head says about the framing of the
+ * response and whether the connection can carry another request.
+ * `content_length` is `-1` without a length.
+ */
+struct UpstreamResponse
+{
+    int status = 0;
+    long long content_length = -1;
+    bool chunked = false;
+    bool close = false;
+};
+
+/**
+ * Read the status and the framing fields of a complete response `head`,
+ * `false` when it is not an HTTP/1.x response or its framing is unclear
+ */
+bool parse_upstream_head(std::string_view head, UpstreamResponse &response)
+{
+    if (head.size() < 16 || head.compare(0, 7, "HTTP/1.") != 0 || head[8] != ' ' || !isdigit((unsigned char)head[9]) ||
+        !isdigit((unsigned char)head[10]) || !isdigit((unsigned char)head[11]))
+        return false;
+    response = UpstreamResponse();
+    response.status = (head[9] - '0') * 100 + (head[10] - '0') * 10 + (head[11] - '0');
+    response.close = head[7] == '0';
+
+    size_t eol = head.find("\r\n");
+    for (size_t pos = eol + 2; pos + 2 < head.size(); pos = eol + 2)
+    {
+        eol = head.find("\r\n", pos);
+        std::string_view line = head.substr(pos, eol - pos);
+        size_t colon = line.find(':');
+        if (colon == std::string_view::npos)
+            return false;
+        std::string_view name = line.substr(0, colon);
+        std::string_view value = line.substr(colon + 1);
+        while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+            value.remove_prefix(1);
+        while (!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+            value.remove_suffix(1);
+
+        if (name.size() == 14 && strncasecmp(name.data(), "content-length", 14) == 0)
+        {
+            long long length = 0;
+            for (char c : value)
+            {
+                if (c < '0' || c > '9' || length > (LLONG_MAX - 9) / 10)
+                    return false;
+                length = length * 10 + (c - '0');
+            }
+            if (value.empty() || (response.content_length != -1 && response.content_length != length))
+                return false;
+            response.content_length = length;
+        }
+        else if (name.size() == 17 && strncasecmp(name.data(), "transfer-encoding", 17) == 0)
+        {
+            /* Any other coding ends with the connection, RFC 9112 section 6.3 */
+            response.chunked = header_value_has_token(value, "chunked");
+            if (!response.chunked)
+                response.close = true;
+        }
+        else if (name.size() == 10 && strncasecmp(name.data(), "connection", 10) == 0)
+        {
+            if (header_value_has_token(value, "close"))
+                response.close = true;
+            else if (header_value_has_token(value, "keep-alive"))
+                response.close = false;
+        }
+    }
+    /* Both at once is how responses get smuggled, refuse it */
+    return !(response.chunked && response.content_length != -1);
+}
+
+/**
+ * Collects the decoded bytes of a chunked response, for a client that
+ * gets the body without its framing
+ */
+struct DecodedBody : RequestBody
+{
+    std::string *into = nullptr;
+
+    bool write(const char *data, size_t size) override
+    {
+        if (into != nullptr)
+            into->append(data, size);
+        return true;
+    }
+
+    void finish(Reactor &, Connection &, bool) override {}
+};
+
+/**
+ * Forward the request on `conn` to a backend and relay the answer
+ *
+ * The head goes out as the client sent it minus its hop-by-hop fields,
+ * the body follows as it arrives (chunked again when it came chunked,
+ * the server takes the chunks apart as it reads them). The answer's head
+ * comes back the same way with a `Connection` field of ours, the body
+ * as the backend framed it, unless the client can not take chunks (an
+ * HTTP/1.0 client, an HTTP/2 stream) and gets the decoded body instead.
+ * Interim `1xx` answers are dropped, the client got its `100 Continue`
+ * from us.
+ *
+ * A request that failed before the backend answered is tried again when
+ * nothing of it is lost: on a refused connect (with the backend marked
+ * down) and, for requests without a body, on a pooled connection the
+ * backend just closed. Otherwise the client gets a `502`, or loses its
+ * connection when the answer had begun.
+ */
+Async proxy_request(Reactor &reactor, Connection &conn, const HttpRequest &req, const RouteParams &,
+                    bool keep_alive)
+{
+    bool has_body = req.chunked || req.content_length > 0;
+    bool chunked_request = req.chunked;
+    bool head_only = req.method == "HEAD";
+    bool unframed_client = conn.http2_parent != nullptr || req.version_minor == 0;
+    std::string request;
+    append_forwarded_head(request, req.head, false);
+    request += "\r\n";
+    add_metric(reactor.metrics->upstream_requests);
+
+    UpstreamLease lease;
+    UpstreamResponse response;
+    size_t head_size = 0;
+    for (size_t attempt = 0;; ++attempt)
+    {
+        if (attempt > reactor.upstreams.backends.size() || !acquire_link(reactor, lease))
+        {
+            add_metric(reactor.metrics->upstream_failures);
+            if (attempt == 0)
+                queue_text(reactor, conn, "503 Service Unavailable", "Service Unavailable\n", keep_alive, head_only);
+            else
+                queue_text(reactor, conn, "502 Bad Gateway", "Bad Gateway\n", keep_alive, head_only);
+            co_return;
+        }
+        UpstreamLink &link = *lease.link;
+        if (link.connecting)
+        {
+            co_await async_upstream(link, POLLOUT);
+            if (!finish_connect(link))
+            {
+                reactor.upstreams.backends[link.backend].healthy = false;
+                lease.release(false);
+                continue;
+            }
+        }
+
+        bool failed = false;
+        std::string out = request;
+        bool body_left = has_body;
+        while (!failed)
+        {
+            if (out.empty())
+            {
+                if (!body_left)
+                    break;
+                std::string piece;
+                body_left = co_await async_read(piece);
+                if (!chunked_request)
+                {
+                    out = std::move(piece);
+                    continue;
+                }
+                if (!piece.empty())
+                {
+                    char size[20];
+                    snprintf(size, sizeof(size), "%zx\r\n", piece.size());
+                    out = size + piece + "\r\n";
+                }
+                if (!body_left)
+                    out += "0\r\n\r\n";
+                continue;
+            }
+            ssize_t count = send(link.fd, out.data(), out.size(), MSG_NOSIGNAL);
+            if (count > 0)
+                out.erase(0, count);
+            else if (count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                co_await async_upstream(link, POLLOUT);
+            else if (count != -1 || errno != EINTR)
+                failed = true;
+        }
+
+        while (!failed)
+        {
+            size_t end = link.in.find("\r\n\r\n");
+            if (end != std::string::npos)
+            {
+                head_size = end + 4;
+                if (!parse_upstream_head(std::string_view(link.in).substr(0, head_size), response) ||
+                    response.status == 101)
+                {
+                    lease.release(false);
+                    add_metric(reactor.metrics->upstream_failures);
+                    queue_text(reactor, conn, "502 Bad Gateway", "Bad Gateway\n", keep_alive, head_only);
+                    co_return;
+                }
+                if (response.status >= 200)
+                    break;
+                link.in.erase(0, head_size);
+                continue;
+            }
+            if (link.in.size() > MAX_REQUEST_HEAD)
+            {
+                failed = true;
+                break;
+            }
+            ssize_t count = read_link(link);
+            if (count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                co_await async_upstream(link, POLLIN);
+            else if (count <= 0 && (count != -1 || errno != EINTR))
+                failed = true;
+        }
+        if (!failed)
+            break;
+
+        /* Maybe the backend closed a pooled connection just as we picked it */
+        bool replay = lease.reused && !has_body && link.in.empty();
+        lease.release(false);
+        if (!replay)
+        {
+            add_metric(reactor.metrics->upstream_failures);
+            queue_text(reactor, conn, "502 Bad Gateway", "Bad Gateway\n", keep_alive, head_only);
+            co_return;
+        }
+    }
+
+    UpstreamLink &link = *lease.link;
+    bool no_body = head_only || response.status == 204 || response.status == 304;
+    bool until_close = !no_body && !response.chunked && response.content_length == -1;
+    bool decode = !no_body && response.chunked && unframed_client;
+    bool client_keep_alive = keep_alive && !until_close && !(decode && conn.http2_parent == nullptr);
+
+    std::string head;
+    append_forwarded_head(head, std::string_view(link.in).substr(0, head_size), decode);
+    head += client_keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    link.in.erase(0, head_size);
+    queue_owned(reactor, conn, std::move(head));
+    if (no_body)
+    {
+        lease.release(!response.close);
+        co_return;
+    }
+
+    start_async_relay(conn, client_keep_alive);
+    HttpParser framing;
+    framing.state = HttpParser::CHUNK_SIZE;
+    std::string decoded;
+    DecodedBody sink;
+    sink.into = decode ? &decoded : nullptr;
+    long long left = response.content_length;
+    bool complete = false;
+    while (!complete)
+    {
+        std::string piece;
+        if (response.chunked)
+        {
+            size_t used = 0;
+            framing.body_len = 0;
+            ParseResult result = stream_request_body(framing, link.in.data(), link.in.size(), UINT32_MAX, sink, used);
+            if (result == PARSE_ERROR)
+                break;
+            piece = decode ? std::move(decoded) : link.in.substr(0, used);
+            decoded.clear();
+            link.in.erase(0, used);
+            complete = result == PARSE_COMPLETE;
+        }
+        else
+        {
+            size_t size = until_close ? link.in.size() : (size_t)std::min(left, (long long)link.in.size());
+            piece = link.in.substr(0, size);
+            link.in.erase(0, size);
+            if (!until_close)
+                left -= size;
+            complete = left == 0;
+        }
+        if (!piece.empty())
+            co_await async_write(piece);
+        if (complete)
+            break;
+
+        ssize_t count = read_link(link);
+        if (count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            co_await async_upstream(link, POLLIN);
+        }
+        else if (count == 0 && until_close)
+        {
+            complete = true;
+            response.close = true;
+        }
+        else if (count <= 0 && (count != -1 || errno != EINTR))
+        {
+            break;
+        }
+    }
+
+    lease.release(complete && !response.close);
+    if (!complete)
+    {
+        /* Ending the body here would pass off a truncated one as complete */
+        add_metric(reactor.metrics->upstream_failures);
+        conn.closing = true;
+    }
+}
+
+/**
+ * The routes this server answers, built once in `run_server()`
+ *
+ * With backends every request outside `/healthz` is proxied to them,
+ * with a document root every `GET` outside it is a file, without either
+ * `/hello/:name` greets by name, `/stream/:bytes` streams a generated
+ * body, `/upload` takes a streamed body, `/sleep/:ms` and `/report/:ms`
+ * answer from the worker pool, `/countdown/:n` and `/digest` are coroutines,
+ * `/echo` and `/live/:channel` are WebSockets and everything else gets the
+ * fixed greeting.
+ */
+bool build_router(Router &router, const ServerConfig &config)
+{
+    if (config.routes != nullptr && !config.routes(router))
+        return false;
+    if (!add_route(router, "GET", "/healthz", serve_health))
+        return false;
+    if (!config.upstreams.empty())
+        return add_async_route(router, nullptr, "/*path", proxy_request);
+    if (config.docroot_fd != -1)
+        return add_route(router, "GET", "/*path", serve_static_file);
+    return add_route(router, "GET", "/hello/:name", serve_hello_name) &&
+           add_route(router, "GET", "/stream/:bytes", serve_generated_stream) &&
+           add_route(router, "GET", "/sleep/:ms", serve_sleep) &&
+           add_route(router, "GET", "/report/:ms", serve_report) &&
+           add_async_route(router, "GET", "/countdown/:n", serve_countdown) &&
+           add_async_route(router, "POST", "/digest", serve_digest) &&
+           add_body_route(router, "POST", "/upload", accept_upload) &&
+           add_body_route(router, "PUT", "/upload", accept_upload) &&
+           add_websocket_route(router, "/echo", {nullptr, echo_message}) &&
+           add_websocket_route(router, "/live/:channel", {open_live, nullptr}) &&
+           add_route(router, "POST", "/live/:channel", publish_live) &&
+           add_route(router, nullptr, "/*path", serve_hello);
+}
+
+/**
+ * Result of draining a socket, see `EpollLoop::read_input`
+ */
+enum ReadResult
+{
+    READ_DRAINED,
+    READ_PAUSED,
+    READ_CLOSED,
+};
+
+struct EpollLoop : EventLoop
+{
+    int epoll_fd = -1;
+    std::vector<epoll_event> events;
+    int splice_pipe[2] = {-1, -1};
+
+    ~EpollLoop() override
+    {
+        if (epoll_fd != -1)
+            ::close(epoll_fd);
+        close_splice_pipe();
+    }
+
+    void close_splice_pipe()
+    {
+        for (int &fd : splice_pipe)
+        {
+            if (fd != -1)
+                ::close(fd);
+            fd = -1;
+        }
+    }
+
+    int start(Reactor &reactor) override
+    {
+        /**
+         * Create a epoll instance using `epoll_create1`
+         * it is a special object that can monitor multiple sockets for event
+         *
+         * It returns a file descriptor, flat `0` describes normal epoll_instance
+         */
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd == -1)
+        {
+            perror("epoll_create1");
+            return -1;
+        }
+
+        /**
+         * Adding Listener on `listen` socket
+         * specifically listen on reading
+         * so basically whenever someone trys to connect to the server event is generated
+         * EPOLLIN is generated
+         */
+        epoll_event event{};
+        event.data.fd = reactor.listen_fd;
+        event.events = EPOLLIN;
+
+        /**
+         * `epoll_ctl` is defines a definition for add sockets to the epoll instance
+         * `epoll_ctl(epoll_instance_created, Operation name add or remove, for which fd, event defined earlier)`
+        */
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, reactor.listen_fd, &event) == -1)
+        {
+            perror("epoll_ctl");
+            return -1;
+        }
+
+        /**
+         * This events will store all the epoll events
+         * With the capacity of `MAX_EVENTS`
+         * lets suppose 15 connection simultaneously, it will first handle
+         * 10 clients, remaining 5 clients will go to `epoll_wait()`
+         */
+        event.data.fd = reactor.completed.event_fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, reactor.completed.event_fd, &event) == -1)
+        {
+            perror("epoll_ctl");
+            return -1;
+        }
+
+        events.resize(MAX_EVENTS);
+        return 0;
+    }
+
+    void poll(Reactor &reactor, int timeout_ms) override
+    {
+        /**
+         * epoll_wait stores the socker which are ready for an event
+         * these sockets are stored in event[]
+         *
+         * Methodology:
+         *  When client connects to the listening first it talks to the kernal
+         *  Kernal places this connection request in pending backlog
+         *  This pending backlog is cleared by `accept()`
+         *
+         *  EPOllIN tells the epoll that `alert me when a client tries to connect`
+         *  as soon as client connection comes in our listening socket becomes active
+         */
+        int n = epoll_wait(epoll_fd, events.data(), (int)events.size(), timeout_ms);
+        refresh_response_date(reactor.responses);
+        for (int i = 0; i < n; ++i)
+        {
+            if (events[i].data.fd == reactor.listen_fd)
+            {
+                accept_clients(reactor);
+            }
+            else if (events[i].data.fd == reactor.completed.event_fd)
+            {
+                uint64_t count;
+                if (read(reactor.completed.event_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+                    perror("eventfd read");
+                finish_tasks(reactor);
+            }
+            else if (UpstreamLink *link = find_link(reactor.upstreams, events[i].data.fd))
+            {
+                upstream_ready(reactor, *link);
+            }
+            else
+            {
+                handle_client(reactor, events[i].data.fd, events[i].events);
+            }
+        }
+    }
+
+    void flush(Reactor &reactor, Connection &conn) override
+    {
+        if (!flush_output(reactor, conn) || (conn.closing && conn.out.empty()))
+            close(reactor, conn);
+    }
+
+    /* Upstream sockets are one-shot, every wait arms them again */
+    void watch(Reactor &, UpstreamLink &link, uint32_t events) override
+    {
+        epoll_event event{};
+        event.data.fd = link.fd;
+        event.events = events | EPOLLONESHOT;
+        if (epoll_ctl(epoll_fd, link.registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, link.fd, &event) == -1)
+            perror("epoll_ctl");
+        link.registered = true;
+    }
+
+    void unwatch(Reactor &, UpstreamLink &link) override
+    {
+        if (link.registered)
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, link.fd, nullptr);
+        link.registered = false;
+    }
+
+    /* What waits in the socket is not reported again, read it as if it had just arrived */
+    void resume(Reactor &reactor, Connection &conn) override
+    {
+        handle_client(reactor, conn.fd, EPOLLIN);
+    }
+
+    void stop_accepting(Reactor &reactor) override
+    {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, reactor.listen_fd, nullptr);
+        ::close(reactor.listen_fd);
+        reactor.listen_fd = -1;
+    }
+
+    void close(Reactor &reactor, Connection &conn) override
+    {
+        int client_fd = conn.fd;
+
+        /**
+         * This tells the epoll to stop monitoring this socket, no longer need to watch
+         */
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client_fd, nullptr);
+
+        /* A TLS client is told we are done, unless the session already broke */
+        if (conn.tls != nullptr && SSL_is_init_finished(conn.tls))
+        {
+            ERR_clear_error();
+            SSL_shutdown(conn.tls);
+            ERR_clear_error();
+        }
+        ::close(client_fd);
+        erase_connection(reactor, client_fd);
+    }
+
+    /**
+     * Accept new clients until the backlog is empty or the budget is used up
+     *
+     * `accept4` hands us the client socket already non-blocking and
+     * close-on-exec, which saves the two `fcntl` calls per connection.
+     *
+     * During a connection burst one wakeup drains many clients instead of
+     * one. The budget (`accept_budget`) keeps a huge burst from starving the
+     * clients we already have; the listening socket is level-triggered, so
+     * whatever is left in the backlog is reported again by the next `epoll_wait`.
+     */
+    void accept_clients(Reactor &reactor)
+    {
+        for (int accepted = 0; accepted < reactor.config->accept_budget; ++accepted)
+        {
+            /* Client address details*/
+            sockaddr_in client_addr;
+            socklen_t client_len = sizeof(client_addr);
+
+            /**
+             * Whenever a new client connects, a new file descriptor is created
+             */
+            int client_fd = accept4(reactor.listen_fd, (sockaddr *)&client_addr, &client_len,
+                                    SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client_fd == -1)
+            {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    perror("accept4");
+                return;
+            }
+            uint32_t peer = client_addr.sin_addr.s_addr;
+            if (!admit_client(reactor, client_fd, peer))
+                continue;
+
+            /**
+             * Again creating a specific watcher for this socket
+             * With specified operations such as EPOLLN -> client send data, EPOLLET -> new data arrives
+            */
+            epoll_event client_event{};
+            client_event.data.fd = client_fd;
+            client_event.events = EPOLLIN | EPOLLET;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &client_event) == -1)
+            {
+                perror("epoll_ctl");
+                ::close(client_fd);
+                continue;
+            }
+
+            Connection &conn = open_connection(reactor, client_fd, peer);
+            if (reactor.config->tls_context != nullptr && !start_tls(reactor.config->tls_context, conn))
+                close(reactor, conn);
+        }
+    }
+
+    /**
+     * Update the epoll interest of a client, EPOLLOUT is only wanted while
+     * there is output the socket did not accept yet
+     */
+    void set_want_write(Connection &conn, bool want_write)
+    {
+        if (conn.want_write == want_write)
+            return;
+
+        epoll_event client_event{};
+        client_event.data.fd = conn.fd;
+        client_event.events = EPOLLIN | EPOLLET | (want_write ? (uint32_t)EPOLLOUT : 0u);
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn.fd, &client_event);
+        conn.want_write = want_write;
+    }
+
+    /**
+     * Write out as much of `conn.out` as the socket takes
+     *
+     * Memory chunks are gathered into one `sendmsg`, file chunks go out with
+     * `sendfile`. When a file follows the headers we pass `MSG_MORE`, so the
+     * headers and the first part of the file share a packet. A TLS
+     * connection the kernel does not encrypt for writes through OpenSSL.
+     *
+     * Partial writes are normal on a non-blocking socket: whatever is left
+     * stays queued and we ask epoll to tell us when the socket is writable
+     * again. Returns `false` on a write error.
+     */
+    bool flush_output(Reactor &reactor, Connection &conn)
+    {
+        std::vector<iovec> &iov = reactor.iov;
+        while (!conn.out.empty())
+        {
+            OutputChunk &front = conn.out.front();
+            ssize_t written;
+            if (conn.tls != nullptr && !conn.ktls_send)
+            {
+                written = tls_send_output(reactor, conn);
+                if (written == 0)
+                    return false;
+            }
+            else if (front.file != nullptr)
+            {
+                off_t offset = front.file_offset + conn.out_offset;
+                written = sendfile(conn.fd, front.file->fd, &offset, front.size - conn.out_offset);
+                /* The file shrank under us, we can not send what Content-Length promised */
+                if (written == 0)
+                    return false;
+            }
+            else
+            {
+                bool more = gather_output(conn, iov, IOV_MAX);
+                msghdr msg{};
+                msg.msg_iov = iov.data();
+                msg.msg_iovlen = iov.size();
+                written = sendmsg(conn.fd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+            }
+
+            if (written == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    add_metric(reactor.metrics->write_eagain);
+                    set_want_write(conn, true);
+                    return true;
+                }
+                return false;
+            }
+            consume_output(reactor, conn, written);
+        }
+
+        set_want_write(conn, false);
+        return true;
+    }
+
+    /**
+     * Read everything the socket has into `conn.in`
+     *
+     * Client sockets are edge-triggered, epoll only reports them again when
+     * new data arrives, so we have to keep reading until `EAGAIN` or the data
+     * already sitting in the socket would never be seen.
+     *
+     * We stop early once a lot of responses are queued and the client is not
+     * reading them, the rest waits in the kernel until the output drained.
+     * The same goes while a streamed response is still being produced, a
+     * blocking task works on the request or a coroutine handler holds
+     * the connection.
+     *
+     * The socket is read straight into the end of `conn.in`, a buffer
+     * borrowed from the pool only while we read; when the reads are all
+     * answered (nearly always) it goes back before we return.
+     *
+     * Returns `READ_DRAINED` after `EAGAIN`, `READ_PAUSED` when we stopped
+     * early and `READ_CLOSED` when the peer closed or the read failed.
+     */
+    ReadResult read_input(Reactor &reactor, Connection &conn)
+    {
+        while (!conn.closing)
+        {
+            if (conn.out_bytes >= MAX_PENDING_OUTPUT || conn.stream != nullptr || held_by_server(conn))
+                return READ_PAUSED;
+
+            if (conn.body != nullptr && conn.in.length == 0 && conn.parser.state == HttpParser::BODY)
+            {
+                /* Only plain sockets can be spliced, TLS needs the bytes decrypted */
+                int target = conn.tls == nullptr ? conn.body->splice_target() : -1;
+                if (target != -1 && (splice_pipe[0] != -1 || pipe2(splice_pipe, O_CLOEXEC | O_NONBLOCK) == 0))
+                {
+                    ReadResult result;
+                    if (!splice_input(reactor, conn, target, result))
+                        return result;
+                    continue;
+                }
+            }
+
+            /* A streamed body and HTTP/2 or WebSocket frames are consumed as they arrive, read in large pieces */
+            bool streaming = conn.body != nullptr || conn.h2 != nullptr || conn.ws != nullptr;
+            size_t want = streaming ? BODY_READ_SIZE : MIN_READ_SIZE;
+            char *space = reserve_input(reactor.buffers, conn.in, want);
+            if (space == nullptr)
+            {
+                reject_request(reactor, conn, 413);
+                return READ_DRAINED;
+            }
+
+            size_t room = conn.in.capacity() - conn.in.length;
+            ssize_t count = conn.tls != nullptr ? tls_read(conn, space, room) : read(conn.fd, space, room);
+            if (count > 0)
+            {
+                conn.in.length += count;
+                add_metric(reactor.metrics->bytes_in, count);
+                process_input(reactor, conn);
+                continue;
+            }
+            if (conn.in.length == 0)
+                release_input(reactor.buffers, conn.in);
+            if (count == -1 && errno == EINTR)
+                continue;
+            if (count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                add_metric(reactor.metrics->read_eagain);
+                return READ_DRAINED;
+            }
+
+            /* Peer closed its side or the read failed */
+            return READ_CLOSED;
+        }
+        return READ_DRAINED;
+    }
+
+    /**
+     * Move the rest of a `Content-Length` body from the socket into the
+     * file `conn.body` names, through the reactor's pipe, the bytes never
+     * enter user space
+     *
+     * The pipe is always drained into the file before the next splice from
+     * the socket, so one pipe serves every connection. Returns `true` once
+     * the body is complete, otherwise `false` and what `read_input` should
+     * report in `result`.
+     */
+    bool splice_input(Reactor &reactor, Connection &conn, int target, ReadResult &result)
+    {
+        result = READ_DRAINED;
+        bool moved = false;
+        while (conn.parser.content_length > 0)
+        {
+            ssize_t count = splice(conn.fd, nullptr, splice_pipe[1], nullptr,
+                                   std::min((size_t)conn.parser.content_length, (size_t)BODY_READ_SIZE),
+                                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (count == -1 && errno == EINTR)
+                continue;
+            if (count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                add_metric(reactor.metrics->read_eagain);
+                if (moved)
+                    update_connection_timer(reactor, conn);
+                return false;
+            }
+            if (count <= 0)
+            {
+                result = READ_CLOSED;
+                return false;
+            }
+            add_metric(reactor.metrics->bytes_in, count);
+
+            for (ssize_t done = 0; done < count;)
+            {
+                ssize_t written = splice(splice_pipe[0], nullptr, target, nullptr, count - done, SPLICE_F_MOVE);
+                if (written == -1 && errno == EINTR)
+                    continue;
+                if (written <= 0)
+                {
+                    /* Whatever is stuck in the pipe belongs to this body, start over with a fresh one */
+                    close_splice_pipe();
+                    reject_request(reactor, conn, 500);
+                    return false;
+                }
+                done += written;
+            }
+            conn.body->spliced(count);
+            conn.parser.content_length -= count;
+            conn.parser.body_len += count;
+            moved = true;
+        }
+
+        finish_request_body(reactor, conn);
+        update_connection_timer(reactor, conn);
+        return true;
+    }
+
+    void handle_client(Reactor &reactor, int client_fd, uint32_t ready)
+    {
+        auto it = reactor.connections.find(client_fd);
+        if (it == reactor.connections.end())
+            return;
+        Connection &conn = it->second;
+
+        if (ready & EPOLLERR)
+        {
+            close(reactor, conn);
+            return;
+        }
+
+        if (conn.tls != nullptr && !SSL_is_init_finished(conn.tls))
+        {
+            bool want_write = false;
+            int step = tls_handshake(reactor, conn, want_write);
+            if (step == -1)
+            {
+                close(reactor, conn);
+                return;
+            }
+            set_want_write(conn, want_write);
+            if (step == 0)
+                return;
+        }
+
+        /**
+         * Writing first frees room in `out`, which may be exactly what paused
+         * reading last time. After that we read, answer, and try to flush the
+         * new answers right away.
+         *
+         * When reading paused but the flush then emptied `out`, edge-triggered
+         * epoll will not report the requests still waiting in the socket, so
+         * we go around again ourselves.
+         */
+        ReadResult result;
+        do
+        {
+            if (!flush_output(reactor, conn))
+            {
+                close(reactor, conn);
+                return;
+            }
+            result = read_input(reactor, conn);
+            if (!flush_output(reactor, conn))
+            {
+                close(reactor, conn);
+                return;
+            }
+        } while (result == READ_PAUSED && conn.out.empty() && !held_by_server(conn));
+
+        if (result == READ_CLOSED)
+            conn.closing = true;
+        if (conn.closing && conn.out.empty())
+            close(reactor, conn);
+    }
+};
+
+/**
+ * io_uring backend
+ *
+ * Instead of asking the kernel which sockets are ready and then doing one
+ * syscall per accept, read and write, we hand the kernel long-lived
+ * requests and collect their completions, every `io_uring_enter` submits
+ * and completes a whole batch at once:
+ *
+ *  - one multishot accept on the listening socket produces a completion
+ *    per new client
+ *  - every client has one multishot recv that picks its buffer from a
+ *    provided buffer ring, so no memory is tied up in idle connections
+ *  - responses go out with `sendmsg`, and the last response on a
+ *    connection is linked to the `close`, both leave in a single submission
+ *
+ * Completions are matched to their connection through `user_data`, which
+ * packs the operation, the fd and the connection generation. A
+ * completion for an fd number that was closed and reused meanwhile has a
+ * stale generation and is ignored.
+ *
+ * We talk to the kernel through the raw syscalls, the subset of liburing
+ * we need is small. Needs Linux 6.0 or newer (multishot recv).
+ */
+struct UringSend
+{
+    msghdr msg;
+    iovec iov[URING_SEND_IOV];
+};
+
+enum UringOp : uint64_t
+{
+    URING_ACCEPT = 1,
+    URING_RECV,
+    URING_SEND,
+    URING_POLL_OUT,
+    URING_CLOSE,
+    URING_CANCEL,
+    URING_TASKS,
+    URING_UPSTREAM,
+};
+
+int io_uring_setup(unsigned entries, io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+int io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg,
+                   size_t arg_size)
+{
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+int io_uring_register(int ring_fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+struct UringLoop : EventLoop
+{
+    int ring_fd = -1;
+
+    void *sq_ring = MAP_FAILED;
+    void *cq_ring = MAP_FAILED;
+    size_t sq_ring_size = 0;
+    size_t cq_ring_size = 0;
+    io_uring_sqe *sqes = (io_uring_sqe *)MAP_FAILED;
+    size_t sqes_size = 0;
+
+    unsigned *sq_head = nullptr;
+    unsigned *sq_tail = nullptr;
+    unsigned sq_mask = 0;
+    unsigned sq_entries = 0;
+    unsigned sq_local_tail = 0;
+    unsigned *cq_head = nullptr;
+    unsigned *cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe *cqes = nullptr;
+
+    io_uring_buf_ring *buf_ring = (io_uring_buf_ring *)MAP_FAILED;
+    size_t buf_ring_size = 0;
+    char *buffers = (char *)MAP_FAILED;
+    unsigned short buf_tail = 0;
+
+    uint32_t next_generation = 0;
+    std::vector<UringSend *> free_sends;
+    uint64_t task_signal = 0;
+
+    ~UringLoop() override
+    {
+        for (UringSend *send : free_sends)
+            delete send;
+        if (buffers != MAP_FAILED)
+            munmap(buffers, (size_t)URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE);
+        if (buf_ring != MAP_FAILED)
+            munmap(buf_ring, buf_ring_size);
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqes_size);
+        if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+            munmap(cq_ring, cq_ring_size);
+        if (sq_ring != MAP_FAILED)
+            munmap(sq_ring, sq_ring_size);
+        if (ring_fd != -1)
+            ::close(ring_fd);
+    }
+
+    static uint64_t pack(UringOp op, uint32_t generation, int fd)
+    {
+        return (uint64_t)op << 56 | (uint64_t)(generation & 0xffffff) << 32 | (uint32_t)fd;
+    }
+
+    /**
+     * Create the ring and the provided buffer ring, `-1` when the kernel
+     * does not support what we need (the caller falls back to epoll)
+     */
+    int setup()
+    {
+        /**
+         * Only this reactor thread ever submits, which lets newer kernels
+         * skip locking and run completion work only when we ask for it.
+         * Older kernels reject the flags, so we retry with fewer of them.
+         */
+        const unsigned flag_sets[] = {
+            IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+            IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN,
+            IORING_SETUP_CQSIZE,
+        };
+        io_uring_params params{};
+        for (unsigned flags : flag_sets)
+        {
+            params = io_uring_params{};
+            params.flags = flags;
+            params.cq_entries = URING_QUEUE_DEPTH * 4;
+            ring_fd = io_uring_setup(URING_QUEUE_DEPTH, &params);
+            if (ring_fd >= 0 || errno != EINVAL)
+                break;
+        }
+        if (ring_fd < 0)
+        {
+            perror("io_uring_setup");
+            return -1;
+        }
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG))
+        {
+            std::cerr << "io_uring: kernel too old" << std::endl;
+            return -1;
+        }
+
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        sq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                       IORING_OFF_SQ_RING);
+        if (sq_ring == MAP_FAILED)
+        {
+            perror("mmap");
+            return -1;
+        }
+        cq_ring = sq_ring;
+        cq_ring_size = sq_ring_size;
+
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe *)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                    ring_fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+        {
+            perror("mmap");
+            return -1;
+        }
+
+        char *sq = (char *)sq_ring;
+        sq_head = (unsigned *)(sq + params.sq_off.head);
+        sq_tail = (unsigned *)(sq + params.sq_off.tail);
+        sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+        sq_entries = params.sq_entries;
+        sq_local_tail = *sq_tail;
+        /* Submission slot `i` always uses sqe `i`, the indirection array is never touched again */
+        unsigned *sq_array = (unsigned *)(sq + params.sq_off.array);
+        for (unsigned i = 0; i < sq_entries; ++i)
+            sq_array[i] = i;
+
+        char *cq = (char *)cq_ring;
+        cq_head = (unsigned *)(cq + params.cq_off.head);
+        cq_tail = (unsigned *)(cq + params.cq_off.tail);
+        cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+
+        /**
+         * Receive buffers: `URING_RECV_BUFFERS` buffers of
+         * `URING_RECV_BUFFER_SIZE` bytes shared by all connections of this
+         * reactor. The kernel picks a free one when data arrives and tells
+         * us its id in the completion, we copy the bytes out and hand the
+         * buffer straight back.
+         */
+        buf_ring_size = URING_RECV_BUFFERS * sizeof(io_uring_buf);
+        buf_ring = (io_uring_buf_ring *)mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE,
+                                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        buffers = (char *)mmap(nullptr, (size_t)URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE,
+                               PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buf_ring == MAP_FAILED || buffers == MAP_FAILED)
+        {
+            perror("mmap");
+            return -1;
+        }
+
+        io_uring_buf_reg reg{};
+        reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+        reg.ring_entries = URING_RECV_BUFFERS;
+        reg.bgid = 0;
+        if (io_uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+        {
+            perror("io_uring_register");
+            return -1;
+        }
+        for (unsigned short bid = 0; bid < URING_RECV_BUFFERS; ++bid)
+            recycle_buffer(bid);
+        return 0;
+    }
+
+    /**
+     * Hand buffer `bid` back to the kernel
+     *
+     * The ring is indexed as a plain `io_uring_buf` array: in C++ the
+     * header's flexible `bufs` member starts after an empty struct and no
+     * longer lines up with the slots the kernel reads.
+     */
+    void recycle_buffer(unsigned short bid)
+    {
+        io_uring_buf &buf = ((io_uring_buf *)buf_ring)[buf_tail & (URING_RECV_BUFFERS - 1)];
+        buf.addr = (uint64_t)(uintptr_t)(buffers + (size_t)bid * URING_RECV_BUFFER_SIZE);
+        buf.len = URING_RECV_BUFFER_SIZE;
+        buf.bid = bid;
+        ++buf_tail;
+        __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+    }
+
+    /**
+     * Next free submission slot, submitting what is queued when the ring is full
+     */
+    io_uring_sqe *get_sqe()
+    {
+        while (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+            submit(0, 0);
+        io_uring_sqe *sqe = &sqes[sq_local_tail & sq_mask];
+        memset(sqe, 0, sizeof(*sqe));
+        ++sq_local_tail;
+        return sqe;
+    }
+
+    /**
+     * Submit everything queued and wait for `min_complete` completions,
+     * or at most `timeout_ms` milliseconds (`-1` waits as long as it takes)
+     */
+    void submit(unsigned min_complete, int timeout_ms)
+    {
+        unsigned to_submit = sq_local_tail - *sq_tail;
+        __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+
+        __kernel_timespec ts{};
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        io_uring_getevents_arg arg{};
+        arg.ts = timeout_ms < 0 ? 0 : (uint64_t)(uintptr_t)&ts;
+
+        unsigned flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        if (io_uring_enter(ring_fd, to_submit, min_complete, flags, &arg, sizeof(arg)) == -1 &&
+            errno != EINTR && errno != ETIME && errno != EBUSY && errno != EAGAIN)
+            perror("io_uring_enter");
+    }
+
+    int start(Reactor &reactor) override
+    {
+        if (setup() == -1)
+            return -1;
+        arm_accept(reactor);
+        arm_task_signal(reactor);
+        return 0;
+    }
+
+    /* One read of the eventfd at a time, it completes when tasks came back */
+    void arm_task_signal(Reactor &reactor)
+    {
+        io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = reactor.completed.event_fd;
+        sqe->addr = (uint64_t)(uintptr_t)&task_signal;
+        sqe->len = sizeof(task_signal);
+        sqe->user_data = pack(URING_TASKS, 0, reactor.completed.event_fd);
+    }
+
+    void arm_accept(Reactor &reactor)
+    {
+        io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = reactor.listen_fd;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->user_data = pack(URING_ACCEPT, 0, reactor.listen_fd);
+    }
+
+    void arm_recv(Connection &conn)
+    {
+        io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = conn.fd;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->user_data = pack(URING_RECV, conn.generation, conn.fd);
+        conn.recv_armed = true;
+    }
+
+    /**
+     * The multishot accept is cancelled and the socket closed in one
+     * submission, the close runs however the cancel went
+     */
+    void stop_accepting(Reactor &reactor) override
+    {
+        io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = pack(URING_ACCEPT, 0, reactor.listen_fd);
+        sqe->flags = IOSQE_IO_HARDLINK;
+        sqe->user_data = pack(URING_CANCEL, 0, reactor.listen_fd);
+        sqe = get_sqe();
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = reactor.listen_fd;
+        sqe->user_data = pack(URING_CLOSE, 0, reactor.listen_fd);
+        reactor.listen_fd = -1;
+    }
+
+    void cancel_recv(Connection &conn)
+    {
+        io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = pack(URING_RECV, conn.generation, conn.fd);
+        sqe->user_data = pack(URING_CANCEL, conn.generation, conn.fd);
+    }
+
+    /**
+     * Queue the `close` of a connection, when the sqe queued right before
+     * carries `IOSQE_IO_LINK` the close only runs once that one succeeded
+     */
+    void queue_close(Connection &conn)
+    {
+        io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = conn.fd;
+        sqe->user_data = pack(URING_CLOSE, conn.generation, conn.fd);
+    }
+
+    /**
+     * From here on nothing new is queued for `conn`, its pending recv is
+     * cancelled and the close completion erases it
+     */
+    void begin_close(Connection &conn)
+    {
+        conn.close_submitted = true;
+        if (conn.recv_armed)
+            cancel_recv(conn);
+    }
+
+    void poll(Reactor &reactor, int timeout_ms) override
+    {
+        submit(1, timeout_ms);
+        refresh_response_date(reactor.responses);
+
+        unsigned head = *cq_head;
+        while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+        {
+            io_uring_cqe cqe = cqes[head & cq_mask];
+            ++head;
+            /* Free the slot before handling, handlers may queue new work */
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            handle_completion(reactor, cqe);
+        }
+    }
+
+    Connection *find_connection(Reactor &reactor, uint64_t user_data)
+    {
+        int fd = (int)(uint32_t)user_data;
+        auto it = reactor.connections.find(fd);
+        if (it == reactor.connections.end())
+            return nullptr;
+        if ((it->second.generation & 0xffffff) != ((user_data >> 32) & 0xffffff))
+            return nullptr;
+        return &it->second;
+    }
+
+    void handle_completion(Reactor &reactor, const io_uring_cqe &cqe)
+    {
+        UringOp op = (UringOp)(cqe.user_data >> 56);
+        switch (op)
+        {
+        case URING_ACCEPT:
+            if (cqe.res >= 0)
+            {
+                /* A multishot accept has no address per client, so ask for it when it counts */
+                uint32_t peer = 0;
+                sockaddr_in client_addr;
+                socklen_t client_len = sizeof(client_addr);
+                if ((reactor.config->rate_limit > 0 || reactor.config->access_log_fd != -1) &&
+                    getpeername(cqe.res, (sockaddr *)&client_addr, &client_len) == 0)
+                    peer = client_addr.sin_addr.s_addr;
+                if (admit_client(reactor, cqe.res, peer))
+                {
+                    Connection &conn = open_connection(reactor, cqe.res, peer);
+                    conn.generation = ++next_generation;
+                    arm_recv(conn);
+                }
+            }
+            else if (cqe.res != -EINTR && cqe.res != -ECONNABORTED && cqe.res != -EAGAIN && cqe.res != -ECANCELED)
+            {
+                std::cerr << "io_uring accept: " << strerror(-cqe.res) << std::endl;
+            }
+            if (!(cqe.flags & IORING_CQE_F_MORE) && reactor.listen_fd != -1)
+                arm_accept(reactor);
+            break;
+        case URING_RECV:
+            handle_recv(reactor, cqe);
+            break;
+        case URING_SEND:
+        case URING_POLL_OUT:
+            handle_send(reactor, cqe, op);
+            break;
+        case URING_TASKS:
+            if (cqe.res < 0 && cqe.res != -EINTR && cqe.res != -EAGAIN)
+                std::cerr << "io_uring eventfd read: " << strerror(-cqe.res) << std::endl;
+            arm_task_signal(reactor);
+            finish_tasks(reactor);
+            break;
+        case URING_UPSTREAM:
+        {
+            UpstreamLink *link = find_link(reactor.upstreams, (int)(uint32_t)cqe.user_data);
+            if (link == nullptr || (link->generation & 0xffffff) != ((cqe.user_data >> 32) & 0xffffff) ||
+                cqe.res < 0)
+                break;
+            link->polling &= ~(uint32_t)cqe.res;
+            if (cqe.res & (POLLERR | POLLHUP))
+                link->polling = 0;
+            upstream_ready(reactor, *link);
+            break;
+        }
+        case URING_CLOSE:
+        {
+            Connection *conn = find_connection(reactor, cqe.user_data);
+            if (conn == nullptr)
+                break;
+            /* The linked send failed, so the close was cancelled, close on its own */
+            if (cqe.res == -ECANCELED)
+            {
+                queue_close(*conn);
+                break;
+            }
+            if (conn->uring_send != nullptr)
+                free_sends.push_back(conn->uring_send);
+            erase_connection(reactor, conn->fd);
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    void handle_recv(Reactor &reactor, const io_uring_cqe &cqe)
+    {
+        Connection *conn = find_connection(reactor, cqe.user_data);
+        if (conn != nullptr && !(cqe.flags & IORING_CQE_F_MORE))
+            conn->recv_armed = false;
+
+        if (cqe.flags & IORING_CQE_F_BUFFER)
+        {
+            unsigned short bid = (unsigned short)(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            if (conn != nullptr && cqe.res > 0 && !conn->close_submitted && !conn->closing)
+            {
+                char *space = reserve_input(reactor.buffers, conn->in, cqe.res);
+                if (space == nullptr)
+                {
+                    reject_request(reactor, *conn, 413);
+                }
+                else
+                {
+                    memcpy(space, buffers + (size_t)bid * URING_RECV_BUFFER_SIZE, cqe.res);
+                    conn->in.length += cqe.res;
+                    add_metric(reactor.metrics->bytes_in, cqe.res);
+                }
+            }
+            recycle_buffer(bid);
+        }
+        if (conn == nullptr || conn->close_submitted)
+            return;
+
+        if (cqe.res > 0)
+        {
+            if (!conn->closing)
+                process_input(reactor, *conn);
+
+            /**
+             * Same backpressure as the epoll loop: a client that sends
+             * requests but does not read the answers stops being read
+             * until its output drained, or its streamed response, its
+             * blocking task, its coroutine handler or the cache fill it
+             * waits for ended
+             */
+            if ((conn->out_bytes >= MAX_PENDING_OUTPUT || conn->stream != nullptr ||
+                 held_by_server(*conn)) &&
+                conn->recv_armed && !conn->recv_paused)
+            {
+                conn->recv_paused = true;
+                cancel_recv(*conn);
+            }
+        }
+        else if (cqe.res == 0)
+        {
+            conn->closing = true;
+        }
+        else if (cqe.res != -ENOBUFS && cqe.res != -ECANCELED)
+        {
+            close(reactor, *conn);
+            return;
+        }
+
+        /* A multishot recv ends after errors like running out of buffers, start a new one */
+        if (!conn->recv_armed && !conn->recv_paused && !conn->closing)
+            arm_recv(*conn);
+        flush(reactor, *conn);
+    }
+
+    void handle_send(Reactor &reactor, const io_uring_cqe &cqe, UringOp op)
+    {
+        Connection *conn = find_connection(reactor, cqe.user_data);
+        if (conn == nullptr)
+            return;
+        conn->send_in_flight = false;
+        if (op == URING_SEND && cqe.res > 0)
+            consume_output(reactor, *conn, cqe.res);
+        if (conn->close_submitted)
+            return;
+
+        /* The `msghdr` is free again, an idle connection should not hold one */
+        if (conn->uring_send != nullptr)
+        {
+            free_sends.push_back(conn->uring_send);
+            conn->uring_send = nullptr;
+        }
+        if (cqe.res < 0)
+        {
+            close(reactor, *conn);
+            return;
+        }
+
+        resume_recv(*conn);
+        if (conn->close_requested)
+        {
+            close(reactor, *conn);
+            return;
+        }
+        flush(reactor, *conn);
+    }
+
+    void resume_recv(Connection &conn)
+    {
+        if (conn.recv_paused && conn.out_bytes < MAX_PENDING_OUTPUT / 2 && conn.stream == nullptr &&
+            !held_by_server(conn))
+        {
+            conn.recv_paused = false;
+            if (!conn.recv_armed && !conn.closing)
+                arm_recv(conn);
+        }
+    }
+
+    void resume(Reactor &reactor, Connection &conn) override
+    {
+        if (conn.close_submitted)
+            return;
+        resume_recv(conn);
+        flush(reactor, conn);
+    }
+
+    /* A one-shot poll, unless one for the same events is pending already */
+    void watch(Reactor &, UpstreamLink &link, uint32_t events) override
+    {
+        if ((link.polling & events) == events)
+            return;
+        io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = link.fd;
+        sqe->poll32_events = events;
+        sqe->user_data = pack(URING_UPSTREAM, link.generation, link.fd);
+        link.polling |= events;
+    }
+
+    /* A pending poll holds on to the socket, closing the fd alone would not end it */
+    void unwatch(Reactor &, UpstreamLink &link) override
+    {
+        if (link.polling == 0)
+            return;
+        io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = pack(URING_UPSTREAM, link.generation, link.fd);
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = pack(URING_CANCEL, link.generation, link.fd);
+        link.polling = 0;
+    }
+
+    /**
+     * Send what is queued, one operation in flight per connection
+     *
+     * File chunks are tried with a plain `sendfile` first. When the socket
+     * is full we wait for a POLLOUT completion and try again, io_uring has
+     * no single operation that sends from a file to a socket.
+     */
+    void flush(Reactor &reactor, Connection &conn) override
+    {
+        if (conn.send_in_flight || conn.close_submitted)
+            return;
+
+        while (!conn.out.empty())
+        {
+            OutputChunk &front = conn.out.front();
+            if (front.file == nullptr)
+                break;
+
+            off_t offset = front.file_offset + conn.out_offset;
+            ssize_t written = sendfile(conn.fd, front.file->fd, &offset, front.size - conn.out_offset);
+            if (written > 0)
+            {
+                consume_output(reactor, conn, written);
+                continue;
+            }
+            if (written == -1 && errno == EINTR)
+                continue;
+            if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                add_metric(reactor.metrics->write_eagain);
+                io_uring_sqe *sqe = get_sqe();
+                sqe->opcode = IORING_OP_POLL_ADD;
+                sqe->fd = conn.fd;
+                sqe->poll32_events = POLLOUT;
+                sqe->user_data = pack(URING_POLL_OUT, conn.generation, conn.fd);
+                conn.send_in_flight = true;
+                return;
+            }
+            close(reactor, conn);
+            return;
+        }
+
+        if (conn.out.empty())
+        {
+            /* A client that stopped sending still gets the answer of its task or coroutine */
+            if (conn.closing && conn.task == nullptr && conn.coroutine == nullptr)
+                close(reactor, conn);
+            return;
+        }
+
+        if (conn.uring_send == nullptr)
+        {
+            if (free_sends.empty())
+            {
+                conn.uring_send = new UringSend;
+            }
+            else
+            {
+                conn.uring_send = free_sends.back();
+                free_sends.pop_back();
+            }
+        }
+
+        std::vector<iovec> &iov = reactor.iov;
+        bool more = gather_output(conn, iov, URING_SEND_IOV);
+        UringSend &send = *conn.uring_send;
+        std::copy(iov.begin(), iov.end(), send.iov);
+        send.msg = msghdr{};
+        send.msg.msg_iov = send.iov;
+        send.msg.msg_iovlen = iov.size();
+
+        size_t batch = 0;
+        for (const iovec &v : iov)
+            batch += v.iov_len;
+        bool last = conn.closing && conn.stream == nullptr && batch == conn.out_bytes;
+
+        /**
+         * The last response on a connection goes out linked to the close.
+         * `MSG_WAITALL` makes io_uring retry a short send itself, a short
+         * send would otherwise break the link and skip the close.
+         */
+        if (last)
+            begin_close(conn);
+
+        io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = conn.fd;
+        sqe->addr = (uint64_t)(uintptr_t)&send.msg;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0) | (last ? MSG_WAITALL : 0);
+        sqe->user_data = pack(URING_SEND, conn.generation, conn.fd);
+        conn.send_in_flight = true;
+
+        if (last)
+        {
+            sqe->flags |= IOSQE_IO_LINK;
+            queue_close(conn);
+        }
+    }
+
+    void close(Reactor &, Connection &conn) override
+    {
+        if (conn.close_submitted)
+            return;
+        /* The buffers of a send in flight must stay alive, close once it completes */
+        if (conn.send_in_flight)
+        {
+            conn.close_requested = true;
+            return;
+        }
+        begin_close(conn);
+        queue_close(conn);
+    }
+};
+
+/**
+ * Close every connection whose deadline passed
+ */
+void expire_timers(Reactor &reactor)
+{
+    uint64_t now = (uint64_t)monotonic_milliseconds() / TIMER_TICK_MS;
+    while (TimerNode *node = next_expired_timer(reactor.timers, now))
+    {
+        Connection *conn = (Connection *)((char *)node - offsetof(Connection, timer));
+        if (conn->timer_kind == TIMER_WAKE)
+        {
+            /* Not a timeout, a coroutine's sleep is over */
+            conn->timer_kind = TIMER_NONE;
+            wake_coroutine(*conn->coroutine);
+            continue;
+        }
+        if (conn->ws != nullptr && !conn->ws->ping_sent && !conn->ws->close_sent && !conn->closing)
+        {
+            /* A silent WebSocket gets one ping, any frame back clears it */
+            conn->ws->ping_sent = true;
+            queue_websocket_control(reactor, *conn, WS_PING, "");
+            update_connection_timer(reactor, *conn);
+            reactor.loop->flush(reactor, *conn);
+            continue;
+        }
+        conn->timer_kind = TIMER_NONE;
+        add_metric(reactor.metrics->connections_timed_out);
+        reactor.loop->close(reactor, *conn);
+    }
+}
+
+/**
+ * Graceful shutdown
+ *
+ * `run_server()` sets `draining` once the server is to go away, on `SIGTERM`
+ * or after it handed its listening sockets to a new server, and wakes
+ * every reactor through its eventfd in `event_fds`. A reactor then stops
+ * accepting and lets its clients finish:
+ *
+ *  - every answer from here on carries `Connection: close`
+ *  - keep-alive connections with nothing in flight are closed, the busy
+ *    ones once their last answer went out
+ *  - HTTP/2 connections get a GOAWAY, the streams already open are
+ *    answered and the connection closes after the last of them
+ *  - WebSockets get a close frame saying we are going away (1001) and
+ *    close once the client answered it
+ *  - the admin port is closed as well, scrapes go to whoever took over
+ *
+ * Whatever is still open `drain_timeout` seconds later is dropped. The
+ * reactor ends once it has no connections left and none of its tasks is
+ * out in the pool anymore.
+ */
+struct Shutdown
+{
+    std::atomic<bool> draining{false};
+    std::vector<int> event_fds;
+};
+
+/**
+ * One round of draining: close what is idle (or, past the deadline,
+ * everything), say GOAWAY on HTTP/2 connections and close on WebSockets
+ * that were not told yet
+ */
+void drain_connections(Reactor &reactor)
+{
+    bool expired = monotonic_milliseconds() >= reactor.drain_deadline;
+    /* Closing erases from `connections`, collect first */
+    std::vector<int> fds;
+    fds.reserve(reactor.connections.size());
+    for (auto &entry : reactor.connections)
+        fds.push_back(entry.first);
+
+    for (int fd : fds)
+    {
+        auto it = reactor.connections.find(fd);
+        if (it == reactor.connections.end())
+            continue;
+        Connection &conn = it->second;
+        if (expired)
+        {
+            reactor.loop->close(reactor, conn);
+        }
+        else if (conn.h2 != nullptr && !conn.h2->goaway)
+        {
+            Http2Session &session = *conn.h2;
+            append_frame_header(session.frames, 8, H2_GOAWAY, 0, 0);
+            append_u32(session.frames, session.last_stream);
+            append_u32(session.frames, H2_NO_ERROR);
+            session.goaway = true;
+            write_http2(reactor, conn);
+            reactor.loop->flush(reactor, conn);
+        }
+        else if (conn.ws != nullptr)
+        {
+            if (!conn.ws->close_sent && !conn.closing)
+            {
+                close_websocket(reactor, conn, WS_GOING_AWAY, false);
+                reactor.loop->flush(reactor, conn);
+            }
+        }
+        else if (conn.h2 == nullptr && conn.timer_kind == TIMER_IDLE && conn.coroutine == nullptr &&
+                 conn.task == nullptr && conn.stream == nullptr)
+        {
+            reactor.loop->close(reactor, conn);
+        }
+    }
+}
+
+/**
+ * Queue the broadcasts posted to this reactor on the subscribers of
+ * their channels, see "WebSockets"
+ *
+ * Nothing is flushed or closed until every frame is queued, either may
+ * take a connection out of a channel we are walking. A subscriber that
+ * had nothing queued is flushed, one that can not keep up is closed.
+ */
+void deliver_broadcasts(Reactor &reactor)
+{
+    BroadcastInbox &inbox = *reactor.hub->inboxes[reactor.id];
+    if (!inbox.pending.load(std::memory_order_acquire))
+        return;
+    std::vector<std::shared_ptr<const Broadcast>> queued;
+    {
+        std::lock_guard<std::mutex> guard(inbox.lock);
+        queued.swap(inbox.queued);
+        inbox.pending.store(false, std::memory_order_relaxed);
+    }
+
+    std::vector<Connection *> &fanout = reactor.fanout;
+    std::vector<int> flush_fds;
+    std::vector<int> slow_fds;
+    for (const std::shared_ptr<const Broadcast> &broadcast : queued)
+    {
+        auto channel = reactor.channels.find(broadcast->channel);
+        if (channel == reactor.channels.end())
+            continue;
+        fanout.assign(channel->second.begin(), channel->second.end());
+
+        /* Our own copies, made once for all our subscribers */
+        std::shared_ptr<const std::string> plain;
+        std::shared_ptr<const std::string> deflated;
+        for (Connection *conn : fanout)
+        {
+            if (conn->closing || conn->ws->close_sent)
+                continue;
+            bool compressed = conn->ws->deflate && broadcast->deflated != nullptr;
+            std::shared_ptr<const std::string> &frame = compressed ? deflated : plain;
+            if (frame == nullptr)
+                frame = std::make_shared<const std::string>(compressed ? *broadcast->deflated : *broadcast->plain);
+            if (conn->out_bytes >= MAX_PENDING_OUTPUT)
+            {
+                slow_fds.push_back(conn->fd);
+                conn->closing = true;
+                continue;
+            }
+            if (conn->out.empty())
+                flush_fds.push_back(conn->fd);
+            queue_shared(reactor, *conn, frame);
+            add_metric(reactor.metrics->websocket_broadcasts);
+        }
+    }
+    fanout.clear();
+
+    for (int fd : flush_fds)
+    {
+        auto it = reactor.connections.find(fd);
+        if (it != reactor.connections.end())
+            reactor.loop->flush(reactor, it->second);
+    }
+    for (int fd : slow_fds)
+    {
+        auto it = reactor.connections.find(fd);
+        if (it != reactor.connections.end())
+            reactor.loop->close(reactor, it->second);
+    }
+}
+
+void run_reactor(int id, int listen_fd, const ServerConfig &config, const Router &router,
+                 ReactorMetrics *metrics, WorkerPool *workers, Shutdown *shutdown,
+                 std::atomic<int> *open_connections, AccessLogRing *access_log, WebSocketHub *hub)
+{
+    if (config.pin_cpus && pin_thread_to_cpu(config.reactor_cpus[id]) == -1)
+        std::cerr << "reactor " << id << ": could not pin to CPU " << config.reactor_cpus[id] << std::endl;
+    if (config.numa && prefer_numa_node(config.reactor_nodes[id]) == -1)
+        std::cerr << "reactor " << id << ": could not prefer NUMA node " << config.reactor_nodes[id] << std::endl;
+
+    /**
+     * On the heap rather than the stack, whose top pages the thread that
+     * created us touched first, see "NUMA placement"
+     */
+    std::unique_ptr<Reactor> owned(new Reactor);
+    Reactor &reactor = *owned;
+    reactor.id = id;
+    reactor.listen_fd = listen_fd;
+    reactor.config = &config;
+    reactor.router = &router;
+    reactor.metrics = metrics;
+    reactor.workers = workers;
+    reactor.completed.event_fd = shutdown->event_fds[id];
+    build_response_cache(reactor.responses);
+    reactor.files.capacity = config.file_cache_size;
+    reactor.files.byte_budget = (size_t)config.file_cache_bytes;
+    reactor.cache.budget = (size_t)config.response_cache;
+    reactor.open_connections = open_connections;
+    reactor.access_log = access_log;
+    reactor.hub = hub;
+    if (config.rate_limit > 0)
+    {
+        reactor.limiter.buckets.resize(1 << RATE_LIMIT_BITS);
+        reactor.limiter.rate = config.rate_limit / 1000.0f;
+        reactor.limiter.burst = (float)(config.rate_burst > 0 ? config.rate_burst : config.rate_limit);
+    }
+    reactor.upstreams.backends.resize(config.upstreams.size());
+
+    std::unique_ptr<EventLoop> loop;
+    if (config.backend == "io_uring")
+    {
+        loop.reset(new UringLoop);
+        reactor.loop = loop.get();
+        if (loop->start(reactor) == -1)
+        {
+            std::cerr << "reactor " << id << ": io_uring unavailable, using epoll" << std::endl;
+            loop.reset();
+        }
+    }
+    if (loop == nullptr)
+    {
+        loop.reset(new EpollLoop);
+        reactor.loop = loop.get();
+        if (loop->start(reactor) == -1)
+            return;
+    }
+
+    while (true)
+    {
+        if (!reactor.draining && shutdown->draining.load(std::memory_order_acquire))
+        {
+            reactor.draining = true;
+            reactor.drain_deadline = monotonic_milliseconds() + config.drain_timeout * 1000L;
+            loop->stop_accepting(reactor);
+        }
+        if (reactor.draining)
+            drain_connections(reactor);
+
+        /**
+         * We sleep until the next connection deadline or health check, or
+         * for good while this reactor has no connections and no backends.
+         * While draining we look at the connections every tick.
+         */
+        int timeout_ms = timer_wait_ms(reactor.timers, monotonic_milliseconds());
+        int check_ms = check_upstreams(reactor);
+        if (check_ms != -1 && (timeout_ms == -1 || check_ms < timeout_ms))
+            timeout_ms = check_ms;
+        if (reactor.draining && (timeout_ms == -1 || timeout_ms > TIMER_TICK_MS))
+            timeout_ms = TIMER_TICK_MS;
+        loop->poll(reactor, timeout_ms);
+        expire_timers(reactor);
+        do
+            run_coroutines(reactor);
+        while (wake_cache_waiters(reactor));
+        deliver_broadcasts(reactor);
+        if (reactor.draining && reactor.connections.empty() && reactor.completed.pending == 0)
+            break;
+    }
+}
+
+/**
+ * Admin endpoint
+ *
+ * `/metrics` on `--admin-port` answers with all reactors' metrics summed
+ * up, in the Prometheus text format. It runs on a thread of its own with
+ * plain blocking sockets, scrapes are rare and must never slow down a
+ * reactor.
+ */
+void append_metric(std::string &out, const char *name, const char *type, const char *help, uint64_t value)
+{
+    char line[256];
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", name, help, name, type, name,
+             (unsigned long long)value);
+    out += line;
+}
+
+uint64_t sum_metric(const std::vector<std::unique_ptr<ReactorMetrics>> &reactors,
+                    std::atomic<uint64_t> ReactorMetrics::*counter)
+{
+    uint64_t total = 0;
+    for (const auto &metrics : reactors)
+        total += ((*metrics).*counter).load(std::memory_order_relaxed);
+    return total;
+}
+
+std::string render_metrics(const std::vector<std::unique_ptr<ReactorMetrics>> &reactors)
+{
+    std::string out;
+    uint64_t accepted = sum_metric(reactors, &ReactorMetrics::connections_accepted);
+    uint64_t closed = sum_metric(reactors, &ReactorMetrics::connections_closed);
+    append_metric(out, "http_connections_accepted_total", "counter", "Client connections accepted.", accepted);
+    append_metric(out, "http_connections_closed_total", "counter", "Client connections closed.", closed);
+    append_metric(out, "http_connections_open", "gauge", "Client connections currently open.",
+                  accepted >= closed ? accepted - closed : 0);
+    append_metric(out, "http_connections_timed_out_total", "counter",
+                  "Connections closed because a header, body or idle deadline passed.",
+                  sum_metric(reactors, &ReactorMetrics::connections_timed_out));
+    append_metric(out, "http_connections_refused_total", "counter",
+                  "Clients turned away at accept because --max-connections were open.",
+                  sum_metric(reactors, &ReactorMetrics::connections_refused));
+    append_metric(out, "http_requests_total", "counter", "Requests answered.",
+                  sum_metric(reactors, &ReactorMetrics::requests));
+    append_metric(out, "http_access_log_dropped_total", "counter",
+                  "Requests left out of the access log because its ring was full or sampled.",
+                  sum_metric(reactors, &ReactorMetrics::access_log_dropped));
+    append_metric(out, "http_rate_limited_total", "counter",
+                  "Connections and requests refused because their client went over --rate-limit.",
+                  sum_metric(reactors, &ReactorMetrics::requests_limited));
+    append_metric(out, "http_parse_errors_total", "counter", "Requests rejected as malformed or too large.",
+                  sum_metric(reactors, &ReactorMetrics::parse_errors));
+    append_metric(out, "http_received_bytes_total", "counter", "Bytes read from clients.",
+                  sum_metric(reactors, &ReactorMetrics::bytes_in));
+    append_metric(out, "http_sent_bytes_total", "counter", "Bytes written to clients.",
+                  sum_metric(reactors, &ReactorMetrics::bytes_out));
+    append_metric(out, "http_read_eagain_total", "counter", "Reads that found the socket empty.",
+                  sum_metric(reactors, &ReactorMetrics::read_eagain));
+    append_metric(out, "http_write_eagain_total", "counter", "Writes that found the socket full.",
+                  sum_metric(reactors, &ReactorMetrics::write_eagain));
+    append_metric(out, "http_tls_handshakes_total", "counter", "TLS handshakes completed.",
+                  sum_metric(reactors, &ReactorMetrics::tls_handshakes));
+    append_metric(out, "http_tls_resumed_total", "counter", "TLS handshakes that resumed an earlier session.",
+                  sum_metric(reactors, &ReactorMetrics::tls_resumed));
+    append_metric(out, "http_tls_failures_total", "counter", "TLS handshakes that failed.",
+                  sum_metric(reactors, &ReactorMetrics::tls_failures));
+    append_metric(out, "http_ktls_connections_total", "counter",
+                  "TLS connections whose encryption the kernel took over.",
+                  sum_metric(reactors, &ReactorMetrics::ktls_connections));
+    append_metric(out, "http_tasks_offloaded_total", "counter", "Requests answered from the worker pool.",
+                  sum_metric(reactors, &ReactorMetrics::tasks_offloaded));
+    append_metric(out, "http_upstream_requests_total", "counter", "Requests forwarded to a backend.",
+                  sum_metric(reactors, &ReactorMetrics::upstream_requests));
+    append_metric(out, "http_upstream_failures_total", "counter",
+                  "Proxied requests that failed for want of a working backend.",
+                  sum_metric(reactors, &ReactorMetrics::upstream_failures));
+    append_metric(out, "http_cache_hits_total", "counter", "Requests answered from the response cache.",
+                  sum_metric(reactors, &ReactorMetrics::cache_hits));
+    append_metric(out, "http_cache_misses_total", "counter", "Requests whose answer was offered to the response cache.",
+                  sum_metric(reactors, &ReactorMetrics::cache_misses));
+    append_metric(out, "http_cache_coalesced_total", "counter",
+                  "Requests that waited for the same target to be answered.",
+                  sum_metric(reactors, &ReactorMetrics::cache_coalesced));
+    append_metric(out, "http_websocket_upgrades_total", "counter", "Connections upgraded to WebSocket.",
+                  sum_metric(reactors, &ReactorMetrics::websocket_upgrades));
+    append_metric(out, "http_websocket_messages_received_total", "counter", "WebSocket messages from clients.",
+                  sum_metric(reactors, &ReactorMetrics::websocket_messages));
+    append_metric(out, "http_websocket_broadcast_sends_total", "counter",
+                  "Broadcast frames queued on a subscriber.",
+                  sum_metric(reactors, &ReactorMetrics::websocket_broadcasts));
+
+    uint64_t buckets[LATENCY_BUCKETS];
+    uint64_t count = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; ++i)
+    {
+        buckets[i] = 0;
+        for (const auto &metrics : reactors)
+            buckets[i] += metrics->latency[i].load(std::memory_order_relaxed);
+        count += buckets[i];
+    }
+
+    /**
+     * The exported histogram has one bucket per power of two from about
+     * 1 us to 34 s, those boundaries fall exactly on internal buckets
+     */
+    const char *name = "http_request_duration_seconds";
+    out += "# HELP http_request_duration_seconds Time from reading a request to sending the last byte of its response.\n";
+    out += "# TYPE http_request_duration_seconds histogram\n";
+    char line[256];
+    uint64_t cumulative = 0;
+    int bucket = 0;
+    for (int bit = 10; bit <= 35; ++bit)
+    {
+        uint64_t bound = (uint64_t)1 << bit;
+        while (bucket < LATENCY_BUCKETS && latency_bucket_end(bucket) <= bound)
+            cumulative += buckets[bucket++];
+        snprintf(line, sizeof(line), "%s_bucket{le=\"%.9g\"} %llu\n", name, bound / 1e9,
+                 (unsigned long long)cumulative);
+        out += line;
+    }
+    snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9f\n%s_count %llu\n", name,
+             (unsigned long long)count, name,
+             sum_metric(reactors, &ReactorMetrics::latency_sum_ns) / 1e9, name, (unsigned long long)count);
+    out += line;
+
+    /* Quantiles straight from the fine buckets, each is the end of its bucket */
+    out += "# HELP http_request_duration_quantile_seconds Request latency quantiles since start.\n";
+    out += "# TYPE http_request_duration_quantile_seconds gauge\n";
+    const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    for (double quantile : quantiles)
+    {
+        uint64_t wanted = (uint64_t)(quantile * count);
+        uint64_t seen = 0;
+        uint64_t value = 0;
+        for (int i = 0; i < LATENCY_BUCKETS && count > 0; ++i)
+        {
+            seen += buckets[i];
+            if (seen > wanted)
+            {
+                value = latency_bucket_end(i);
+                break;
+            }
+        }
+        snprintf(line, sizeof(line), "http_request_duration_quantile_seconds{quantile=\"%g\"} %.9f\n", quantile,
+                 value / 1e9);
+        out += line;
+    }
+    return out;
+}
+
+/* Append `text` to `out` as the inside of a JSON string */
+void append_json_text(std::string &out, const char *text, size_t size)
+{
+    static const char hex[] = "0123456789abcdef";
+    for (size_t i = 0; i < size; ++i)
+    {
+        unsigned char c = (unsigned char)text[i];
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += (char)c;
+        }
+        else if (c < 0x20 || c >= 0x7f)
+        {
+            out += "\\u00";
+            out += hex[c >> 4];
+            out += hex[c & 15];
+        }
+        else
+        {
+            out += (char)c;
+        }
+    }
+}
+
+/**
+ * Append `record`, logged by reactor `reactor`, to `out` as one line of
+ * JSON. `second` and `date` remember the last second formatted.
+ */
+void format_access_record(std::string &out, const AccessRecord &record, int reactor, time_t &second, char *date)
+{
+    time_t when = (time_t)(record.time_ms / 1000);
+    if (when != second)
+    {
+        tm parts;
+        gmtime_r(&when, &parts);
+        strftime(date, 21, "%Y-%m-%dT%H:%M:%S", &parts);
+        second = when;
+    }
+    char line[160];
+    snprintf(line, sizeof(line), "{\"time\":\"%s.%03uZ\",\"reactor\":%d,\"client\":", date,
+             (unsigned)(record.time_ms % 1000), reactor);
+    out += line;
+    if (record.peer == 0)
+    {
+        out += "null";
+    }
+    else
+    {
+        char address[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &record.peer, address, sizeof(address));
+        out += '"';
+        out += address;
+        out += '"';
+    }
+    out += ",\"method\":\"";
+    append_json_text(out, record.method, strnlen(record.method, sizeof(record.method)));
+    out += "\",\"target\":\"";
+    append_json_text(out, record.target, record.target_len);
+    snprintf(line, sizeof(line),
+             "\",%s\"protocol\":\"HTTP/%s\",\"status\":%u,\"bytes\":%llu,\"duration_us\":%u}\n",
+             record.truncated ? "\"truncated\":true," : "",
+             record.version == 20 ? "2" : (record.version == 11 ? "1.1" : "1.0"), (unsigned)record.status,
+             (unsigned long long)record.bytes, (unsigned)record.duration_us);
+    out += line;
+}
+
+/* Write out what `out` holds and empty it, a log that fails loses those lines */
+void write_access_log(int fd, std::string &out)
+{
+    size_t written = 0;
+    while (written < out.size())
+    {
+        ssize_t n = write(fd, out.data() + written, out.size() - written);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            perror("access log");
+            break;
+        }
+        written += n;
+    }
+    out.clear();
+}
+
+/**
+ * The access log thread: it takes what the reactors put into their rings
+ * and writes it to `fd`, see "Access logging". Once `stop` is set it
+ * empties the rings a last time and returns.
+ */
+void run_access_log(int fd, const std::vector<std::unique_ptr<AccessLogRing>> &rings, const std::atomic<bool> &stop)
+{
+    std::string out;
+    out.reserve(ACCESS_LOG_BATCH + 512);
+    time_t second = -1;
+    char date[21] = {};
+    for (;;)
+    {
+        bool stopping = stop.load(std::memory_order_acquire);
+        bool busy = false;
+        for (size_t i = 0; i < rings.size(); ++i)
+        {
+            AccessLogRing &ring = *rings[i];
+            uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+            uint64_t head = ring.head.load(std::memory_order_acquire);
+            busy |= head != tail;
+            for (; tail != head; ++tail)
+            {
+                format_access_record(out, ring.records[tail % ACCESS_LOG_RING], (int)i, second, date);
+                if (out.size() >= ACCESS_LOG_BATCH)
+                    write_access_log(fd, out);
+            }
+            ring.tail.store(tail, std::memory_order_release);
+        }
+        if (!out.empty())
+            write_access_log(fd, out);
+        if (stopping)
+            return;
+        if (!busy)
+            std::this_thread::sleep_for(std::chrono::milliseconds(ACCESS_LOG_FLUSH_MS));
+    }
+}
+
+/**
+ * Accept admin clients one at a time, read their request and answer it
+ *
+ * Once `stop_fd` fires the server is draining: the listening socket is
+ * closed, like the reactors close theirs, so scrapes on a shared port go
+ * to the server that takes over instead of alternating between both.
+ */
+void run_admin(int listen_fd, int stop_fd, const std::vector<std::unique_ptr<ReactorMetrics>> &metrics)
+{
+    while (true)
+    {
+        pollfd ready[2] = {};
+        ready[0].fd = listen_fd;
+        ready[0].events = POLLIN;
+        ready[1].fd = stop_fd;
+        ready[1].events = POLLIN;
+        if (poll(ready, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+        if (ready[1].revents != 0)
+            break;
+
+        int client_fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client_fd == -1)
+            continue;
+
+        /* A client that stalls gets dropped instead of blocking the next scrape */
+        timeval timeout{};
+        timeout.tv_sec = 1;
+        setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        char buf[4096];
+        size_t len = 0;
+        while (len < sizeof(buf))
+        {
+            ssize_t count = read(client_fd, buf + len, sizeof(buf) - len);
+            if (count <= 0)
+                break;
+            len += count;
+            if (memmem(buf, len, "\r\n\r\n", 4) != nullptr)
+                break;
+        }
+
+        std::string_view request(buf, len);
+        std::string body;
+        const char *status = "404 Not Found";
+        if (request.rfind("GET /metrics ", 0) == 0 || request.rfind("GET /metrics?", 0) == 0)
+        {
+            status = "200 OK";
+            body = render_metrics(metrics);
+        }
+        else
+        {
+            body = "Not Found\n";
+        }
+
+        std::string response = "HTTP/1.1 ";
+        response += status;
+        response += "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: ";
+        response += std::to_string(body.size());
+        response += "\r\nConnection: close\r\n\r\n";
+        response += body;
+        for (size_t sent = 0; sent < response.size();)
+        {
+            ssize_t count = send(client_fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (count <= 0)
+                break;
+            sent += count;
+        }
+        close(client_fd);
+    }
+    close(listen_fd);
+}
+
+/**
+ * Look up the address of `upstream.name` (`HOST:PORT`, an IPv6 address
+ * in brackets), `false` after saying why it has none
+ */
+bool resolve_upstream(UpstreamAddress &upstream)
+{
+    size_t colon = upstream.name.rfind(':');
+    if (colon == std::string::npos || colon == 0 || colon + 1 == upstream.name.size())
+    {
+        std::cerr << "upstream " << upstream.name << ": expected HOST:PORT" << std::endl;
+        return false;
+    }
+    std::string host = upstream.name.substr(0, colon);
+    std::string port = upstream.name.substr(colon + 1);
+    if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+        host = host.substr(1, host.size() - 2);
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *found = nullptr;
+    int error = getaddrinfo(host.c_str(), port.c_str(), &hints, &found);
+    if (error != 0)
+    {
+        std::cerr << "upstream " << upstream.name << ": " << gai_strerror(error) << std::endl;
+        return false;
+    }
+    memcpy(&upstream.address, found->ai_addr, found->ai_addrlen);
+    upstream.address_size = found->ai_addrlen;
+    freeaddrinfo(found);
+    return true;
+}
+
+int parse_args(int argc, char **argv, ServerConfig &config)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h")
+        {
+            return 1;
+        }
+        else if (arg == "--pin-cpus")
+        {
+            config.pin_cpus = true;
+        }
+        else if (arg == "--numa")
+        {
+            config.numa = true;
+        }
+        else if (arg == "--steer" && i + 1 < argc)
+        {
+            config.steer = argv[++i];
+            if (config.steer != "incoming-cpu" && config.steer != "cbpf")
+                return -1;
+        }
+        else if ((arg == "--port" || arg == "--workers" || arg == "--idle-timeout" ||
+                  arg == "--header-timeout" || arg == "--body-timeout" || arg == "--max-requests" ||
+                  arg == "--accept-budget" || arg == "--file-cache" || arg == "--admin-port" ||
+                  arg == "--ticket-rotation" || arg == "--task-threads" || arg == "--upstream-idle" ||
+                  arg == "--drain-timeout" || arg == "--max-connections" || arg == "--rate-limit" ||
+                  arg == "--rate-burst" || arg == "--websocket-deflate" || arg == "--websocket-ping") &&
+                 i + 1 < argc)
+        {
+            char *end = nullptr;
+            long value = std::strtol(argv[++i], &end, 10);
+            if (*end != '\0' || value < 0 || value > 1000000)
+                return -1;
+            if (arg == "--port" || arg == "--admin-port")
+            {
+                if (value > 65535)
+                    return -1;
+                if (arg == "--port")
+                    config.port = (int)value;
+                else
+                    config.admin_port = (int)value;
+            }
+            else if (arg == "--workers")
+                config.workers = (int)value;
+            else if (arg == "--idle-timeout")
+                config.idle_timeout = (int)value;
+            else if (arg == "--header-timeout")
+                config.header_timeout = (int)value;
+            else if (arg == "--body-timeout")
+                config.body_timeout = (int)value;
+            else if (arg == "--max-requests")
+                config.max_requests = (int)value;
+            else if (arg == "--file-cache")
+                config.file_cache_size = (int)value;
+            else if (arg == "--ticket-rotation")
+                config.ticket_rotation = value > 0 ? (int)value : 1;
+            else if (arg == "--task-threads")
+                config.task_threads = value > 0 ? (int)std::min(value, 1024L) : 1;
+            else if (arg == "--upstream-idle")
+                config.upstream_idle = (int)value;
+            else if (arg == "--drain-timeout")
+                config.drain_timeout = (int)value;
+            else if (arg == "--max-connections")
+                config.max_connections = (int)value;
+            else if (arg == "--rate-limit")
+                config.rate_limit = (int)value;
+            else if (arg == "--rate-burst")
+                config.rate_burst = (int)value;
+            else if (arg == "--websocket-deflate")
+            {
+                if (value > 9)
+                    return -1;
+                config.websocket_deflate = (int)value;
+            }
+            else if (arg == "--websocket-ping")
+                config.websocket_ping = value > 0 ? (int)value : 1;
+            else
+                config.accept_budget = value > 0 ? (int)value : 1;
+        }
+        else if ((arg == "--response-cache" || arg == "--file-cache-bytes") && i + 1 < argc)
+        {
+            char *end = nullptr;
+            long long value = std::strtoll(argv[++i], &end, 10);
+            if (*end != '\0' || value < 0 || value > (1LL << 40))
+                return -1;
+            if (arg == "--response-cache")
+                config.response_cache = (long)value;
+            else
+                config.file_cache_bytes = (long)value;
+        }
+        else if ((arg == "--body-memory" || arg == "--max-body") && i + 1 < argc)
+        {
+            /* Bodies are counted in 32 bits, and one held in memory has to fit the largest input buffer */
+            char *end = nullptr;
+            long long value = std::strtoll(argv[++i], &end, 10);
+            long long limit = UINT32_MAX;
+            if (arg == "--body-memory")
+                limit = (BUFFER_MIN_SIZE << (BUFFER_CLASSES - 1)) - MAX_REQUEST_HEAD;
+            if (*end != '\0' || value < 0 || value > limit)
+                return -1;
+            if (arg == "--max-body")
+                config.max_body = (long)value;
+            else
+                config.body_memory = (long)value;
+        }
+        else if (arg == "--websocket-max-message" && i + 1 < argc)
+        {
+            char *end = nullptr;
+            long long value = std::strtoll(argv[++i], &end, 10);
+            if (*end != '\0' || value <= 0 || value > UINT32_MAX)
+                return -1;
+            config.websocket_max_message = (long)value;
+        }
+        else if (arg == "--access-log" && i + 1 < argc)
+        {
+            config.access_log = argv[++i];
+        }
+        else if (arg == "--access-log-overflow" && i + 1 < argc)
+        {
+            std::string policy = argv[++i];
+            if (policy != "drop" && policy != "sample")
+                return -1;
+            config.access_log_sample = policy == "sample";
+        }
+        else if (arg == "--spool-dir" && i + 1 < argc)
+        {
+            config.spool_dir = argv[++i];
+        }
+        else if (arg == "--compress" && i + 1 < argc)
+        {
+            std::string value = argv[++i];
+            size_t equals = value.find('=');
+            if (equals == std::string::npos || equals == 0)
+                return -1;
+            CompressionRule rule = {value.substr(0, equals), {0, 0, 0}};
+            char *end = nullptr;
+            rule.levels[ENCODING_GZIP] = (int)std::strtol(value.c_str() + equals + 1, &end, 10);
+            if (*end != ',')
+                return -1;
+            rule.levels[ENCODING_BROTLI] = (int)std::strtol(end + 1, &end, 10);
+            if (*end != '\0' || rule.levels[ENCODING_GZIP] < 0 || rule.levels[ENCODING_GZIP] > 9 ||
+                rule.levels[ENCODING_BROTLI] < 0 || rule.levels[ENCODING_BROTLI] > 11)
+                return -1;
+
+            auto same = std::find_if(config.compression.begin(), config.compression.end(),
+                                     [&](const CompressionRule &other) { return other.type == rule.type; });
+            if (same != config.compression.end())
+                *same = rule;
+            else
+                config.compression.push_back(rule);
+        }
+        else if (arg == "--docroot" && i + 1 < argc)
+        {
+            config.docroot = argv[++i];
+        }
+        else if (arg == "--tls-cert" && i + 1 < argc)
+        {
+            config.tls_cert = argv[++i];
+        }
+        else if (arg == "--tls-key" && i + 1 < argc)
+        {
+            config.tls_key = argv[++i];
+        }
+        else if (arg == "--upstream" && i + 1 < argc)
+        {
+            UpstreamAddress upstream;
+            upstream.name = argv[++i];
+            config.upstreams.push_back(upstream);
+        }
+        else if (arg == "--upstream-health" && i + 1 < argc)
+        {
+            config.upstream_health = argv[++i];
+            if (config.upstream_health.empty() || config.upstream_health[0] != '/')
+                return -1;
+        }
+        else if (arg == "--handoff" && i + 1 < argc)
+        {
+            config.handoff = argv[++i];
+            if (config.handoff.size() >= sizeof(sockaddr_un::sun_path) - 16)
+                return -1;
+        }
+        else if (arg == "--backend" && i + 1 < argc)
+        {
+            config.backend = argv[++i];
+            if (config.backend != "epoll" && config.backend != "io_uring")
+                return -1;
+        }
+        else
+        {
+            return -1;
+        }
+    }
+    if (config.tls_cert.empty() != config.tls_key.empty())
+        return -1;
+    return 0;
+}
+
+/**
+ * Graceful reload
+ *
+ * A server started with `--handoff PATH` listens on the Unix socket
+ * PATH. A new server started with the same option connects there before
+ * it opens any listening socket of its own, and the running server
+ * hands its listening sockets over with `SCM_RIGHTS`:
+ *
+ *  - both processes now hold the very same sockets, the port never stops
+ *    accepting and no client waiting in a backlog is lost
+ *  - once its reactors run the new server takes PATH over for the next
+ *    reload and confirms with one byte, the old one then drains (see
+ *    "Graceful shutdown") and exits
+ *  - a new server that dies before it confirmed leaves the old one
+ *    serving as if nothing happened
+ *
+ * Nothing listening at PATH means there is no server to take over from,
+ * the new one opens its sockets itself. Every socket taken over gets a
+ * reactor, so `--workers` can grow across a reload but not shrink. The
+ * admin port is not handed over, both servers bind it with `SO_REUSEPORT`.
+ *
+ * Only a process of our own user may connect.
+ */
+sockaddr_un handoff_address(const std::string &path)
+{
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, path.data(), path.size());
+    return address;
+}
+
+/**
+ * Take the listening sockets over from the server at `config.handoff`, a
+ * socket for another port is not ours and closed. Returns the connection
+ * to confirm on, `-1` when no server runs there.
+ */
+int take_over_listeners(const ServerConfig &config, std::vector<int> &listen_fds)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        perror("socket");
+        return -1;
+    }
+    sockaddr_un address = handoff_address(config.handoff);
+    if (connect(fd, (sockaddr *)&address, sizeof(address)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    timeval timeout = {HANDOFF_TIMEOUT_MS / 1000, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    uint32_t count = 0;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    iovec iov = {&count, sizeof(count)};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != (ssize_t)sizeof(count))
+    {
+        std::cerr << "handoff: no listening sockets from " << config.handoff << std::endl;
+        close(fd);
+        return -1;
+    }
+
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        size_t fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < fds; ++i)
+        {
+            int listen_fd;
+            memcpy(&listen_fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            sockaddr_in bound{};
+            socklen_t size = sizeof(bound);
+            if (getsockname(listen_fd, (sockaddr *)&bound, &size) == 0 && bound.sin_family == AF_INET &&
+                ntohs(bound.sin_port) == config.port)
+                listen_fds.push_back(listen_fd);
+            else
+                close(listen_fd);
+        }
+    }
+    return fd;
+}
+
+/**
+ * Listen on PATH for the next server, bound under a name of our own
+ * first and renamed, so PATH always leads to a server. `-1` on error.
+ */
+int listen_handoff(const std::string &path)
+{
+    std::string bound = path + "." + std::to_string(getpid());
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        perror("socket");
+        return -1;
+    }
+    sockaddr_un address = handoff_address(bound);
+    unlink(bound.c_str());
+    if (bind(fd, (sockaddr *)&address, sizeof(address)) == -1 || chmod(bound.c_str(), 0600) == -1 ||
+        listen(fd, 1) == -1 || rename(bound.c_str(), path.c_str()) == -1)
+    {
+        perror(path.c_str());
+        unlink(bound.c_str());
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Serve one server connecting to `handoff_fd`: send it `listen_fds` and
+ * wait for it to confirm, `true` once it took over
+ */
+bool hand_off_listeners(int handoff_fd, const std::vector<int> &listen_fds)
+{
+    int fd = accept4(handoff_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd == -1)
+        return false;
+    ucred peer{};
+    socklen_t size = sizeof(peer);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &size) == -1 || peer.uid != geteuid())
+    {
+        close(fd);
+        return false;
+    }
+
+    uint32_t count = (uint32_t)std::min(listen_fds.size(), (size_t)HANDOFF_MAX_FDS);
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)] = {};
+    iovec iov = {&count, sizeof(count)};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), listen_fds.data(), sizeof(int) * count);
+
+    char confirmed = 0;
+    pollfd reply = {fd, POLLIN, 0};
+    bool took_over = sendmsg(fd, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(count) &&
+                     ::poll(&reply, 1, HANDOFF_TIMEOUT_MS) == 1 && read(fd, &confirmed, 1) == 1;
+    close(fd);
+    if (took_over)
+        std::cout << "Listening sockets handed over to process " << peer.pid << ", draining" << std::endl;
+    else
+        std::cerr << "handoff: process " << peer.pid << " did not take over" << std::endl;
+    return took_over;
+}
+
+/**
+ * Block until the server is to stop: `SIGTERM` arrived on `signal_fd`
+ * or a new server took over through `handoff_fd` (`-1` without one)
+ */
+void wait_for_shutdown(int signal_fd, int handoff_fd, const std::vector<int> &listen_fds)
+{
+    pollfd events[2] = {{signal_fd, POLLIN, 0}, {handoff_fd, POLLIN, 0}};
+    while (true)
+    {
+        if (::poll(events, handoff_fd == -1 ? 1 : 2, -1) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            return;
+        }
+        if (events[0].revents & POLLIN)
+        {
+            std::cout << "SIGTERM, draining" << std::endl;
+            return;
+        }
+        if ((events[1].revents & POLLIN) && hand_off_listeners(handoff_fd, listen_fds))
+            return;
+    }
+}
+
+void print_usage(const char *program)
+{
+    std::cerr << "usage: " << program << " [--port N] [--workers N] [--pin-cpus] [--numa] [--steer incoming-cpu|cbpf]"
+              << " [--idle-timeout N] [--header-timeout N] [--body-timeout N]"
+              << " [--max-requests N] [--accept-budget N]"
+              << " [--max-connections N] [--rate-limit N] [--rate-burst N]"
+              << " [--docroot DIR] [--file-cache N] [--file-cache-bytes BYTES]"
+              << " [--response-cache BYTES] [--backend epoll|io_uring]"
+              << " [--access-log FILE] [--access-log-overflow drop|sample]"
+              << " [--admin-port N] [--body-memory BYTES] [--max-body BYTES] [--spool-dir DIR]"
+              << " [--compress TYPE=GZIP,BROTLI] [--tls-cert FILE --tls-key FILE] [--ticket-rotation N]"
+              << " [--task-threads N] [--upstream HOST:PORT]... [--upstream-idle N] [--upstream-health PATH]"
+              << " [--handoff PATH] [--drain-timeout N] [--help]"
+              << " [--websocket-deflate N] [--websocket-ping N] [--websocket-max-message BYTES]" << std::endl;
+}
+
+int run_server(ServerConfig &config)
+{
+    /**
+     * A client that goes away while we write to it would otherwise kill
+     * the whole process with SIGPIPE, we want the EPIPE error instead
+     */
+    signal(SIGPIPE, SIG_IGN);
+
+    /**
+     * SIGTERM drains the server instead of killing it. It is blocked
+     * before any thread starts, so only `signal_fd` ever sees it.
+     */
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr);
+    int signal_fd = signalfd(-1, &stop_signals, SFD_CLOEXEC);
+    if (signal_fd == -1)
+    {
+        perror("signalfd");
+        return 1;
+    }
+
+    for (UpstreamAddress &upstream : config.upstreams)
+    {
+        if (!resolve_upstream(upstream))
+            return 1;
+    }
+
+    if (config.access_log == "-")
+    {
+        config.access_log_fd = STDOUT_FILENO;
+    }
+    else if (!config.access_log.empty())
+    {
+        config.access_log_fd = open(config.access_log.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (config.access_log_fd == -1)
+        {
+            perror(config.access_log.c_str());
+            return 1;
+        }
+    }
+
+    if (!config.docroot.empty())
+    {
+        config.docroot_fd = open(config.docroot.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (config.docroot_fd == -1)
+        {
+            perror(config.docroot.c_str());
+            return 1;
+        }
+    }
+
+    /**
+     * The TLS handshake and OpenSSL's reads and writes are driven by
+     * readiness events, so TLS connections are served by the epoll backend
+     */
+    TicketKeys ticket_keys;
+    if (!config.tls_cert.empty())
+    {
+        config.tls_context = create_tls_context(config, ticket_keys);
+        if (config.tls_context == nullptr)
+            return 1;
+        if (config.backend == "io_uring")
+        {
+            std::cerr << "TLS is served by the epoll backend" << std::endl;
+            config.backend = "epoll";
+        }
+    }
+
+    Router router;
+    if (!build_router(router, config))
+        return 1;
+
+    if (config.workers == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        config.workers = cpus > 0 ? (int)cpus : 1;
+    }
+
+    /**
+     * Every listening socket is created up front on the main thread,
+     * so a port that is already taken fails the whole server at startup
+     * instead of silently leaving one reactor dead. A running server
+     * hands us its own sockets instead, see "Graceful reload".
+     */
+    std::vector<int> listen_fds;
+    int predecessor = -1;
+    if (!config.handoff.empty())
+        predecessor = take_over_listeners(config, listen_fds);
+    if ((int)listen_fds.size() > config.workers)
+        config.workers = (int)listen_fds.size();
+    for (int i = (int)listen_fds.size(); i < config.workers; ++i)
+    {
+        int listen_fd = create_listen_socket(config.port);
+        if (listen_fd == -1)
+            return 1;
+        listen_fds.push_back(listen_fd);
+    }
+
+    if (config.numa || !config.steer.empty())
+        config.pin_cpus = true;
+    if (config.pin_cpus && !plan_reactor_cpus(config))
+        return 1;
+    if (!config.steer.empty() && !steer_connections(config, listen_fds))
+        return 1;
+
+    /* `admin_stop` tells the admin thread to close its socket once we drain */
+    int admin_fd = -1;
+    int admin_stop = -1;
+    if (config.admin_port != 0)
+    {
+        admin_fd = create_listen_socket(config.admin_port);
+        if (admin_fd == -1)
+            return 1;
+        admin_stop = eventfd(0, EFD_CLOEXEC);
+        if (admin_stop == -1)
+        {
+            perror("eventfd");
+            return 1;
+        }
+    }
+
+    std::vector<std::unique_ptr<ReactorMetrics>> metrics;
+    for (int i = 0; i < config.workers; ++i)
+        metrics.emplace_back(new ReactorMetrics);
+
+    Shutdown shutdown;
+    for (int i = 0; i < config.workers; ++i)
+    {
+        int event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (event_fd == -1)
+        {
+            perror("eventfd");
+            return 1;
+        }
+        shutdown.event_fds.push_back(event_fd);
+    }
+
+    WorkerPool workers;
+    start_worker_pool(workers, config.task_threads);
+
+    std::vector<std::unique_ptr<AccessLogRing>> access_rings;
+    std::atomic<bool> access_log_stop{false};
+    std::thread access_log;
+    if (config.access_log_fd != -1)
+    {
+        for (int i = 0; i < config.workers; ++i)
+            access_rings.emplace_back(new AccessLogRing);
+        access_log = std::thread(run_access_log, config.access_log_fd, std::cref(access_rings),
+                                 std::cref(access_log_stop));
+    }
+
+    /* A broadcast reaches the other reactors through the eventfd that also wakes them for shutdown */
+    WebSocketHub hub;
+    for (int i = 0; i < config.workers; ++i)
+    {
+        hub.inboxes.emplace_back(new BroadcastInbox);
+        hub.inboxes.back()->event_fd = shutdown.event_fds[i];
+    }
+
+    std::atomic<int> open_connections{0};
+    std::vector<std::thread> reactors;
+    for (int i = 0; i < config.workers; ++i)
+        reactors.emplace_back(run_reactor, i, listen_fds[i], std::cref(config), std::cref(router),
+                              metrics[i].get(), &workers, &shutdown, &open_connections,
+                              access_rings.empty() ? nullptr : access_rings[i].get(), &hub);
+    std::thread admin;
+    if (admin_fd != -1)
+        admin = std::thread(run_admin, admin_fd, admin_stop, std::cref(metrics));
+
+    std::cout << (config.tls_context != nullptr ? "HTTPS" : "HTTP") << " server running on port " << config.port
+              << " with " << config.workers << " reactor(s)";
+    if (config.numa)
+    {
+        std::vector<int> nodes = config.reactor_nodes;
+        std::sort(nodes.begin(), nodes.end());
+        std::cout << " on " << std::unique(nodes.begin(), nodes.end()) - nodes.begin() << " NUMA node(s)";
+    }
+    std::cout << std::endl;
+
+    int handoff_fd = -1;
+    if (!config.handoff.empty())
+        handoff_fd = listen_handoff(config.handoff);
+    if (predecessor != -1)
+    {
+        char confirmed = 1;
+        if (write(predecessor, &confirmed, 1) != 1)
+            perror("handoff");
+        close(predecessor);
+    }
+
+    /* Reactors close their listening sockets once they stop accepting */
+    wait_for_shutdown(signal_fd, handoff_fd, listen_fds);
+    if (handoff_fd != -1)
+        close(handoff_fd);
+    shutdown.draining.store(true, std::memory_order_release);
+    for (int event_fd : shutdown.event_fds)
+    {
+        uint64_t one = 1;
+        if (write(event_fd, &one, sizeof(one)) == -1)
+            perror("eventfd write");
+    }
+    if (admin.joinable())
+    {
+        uint64_t one = 1;
+        if (write(admin_stop, &one, sizeof(one)) == -1)
+            perror("eventfd write");
+        admin.join();
+        close(admin_stop);
+    }
+
+    for (std::thread &reactor : reactors)
+        reactor.join();
+    stop_worker_pool(workers);
+    if (access_log.joinable())
+    {
+        /* The reactors are done, so this last round gets every record */
+        access_log_stop.store(true, std::memory_order_release);
+        access_log.join();
+    }
+
+    for (int event_fd : shutdown.event_fds)
+        close(event_fd);
+    close(signal_fd);
+    SSL_CTX_free(config.tls_context);
     return 0;
 }
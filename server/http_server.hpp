@@ -0,0 +1,348 @@
+#ifndef HTTP_SERVER_HPP
+#define HTTP_SERVER_HPP
+
+#include <sys/socket.h>
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "http_parser.hpp"
+
+#define PORT 8080
+#define MAX_ROUTE_PARAMS 8
+
+/**
+ * The server as a library
+ *
+ * `http_core` is the whole server but `main()`. A program embedding it
+ * fills a `ServerConfig`, by hand or with `parse_args()`, adds its own
+ * routes through `ServerConfig::routes` and calls `run_server()`. The
+ * `http_server` executable does exactly that with its command line.
+ *
+ * Everything behind a handler's `Reactor` and `Connection` stays inside
+ * the library, a handler answers through `queue_text()`, a WebSocket
+ * route through the `websocket_` functions.
+ */
+typedef struct ssl_ctx_st SSL_CTX;
+
+struct Reactor;
+struct Connection;
+struct Router;
+
+/**
+ * Content codings we compress responses with, see "Response compression"
+ */
+enum Encoding : uint8_t
+{
+    ENCODING_IDENTITY,
+    ENCODING_GZIP,
+    ENCODING_BROTLI,
+    ENCODINGS,
+};
+
+static const char *const encoding_names[ENCODINGS] = {"identity", "gzip", "br"};
+
+/**
+ * How hard to compress one family of content types, `type` is a prefix of
+ * the Content-Type. `levels` is indexed by `Encoding`: a zlib level
+ * (1-9) for gzip, a quality (1-11) for brotli, `0` turns the coding off.
+ */
+struct CompressionRule
+{
+    std::string type;
+    int levels[ENCODINGS];
+};
+
+/**
+ * A backend given with `--upstream HOST:PORT`, `run_server()` resolves `name`
+ * into `address` once
+ */
+struct UpstreamAddress
+{
+    std::string name;
+    sockaddr_storage address = {};
+    socklen_t address_size = 0;
+};
+
+/**
+ * Server configuration, filled from the command line by `parse_args()`
+ *
+ * `workers` is the number of reactors, every reactor is one thread with
+ * its own listening socket and its own epoll instance.
+ * `0` means one reactor per online CPU.
+ *
+ * `pin_cpus` pins reactor `i` to the `i`-th CPU this process is allowed
+ * to run on, so a reactor never migrates between cores. `numa` spreads
+ * the pinned reactors over the NUMA nodes and keeps every reactor's
+ * memory on its node, `steer` hands a connection to the reactor on the
+ * CPU its packets arrive at, `incoming-cpu` or `cbpf`. Both imply
+ * `pin_cpus`, see "NUMA placement". `run_server()` fills in
+ * `reactor_cpus` and `reactor_nodes`, the CPU and node of every reactor.
+ *
+ * `idle_timeout` is how many seconds a keep-alive connection may stay
+ * silent before we close it, `max_requests` caps how many requests one
+ * connection can send before we answer with `Connection: close`.
+ * `header_timeout` is how long a client may take to send a request head,
+ * `body_timeout` how long it may pause in the middle of a body.
+ *
+ * `accept_budget` is the most clients one reactor accepts per wakeup.
+ * `max_connections` caps the clients of all reactors together, `0` is
+ * no cap. `rate_limit` is how many requests per second one client
+ * address may send to a reactor, `rate_burst` how many it may send at
+ * once (default `rate_limit`), see "Admission control".
+ *
+ * `docroot` turns on static file serving from that directory, `run_server()`
+ * opens it once into `docroot_fd`. `file_cache_size` is how many open
+ * files every reactor keeps in its LRU cache, `file_cache_bytes` how many
+ * bytes of compressed copies of them, `0` sends every file uncompressed.
+ *
+ * `backend` picks the event loop every reactor runs, `epoll` or `io_uring`.
+ *
+ * `admin_port` serves `/metrics` when it is not `0`.
+ *
+ * `body_memory` is the largest request body a connection holds in
+ * memory: routes that take the whole body at once answer `413` beyond it,
+ * streamed bodies beyond it spill to a temporary file under `spool_dir`.
+ * `max_body` caps streamed bodies.
+ *
+ * `compression` says which content types are compressed and how hard,
+ * `--compress` replaces or adds rules.
+ *
+ * `tls_cert` and `tls_key` turn on TLS for every client connection,
+ * `run_server()` loads them once into `tls_context`, which all reactors share.
+ * Session tickets are sealed with keys that rotate every
+ * `ticket_rotation` seconds.
+ *
+ * `task_threads` is the size of the `WorkerPool` that runs blocking handlers.
+ *
+ * `upstreams` turns the server into a proxy for these backends, every
+ * reactor keeps up to `upstream_idle` idle connections to each of them
+ * and checks their health by asking for `upstream_health`.
+ *
+ * `response_cache` is how many bytes of answers every reactor may keep in
+ * its response cache, `0` leaves it off, see "Response caching".
+ *
+ * `access_log` is the file every request is logged to, `-` for standard
+ * output, `run_server()` opens it into `access_log_fd`. `access_log_sample`
+ * has a busy log keep a sample instead of dropping what does not fit,
+ * see "Access logging".
+ *
+ * `websocket_deflate` is the zlib level WebSocket messages are compressed
+ * with for clients that offer `permessage-deflate`, `0` turns it off.
+ * `websocket_ping` is how many seconds a WebSocket may stay silent before
+ * we ping it, one that does not answer is closed as long again later.
+ * `websocket_max_message` is the largest message a client may send, see
+ * "WebSockets".
+ *
+ * `handoff` is the Unix socket a new server takes the listening sockets
+ * over through, see "Graceful reload". A server that stops takes up to
+ * `drain_timeout` seconds to finish the requests in progress.
+ *
+ * `routes` is for programs that embed the server: it is called with the
+ * router before the built-in routes are added and registers its own with
+ * `add_route()`. A route more specific than a built-in one wins, the
+ * same route registered twice fails startup, so does returning `false`.
+ */
+struct ServerConfig
+{
+    int port = PORT;
+    int workers = 0;
+    bool pin_cpus = false;
+    bool numa = false;
+    std::string steer;
+    std::vector<int> reactor_cpus;
+    std::vector<int> reactor_nodes;
+    int idle_timeout = 5;
+    int header_timeout = 10;
+    int body_timeout = 10;
+    int max_requests = 1000;
+    int accept_budget = 64;
+    int max_connections = 0;
+    int rate_limit = 0;
+    int rate_burst = 0;
+    std::string docroot;
+    int docroot_fd = -1;
+    int file_cache_size = 1024;
+    long file_cache_bytes = 64L * 1024 * 1024;
+    std::string backend = "epoll";
+    int admin_port = 0;
+    long body_memory = 1024 * 1024;
+    long max_body = 1024L * 1024 * 1024;
+    std::string spool_dir = "/tmp";
+    std::vector<CompressionRule> compression = {
+        {"text/", {0, 6, 5}},
+        {"application/javascript", {0, 6, 5}},
+        {"application/json", {0, 6, 5}},
+        {"application/wasm", {0, 6, 5}},
+        {"application/xml", {0, 6, 5}},
+        {"image/svg+xml", {0, 6, 5}},
+    };
+    std::string tls_cert;
+    std::string tls_key;
+    int ticket_rotation = 3600;
+    SSL_CTX *tls_context = nullptr;
+    int task_threads = 4;
+    std::vector<UpstreamAddress> upstreams;
+    int upstream_idle = 32;
+    std::string upstream_health = "/healthz";
+    long response_cache = 0;
+    std::string access_log;
+    int access_log_fd = -1;
+    bool access_log_sample = false;
+    int websocket_deflate = 6;
+    int websocket_ping = 30;
+    long websocket_max_message = 1024 * 1024;
+    std::string handoff;
+    int drain_timeout = 30;
+    bool (*routes)(Router &router) = nullptr;
+};
+
+/**
+ * The parameters of the matched route, views into the request buffer
+ * (values) and into `Router::text` (names). Values are not percent-decoded.
+ */
+struct RouteParam
+{
+    std::string_view name;
+    std::string_view value;
+};
+
+struct RouteParams
+{
+    RouteParam items[MAX_ROUTE_PARAMS];
+    uint32_t count = 0;
+
+    std::string_view get(std::string_view name) const
+    {
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            if (items[i].name == name)
+                return items[i].value;
+        }
+        return std::string_view();
+    }
+};
+
+/**
+ * A route handler answers the request on `conn` before it returns.
+ * `keep_alive` is whether the answer may leave the connection open.
+ */
+typedef void (*RouteHandler)(Reactor &reactor, Connection &conn, const HttpRequest &req,
+                             const RouteParams &params, bool keep_alive);
+
+/**
+ * Route `method` (`nullptr` for any method) on `pattern` to `handler`. A
+ * pattern is an absolute path where a segment may be `:name` and the last
+ * one may be `*name`, see "Request routing".
+ */
+bool add_route(Router &router, const char *method, std::string_view pattern, RouteHandler handler);
+
+/**
+ * Queue a small `text/plain` response built for this request
+ */
+void queue_text(Reactor &reactor, Connection &conn, const char *status, std::string_view body, bool keep_alive,
+                bool head_only = false, const char *extra_headers = "");
+
+/**
+ * What a WebSocket route does with its connections, see "WebSockets"
+ *
+ * `open` is called once the upgrade is answered, with the request that
+ * asked for it. `message` is called with every complete message the
+ * client sends, a view that is only valid during the call. Either may be
+ * `nullptr`.
+ */
+struct WebSocketHandler
+{
+    void (*open)(Reactor &reactor, Connection &conn, const HttpRequest &req, const RouteParams &params) = nullptr;
+    void (*message)(Reactor &reactor, Connection &conn, std::string_view message, bool binary) = nullptr;
+};
+
+/**
+ * Upgrade `GET` requests for `pattern` to WebSockets answered by
+ * `handler`, plain requests get `426 Upgrade Required`
+ */
+bool add_websocket_route(Router &router, std::string_view pattern, const WebSocketHandler &handler);
+
+/**
+ * Send one message on the WebSocket `conn`, a text message must be UTF-8
+ */
+void websocket_send(Reactor &reactor, Connection &conn, std::string_view message, bool binary = false);
+
+/**
+ * Have the WebSocket `conn` receive what is published to `channel` until it closes
+ */
+void websocket_subscribe(Reactor &reactor, Connection &conn, std::string_view channel);
+
+/**
+ * Send `message` to every WebSocket subscribed to `channel`, on every
+ * reactor. The frame is built once and shared by all of them.
+ */
+void websocket_publish(Reactor &reactor, std::string_view channel, std::string_view message, bool binary = false);
+
+/**
+ * Command line:
+ *   --port N              port to listen on (default 8080)
+ *   --workers N           number of reactors (default: number of online CPUs)
+ *   --pin-cpus            pin every reactor to its own CPU
+ *   --numa                spread pinned reactors over the NUMA nodes, memory node-local
+ *   --steer incoming-cpu|cbpf
+ *                         hand connections to the reactor on the CPU they arrive at
+ *   --idle-timeout N      seconds before an idle keep-alive connection is closed (default 5)
+ *   --header-timeout N    seconds a client may take to send a request head (default 10)
+ *   --body-timeout N      seconds a client may pause while sending a body (default 10)
+ *   --max-requests N      requests served per connection before closing it (default 1000)
+ *   --accept-budget N     clients accepted per wakeup of a reactor (default 64)
+ *   --max-connections N   clients open at once, more are refused with 503 (default no cap)
+ *   --rate-limit N        requests per second per client address and reactor (default off)
+ *   --rate-burst N        requests a client may send at once (default: --rate-limit)
+ *   --docroot DIR         serve static files from DIR
+ *   --file-cache N        open files cached per reactor (default 1024)
+ *   --file-cache-bytes BYTES  compressed copies of static files kept per reactor (default 64 MiB)
+ *   --response-cache BYTES  dynamic answers kept per reactor (default 0, off)
+ *   --access-log FILE     log every request to FILE as JSON lines, `-` for standard output
+ *   --access-log-overflow drop|sample
+ *                         what a busy access log does with records it has no room for (default drop)
+ *   --backend NAME        event loop, `epoll` (default) or `io_uring`
+ *   --admin-port N        serve Prometheus metrics on /metrics at port N (default off)
+ *   --body-memory BYTES   largest request body held in memory (default 1 MB)
+ *   --max-body BYTES      largest streamed request body (default 1 GB)
+ *   --spool-dir DIR       where streamed bodies spill to (default /tmp)
+ *   --compress TYPE=G,B   gzip level G and brotli quality B for content types starting
+ *                         with TYPE, `0` turns a coding off (default 6,5 for text)
+ *   --tls-cert FILE       serve TLS with this PEM certificate chain (needs --tls-key)
+ *   --tls-key FILE        private key of the certificate
+ *   --ticket-rotation N   seconds between session ticket key rotations (default 3600)
+ *   --task-threads N      threads running blocking handlers (default 4)
+ *   --upstream HOST:PORT  proxy to this backend, may be given more than once
+ *   --upstream-idle N     idle connections kept per backend and reactor (default 32)
+ *   --upstream-health P   path asked for in backend health checks (default /healthz)
+ *   --websocket-deflate N zlib level of permessage-deflate, `0` turns it off (default 6)
+ *   --websocket-ping N    seconds a WebSocket may stay silent before it is pinged (default 30)
+ *   --websocket-max-message BYTES
+ *                         largest message a WebSocket client may send (default 1 MB)
+ *   --handoff PATH        Unix socket a new server takes the listening sockets over through
+ *   --drain-timeout N     seconds a stopping server lets requests finish (default 30)
+ *   --help                list the options and exit
+ *
+ * Returns `-1` on an unknown or malformed option, `1` when `--help` asks
+ * for the options instead.
+ */
+int parse_args(int argc, char **argv, ServerConfig &config);
+
+/**
+ * The one-line summary of the options `parse_args()` takes
+ */
+void print_usage(const char *program);
+
+/**
+ * Run the server until it gets SIGTERM, then drain it
+ *
+ * SIGPIPE is ignored and SIGTERM blocked for the whole process, the
+ * server takes SIGTERM through a `signalfd`. Returns the exit status,
+ * `1` if the server could not start.
+ */
+int run_server(ServerConfig &config);
+
+#endif
@@ -0,0 +1,13 @@
+#include "http_server.hpp"
+
+int main(int argc, char **argv)
+{
+    ServerConfig config;
+    int parsed = parse_args(argc, argv, config);
+    if (parsed != 0)
+    {
+        print_usage(argv[0]);
+        return parsed == 1 ? 0 : 1;
+    }
+    return run_server(config);
+}
@@ -0,0 +1,198 @@
+#ifndef TIMER_WHEEL_HPP
+#define TIMER_WHEEL_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+#define TIMER_TICK_MS 100
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+/**
+ * Timers
+ *
+ * Every connection always has exactly one deadline: close it if the client
+ * stays idle, takes too long to send its headers or stalls in the middle
+ * of a body. With hundreds of thousands of connections those deadlines
+ * are moved on nearly every read and write, so they live in a
+ * hierarchical timing wheel where arming, moving and cancelling a timer
+ * is unlinking and linking one list node.
+ *
+ * Time is counted in ticks of `TIMER_TICK_MS`. Level 0 has one slot per
+ * tick for the next `TIMER_WHEEL_SLOTS` ticks, every level above has
+ * slots `TIMER_WHEEL_SLOTS` times as wide. A timer is put in the finest
+ * level its deadline fits, and whenever the level below wraps around, the
+ * next slot of a level is emptied and its timers redistributed downwards
+ * ("cascading"), so it reaches level 0 just when it is due.
+ *
+ * `tick` only moves when the wheel runs, after the event loop woke up,
+ * and the loop may sleep until the next cascade. Deadlines are therefore
+ * taken from the clock the caller passes in, never from `tick`, only the
+ * slot a timer goes into is picked relative to it.
+ *
+ * The nodes are embedded in `Connection`, nothing is allocated.
+ */
+struct TimerNode
+{
+    TimerNode *prev = nullptr;
+    TimerNode *next = nullptr;
+    uint64_t expires = 0;
+};
+
+struct TimerWheel
+{
+    uint64_t tick = 0;
+    size_t armed = 0;
+    TimerNode slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+
+    TimerWheel()
+    {
+        for (auto &level : slots)
+        {
+            for (TimerNode &slot : level)
+                slot.prev = slot.next = &slot;
+        }
+    }
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+};
+
+inline bool timer_armed(const TimerNode &node)
+{
+    return node.next != nullptr;
+}
+
+inline void cancel_timer(TimerWheel &wheel, TimerNode &node)
+{
+    if (!timer_armed(node))
+        return;
+    node.prev->next = node.next;
+    node.next->prev = node.prev;
+    node.prev = node.next = nullptr;
+    wheel.armed--;
+}
+
+/**
+ * Link an unlinked `node` into the slot for `node.expires`
+ *
+ * A node that is due already goes into the level 0 slot of the current
+ * tick, which `next_expired_timer()` empties before it moves on.
+ */
+inline void place_timer(TimerWheel &wheel, TimerNode &node)
+{
+    const uint64_t horizon = (uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS);
+    if (node.expires < wheel.tick)
+        node.expires = wheel.tick;
+    if (node.expires - wheel.tick >= horizon)
+        node.expires = wheel.tick + horizon - 1;
+
+    uint64_t delta = node.expires - wheel.tick;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (uint64_t)1 << (TIMER_WHEEL_BITS * (level + 1)))
+        level++;
+    TimerNode &slot = wheel.slots[level][(node.expires >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)];
+
+    node.prev = slot.prev;
+    node.next = &slot;
+    slot.prev->next = &node;
+    slot.prev = &node;
+    wheel.armed++;
+}
+
+/**
+ * (Re)arm `node` to fire `delay_ms` after `now_ms`, the caller's reading
+ * of the clock `expire_timers` passes to `next_expired_timer()`
+ *
+ * The deadline is the first tick that starts no earlier than
+ * `now_ms + delay_ms`, so a timer never fires before its delay, at most
+ * one tick after it.
+ */
+inline void set_timer(TimerWheel &wheel, TimerNode &node, long delay_ms, long now_ms)
+{
+    cancel_timer(wheel, node);
+    /* An empty wheel is not advanced, catch up so it does not have to walk the ticks it missed */
+    uint64_t now = (uint64_t)now_ms / TIMER_TICK_MS;
+    if (wheel.armed == 0 && wheel.tick < now)
+        wheel.tick = now;
+    node.expires = (uint64_t)(now_ms + (delay_ms > 0 ? delay_ms : 0) + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    place_timer(wheel, node);
+}
+
+/**
+ * Move the timers of the slots that just came into range one level down
+ */
+inline void cascade_timers(TimerWheel &wheel)
+{
+    for (int level = 1; level < TIMER_WHEEL_LEVELS; ++level)
+    {
+        if (wheel.tick & (((uint64_t)1 << (TIMER_WHEEL_BITS * level)) - 1))
+            return;
+        TimerNode &slot = wheel.slots[level][(wheel.tick >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)];
+        while (slot.next != &slot)
+        {
+            TimerNode &node = *slot.next;
+            cancel_timer(wheel, node);
+            place_timer(wheel, node);
+        }
+    }
+}
+
+/**
+ * Next timer due at or before tick `now`, unlinked, or `nullptr` once
+ * everything due has been handed out
+ *
+ * Call it in a loop, whatever the caller does with an expired timer
+ * (including arming new ones) does not disturb the iteration.
+ */
+inline TimerNode *next_expired_timer(TimerWheel &wheel, uint64_t now)
+{
+    while (true)
+    {
+        TimerNode &slot = wheel.slots[0][wheel.tick & (TIMER_WHEEL_SLOTS - 1)];
+        if (slot.next != &slot)
+        {
+            TimerNode *node = slot.next;
+            cancel_timer(wheel, *node);
+            return node;
+        }
+        if (wheel.tick >= now)
+            return nullptr;
+        /* Nothing can be due while the wheel is empty, skip ahead */
+        if (wheel.armed == 0)
+        {
+            wheel.tick = now;
+            return nullptr;
+        }
+        wheel.tick++;
+        cascade_timers(wheel);
+    }
+}
+
+/**
+ * How long the event loop may sleep before the wheel needs to run again,
+ * `-1` (forever) when no timer is armed
+ *
+ * That is the next non-empty level 0 slot, the current one included, or
+ * the next cascade if it comes first.
+ */
+inline int timer_wait_ms(const TimerWheel &wheel, long now_ms)
+{
+    if (wheel.armed == 0)
+        return -1;
+
+    uint64_t ticks = TIMER_WHEEL_SLOTS - (wheel.tick & (TIMER_WHEEL_SLOTS - 1));
+    for (uint64_t i = 0; i < ticks; ++i)
+    {
+        const TimerNode &slot = wheel.slots[0][(wheel.tick + i) & (TIMER_WHEEL_SLOTS - 1)];
+        if (slot.next != &slot)
+        {
+            ticks = i;
+            break;
+        }
+    }
+    long wait = (long)(wheel.tick + ticks) * TIMER_TICK_MS - now_ms;
+    return wait > 0 ? (int)wait : 0;
+}
+
+#endif
@@ -0,0 +1,327 @@
+#ifndef WEBSOCKET_HPP
+#define WEBSOCKET_HPP
+
+#include <strings.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WEBSOCKET_MAX_HEADER 14
+#define WEBSOCKET_MAX_CONTROL 125
+
+/**
+ * WebSocket framing (RFC 6455) and the `permessage-deflate` offer (RFC 7692)
+ *
+ * After the upgrade a connection carries frames both ways: two bytes
+ * (FIN, three reserved bits, the opcode, the mask bit, a 7-bit length),
+ * a 16 or 64-bit length when the 7 bits say `126` or `127`, the 4-byte
+ * masking key on frames from the client, then the payload. A message is
+ * one text or binary frame, or one of them without FIN followed by
+ * continuation frames up to the one with FIN. Control frames (close, ping,
+ * pong) may come between the fragments, they are never fragmented and
+ * carry at most 125 bytes.
+ *
+ * `permessage-deflate` flags a compressed message with the first reserved
+ * bit (RSV1) on its first frame. This header only knows the wire format,
+ * the server does the rest.
+ */
+enum WebSocketOpcode : uint8_t
+{
+    WS_CONTINUATION = 0x0,
+    WS_TEXT = 0x1,
+    WS_BINARY = 0x2,
+    WS_CLOSE = 0x8,
+    WS_PING = 0x9,
+    WS_PONG = 0xa,
+};
+
+enum WebSocketFlag : uint8_t
+{
+    WS_FIN = 0x80,
+    WS_RSV1 = 0x40,
+    WS_RSV2 = 0x20,
+    WS_RSV3 = 0x10,
+    WS_MASKED = 0x80,
+};
+
+enum WebSocketStatus : uint16_t
+{
+    WS_NORMAL_CLOSURE = 1000,
+    WS_GOING_AWAY = 1001,
+    WS_PROTOCOL_ERROR = 1002,
+    WS_UNSUPPORTED_DATA = 1003,
+    WS_NO_STATUS = 1005,
+    WS_INVALID_PAYLOAD = 1007,
+    WS_POLICY_VIOLATION = 1008,
+    WS_MESSAGE_TOO_BIG = 1009,
+    WS_INTERNAL_ERROR = 1011,
+};
+
+/**
+ * One frame header as read off the wire. `flags` is the first byte
+ * without the opcode (FIN and the reserved bits), `key` the masking key
+ * in memory order, `header_size` where the payload starts.
+ */
+struct WebSocketFrame
+{
+    uint8_t flags = 0;
+    uint8_t opcode = 0;
+    bool masked = false;
+    uint32_t key = 0;
+    uint64_t length = 0;
+    size_t header_size = 0;
+
+    bool fin() const { return (flags & WS_FIN) != 0; }
+    bool control() const { return (opcode & 0x8) != 0; }
+};
+
+/**
+ * Read the frame header at the start of the `size` bytes at `p`
+ *
+ * Returns `1` once it is complete, `0` when more bytes are needed and
+ * `-1` for a 64-bit length with the top bit set.
+ */
+inline int websocket_read_header(const unsigned char *p, size_t size, WebSocketFrame &frame)
+{
+    if (size < 2)
+        return 0;
+    frame.flags = p[0] & 0xf0;
+    frame.opcode = p[0] & 0x0f;
+    frame.masked = (p[1] & WS_MASKED) != 0;
+    size_t at = 2;
+    uint64_t length = p[1] & 0x7f;
+    if (length == 126)
+    {
+        if (size < 4)
+            return 0;
+        length = (uint64_t)p[2] << 8 | p[3];
+        at = 4;
+    }
+    else if (length == 127)
+    {
+        if (size < 10)
+            return 0;
+        length = 0;
+        for (int i = 0; i < 8; ++i)
+            length = length << 8 | p[2 + i];
+        if (length >> 63)
+            return -1;
+        at = 10;
+    }
+    if (frame.masked)
+    {
+        if (size < at + 4)
+            return 0;
+        memcpy(&frame.key, p + at, 4);
+        at += 4;
+    }
+    frame.length = length;
+    frame.header_size = at;
+    return 1;
+}
+
+/**
+ * Append the header of an unmasked frame, the server never masks.
+ * `first` is FIN, the reserved bits and the opcode.
+ */
+inline void websocket_append_header(std::string &out, uint8_t first, uint64_t length)
+{
+    char header[10];
+    size_t size = 2;
+    header[0] = (char)first;
+    if (length < 126)
+    {
+        header[1] = (char)length;
+    }
+    else if (length <= 0xffff)
+    {
+        header[1] = 126;
+        header[2] = (char)(length >> 8);
+        header[3] = (char)length;
+        size = 4;
+    }
+    else
+    {
+        header[1] = 127;
+        for (int i = 0; i < 8; ++i)
+            header[2 + i] = (char)(length >> (56 - 8 * i));
+        size = 10;
+    }
+    out.append(header, size);
+}
+
+/**
+ * Whether `size` bytes at `data` are well-formed UTF-8: no overlong
+ * forms, no surrogates, nothing above U+10FFFF. Text messages and close
+ * reasons must be, ASCII runs are checked eight bytes at a time.
+ */
+inline bool utf8_valid(const char *data, size_t size)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    const unsigned char *end = p + size;
+    while (p < end)
+    {
+        if (end - p >= 8)
+        {
+            uint64_t word;
+            memcpy(&word, p, 8);
+            if ((word & 0x8080808080808080ull) == 0)
+            {
+                p += 8;
+                continue;
+            }
+        }
+        unsigned char c = *p;
+        if (c < 0x80)
+        {
+            ++p;
+            continue;
+        }
+        size_t follow;
+        uint32_t code;
+        uint32_t smallest;
+        if ((c & 0xe0) == 0xc0)
+        {
+            follow = 1;
+            code = c & 0x1f;
+            smallest = 0x80;
+        }
+        else if ((c & 0xf0) == 0xe0)
+        {
+            follow = 2;
+            code = c & 0x0f;
+            smallest = 0x800;
+        }
+        else if ((c & 0xf8) == 0xf0)
+        {
+            follow = 3;
+            code = c & 0x07;
+            smallest = 0x10000;
+        }
+        else
+        {
+            return false;
+        }
+        if ((size_t)(end - p) <= follow)
+            return false;
+        for (size_t i = 1; i <= follow; ++i)
+        {
+            if ((p[i] & 0xc0) != 0x80)
+                return false;
+            code = code << 6 | (p[i] & 0x3f);
+        }
+        if (code < smallest || code > 0x10ffff || (code >= 0xd800 && code <= 0xdfff))
+            return false;
+        p += follow + 1;
+    }
+    return true;
+}
+
+/**
+ * Whether a client may close with `code`: the ones RFC 6455 and the IANA
+ * registry define for use on the wire, and the ranges for libraries and
+ * applications
+ */
+inline bool websocket_close_code_valid(uint16_t code)
+{
+    return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1014) || (code >= 3000 && code <= 4999);
+}
+
+/* `text` without the spaces and tabs around it */
+inline std::string_view websocket_trim(std::string_view text)
+{
+    while (!text.empty() && (text.front() == ' ' || text.front() == '\t'))
+        text.remove_prefix(1);
+    while (!text.empty() && (text.back() == ' ' || text.back() == '\t'))
+        text.remove_suffix(1);
+    return text;
+}
+
+/**
+ * Whether one `permessage-deflate` offer (its parameters after the name)
+ * can be taken as we answer every offer:
+ * `server_no_context_takeover; client_no_context_takeover`
+ *
+ * A window smaller than the full 32 KB for our side is refused, the one
+ * the client keeps for its side does not matter to us. Unknown and
+ * repeated parameters refuse the offer, as RFC 7692 asks.
+ */
+inline bool websocket_deflate_offer_ok(std::string_view params)
+{
+    bool seen[4] = {};
+    static const char *const names[4] = {"server_no_context_takeover", "client_no_context_takeover",
+                                         "server_max_window_bits", "client_max_window_bits"};
+    while (!params.empty())
+    {
+        size_t semicolon = params.find(';');
+        std::string_view param = websocket_trim(params.substr(0, semicolon));
+        params = semicolon == std::string_view::npos ? std::string_view() : params.substr(semicolon + 1);
+        if (param.empty())
+            continue;
+
+        size_t equals = param.find('=');
+        std::string_view name = websocket_trim(param.substr(0, equals));
+        std::string_view value;
+        if (equals != std::string_view::npos)
+        {
+            value = websocket_trim(param.substr(equals + 1));
+            if (value.size() >= 2 && value.front() == '"' && value.back() == '"')
+                value = value.substr(1, value.size() - 2);
+        }
+
+        int which = -1;
+        for (int i = 0; i < 4; ++i)
+        {
+            if (name.size() == strlen(names[i]) && strncasecmp(name.data(), names[i], name.size()) == 0)
+                which = i;
+        }
+        if (which == -1 || seen[which])
+            return false;
+        seen[which] = true;
+        if (which < 2)
+        {
+            if (equals != std::string_view::npos)
+                return false;
+            continue;
+        }
+        if (which == 3 && equals == std::string_view::npos)
+            continue;
+        if (value.empty() || value.size() > 2 || value[0] < '0' || value[0] > '9' ||
+            (value.size() == 2 && (value[1] < '0' || value[1] > '9')))
+            return false;
+        int bits = value.size() == 1 ? value[0] - '0' : (value[0] - '0') * 10 + value[1] - '0';
+        if (bits < 8 || bits > 15 || (which == 2 && bits != 15))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Whether the `Sec-WebSocket-Extensions` value `offers` holds a
+ * `permessage-deflate` offer we take, see `websocket_deflate_offer_ok()`
+ */
+inline bool websocket_accepts_deflate(std::string_view offers)
+{
+    static const std::string_view deflate = "permessage-deflate";
+    while (!offers.empty())
+    {
+        size_t comma = offers.find(',');
+        std::string_view offer = offers.substr(0, comma);
+        offers = comma == std::string_view::npos ? std::string_view() : offers.substr(comma + 1);
+
+        size_t semicolon = offer.find(';');
+        std::string_view name = websocket_trim(offer.substr(0, semicolon));
+        if (name.size() != deflate.size() || strncasecmp(name.data(), deflate.data(), deflate.size()) != 0)
+            continue;
+        if (websocket_deflate_offer_ok(semicolon == std::string_view::npos ? std::string_view()
+                                                                           : offer.substr(semicolon + 1)))
+            return true;
+    }
+    return false;
+}
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef CHECK_HPP
+#define CHECK_HPP
+
+#include <cstdio>
+
+/**
+ * The little the tests need from a test framework
+ *
+ * `CHECK(condition)` reports a failed condition with its file and line
+ * and carries on, so one run shows every failure. A test's `main()`
+ * returns `check_result()`, which ctest reads as pass or fail.
+ */
+inline int &check_failures()
+{
+    static int failures = 0;
+    return failures;
+}
+
+inline bool check(bool ok, const char *condition, const char *file, int line)
+{
+    if (!ok)
+    {
+        fprintf(stderr, "%s:%d: CHECK(%s) failed\n", file, line, condition);
+        ++check_failures();
+    }
+    return ok;
+}
+
+#define CHECK(condition) check((condition), #condition, __FILE__, __LINE__)
+
+inline int check_result()
+{
+    if (check_failures() != 0)
+        fprintf(stderr, "%d check(s) failed\n", check_failures());
+    return check_failures() == 0 ? 0 : 1;
+}
+
+#endif
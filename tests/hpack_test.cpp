@@ -0,0 +1,143 @@
+/**
+ * Tests for the HPACK coder in `server/hpack.hpp`, against the examples
+ * of RFC 7541 appendix C and against itself
+ */
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "check.hpp"
+#include "hpack.hpp"
+
+typedef std::vector<std::pair<std::string, std::string>> Fields;
+
+static std::string bytes(std::initializer_list<int> values)
+{
+    std::string out;
+    for (int value : values)
+        out += (char)value;
+    return out;
+}
+
+static bool decode(HpackTable &table, const std::string &block, Fields &fields)
+{
+    std::string name_scratch;
+    std::string value_scratch;
+    fields.clear();
+    return hpack_decode(table, (const unsigned char *)block.data(), block.size(), name_scratch, value_scratch,
+                        [&](std::string_view name, std::string_view value) {
+                            fields.emplace_back(std::string(name), std::string(value));
+                        });
+}
+
+static void test_integers()
+{
+    /* C.1.1 to C.1.3 */
+    std::string out;
+    hpack_write_int(out, 0x00, 5, 10);
+    CHECK(out == bytes({0x0a}));
+    out.clear();
+    hpack_write_int(out, 0x00, 5, 1337);
+    CHECK(out == bytes({0x1f, 0x9a, 0x0a}));
+    out.clear();
+    hpack_write_int(out, 0x00, 8, 42);
+    CHECK(out == bytes({0x2a}));
+
+    std::string encoded = bytes({0x1f, 0x9a, 0x0a});
+    const unsigned char *p = (const unsigned char *)encoded.data();
+    size_t value = 0;
+    CHECK(hpack_read_int(p, p + encoded.size(), 5, value) && value == 1337);
+
+    std::string truncated = bytes({0x1f, 0x9a});
+    p = (const unsigned char *)truncated.data();
+    CHECK(!hpack_read_int(p, p + truncated.size(), 5, value));
+}
+
+static void test_huffman()
+{
+    std::string coded;
+    hpack_huffman_encode("www.example.com", coded);
+    CHECK(coded == bytes({0xf1, 0xe3, 0xc2, 0xe5, 0xf2, 0x3a, 0x6b, 0xa0, 0xab, 0x90, 0xf4, 0xff}));
+    CHECK(hpack_huffman_size("www.example.com") == coded.size());
+
+    std::string text;
+    CHECK(hpack_huffman_decode((const unsigned char *)coded.data(), coded.size(), text));
+    CHECK(text == "www.example.com");
+
+    std::string all;
+    for (int c = 0; c < 256; ++c)
+        all += (char)c;
+    coded.clear();
+    hpack_huffman_encode(all, coded);
+    text.clear();
+    CHECK(hpack_huffman_decode((const unsigned char *)coded.data(), coded.size(), text));
+    CHECK(text == all);
+}
+
+static void test_request_examples()
+{
+    /* C.4.1 and C.4.2, requests with Huffman coding sharing one table */
+    HpackTable table;
+    Fields fields;
+    CHECK(decode(table,
+                 bytes({0x82, 0x86, 0x84, 0x41, 0x8c, 0xf1, 0xe3, 0xc2, 0xe5, 0xf2, 0x3a, 0x6b, 0xa0, 0xab, 0x90,
+                        0xf4, 0xff}),
+                 fields));
+    CHECK(fields == Fields({{":method", "GET"}, {":scheme", "http"}, {":path", "/"},
+                            {":authority", "www.example.com"}}));
+    CHECK(table.size == 57);
+
+    CHECK(decode(table, bytes({0x82, 0x86, 0x84, 0xbe, 0x58, 0x86, 0xa8, 0xeb, 0x10, 0x64, 0x9c, 0xbf}), fields));
+    CHECK(fields == Fields({{":method", "GET"}, {":scheme", "http"}, {":path", "/"},
+                            {":authority", "www.example.com"}, {"cache-control", "no-cache"}}));
+    CHECK(table.size == 110);
+
+    /* An index past both tables is a broken block */
+    CHECK(!decode(table, bytes({0xff, 0x10}), fields));
+}
+
+static void test_round_trip()
+{
+    HpackTable encoder;
+    HpackTable decoder;
+    size_t first_size = 0;
+    Fields sent = {{":status", "200"},
+                   {"content-type", "text/plain"},
+                   {"x-request-id", "0123456789abcdef"},
+                   {"server", "http_server"}};
+    for (int block = 0; block < 3; ++block)
+    {
+        std::string out;
+        hpack_begin_block(encoder, out);
+        for (const auto &field : sent)
+            hpack_encode(encoder, out, field.first, field.second, field.first != "x-request-id");
+        Fields received;
+        CHECK(decode(decoder, out, received));
+        CHECK(received == sent);
+        CHECK(decoder.size == encoder.size);
+        /* The indexed fields shrink to one byte each once both tables have them */
+        if (block == 0)
+            first_size = out.size();
+        else
+            CHECK(out.size() + 15 < first_size);
+    }
+
+    /* Shrinking the table is announced at the start of the next block */
+    hpack_set_max_size(encoder, 0);
+    std::string out;
+    hpack_begin_block(encoder, out);
+    hpack_encode(encoder, out, "server", "http_server", true);
+    Fields received;
+    CHECK(decode(decoder, out, received));
+    CHECK(received == Fields({{"server", "http_server"}}));
+    CHECK(decoder.size == 0 && encoder.size == 0);
+}
+
+int main()
+{
+    test_integers();
+    test_huffman();
+    test_request_examples();
+    test_round_trip();
+    return check_result();
+}
@@ -0,0 +1,196 @@
+/**
+ * Tests for the HTTP/1.1 request parser in `server/http_parser.hpp`
+ *
+ * ctest runs this once per scan kernel set (`HTTP_SCAN`), every case has
+ * to come out the same with the scalar and the SIMD searches.
+ */
+#include <string>
+
+#include "check.hpp"
+#include "http_parser.hpp"
+
+/**
+ * Parse the request in `text` the way a connection does when everything
+ * arrived in one read: once for the head, once more for a body
+ */
+static ParseResult parse_all(std::string &text, HttpParser &parser, HttpRequest &req, size_t max_body = 1 << 20)
+{
+    ParseResult result = parse_request(parser, text.data(), text.size(), req, max_body);
+    if (result == PARSE_HEAD)
+        result = parse_request(parser, text.data(), text.size(), req, max_body);
+    return result;
+}
+
+static int parse_status(std::string text, size_t max_body = 1 << 20)
+{
+    HttpParser parser;
+    HttpRequest req;
+    if (parse_all(text, parser, req, max_body) != PARSE_ERROR)
+        return 0;
+    return parser.error_status;
+}
+
+static void test_simple_get()
+{
+    std::string text = "GET /index.html?q=1 HTTP/1.1\r\nHost: example.com\r\nAccept:  */* \r\n\r\n";
+    HttpParser parser;
+    HttpRequest req;
+    CHECK(parse_all(text, parser, req) == PARSE_COMPLETE);
+    CHECK(req.method == "GET");
+    CHECK(req.target == "/index.html?q=1");
+    CHECK(req.version_minor == 1);
+    CHECK(req.keep_alive);
+    CHECK(req.num_headers == 2);
+    CHECK(req.content_length == -1);
+    CHECK(req.body.empty());
+    CHECK(parser.consumed == text.size());
+    CHECK(req.head.size() == text.size());
+
+    const HttpHeader *host = req.find_header("host");
+    CHECK(host != nullptr && host->value == "example.com");
+    const HttpHeader *accept = req.find_header("ACCEPT");
+    CHECK(accept != nullptr && accept->value == "*/*");
+    CHECK(req.find_header("Cookie") == nullptr);
+}
+
+static void test_byte_at_a_time()
+{
+    std::string text = "POST /upload HTTP/1.1\r\nHost: x\r\nContent-Length: 5\r\n\r\nhello";
+    HttpParser parser;
+    HttpRequest req;
+    size_t head_len = text.find("\r\n\r\n") + 4;
+    bool head_seen = false;
+    for (size_t len = 1; len <= text.size(); ++len)
+    {
+        ParseResult result = parse_request(parser, text.data(), len, req, 1 << 20);
+        if (result == PARSE_HEAD)
+        {
+            CHECK(len == head_len);
+            CHECK(req.content_length == 5);
+            head_seen = true;
+            result = parse_request(parser, text.data(), len, req, 1 << 20);
+        }
+        if (len < text.size())
+            CHECK(result == PARSE_INCOMPLETE);
+        else
+            CHECK(result == PARSE_COMPLETE);
+    }
+    CHECK(head_seen);
+    CHECK(req.body == "hello");
+    CHECK(req.method == "POST");
+    CHECK(parser.consumed == text.size());
+}
+
+static void test_pipelined()
+{
+    std::string text = "GET /a HTTP/1.1\r\nHost: x\r\n\r\nGET /b HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n";
+    HttpParser parser;
+    HttpRequest req;
+    CHECK(parse_all(text, parser, req) == PARSE_COMPLETE);
+    CHECK(req.target == "/a");
+    CHECK(req.keep_alive);
+
+    std::string rest = text.substr(parser.consumed);
+    parser.reset();
+    CHECK(parse_all(rest, parser, req) == PARSE_COMPLETE);
+    CHECK(req.target == "/b");
+    CHECK(!req.keep_alive);
+    CHECK(parser.consumed == rest.size());
+}
+
+static void test_persistence()
+{
+    std::string close = "GET / HTTP/1.0\r\n\r\n";
+    std::string keep = "GET / HTTP/1.0\r\nConnection: Keep-Alive\r\n\r\n";
+    std::string listed = "GET / HTTP/1.1\r\nHost: x\r\nConnection: upgrade, close\r\n\r\n";
+    HttpParser parser;
+    HttpRequest req;
+    CHECK(parse_all(close, parser, req) == PARSE_COMPLETE);
+    CHECK(req.version_minor == 0 && !req.keep_alive);
+    parser.reset();
+    CHECK(parse_all(keep, parser, req) == PARSE_COMPLETE);
+    CHECK(req.keep_alive);
+    parser.reset();
+    CHECK(parse_all(listed, parser, req) == PARSE_COMPLETE);
+    CHECK(!req.keep_alive);
+}
+
+static void test_chunked()
+{
+    std::string text = "POST / HTTP/1.1\r\nHost: x\r\nTransfer-Encoding: chunked\r\n\r\n"
+                       "5\r\nhello\r\n6;name=value\r\n world\r\n0\r\nTrailer: yes\r\n\r\nGET";
+    HttpParser parser;
+    HttpRequest req;
+    CHECK(parse_all(text, parser, req) == PARSE_COMPLETE);
+    CHECK(req.chunked);
+    CHECK(req.body == "hello world");
+    CHECK(parser.consumed == text.size() - 3);
+
+    std::string split = "POST / HTTP/1.1\r\nHost: x\r\nTransfer-Encoding: chunked\r\n\r\nA\r\n0123456789\r\n0\r\n\r\n";
+    parser.reset();
+    ParseResult result = PARSE_INCOMPLETE;
+    for (size_t len = 1; len <= split.size() && result != PARSE_COMPLETE && result != PARSE_ERROR; ++len)
+    {
+        result = parse_request(parser, split.data(), len, req, 1 << 20);
+        if (result == PARSE_HEAD)
+            result = parse_request(parser, split.data(), len, req, 1 << 20);
+    }
+    CHECK(result == PARSE_COMPLETE);
+    CHECK(req.body == "0123456789");
+}
+
+static void test_errors()
+{
+    CHECK(parse_status("GET / HTTP/1.1\r\n\r\n") == 400);
+    CHECK(parse_status("GET  / HTTP/1.1\r\nHost: x\r\n\r\n") == 400);
+    CHECK(parse_status("GET / HTTP/2.0\r\nHost: x\r\n\r\n") == 505);
+    CHECK(parse_status("GET / HTP/1.1\r\nHost: x\r\n\r\n") == 400);
+    CHECK(parse_status("GET / HTTP/1.1\r\nHost x\r\n\r\n") == 400);
+    CHECK(parse_status("GET / HTTP/1.1\r\nHo st: x\r\n\r\n") == 400);
+    CHECK(parse_status("POST / HTTP/1.1\r\nHost: x\r\nContent-Length: 1x\r\n\r\n") == 400);
+    CHECK(parse_status("POST / HTTP/1.1\r\nHost: x\r\nContent-Length: 1\r\nContent-Length: 2\r\n\r\nab") == 400);
+    CHECK(parse_status("POST / HTTP/1.1\r\nHost: x\r\nContent-Length: 3\r\nTransfer-Encoding: chunked\r\n\r\n") ==
+          400);
+    CHECK(parse_status("POST / HTTP/1.1\r\nHost: x\r\nTransfer-Encoding: gzip\r\n\r\n") == 501);
+    CHECK(parse_status("POST / HTTP/1.1\r\nHost: x\r\nContent-Length: 99999999999\r\n\r\n") == 413);
+    CHECK(parse_status("POST / HTTP/1.1\r\nHost: x\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n") == 400);
+    CHECK(parse_status("POST / HTTP/1.1\r\nHost: x\r\nTransfer-Encoding: chunked\r\n\r\n20\r\n"
+                       "0123456789abcdef0123456789abcdef\r\n0\r\n\r\n",
+                       16) == 413);
+
+    std::string many = "GET / HTTP/1.1\r\nHost: x\r\n";
+    for (int i = 0; i < MAX_HEADERS; ++i)
+        many += "X-" + std::to_string(i) + ": y\r\n";
+    CHECK(parse_status(many + "\r\n") == 431);
+
+    std::string huge = "GET / HTTP/1.1\r\nHost: x\r\nCookie: " + std::string(MAX_REQUEST_HEAD, 'c');
+    HttpParser parser;
+    HttpRequest req;
+    CHECK(parse_request(parser, huge.data(), huge.size(), req, 0) == PARSE_ERROR);
+    CHECK(parser.error_status == 431);
+}
+
+static void test_header_helpers()
+{
+    CHECK(header_value_has_token("keep-alive, Upgrade", "upgrade"));
+    CHECK(header_value_has_token(" close ", "close"));
+    CHECK(!header_value_has_token("closed", "close"));
+    CHECK(!header_value_has_token("", "close"));
+    CHECK(parse_content_length("0") == 0);
+    CHECK(parse_content_length("1234") == 1234);
+    CHECK(parse_content_length("") == -1);
+    CHECK(parse_content_length("+1") == -1);
+    CHECK(parse_content_length("1234567890123456789") == -1);
+}
+
+int main()
+{
+    test_simple_get();
+    test_byte_at_a_time();
+    test_pipelined();
+    test_persistence();
+    test_chunked();
+    test_errors();
+    test_header_helpers();
+    return check_result();
+}
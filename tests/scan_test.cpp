@@ -0,0 +1,92 @@
+/**
+ * Tests for the scanning kernels in `server/http_scan.hpp`: every kernel
+ * set this CPU runs has to find exactly what the scalar one finds, for
+ * every position of the match relative to a 16 and 32 byte step, and
+ * unmask every length and alignment exactly like the RFC 6455 loop
+ */
+#include <string>
+
+#include "check.hpp"
+#include "http_scan.hpp"
+
+/* Bytes that sit on either side of a class boundary in one of the searches */
+static const char edge_bytes[] = {'\r', '\n', '\t', ' ', ':', '!', '~', '"', '(', ',', '/', '@', '[', '{',
+                                  '|', '}', '\0', 0x1f, 0x7f, (char)0x80, (char)0xff};
+
+static void check_same(const ScanKernels &kernels, const std::string &text)
+{
+    const ScanKernels &scalar = scalar_scan_kernels();
+    const char *begin = text.data();
+    const char *end = begin + text.size();
+    for (size_t from = 0; from < 4 && from <= text.size(); ++from)
+    {
+        CHECK(kernels.find_head_end(begin + from, end) == scalar.find_head_end(begin + from, end));
+        CHECK(kernels.find_token_end(begin + from, end) == scalar.find_token_end(begin + from, end));
+        CHECK(kernels.find_value_end(begin + from, end) == scalar.find_value_end(begin + from, end));
+    }
+}
+
+static void test_kernels(const ScanKernels &kernels)
+{
+    for (size_t length = 0; length <= 70; ++length)
+    {
+        std::string token(length, 'a');
+        check_same(kernels, token);
+        for (char c : edge_bytes)
+        {
+            std::string text = token + c + "bcdefghijklmnopqrstuvwxyz0123456789\r\n\r\n";
+            check_same(kernels, text);
+            check_same(kernels, text.substr(0, length + 1));
+        }
+
+        std::string head = std::string(length, 'x') + "\r\n\r\n";
+        check_same(kernels, head);
+        check_same(kernels, std::string(length, 'x') + "\r\n\r" + std::string(40, 'y'));
+        check_same(kernels, std::string(length, 'x') + "\r\n\n\r\n\r\n");
+    }
+}
+
+static void test_unmask(const ScanKernels &kernels)
+{
+    const unsigned char key[4] = {0x37, 0xfa, 0x21, 0x3d};
+    uint32_t packed;
+    memcpy(&packed, key, 4);
+    std::string buffer(200, '\0');
+    for (size_t i = 0; i < buffer.size(); ++i)
+        buffer[i] = (char)(i * 31 + 7);
+
+    for (size_t offset = 0; offset < 5; ++offset)
+    {
+        for (size_t length = 0; length + offset <= buffer.size(); ++length)
+        {
+            std::string data = buffer;
+            kernels.unmask(&data[offset], length, packed);
+            bool same = true;
+            for (size_t i = 0; i < buffer.size(); ++i)
+            {
+                char expected = buffer[i];
+                if (i >= offset && i < offset + length)
+                    expected ^= key[(i - offset) % 4];
+                same = same && data[i] == expected;
+            }
+            CHECK(same);
+        }
+    }
+}
+
+int main()
+{
+    const ScanKernels *kernels[3];
+    int count = supported_scan_kernels(kernels);
+    CHECK(count >= 1);
+    for (int i = 0; i < count; ++i)
+    {
+        fprintf(stderr, "checking %s\n", kernels[i]->name);
+        test_kernels(*kernels[i]);
+        test_unmask(*kernels[i]);
+    }
+
+    const char head[] = "GET / HTTP/1.1\r\nHost: x\r\n\r\n";
+    CHECK(scan_kernels().find_head_end(head, head + sizeof(head) - 1) == head + sizeof(head) - 5);
+    return check_result();
+}
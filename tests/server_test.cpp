@@ -0,0 +1,270 @@
+/**
+ * End to end test of `http_core` the way a program embeds it: a child
+ * process runs `run_server()` with a route of its own, the test talks
+ * HTTP/1.1 and WebSocket to it over loopback and finally stops it with
+ * SIGTERM, which has to drain it and exit with status `0`
+ */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "check.hpp"
+#include "http_server.hpp"
+
+static void serve_embedded(Reactor &reactor, Connection &conn, const HttpRequest &req, const RouteParams &params,
+                           bool keep_alive)
+{
+    std::string body = "embedded ";
+    body += params.get("name");
+    queue_text(reactor, conn, "200 OK", body, keep_alive, req.method == "HEAD");
+}
+
+static bool add_embedded_routes(Router &router)
+{
+    return add_route(router, "GET", "/embedded/:name", serve_embedded);
+}
+
+/**
+ * A port nobody listens on right now, the kernel picks it
+ */
+static int free_port()
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t size = sizeof(address);
+    if (bind(fd, (sockaddr *)&address, size) == -1 || getsockname(fd, (sockaddr *)&address, &size) == -1)
+    {
+        perror("free_port");
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return ntohs(address.sin_port);
+}
+
+/**
+ * Connect to the server, retrying while it starts up
+ */
+static int connect_to(int port)
+{
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (int attempt = 0; attempt < 100; ++attempt)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fd, (sockaddr *)&address, sizeof(address)) == 0)
+            return fd;
+        close(fd);
+        usleep(50 * 1000);
+    }
+    return -1;
+}
+
+/**
+ * Send `request` and read until the answer contains `until`, the
+ * connection closes or two seconds pass
+ */
+static std::string exchange(int fd, const std::string &request, const std::string &until)
+{
+    if (!request.empty() && send(fd, request.data(), request.size(), MSG_NOSIGNAL) != (ssize_t)request.size())
+        return "";
+    std::string answer;
+    while (answer.find(until) == std::string::npos)
+    {
+        pollfd ready = {fd, POLLIN, 0};
+        if (poll(&ready, 1, 2000) != 1)
+            break;
+        char buf[4096];
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0)
+            break;
+        answer.append(buf, n);
+    }
+    return answer;
+}
+
+static size_t count(const std::string &text, const std::string &what)
+{
+    size_t found = 0;
+    for (size_t at = text.find(what); at != std::string::npos; at = text.find(what, at + 1))
+        ++found;
+    return found;
+}
+
+static void test_requests(int port)
+{
+    int fd = connect_to(port);
+    CHECK(fd != -1);
+    if (fd == -1)
+        return;
+
+    std::string answer = exchange(fd, "GET / HTTP/1.1\r\nHost: test\r\n\r\n", "Hello, world!");
+    CHECK(answer.rfind("HTTP/1.1 200 OK\r\n", 0) == 0);
+    CHECK(answer.find("Connection: keep-alive\r\n") != std::string::npos);
+
+    /* Three pipelined requests on the same connection, answered in order */
+    answer = exchange(fd,
+                      "GET /embedded/tests HTTP/1.1\r\nHost: test\r\n\r\n"
+                      "GET /healthz HTTP/1.1\r\nHost: test\r\n\r\n"
+                      "GET /hello/pipeline HTTP/1.1\r\nHost: test\r\n\r\n",
+                      "Hello, pipeline!");
+    CHECK(count(answer, "HTTP/1.1 200 OK\r\n") == 3);
+    size_t embedded = answer.find("embedded tests");
+    size_t health = answer.find("ok\n");
+    size_t hello = answer.find("Hello, pipeline!");
+    CHECK(embedded != std::string::npos && health != std::string::npos && hello != std::string::npos);
+    CHECK(embedded < health && health < hello);
+
+    answer = exchange(fd, "POST /healthz HTTP/1.1\r\nHost: test\r\nContent-Length: 0\r\n\r\n", "\r\n\r\n");
+    CHECK(answer.rfind("HTTP/1.1 405 ", 0) == 0);
+    CHECK(answer.find("Allow: GET, HEAD\r\n") != std::string::npos);
+
+    /* A malformed request is answered and the connection closed */
+    answer = exchange(fd, "GET / HTTP/1.1\r\nHost test\r\n\r\n", "\n\n\n");
+    CHECK(answer.rfind("HTTP/1.1 400 Bad Request\r\n", 0) == 0);
+    CHECK(answer.find("Connection: close\r\n") != std::string::npos);
+    close(fd);
+
+    fd = connect_to(port);
+    CHECK(fd != -1);
+    if (fd == -1)
+        return;
+    answer = exchange(fd, "GET /embedded/closing HTTP/1.0\r\n\r\n", "\n\n\n");
+    CHECK(answer.rfind("HTTP/1.1 200 OK\r\n", 0) == 0);
+    CHECK(answer.find("Connection: close\r\n") != std::string::npos);
+    std::string body = "embedded closing";
+    CHECK(answer.size() > body.size() && answer.compare(answer.size() - body.size(), body.size(), body) == 0);
+    close(fd);
+}
+
+/**
+ * A client frame: `first` is FIN, the reserved bits and the opcode, the
+ * payload is masked with the key of RFC 6455 section 5.7
+ */
+static std::string masked_frame(int first, const std::string &payload)
+{
+    static const unsigned char key[4] = {0x37, 0xfa, 0x21, 0x3d};
+    std::string frame;
+    frame += (char)first;
+    frame += (char)(0x80 | payload.size());
+    frame.append((const char *)key, 4);
+    for (size_t i = 0; i < payload.size(); ++i)
+        frame += (char)(payload[i] ^ key[i % 4]);
+    return frame;
+}
+
+static std::string upgrade(const std::string &target, const std::string &extra_headers)
+{
+    return "GET " + target +
+           " HTTP/1.1\r\nHost: test\r\nUpgrade: websocket\r\nConnection: keep-alive, Upgrade\r\n"
+           "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n" +
+           extra_headers + "\r\n";
+}
+
+static void test_websocket(int port)
+{
+    int fd = connect_to(port);
+    CHECK(fd != -1);
+    if (fd == -1)
+        return;
+
+    /* A plain GET of a WebSocket route is told what to ask for */
+    std::string answer = exchange(fd, "GET /echo HTTP/1.1\r\nHost: test\r\n\r\n", "Upgrade Required\n");
+    CHECK(answer.rfind("HTTP/1.1 426 ", 0) == 0);
+    CHECK(answer.find("Sec-WebSocket-Version: 13\r\n") != std::string::npos);
+
+    /* The handshake of RFC 6455 section 1.3, and a frame right behind it */
+    std::string echo = std::string("\x81\x05") + "Hello";
+    answer = exchange(fd, upgrade("/echo", "") + masked_frame(0x81, "Hello"), echo);
+    CHECK(answer.rfind("HTTP/1.1 101 Switching Protocols\r\n", 0) == 0);
+    CHECK(answer.find("Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n") != std::string::npos);
+    CHECK(answer.find("Sec-WebSocket-Extensions") == std::string::npos);
+    CHECK(answer.size() > echo.size() && answer.compare(answer.size() - echo.size(), echo.size(), echo) == 0);
+
+    /* A message in two fragments with a ping between them */
+    answer = exchange(fd, masked_frame(0x01, "Hel") + masked_frame(0x89, "?") + masked_frame(0x80, "lo"), echo);
+    CHECK(answer == std::string("\x8a\x01?") + echo);
+
+    /* Text must be UTF-8, the connection fails with 1007 */
+    answer = exchange(fd, masked_frame(0x81, "\xc0\xaf"), "\n\n\n");
+    CHECK(answer == "\x88\x02\x03\xef");
+    close(fd);
+
+    /* The compressed "Hello" of RFC 7692 section 7.2.3.1, answered plain as it is short */
+    fd = connect_to(port);
+    CHECK(fd != -1);
+    if (fd == -1)
+        return;
+    answer = exchange(fd, upgrade("/echo", "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n"),
+                      "\r\n\r\n");
+    CHECK(answer.find("Sec-WebSocket-Extensions: permessage-deflate; server_no_context_takeover; "
+                      "client_no_context_takeover\r\n") != std::string::npos);
+    answer = exchange(fd, masked_frame(0xc1, "\xf2\x48\xcd\xc9\xc9\x07\x00"), echo);
+    CHECK(answer == echo);
+
+    /* A subscriber gets what is published to its channel, then we close */
+    int publisher = connect_to(port);
+    CHECK(publisher != -1);
+    int subscriber = connect_to(port);
+    CHECK(subscriber != -1);
+    if (publisher != -1 && subscriber != -1)
+    {
+        answer = exchange(subscriber, upgrade("/live/news", ""), "\r\n\r\n");
+        CHECK(answer.rfind("HTTP/1.1 101 ", 0) == 0);
+        answer = exchange(publisher, "POST /live/news HTTP/1.1\r\nHost: test\r\nContent-Length: 8\r\n\r\nbreaking",
+                          "published\n");
+        CHECK(answer.rfind("HTTP/1.1 202 Accepted\r\n", 0) == 0);
+        std::string news = std::string("\x81\x08") + "breaking";
+        CHECK(exchange(subscriber, "", news) == news);
+
+        std::string bye = "\x88\x02\x03\xe8";
+        answer = exchange(subscriber, masked_frame(0x88, "\x03\xe8"), "\n\n\n");
+        CHECK(answer == bye);
+    }
+    close(subscriber);
+    close(publisher);
+    close(fd);
+}
+
+int main()
+{
+    int port = free_port();
+    CHECK(port > 0);
+    if (port <= 0)
+        return check_result();
+
+    pid_t server = fork();
+    if (server == 0)
+    {
+        ServerConfig config;
+        config.port = port;
+        config.workers = 1;
+        config.task_threads = 1;
+        config.drain_timeout = 5;
+        config.routes = add_embedded_routes;
+        _exit(run_server(config));
+    }
+    CHECK(server > 0);
+    if (server <= 0)
+        return check_result();
+
+    test_requests(port);
+    test_websocket(port);
+
+    kill(server, SIGTERM);
+    int status = 0;
+    CHECK(waitpid(server, &status, 0) == server);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    return check_result();
+}
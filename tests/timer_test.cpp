@@ -0,0 +1,132 @@
+/**
+ * Tests for the timing wheel in `server/timer_wheel.hpp`, run on a clock
+ * of its own so the cases do not depend on how fast the machine is
+ */
+#include <initializer_list>
+#include <vector>
+
+#include "check.hpp"
+#include "timer_wheel.hpp"
+
+/**
+ * Run the wheel at `now_ms` the way `expire_timers` does, returns how
+ * many timers fired
+ */
+static int expire(TimerWheel &wheel, long now_ms)
+{
+    int fired = 0;
+    while (next_expired_timer(wheel, (uint64_t)now_ms / TIMER_TICK_MS) != nullptr)
+        ++fired;
+    return fired;
+}
+
+/**
+ * The first time, in steps of `step_ms` from `from_ms`, at which `node`
+ * fired, `-1` if it did not by `until_ms`
+ */
+static long fires_at(TimerWheel &wheel, TimerNode &node, long from_ms, long until_ms, long step_ms)
+{
+    for (long now_ms = from_ms; now_ms <= until_ms; now_ms += step_ms)
+    {
+        while (TimerNode *expired = next_expired_timer(wheel, (uint64_t)now_ms / TIMER_TICK_MS))
+        {
+            if (expired == &node)
+                return now_ms;
+        }
+    }
+    return -1;
+}
+
+static void test_delays()
+{
+    const long delays[] = {1, 99, 100, 101, 950, 6300, 6400, 10000, 60000, 409600, 500000};
+    for (long delay : delays)
+    {
+        TimerWheel wheel;
+        TimerNode node;
+        long start = 1000000 + 37;
+        expire(wheel, start);
+        set_timer(wheel, node, delay, start);
+        long fired = fires_at(wheel, node, start, start + delay + 10 * TIMER_TICK_MS, 1);
+        CHECK(fired >= start + delay);
+        CHECK(fired < start + delay + TIMER_TICK_MS);
+        CHECK(wheel.armed == 0);
+    }
+}
+
+static void test_stale_wheel()
+{
+    /**
+     * One far timer keeps the wheel armed, the loop sleeps until the next
+     * cascade and events arm new timers long after the wheel last ran
+     */
+    TimerWheel wheel;
+    TimerNode keeper;
+    long start = 5000000;
+    expire(wheel, start);
+    set_timer(wheel, keeper, 60000, start);
+
+    for (long late : {1, 3100, 6350})
+    {
+        TimerNode node;
+        long now = start + late;
+        set_timer(wheel, node, 10000, now);
+        /* However stale the wheel, the timer fires within the tick after its delay */
+        long fired = fires_at(wheel, node, now, now + 20000, 1);
+        CHECK(fired >= now + 10000);
+        CHECK(fired < now + 10000 + TIMER_TICK_MS);
+        start = fired;
+    }
+    cancel_timer(wheel, keeper);
+    CHECK(wheel.armed == 0);
+}
+
+static void test_cascade_is_on_time()
+{
+    /* Deadlines that land exactly on a cascade boundary fire on their tick, not the one after */
+    TimerWheel wheel;
+    long start = 0;
+    expire(wheel, start);
+    std::vector<TimerNode> nodes(3);
+    const long delays[] = {TIMER_WHEEL_SLOTS * TIMER_TICK_MS, 2 * TIMER_WHEEL_SLOTS * TIMER_TICK_MS,
+                           TIMER_WHEEL_SLOTS * TIMER_WHEEL_SLOTS * TIMER_TICK_MS};
+    for (int i = 0; i < 3; ++i)
+    {
+        set_timer(wheel, nodes[i], delays[i], start);
+        CHECK(fires_at(wheel, nodes[i], start, start + delays[i] + 10 * TIMER_TICK_MS, TIMER_TICK_MS) ==
+              start + delays[i]);
+        start += delays[i];
+    }
+}
+
+static void test_wait_and_cancel()
+{
+    TimerWheel wheel;
+    CHECK(timer_wait_ms(wheel, 0) == -1);
+
+    TimerNode first;
+    TimerNode second;
+    set_timer(wheel, first, 250, 1000);
+    set_timer(wheel, second, 5000, 1000);
+    CHECK(wheel.armed == 2);
+    CHECK(timer_wait_ms(wheel, 1000) == 300);
+
+    /* Moving a timer is cancelling and arming it, the other one stays */
+    set_timer(wheel, first, 8000, 1000);
+    CHECK(wheel.armed == 2);
+    CHECK(expire(wheel, 5900) == 0);
+    CHECK(expire(wheel, 6000) == 1);
+    CHECK(!timer_armed(second) && timer_armed(first));
+    cancel_timer(wheel, first);
+    CHECK(wheel.armed == 0 && !timer_armed(first));
+    CHECK(expire(wheel, 20000) == 0);
+}
+
+int main()
+{
+    test_delays();
+    test_stale_wheel();
+    test_cascade_is_on_time();
+    test_wait_and_cancel();
+    return check_result();
+}
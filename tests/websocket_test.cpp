@@ -0,0 +1,145 @@
+/**
+ * Tests for the WebSocket framing in `server/websocket.hpp`, against the
+ * examples of RFC 6455 section 5.7 and against itself
+ */
+#include <string>
+
+#include "check.hpp"
+#include "websocket.hpp"
+
+static std::string bytes(std::initializer_list<int> values)
+{
+    std::string out;
+    for (int value : values)
+        out += (char)value;
+    return out;
+}
+
+static int read_header(const std::string &wire, WebSocketFrame &frame)
+{
+    return websocket_read_header((const unsigned char *)wire.data(), wire.size(), frame);
+}
+
+static void test_rfc_examples()
+{
+    /* A single-frame unmasked text message */
+    WebSocketFrame frame;
+    std::string wire = bytes({0x81, 0x05, 0x48, 0x65, 0x6c, 0x6c, 0x6f});
+    CHECK(read_header(wire, frame) == 1);
+    CHECK(frame.fin() && frame.opcode == WS_TEXT && !frame.masked);
+    CHECK(frame.length == 5 && frame.header_size == 2);
+
+    /* A single-frame masked text message, the key is kept in wire order */
+    wire = bytes({0x81, 0x85, 0x37, 0xfa, 0x21, 0x3d, 0x7f, 0x9f, 0x4d, 0x51, 0x58});
+    CHECK(read_header(wire, frame) == 1);
+    CHECK(frame.masked && frame.length == 5 && frame.header_size == 6);
+    const unsigned char *key = (const unsigned char *)&frame.key;
+    CHECK(key[0] == 0x37 && key[1] == 0xfa && key[2] == 0x21 && key[3] == 0x3d);
+    std::string payload = wire.substr(frame.header_size);
+    for (size_t i = 0; i < payload.size(); ++i)
+        payload[i] ^= key[i % 4];
+    CHECK(payload == "Hello");
+
+    /* A fragmented unmasked text message */
+    CHECK(read_header(bytes({0x01, 0x03, 0x48, 0x65, 0x6c}), frame) == 1);
+    CHECK(!frame.fin() && frame.opcode == WS_TEXT && !frame.control());
+    CHECK(read_header(bytes({0x80, 0x02, 0x6c, 0x6f}), frame) == 1);
+    CHECK(frame.fin() && frame.opcode == WS_CONTINUATION);
+
+    /* Ping and 256 bytes in one frame */
+    CHECK(read_header(bytes({0x89, 0x05}), frame) == 1);
+    CHECK(frame.control() && frame.opcode == WS_PING);
+    CHECK(read_header(bytes({0x82, 0x7e, 0x01, 0x00}), frame) == 1);
+    CHECK(frame.opcode == WS_BINARY && frame.length == 256 && frame.header_size == 4);
+
+    /* A compressed message sets RSV1, RFC 7692 section 7.2.3.1 */
+    CHECK(read_header(bytes({0xc1, 0x07}), frame) == 1);
+    CHECK((frame.flags & WS_RSV1) != 0 && frame.length == 7);
+}
+
+static void test_lengths()
+{
+    const uint64_t lengths[] = {0, 1, 125, 126, 127, 65535, 65536, 1ull << 32, (1ull << 63) - 1};
+    for (uint64_t length : lengths)
+    {
+        std::string wire;
+        websocket_append_header(wire, WS_FIN | (uint8_t)WS_BINARY, length);
+        CHECK(wire.size() == (length < 126 ? 2u : length <= 0xffff ? 4u : 10u));
+        WebSocketFrame frame;
+        CHECK(read_header(wire, frame) == 1);
+        CHECK(frame.length == length && frame.header_size == wire.size() && !frame.masked);
+        CHECK(frame.fin() && frame.opcode == WS_BINARY);
+
+        /* Every prefix of the header asks for more */
+        for (size_t size = 0; size < wire.size(); ++size)
+            CHECK(read_header(wire.substr(0, size), frame) == 0);
+    }
+
+    /* Masked headers are only complete with the key */
+    WebSocketFrame frame;
+    std::string wire = bytes({0x82, 0xfe, 0x01, 0x00, 1, 2, 3});
+    CHECK(read_header(wire, frame) == 0);
+    CHECK(read_header(wire + '\x04', frame) == 1 && frame.header_size == 8);
+
+    /* The most significant bit of a 64-bit length must be 0 */
+    CHECK(read_header(bytes({0x82, 0x7f, 0x80, 0, 0, 0, 0, 0, 0, 0}), frame) == -1);
+}
+
+static void test_utf8()
+{
+    CHECK(utf8_valid("", 0));
+    const std::string valid[] = {"Hello, world! 8 bytes at a time", "\xc2\xa2", "\xe2\x82\xac", "\xf0\x90\x8d\x88",
+                                 "\xce\xba\xe1\xbd\xb9\xcf\x83\xce\xbc\xce\xb5", "\xed\x9f\xbf", "\xf4\x8f\xbf\xbf"};
+    for (const std::string &text : valid)
+        CHECK(utf8_valid(text.data(), text.size()));
+
+    /* Overlong forms, surrogates, beyond U+10FFFF, stray and missing continuation bytes */
+    const std::string invalid[] = {"\xc0\xaf",     "\xe0\x80\xaf", "\xed\xa0\x80",     "\xf4\x90\x80\x80",
+                                   "\x80",         "\xc2",         "abcdefgh\xe2\x82", "\xf8\x88\x80\x80\x80",
+                                   "\xce\xba\xff", "\xe2\x28\xa1"};
+    for (const std::string &text : invalid)
+        CHECK(!utf8_valid(text.data(), text.size()));
+}
+
+static void test_close_codes()
+{
+    CHECK(websocket_close_code_valid(1000) && websocket_close_code_valid(1001));
+    CHECK(websocket_close_code_valid(1007) && websocket_close_code_valid(1011));
+    CHECK(websocket_close_code_valid(3000) && websocket_close_code_valid(4999));
+    /* Never on the wire, or not assigned */
+    CHECK(!websocket_close_code_valid(0) && !websocket_close_code_valid(999));
+    CHECK(!websocket_close_code_valid(1004) && !websocket_close_code_valid(1005));
+    CHECK(!websocket_close_code_valid(1006) && !websocket_close_code_valid(1015));
+    CHECK(!websocket_close_code_valid(2999) && !websocket_close_code_valid(5000));
+}
+
+static void test_deflate_offers()
+{
+    CHECK(websocket_accepts_deflate("permessage-deflate"));
+    CHECK(websocket_accepts_deflate("permessage-deflate; client_max_window_bits"));
+    CHECK(websocket_accepts_deflate("Permessage-Deflate; client_no_context_takeover; server_max_window_bits=15"));
+    CHECK(websocket_accepts_deflate("permessage-deflate; client_max_window_bits=\"10\""));
+
+    /* The first offer we can take wins */
+    CHECK(websocket_accepts_deflate("x-webkit-deflate-frame, permessage-deflate; server_max_window_bits=10, "
+                                    "permessage-deflate"));
+
+    CHECK(!websocket_accepts_deflate(""));
+    CHECK(!websocket_accepts_deflate("x-webkit-deflate-frame"));
+    CHECK(!websocket_accepts_deflate("permessage-deflate; server_max_window_bits=10"));
+    CHECK(!websocket_accepts_deflate("permessage-deflate; client_max_window_bits=7"));
+    CHECK(!websocket_accepts_deflate("permessage-deflate; server_max_window_bits"));
+    CHECK(!websocket_accepts_deflate("permessage-deflate; server_no_context_takeover=1"));
+    CHECK(!websocket_accepts_deflate("permessage-deflate; client_no_context_takeover; client_no_context_takeover"));
+    CHECK(!websocket_accepts_deflate("permessage-deflate; mystery"));
+}
+
+int main()
+{
+    test_rfc_examples();
+    test_lengths();
+    test_utf8();
+    test_close_codes();
+    test_deflate_offers();
+    return check_result();
+}